@@ -0,0 +1,478 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2025 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+
+// This sketch is a developer tool (not a tutorial) that adds a number of benchmarking commands
+// to the HomeSpan Command-Line Interface, using SpanUserCommand().  Each command runs a specific
+// internal HomeSpan operation many times and reports the average time per operation.  The device
+// itself is a simple LightBulb so that the benchmarks can also be run while paired to HomeKit.
+
+// Type "@T" into the Serial Monitor to compare the performance of the owning TLV8 container
+// against the zero-copy TLV8View when parsing and packing a TLV similar to the Pair-Setup M3
+// message (a 384-byte SRP Public Key plus a 64-byte Proof), and against the contiguous TLV8Flat
+// container when building and packing the same TLV as a response.
+
+// Type "@Q" into the Serial Monitor to compare the time a separate FreeRTOS task is blocked when
+// updating a Characteristic using homeSpanPAUSE followed by setVal(), versus simply calling
+// setValAsync().  To simulate a busy device, the LightBulb's loop() method adds a delay to every
+// pass through HomeSpan's polling while this benchmark is running.
+
+// Type "@A" into the Serial Monitor to compare the throughput (in MB/s) of each ChaCha20-Poly1305 AEAD
+// backend when encrypting and decrypting 1 KB frames, as used for all encrypted HAP traffic.  The
+// backend marked "(selected)" is the one HomeSpan was built to use (see AEAD.h).
+
+// Type "@H" into the Serial Monitor to compare the number of HKDF-SHA-512 key derivations per second
+// using the generic HKDF::create() versus an HKDF::Salt that has been pre-keyed with the fixed
+// "Control-Salt" used to derive session keys at the end of every Pair-Verify.
+
+// Type "@P" into the Serial Monitor to run a suite of microbenchmarks covering each cryptographic step of
+// Pair-Setup (SRP-6A), Pair-Verify (X25519 and Ed25519), session key derivation (HKDF), encrypted HAP
+// traffic (ChaCha20-Poly1305 frames), and database hashing (SHA-384), all using realistic sizes.  Each step
+// reports operations per second along with the 50th, 90th, and 99th percentile and maximum latency of a
+// single operation, so that regressions in pairing or traffic cost are easy to spot.  Since the SRP steps
+// take a long time, the suite runs in a separate task so HomeSpan can continue to poll while it runs.
+// All steps other than SRP-6A can also be run on a computer with the host benchmark in tools/benchCrypto.cpp.
+
+#include "HomeSpan.h"
+#include "AEAD.h"
+#include "HKDF.h"
+#include "SRP.h"
+#include <sodium.h>
+#include <algorithm>
+
+#define N_ITERATIONS  1000
+#define N_UPDATES     100           // number of Characteristic updates made by the separate task in each half of the queue benchmark
+#define SLOW_LOOP     20            // delay (in milliseconds) added to every pass through HomeSpan's polling during the queue benchmark
+#define FRAME_SIZE    1024          // size of HAP frames used in the AEAD benchmark
+#define N_FAST        1000          // number of operations timed for each fast step in the crypto suite
+#define N_SLOW        10            // number of operations timed for each SRP-6A step in the crypto suite
+#define N_DIGESTS     150           // number of Accessory digests combined into the database hash (HAP limit=150)
+#define ATTR_SIZE     4096          // size of the streamed attributes of a single Accessory hashed into its digest
+
+SpanCharacteristic *level;
+volatile boolean slowLoop=false;
+volatile boolean cryptoRunning=false;
+
+struct BenchLight : Service::LightBulb {
+
+  BenchLight() : Service::LightBulb(){
+    new Characteristic::On();
+    level=new Characteristic::Brightness(50);
+  }
+
+  void loop() override {
+    if(slowLoop)
+      delay(SLOW_LOOP);
+  }
+};
+
+//////////////////////////////////////
+
+void tlvBenchmark(const char *buf){
+
+  uint8_t key[384];
+  uint8_t proof[64];
+  for(int i=0;i<sizeof(key);i++)
+    key[i]=esp_random();
+  for(int i=0;i<sizeof(proof);i++)
+    proof[i]=esp_random();
+
+  TLV8 tlv;                                     // create source TLV and pack it into a buffer
+  tlv.add(6,3);                                 // State=M3
+  tlv.add(3,sizeof(key),key);                   // PublicKey (must be fragmented into 255+129 bytes)
+  tlv.add(4,sizeof(proof),proof);               // Proof
+
+  size_t packSize=tlv.pack_size();
+  TempBuffer<uint8_t> packed(packSize);
+  tlv.pack(packed);
+  TempBuffer<uint8_t> work(packSize);           // working copy, since TLV8View modifies buffer when merging fragments
+
+  Serial.printf("\n*** TLV8 Benchmark: %d iterations of a %d-byte packed TLV ***\n\n",N_ITERATIONS,packSize);
+
+  uint32_t t0=micros();
+  for(int i=0;i<N_ITERATIONS;i++){
+    memcpy(work,packed,packSize);
+    TLV8 t;
+    t.unpack(work,packSize);
+    if(t.len(t.find(3))!=sizeof(key))
+      Serial.printf("*** ERROR: TLV8 unpack failed\n");
+  }
+  uint32_t t1=micros();
+  for(int i=0;i<N_ITERATIONS;i++){
+    memcpy(work,packed,packSize);
+    TLV8View v;
+    v.unpack(work,packSize);
+    if(v.len(v.find(3))!=sizeof(key))
+      Serial.printf("*** ERROR: TLV8View unpack failed\n");
+  }
+  uint32_t t2=micros();
+  for(int i=0;i<N_ITERATIONS;i++)
+    memcpy(work,packed,packSize);
+  uint32_t t3=micros();
+
+  float copyTime=(float)(t3-t2)/N_ITERATIONS;
+  Serial.printf("TLV8::unpack()     : %8.2f us\n",(float)(t1-t0)/N_ITERATIONS-copyTime);
+  Serial.printf("TLV8View::unpack() : %8.2f us\n",(float)(t2-t1)/N_ITERATIONS-copyTime);
+
+  t0=micros();
+  for(int i=0;i<N_ITERATIONS;i++)
+    tlv.pack(work);
+  t1=micros();
+  for(int i=0;i<N_ITERATIONS;i++){
+    tlv.pack_init();
+    while(tlv.pack(work,36)>0);                 // packs in 36-byte chunks, as used when encoding TLV Characteristics
+  }
+  t2=micros();
+
+  Serial.printf("TLV8::pack()       : %8.2f us (single buffer)\n",(float)(t1-t0)/N_ITERATIONS);
+  Serial.printf("TLV8::pack()       : %8.2f us (36-byte chunks)\n",(float)(t2-t1)/N_ITERATIONS);
+
+  t0=micros();
+  for(int i=0;i<N_ITERATIONS;i++){              // build and pack a response the way HAP did prior to TLV8Flat
+    TLV8 t;
+    t.add(6,3);
+    t.add(3,sizeof(key),key);
+    t.add(4,sizeof(proof),proof);
+    t.pack(work);
+  }
+  t1=micros();
+  for(int i=0;i<N_ITERATIONS;i++){              // build and pack the same response in a single contiguous buffer, as now used by HAP
+    TLV8Flat t;
+    t.add(6,3);
+    t.add(3,sizeof(key),key);
+    t.add(4,sizeof(proof),proof);
+    t.pack(work);
+  }
+  t2=micros();
+
+  if(memcmp(work,packed,packSize))
+    Serial.printf("*** ERROR: TLV8Flat pack does not match TLV8 pack\n");
+
+  Serial.printf("TLV8 add+pack      : %8.2f us\n",(float)(t1-t0)/N_ITERATIONS);
+  Serial.printf("TLV8Flat add+pack  : %8.2f us\n\n",(float)(t2-t1)/N_ITERATIONS);
+}
+
+//////////////////////////////////////
+
+void queueTask(void *arg){
+
+  uint32_t pauseMax=0, pauseTotal=0, asyncMax=0, asyncTotal=0, nDropped=0;
+
+  slowLoop=true;
+
+  for(int i=0;i<N_UPDATES;i++){
+    uint32_t t0=micros();
+    {
+      homeSpanPAUSE;
+      level->setVal(i%100+1);
+    }
+    uint32_t dt=micros()-t0;
+    pauseTotal+=dt;
+    pauseMax=max(pauseMax,dt);
+    vTaskDelay(pdMS_TO_TICKS(5));               // simulates time between sensor readings
+  }
+
+  for(int i=0;i<N_UPDATES;i++){
+    uint32_t t0=micros();
+    if(!level->setValAsync(i%100+1))
+      nDropped++;
+    uint32_t dt=micros()-t0;
+    asyncTotal+=dt;
+    asyncMax=max(asyncMax,dt);
+    vTaskDelay(pdMS_TO_TICKS(5));
+  }
+
+  slowLoop=false;
+
+  Serial.printf("\n*** Queue Benchmark: %d updates from a separate task with a %d ms delay added to every pass through HomeSpan's polling ***\n\n",N_UPDATES,SLOW_LOOP);
+  Serial.printf("homeSpanPAUSE + setVal() : %10.2f us average, %8lu us maximum\n",(float)pauseTotal/N_UPDATES,pauseMax);
+  Serial.printf("setValAsync()            : %10.2f us average, %8lu us maximum (%lu dropped)\n\n",(float)asyncTotal/N_UPDATES,asyncMax,nDropped);
+
+  vTaskDelete(NULL);
+}
+
+//////////////////////////////////////
+
+void queueBenchmark(const char *buf){
+
+  if(slowLoop){
+    Serial.printf("\n*** Queue Benchmark is already running\n\n");
+    return;
+  }
+
+  xTaskCreate(queueTask,"Queue Benchmark",4096,NULL,1,NULL);     // benchmark must run in a separate task, since user commands are called from within HomeSpan's polling
+  Serial.printf("\nStarting Queue Benchmark...\n");
+}
+
+//////////////////////////////////////
+
+void aeadBenchmark(const char *buf){
+
+  const AEADBackend *backends[]={&AEAD::sodium,&AEAD::multiBlock};
+
+  uint8_t key[AEAD::KEY_BYTES];
+  uint8_t nonce[AEAD::NONCE_BYTES];
+  uint8_t aad[2]={FRAME_SIZE%256,FRAME_SIZE/256};         // HAP frames use the 2-byte frame length as AAD
+  esp_fill_random(key,sizeof(key));
+  esp_fill_random(nonce,sizeof(nonce));
+
+  TempBuffer<uint8_t> frame(FRAME_SIZE);
+  TempBuffer<uint8_t> encrypted(FRAME_SIZE+AEAD::TAG_BYTES);
+  TempBuffer<uint8_t> reference(FRAME_SIZE+AEAD::TAG_BYTES);
+  TempBuffer<uint8_t> decrypted(FRAME_SIZE);
+  esp_fill_random(frame,FRAME_SIZE);
+
+  AEAD::sodium.encrypt(reference,frame,FRAME_SIZE,aad,2,nonce,key);
+
+  Serial.printf("\n*** AEAD Benchmark: %d iterations of a %d-byte HAP frame ***\n\n",N_ITERATIONS,FRAME_SIZE);
+
+  for(auto b : backends){
+
+    b->encrypt(encrypted,frame,FRAME_SIZE,aad,2,nonce,key);
+    if(memcmp(encrypted,reference,FRAME_SIZE+AEAD::TAG_BYTES) || b->decrypt(decrypted,reference,FRAME_SIZE+AEAD::TAG_BYTES,aad,2,nonce,key) || memcmp(decrypted,frame,FRAME_SIZE)){
+      Serial.printf("*** ERROR: %s backend does not match libsodium\n",b->name);
+      continue;
+    }
+
+    uint32_t t0=micros();
+    for(int i=0;i<N_ITERATIONS;i++)
+      b->encrypt(encrypted,frame,FRAME_SIZE,aad,2,nonce,key);
+    uint32_t t1=micros();
+    for(int i=0;i<N_ITERATIONS;i++)
+      b->decrypt(decrypted,encrypted,FRAME_SIZE+AEAD::TAG_BYTES,aad,2,nonce,key);
+    uint32_t t2=micros();
+
+    Serial.printf("%-12s : encrypt %6.2f MB/s, decrypt %6.2f MB/s %s\n",b->name,(float)N_ITERATIONS*FRAME_SIZE/(t1-t0),(float)N_ITERATIONS*FRAME_SIZE/(t2-t1),b==&AEAD::backend?"(selected)":"");
+  }
+
+  Serial.printf("\n");
+}
+
+//////////////////////////////////////
+
+void hkdfBenchmark(const char *buf){
+
+  uint8_t sharedKey[32];
+  uint8_t key1[32];
+  uint8_t key2[32];
+  uint8_t prk[HKDF::PRK_BYTES];
+  esp_fill_random(sharedKey,sizeof(sharedKey));
+
+  HKDF::Salt controlSalt("Control-Salt");
+
+  controlSalt.create(key2,sharedKey,32,"Control-Read-Encryption-Key");
+  HKDF::create(key1,sharedKey,32,"Control-Salt","Control-Read-Encryption-Key");
+  if(memcmp(key1,key2,32))
+    Serial.printf("*** ERROR: HKDF::Salt does not match HKDF::create()\n");
+
+  Serial.printf("\n*** HKDF Benchmark: %d iterations of a 32-byte key derivation ***\n\n",N_ITERATIONS);
+
+  uint32_t t0=micros();
+  for(int i=0;i<N_ITERATIONS;i++)
+    HKDF::create(key1,sharedKey,32,"Control-Salt","Control-Read-Encryption-Key");
+  uint32_t t1=micros();
+  for(int i=0;i<N_ITERATIONS;i++)
+    controlSalt.create(key1,sharedKey,32,"Control-Read-Encryption-Key");
+  uint32_t t2=micros();
+  for(int i=0;i<N_ITERATIONS;i++){                    // both session keys, as derived at end of Pair-Verify
+    controlSalt.extract(prk,sharedKey,32);
+    HKDF::expand(key1,32,prk,"Control-Read-Encryption-Key");
+    HKDF::expand(key2,32,prk,"Control-Write-Encryption-Key");
+  }
+  uint32_t t3=micros();
+
+  Serial.printf("HKDF::create()               : %8.0f derivations/sec\n",N_ITERATIONS*1.0e6/(t1-t0));
+  Serial.printf("HKDF::Salt::create()         : %8.0f derivations/sec\n",N_ITERATIONS*1.0e6/(t2-t1));
+  Serial.printf("Salt::extract() + 2x expand(): %8.0f session key pairs/sec (%.0f with HKDF::create)\n\n",N_ITERATIONS*1.0e6/(t3-t2),N_ITERATIONS*1.0e6/(t1-t0)/2);
+}
+
+//////////////////////////////////////
+
+// Times each of n calls to op() individually and reports throughput and latency percentiles
+
+template <class F> void timeOp(const char *name, int n, F op){
+
+  TempBuffer<uint32_t> t(n);
+
+  op();                                         // warm-up (first call may include one-time initialization)
+
+  uint32_t start=micros();
+  for(int i=0;i<n;i++){
+    uint32_t t0=micros();
+    op();
+    t[i]=micros()-t0;
+  }
+  uint32_t total=micros()-start;
+
+  std::sort(t.get(),t.get()+n);
+
+  Serial.printf("%-36s : %10.1f ops/sec   p50 %8lu us   p90 %8lu us   p99 %8lu us   max %8lu us\n",
+    name,n*1.0e6/total,t[(n-1)*50/100],t[(n-1)*90/100],t[(n-1)*99/100],t[n-1]);
+}
+
+//////////////////////////////////////
+
+void cryptoTask(void *arg){
+
+  Serial.printf("\n*** Crypto Suite: %d operations per SRP-6A step, %d per all other steps ***\n\n",N_SLOW,N_FAST);
+
+  // Pair-Setup (SRP-6A with 3072-bit group)
+
+  SRP6A *srp=new SRP6A;
+  Verification vData;
+  uint8_t publicKey[384];
+  uint8_t proof[64];
+
+  esp_fill_random(publicKey,sizeof(publicKey));
+  publicKey[0]&=0x7F;                           // ensures simulated Client Public Key, A, is less than N
+  esp_fill_random(proof,sizeof(proof));         // simulated Client Proof (will not verify, but takes the same time)
+
+  timeOp("SRP-6A verifier (s, v)",N_SLOW,[&](){srp->createVerifyCode("466-37-726",&vData);});
+  timeOp("SRP-6A accessory public key (B)",N_SLOW,[&](){srp->precompute(&vData);});
+  timeOp("SRP-6A session key (u, S, K)",N_SLOW,[&](){srp->createSessionKey(publicKey,sizeof(publicKey));});
+  timeOp("SRP-6A proofs (M1, M2)",N_FAST,[&](){srp->verifyClientProof(proof);srp->createAccProof(proof);});
+
+  delete srp;
+  Serial.printf("\n");
+
+  // Pair-Verify (X25519 key exchange and Ed25519 signatures over the 81-byte AccessoryInfo)
+
+  uint8_t curvePublic[crypto_box_PUBLICKEYBYTES], curveSecret[crypto_box_SECRETKEYBYTES], iosCurveKey[crypto_box_PUBLICKEYBYTES], sharedKey[crypto_box_PUBLICKEYBYTES];
+  uint8_t LTPK[crypto_sign_PUBLICKEYBYTES], LTSK[crypto_sign_SECRETKEYBYTES], signature[crypto_sign_BYTES];
+  uint8_t accessoryInfo[crypto_box_PUBLICKEYBYTES+17+crypto_box_PUBLICKEYBYTES];
+
+  crypto_box_keypair(iosCurveKey,curveSecret);
+  crypto_sign_keypair(LTPK,LTSK);
+  esp_fill_random(accessoryInfo,sizeof(accessoryInfo));
+
+  timeOp("X25519 keypair + shared secret",N_FAST,[&](){crypto_box_keypair(curvePublic,curveSecret);crypto_scalarmult(sharedKey,curveSecret,iosCurveKey);});
+  timeOp("Ed25519 sign (AccessoryInfo)",N_FAST,[&](){crypto_sign_detached(signature,NULL,accessoryInfo,sizeof(accessoryInfo),LTSK);});
+  timeOp("Ed25519 verify (iOSDeviceInfo)",N_FAST,[&](){crypto_sign_verify_detached(signature,accessoryInfo,sizeof(accessoryInfo),LTPK);});
+  Serial.printf("\n");
+
+  // Session key derivation
+
+  uint8_t key1[32], key2[32], prk[HKDF::PRK_BYTES];
+  HKDF::Salt controlSalt("Control-Salt");
+
+  timeOp("HKDF-SHA-512 single key",N_FAST,[&](){controlSalt.create(key1,sharedKey,32,"Control-Read-Encryption-Key");});
+  timeOp("HKDF-SHA-512 session key pair",N_FAST,[&](){
+    controlSalt.extract(prk,sharedKey,32);
+    HKDF::expand(key1,32,prk,"Control-Read-Encryption-Key");
+    HKDF::expand(key2,32,prk,"Control-Write-Encryption-Key");
+  });
+  Serial.printf("\n");
+
+  // Encrypted HAP traffic (frames are encrypted in HapStreamBuffer and decrypted in receiveEncrypted)
+
+  TempBuffer<uint8_t> frame(FRAME_SIZE+AEAD::TAG_BYTES);
+  uint8_t nonce[AEAD::NONCE_BYTES]={0};
+  esp_fill_random(frame,FRAME_SIZE);
+
+  for(int size : {64,FRAME_SIZE}){              // a small frame (e.g. an Event Notification) and a full frame
+    char name[48];
+    uint8_t aad[2]={(uint8_t)(size%256),(uint8_t)(size/256)};
+    sprintf(name,"ChaCha20-Poly1305 encrypt (%d bytes)",size);
+    timeOp(name,N_FAST,[&](){AEAD::encrypt(frame,frame,size,aad,2,nonce,key1);});
+    sprintf(name,"ChaCha20-Poly1305 decrypt (%d bytes)",size);
+    AEAD::encrypt(frame,frame,size,aad,2,nonce,key1);
+    TempBuffer<uint8_t> work(size);
+    timeOp(name,N_FAST,[&](){
+      if(AEAD::decrypt(work,frame,size+AEAD::TAG_BYTES,aad,2,nonce,key1))
+        Serial.printf("*** ERROR: decryption failed\n");
+    });
+  }
+  Serial.printf("  (%s backend)\n\n",AEAD::backend.name);
+
+  // Database hashing
+
+  TempBuffer<uint8_t> attributes(ATTR_SIZE);
+  TempBuffer<uint8_t> digests(N_DIGESTS*48);
+  uint8_t hashCode[64];
+  esp_fill_random(attributes,ATTR_SIZE);
+  esp_fill_random(digests,N_DIGESTS*48);
+
+  char name[48];
+  sprintf(name,"SHA-384 Accessory digest (%d bytes)",ATTR_SIZE);
+  timeOp(name,N_FAST,[&](){mbedtls_sha512(attributes,ATTR_SIZE,hashCode,1);});
+  sprintf(name,"SHA-384 database hash (%d digests)",N_DIGESTS);
+  timeOp(name,N_FAST,[&](){
+    mbedtls_sha512_context ctx;
+    mbedtls_sha512_init(&ctx);
+    mbedtls_sha512_starts(&ctx,1);
+    for(int i=0;i<N_DIGESTS;i++)
+      mbedtls_sha512_update(&ctx,digests+i*48,48);
+    mbedtls_sha512_finish(&ctx,hashCode);
+    mbedtls_sha512_free(&ctx);
+  });
+
+  Serial.printf("\n");
+  cryptoRunning=false;
+  vTaskDelete(NULL);
+}
+
+//////////////////////////////////////
+
+void cryptoBenchmark(const char *buf){
+
+  if(cryptoRunning){
+    Serial.printf("\n*** Crypto Suite is already running\n\n");
+    return;
+  }
+
+  cryptoRunning=true;
+  xTaskCreate(cryptoTask,"Crypto Suite",8192,NULL,1,NULL);       // SRP steps take several seconds in total, so run in a separate task rather than stalling HomeSpan's polling
+  Serial.printf("\nStarting Crypto Suite...\n");
+}
+
+//////////////////////////////////////
+
+void setup() {
+ 
+  Serial.begin(115200);
+
+  homeSpan.begin(Category::Lighting,"HomeSpan Benchmarks");
+
+  new SpanAccessory();
+    new Service::AccessoryInformation();
+      new Characteristic::Identify();
+            
+    new BenchLight();
+
+  new SpanUserCommand('T',"- run TLV8 benchmark",tlvBenchmark);
+  new SpanUserCommand('Q',"- run cross-task Characteristic update benchmark",queueBenchmark);
+  new SpanUserCommand('A',"- run ChaCha20-Poly1305 AEAD benchmark",aeadBenchmark);
+  new SpanUserCommand('H',"- run HKDF key derivation benchmark",hkdfBenchmark);
+  new SpanUserCommand('P',"- run pairing and traffic crypto suite",cryptoBenchmark);
+}
+
+//////////////////////////////////////
+
+void loop(){
+ 
+  homeSpan.poll();
+  
+}
@@ -0,0 +1,103 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2023 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+// This example demonstrates how to use HomeSpan's optional coroutine API (SpanTask) to implement
+// time-based behaviour without writing a state machine in loop().  It emulates the same motorized
+// Window Shade as Tutorial Example 13 (TargetStates), in which the shade moves gradually from its
+// current position to the target position requested in the Home App, and then stops.
+
+// In Example 13 this requires a loop() method that checks, on every pass, whether the target and
+// current positions differ, and whether enough time has elapsed to take the next step.  Here the
+// same behaviour is written as a single coroutine that suspends itself until the target position
+// changes, and then sleeps between steps.  While suspended, the Service costs nothing on each pass
+// through HomeSpan's polling.
+
+// Coroutines require C++20.  The Arduino-ESP32 core 3.x compiles sketches with C++20 (or later)
+// enabled by default.
+
+#include "HomeSpan.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "This sketch requires a compiler with C++20 coroutine support"
+#endif
+
+using namespace std::chrono_literals;      // allows durations such as 100ms to be written as literals
+
+////////////////////////////////////
+
+struct DEV_WindowShade : Service::WindowCovering {
+
+  SpanCharacteristic *current;
+  SpanCharacteristic *target;
+  SpanTask motor;                     // owns the coroutine - must be kept for as long as the coroutine is to run
+
+  DEV_WindowShade() : Service::WindowCovering(){
+
+    current=new Characteristic::CurrentPosition(0);
+    target=new Characteristic::TargetPosition(0);
+
+    motor=runMotor();                 // start coroutine - it runs until it reaches its first co_await
+  }
+
+  SpanTask runMotor(){
+
+    while(true){
+
+      co_await target->changed();                                   // suspend until Home App changes target position
+      LOG1("Moving Shade from %d to %d\n",current->getVal(),target->getVal());
+
+      while(current->getVal()!=target->getVal()){                   // target may be changed again while shade is moving
+        current->setVal(current->getVal()+(target->getVal()>current->getVal()?1:-1));
+        co_await homeSpan.sleep(100ms);                             // suspend for 100 ms between steps
+      }
+
+      LOG1("Shade stopped at %d\n",current->getVal());
+    }
+  }
+
+};
+
+////////////////////////////////////
+
+void setup() {
+
+  Serial.begin(115200);
+
+  homeSpan.begin(Category::WindowCoverings,"Coroutine Shade");
+
+  new SpanAccessory();                                                          
+    new Service::AccessoryInformation();
+      new Characteristic::Identify(); 
+    new DEV_WindowShade();
+}
+
+//////////////////////////////////////
+
+void loop(){
+  
+  homeSpan.poll();  
+}
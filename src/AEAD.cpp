@@ -0,0 +1,324 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#include <sodium.h>
+
+#include "AEAD.h"
+
+/////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+// libsodium backend
+
+static void sodiumEncrypt(uint8_t *c, const uint8_t *m, size_t mLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key){
+  crypto_aead_chacha20poly1305_ietf_encrypt(c,NULL,m,mLen,ad,adLen,NULL,nonce,key);
+}
+
+static int sodiumDecrypt(uint8_t *m, const uint8_t *c, size_t cLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key){
+  return(crypto_aead_chacha20poly1305_ietf_decrypt(m,NULL,NULL,c,cLen,ad,adLen,nonce,key));
+}
+
+const AEADBackend AEAD::sodium={"libsodium",sodiumEncrypt,sodiumDecrypt};
+
+/////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+// Multi-block backend
+
+static inline uint32_t load32(const uint8_t *p){
+  return((uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24));
+}
+
+static inline void store32(uint8_t *p, uint32_t v){
+  p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24;
+}
+
+//////////////////////////////////////
+// ChaCha20 - each state word is a vector
+// holding that word for four consecutive
+// blocks, so all four blocks are computed
+// with the same instructions
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+#define ROTL(v,n) (((v)<<(n))|((v)>>(32-(n))))
+#define QR(a,b,c,d) a+=b; d^=a; d=ROTL(d,16); c+=d; b^=c; b=ROTL(b,12); a+=b; d^=a; d=ROTL(d,8); c+=d; b^=c; b=ROTL(b,7);
+
+static void chacha20x4(uint8_t *keyStream, const uint32_t *state){     // writes 256 bytes of keyStream for block counters state[12] through state[12]+3
+
+  u32x4 s[16];
+  u32x4 x[16];
+
+  for(int i=0;i<16;i++)
+    s[i]=(u32x4){state[i],state[i],state[i],state[i]};
+  s[12]+=(u32x4){0,1,2,3};
+
+  for(int i=0;i<16;i++)
+    x[i]=s[i];
+
+  for(int i=0;i<10;i++){
+    QR(x[0],x[4],x[8],x[12]) QR(x[1],x[5],x[9],x[13]) QR(x[2],x[6],x[10],x[14]) QR(x[3],x[7],x[11],x[15])      // column rounds
+    QR(x[0],x[5],x[10],x[15]) QR(x[1],x[6],x[11],x[12]) QR(x[2],x[7],x[8],x[13]) QR(x[3],x[4],x[9],x[14])      // diagonal rounds
+  }
+
+  for(int i=0;i<16;i++)
+    x[i]+=s[i];
+
+  for(int j=0;j<4;j++)
+    for(int i=0;i<16;i++)
+      store32(keyStream+64*j+4*i,x[i][j]);
+}
+
+static void chacha20Init(uint32_t *state, const uint8_t *key, const uint8_t *nonce, uint32_t counter){
+
+  state[0]=0x61707865;          // "expand 32-byte k"
+  state[1]=0x3320646e;
+  state[2]=0x79622d32;
+  state[3]=0x6b206574;
+  for(int i=0;i<8;i++)
+    state[4+i]=load32(key+4*i);
+  state[12]=counter;
+  for(int i=0;i<3;i++)
+    state[13+i]=load32(nonce+4*i);
+}
+
+static void chacha20Xor(uint8_t *out, const uint8_t *in, size_t len, uint32_t *state){
+
+  uint8_t keyStream[256];
+
+  while(len>0){
+    chacha20x4(keyStream,state);
+    size_t n=len<256?len:256;
+    for(size_t i=0;i<n;i++)
+      out[i]=in[i]^keyStream[i];
+    state[12]+=4;
+    out+=n;
+    in+=n;
+    len-=n;
+  }
+}
+
+//////////////////////////////////////
+// Poly1305 - 26-bit limbs so all products
+// fit in 64 bits on 32-bit processors
+
+struct Poly1305 {
+
+  uint32_t r[5];
+  uint32_t h[5]={0,0,0,0,0};
+  uint32_t pad[4];
+  uint8_t buf[16];
+  size_t nBuf=0;
+
+  Poly1305(const uint8_t *key);
+  void blocks(const uint8_t *m, size_t len);      // processes len/16 full blocks
+  void update(const uint8_t *m, size_t len);
+  void pad16();                                   // appends zeros up to next multiple of 16 bytes
+  void finish(uint8_t *tag);
+};
+
+Poly1305::Poly1305(const uint8_t *key){
+
+  r[0]=(load32(key+0))&0x3ffffff;           // clamp r as per RFC 8439
+  r[1]=(load32(key+3)>>2)&0x3ffff03;
+  r[2]=(load32(key+6)>>4)&0x3ffc0ff;
+  r[3]=(load32(key+9)>>6)&0x3f03fff;
+  r[4]=(load32(key+12)>>8)&0x00fffff;
+
+  for(int i=0;i<4;i++)
+    pad[i]=load32(key+16+4*i);
+}
+
+void Poly1305::blocks(const uint8_t *m, size_t len){
+
+  const uint32_t r0=r[0], r1=r[1], r2=r[2], r3=r[3], r4=r[4];
+  const uint32_t s1=r1*5, s2=r2*5, s3=r3*5, s4=r4*5;
+  uint32_t h0=h[0], h1=h[1], h2=h[2], h3=h[3], h4=h[4];
+
+  for(;len>=16;len-=16,m+=16){
+    h0+=(load32(m+0))&0x3ffffff;
+    h1+=(load32(m+3)>>2)&0x3ffffff;
+    h2+=(load32(m+6)>>4)&0x3ffffff;
+    h3+=(load32(m+9)>>6)&0x3ffffff;
+    h4+=(load32(m+12)>>8)|(1<<24);          // every block in an AEAD is a full 16 bytes (partial blocks are zero-padded), so the high bit is always set
+
+    uint64_t d0=(uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 + (uint64_t)h3*s2 + (uint64_t)h4*s1;
+    uint64_t d1=(uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 + (uint64_t)h3*s3 + (uint64_t)h4*s2;
+    uint64_t d2=(uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 + (uint64_t)h3*s4 + (uint64_t)h4*s3;
+    uint64_t d3=(uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 + (uint64_t)h3*r0 + (uint64_t)h4*s4;
+    uint64_t d4=(uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 + (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+    uint32_t c;
+    c=(uint32_t)(d0>>26); h0=(uint32_t)d0&0x3ffffff;
+    d1+=c; c=(uint32_t)(d1>>26); h1=(uint32_t)d1&0x3ffffff;
+    d2+=c; c=(uint32_t)(d2>>26); h2=(uint32_t)d2&0x3ffffff;
+    d3+=c; c=(uint32_t)(d3>>26); h3=(uint32_t)d3&0x3ffffff;
+    d4+=c; c=(uint32_t)(d4>>26); h4=(uint32_t)d4&0x3ffffff;
+    h0+=c*5; c=h0>>26; h0&=0x3ffffff;
+    h1+=c;
+  }
+
+  h[0]=h0; h[1]=h1; h[2]=h2; h[3]=h3; h[4]=h4;
+}
+
+void Poly1305::update(const uint8_t *m, size_t len){
+
+  if(len==0)
+    return;
+
+  if(nBuf){                                 // complete any partially-filled block first
+    size_t n=16-nBuf<len?16-nBuf:len;
+    memcpy(buf+nBuf,m,n);
+    nBuf+=n;
+    m+=n;
+    len-=n;
+    if(nBuf<16)
+      return;
+    blocks(buf,16);
+    nBuf=0;
+  }
+
+  size_t n=len&~((size_t)15);
+  blocks(m,n);                              // process all full blocks directly from input
+  m+=n;
+  len-=n;
+
+  memcpy(buf,m,len);
+  nBuf=len;
+}
+
+void Poly1305::pad16(){
+
+  if(nBuf){
+    memset(buf+nBuf,0,16-nBuf);
+    blocks(buf,16);
+    nBuf=0;
+  }
+}
+
+void Poly1305::finish(uint8_t *tag){
+
+  uint32_t h0=h[0], h1=h[1], h2=h[2], h3=h[3], h4=h[4];
+  uint32_t c;
+
+  c=h1>>26; h1&=0x3ffffff;                  // fully carry h
+  h2+=c; c=h2>>26; h2&=0x3ffffff;
+  h3+=c; c=h3>>26; h3&=0x3ffffff;
+  h4+=c; c=h4>>26; h4&=0x3ffffff;
+  h0+=c*5; c=h0>>26; h0&=0x3ffffff;
+  h1+=c;
+
+  uint32_t g0=h0+5; c=g0>>26; g0&=0x3ffffff;     // compute h+(-p)
+  uint32_t g1=h1+c; c=g1>>26; g1&=0x3ffffff;
+  uint32_t g2=h2+c; c=g2>>26; g2&=0x3ffffff;
+  uint32_t g3=h3+c; c=g3>>26; g3&=0x3ffffff;
+  uint32_t g4=h4+c-(1<<26);
+
+  uint32_t mask=(g4>>31)-1;                 // select h if h<p, or h+(-p) if h>=p (in constant time)
+  g0&=mask; g1&=mask; g2&=mask; g3&=mask; g4&=mask;
+  mask=~mask;
+  h0=(h0&mask)|g0; h1=(h1&mask)|g1; h2=(h2&mask)|g2; h3=(h3&mask)|g3; h4=(h4&mask)|g4;
+
+  h0=(h0)|(h1<<26);                         // h = h % 2^128
+  h1=(h1>>6)|(h2<<20);
+  h2=(h2>>12)|(h3<<14);
+  h3=(h3>>18)|(h4<<8);
+
+  uint64_t f;                               // tag = (h + pad) % 2^128
+  f=(uint64_t)h0+pad[0];          store32(tag+0,(uint32_t)f);
+  f=(uint64_t)h1+pad[1]+(f>>32);  store32(tag+4,(uint32_t)f);
+  f=(uint64_t)h2+pad[2]+(f>>32);  store32(tag+8,(uint32_t)f);
+  f=(uint64_t)h3+pad[3]+(f>>32);  store32(tag+12,(uint32_t)f);
+}
+
+//////////////////////////////////////
+
+static void computeTag(uint8_t *tag, const uint8_t *c, size_t cLen, const uint8_t *ad, size_t adLen, uint32_t *state){
+
+  uint8_t keyStream[256];
+  chacha20x4(keyStream,state);              // Poly1305 key is first 32 bytes of block 0
+  state[12]=1;                              // encryption starts with block 1
+
+  Poly1305 poly(keyStream);
+  memset(keyStream,0,sizeof(keyStream));
+
+  uint8_t lengths[16];
+  store32(lengths+0,(uint32_t)adLen);
+  store32(lengths+4,(uint32_t)((uint64_t)adLen>>32));
+  store32(lengths+8,(uint32_t)cLen);
+  store32(lengths+12,(uint32_t)((uint64_t)cLen>>32));
+
+  poly.update(ad,adLen);
+  poly.pad16();
+  poly.update(c,cLen);
+  poly.pad16();
+  poly.update(lengths,16);
+  poly.finish(tag);
+}
+
+static void multiBlockEncrypt(uint8_t *c, const uint8_t *m, size_t mLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key){
+
+  uint32_t state[16];
+
+  chacha20Init(state,key,nonce,1);
+  chacha20Xor(c,m,mLen,state);
+  chacha20Init(state,key,nonce,0);
+  computeTag(c+mLen,c,mLen,ad,adLen,state);
+}
+
+static int multiBlockDecrypt(uint8_t *m, const uint8_t *c, size_t cLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key){
+
+  if(cLen<AEAD::TAG_BYTES)
+    return(-1);
+
+  cLen-=AEAD::TAG_BYTES;
+
+  uint32_t state[16];
+  uint8_t tag[AEAD::TAG_BYTES];
+
+  chacha20Init(state,key,nonce,0);
+  computeTag(tag,c,cLen,ad,adLen,state);
+
+  uint8_t diff=0;                           // compare tags in constant time
+  for(int i=0;i<AEAD::TAG_BYTES;i++)
+    diff|=tag[i]^c[cLen+i];
+
+  if(diff)
+    return(-1);
+
+  chacha20Xor(m,c,cLen,state);              // state was left at block 1 by computeTag()
+  return(0);
+}
+
+const AEADBackend AEAD::multiBlock={"multi-block",multiBlockEncrypt,multiBlockDecrypt};
+
+/////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+
+#if defined(HS_AEAD_MULTIBLOCK)
+const AEADBackend &AEAD::backend=AEAD::multiBlock;
+#else
+const AEADBackend &AEAD::backend=AEAD::sodium;
+#endif
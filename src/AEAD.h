@@ -0,0 +1,73 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/////////////////////////////////////////////////
+// ChaCha20-Poly1305 AEAD (RFC 8439) Backends
+//
+// All HAP encryption and decryption goes through AEAD::encrypt()
+// and AEAD::decrypt(), which call the backend selected at build time:
+//
+//   AEAD::sodium     - libsodium's portable implementation (default)
+//   AEAD::multiBlock - HomeSpan's implementation, which generates ChaCha20
+//                      keystream four blocks at a time using GCC vector
+//                      extensions (SSE/NEON on host builds, scalar code on
+//                      targets without vector support), and runs Poly1305
+//                      over all blocks of a frame in a single pass.  Select
+//                      by defining HS_AEAD_MULTIBLOCK as a build flag.
+//
+// Both backends are always compiled so they can be benchmarked against
+// each other at run-time, either on-device or on a host (see
+// tools/benchCrypto.cpp).  Ciphertext is always followed by a 16-byte
+// authentication tag, and encryption/decryption may be done in place.
+
+struct AEADBackend {
+
+  const char *name;
+
+  void (*encrypt)(uint8_t *c, const uint8_t *m, size_t mLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key);      // writes mLen bytes of ciphertext followed by tag into c
+  int (*decrypt)(uint8_t *m, const uint8_t *c, size_t cLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key);       // verifies tag at end of c and writes cLen-TAG_BYTES bytes of plaintext into m.  Returns 0 if successful, else -1
+};
+
+namespace AEAD {
+
+  static const int KEY_BYTES=32;
+  static const int NONCE_BYTES=12;
+  static const int TAG_BYTES=16;
+
+  extern const AEADBackend sodium;
+  extern const AEADBackend multiBlock;
+  extern const AEADBackend &backend;      // backend selected at build time
+
+  inline void encrypt(uint8_t *c, const uint8_t *m, size_t mLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key){backend.encrypt(c,m,mLen,ad,adLen,nonce,key);}
+  inline int decrypt(uint8_t *m, const uint8_t *c, size_t cLen, const uint8_t *ad, size_t adLen, const uint8_t *nonce, const uint8_t *key){return(backend.decrypt(m,c,cLen,ad,adLen,nonce,key));}
+};
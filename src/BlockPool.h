@@ -0,0 +1,186 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <Arduino.h>
+
+#include "PSRAM.h"
+
+/////////////////////////////////////////////////
+// Fixed-block memory pool with O(1) acquire and
+// release.  Storage for all blocks is allocated
+// once (upon first use) and is never returned to
+// the heap.  Blocks are sized by the first request.
+// Pools should be defined as global objects.
+
+class BlockPool {
+
+  private:
+
+  const char *name;                   // name of pool (used only for reporting)
+  size_t nBlocks;                     // capacity of pool
+  size_t blockSize=0;                 // size of each block (set upon first acquire)
+  uint8_t *storage=NULL;              // contiguous storage for all blocks
+  void *freeList=NULL;                // singly-linked list of free blocks (next pointer stored in the block itself)
+  void *spareList=NULL;               // singly-linked list of heap blocks set aside by reserve() for use once the pool is exhausted
+  portMUX_TYPE mux=portMUX_INITIALIZER_UNLOCKED;
+
+  public:
+
+  size_t nUsed=0;                     // number of blocks currently in use
+  size_t nPeak=0;                     // maximum number of blocks ever in use at the same time
+  uint32_t nExhausted=0;              // number of requests that could not be satisfied because all blocks were in use
+  uint32_t nHeap=0;                   // number of requests satisfied from the heap because all blocks were in use
+  uint32_t nRefused=0;                // number of requests refused because all blocks were in use and the heap was also exhausted
+
+  constexpr BlockPool(const char *name, size_t nBlocks) : name{name}, nBlocks{nBlocks} {}     // constexpr ensures pools are ready before any other static objects are constructed
+
+  void *acquire(size_t size){         // returns pointer to free block, or NULL if pool is exhausted or size is larger than block size
+    void *p=NULL;
+    portENTER_CRITICAL(&mux);
+    if(blockSize==0){                 // first use - size and allocate storage
+      blockSize=(size+7)&~((size_t)7);
+      if(blockSize<sizeof(void *))
+        blockSize=sizeof(void *);
+      if((storage=(uint8_t *)HS_MALLOC(nBlocks*blockSize))){
+        for(int i=nBlocks-1;i>=0;i--){
+          *(void **)(storage+i*blockSize)=freeList;
+          freeList=storage+i*blockSize;
+        }
+      }
+    }
+    if(size<=blockSize){
+      if(freeList){
+        p=freeList;
+        freeList=*(void **)p;
+        if(++nUsed>nPeak)
+          nPeak=nUsed;
+      } else {
+        nExhausted++;
+      }
+    }
+    portEXIT_CRITICAL(&mux);
+    return(p);
+  }
+
+  boolean release(void *p){           // returns block to pool, or false if p was not acquired from this pool
+    if(!storage || (uint8_t *)p<storage || (uint8_t *)p>=storage+nBlocks*blockSize)
+      return(false);
+    portENTER_CRITICAL(&mux);
+    *(void **)p=freeList;
+    freeList=p;
+    nUsed--;
+    portEXIT_CRITICAL(&mux);
+    return(true);
+  }
+
+  void *fallback(size_t size){        // returns a spare (or newly-allocated) heap block for use when pool is exhausted, or NULL if heap is also exhausted
+    void *p=NULL;
+    portENTER_CRITICAL(&mux);
+    if(spareList && size<=blockSize){
+      p=spareList;
+      spareList=*(void **)p;
+    }
+    portEXIT_CRITICAL(&mux);
+    if(p==NULL)
+      p=HS_MALLOC(size);
+    portENTER_CRITICAL(&mux);
+    if(p)
+      nHeap++;
+    else
+      nRefused++;
+    portEXIT_CRITICAL(&mux);
+    return(p);
+  }
+
+  boolean reserve(){                  // ensures the next single-block request can be satisfied (setting aside a heap block if pool is exhausted).  Returns false if it cannot
+    portENTER_CRITICAL(&mux);
+    boolean ready=(blockSize==0 || freeList || spareList);
+    portEXIT_CRITICAL(&mux);
+    if(ready)
+      return(true);
+    void *p=HS_MALLOC(blockSize>sizeof(void *)?blockSize:sizeof(void *));
+    portENTER_CRITICAL(&mux);
+    if(p){
+      *(void **)p=spareList;
+      spareList=p;
+    } else {
+      nRefused++;
+    }
+    portEXIT_CRITICAL(&mux);
+    return(p!=NULL);
+  }
+
+  void noteExhausted(){               // records a request the caller refused without acquiring a block because the pool is full
+    portENTER_CRITICAL(&mux);
+    nExhausted++;
+    portEXIT_CRITICAL(&mux);
+  }
+
+  boolean full(){return(nUsed>=nBlocks);}
+  size_t capacity(){return(nBlocks);}
+
+  void print();                       // prints pool statistics (defined in Utils.cpp)
+};
+
+/////////////////////////////////////////////////
+// STL allocator that takes single elements (such as
+// the nodes of a std::list) from a BlockPool, and
+// falls back on the heap when the pool is exhausted.
+// STL containers cannot handle a NULL allocation, so
+// if the heap is also exhausted this halts, exactly as
+// Mallocator does.  Code that wants to refuse an
+// insertion gracefully instead must first call
+// reserve() on the pool (or check full() if the pool
+// is the only source of elements) and refuse the
+// insertion if it fails.
+
+template <class T, BlockPool &pool>
+struct PoolAllocator {
+  typedef T value_type;
+  template <class U> struct rebind { typedef PoolAllocator<U,pool> other; };
+  PoolAllocator() = default;
+  template <class U> constexpr PoolAllocator(const PoolAllocator<U,pool>&) {}
+  [[nodiscard]] T* allocate(std::size_t n) {
+    T *p=NULL;
+    if(n==1)
+      p=static_cast<T*>(pool.acquire(sizeof(T)));
+    if(p==NULL)
+      p=static_cast<T*>(pool.fallback(n*sizeof(T)));
+    if(p==NULL){
+      Serial.printf("\n\n*** FATAL ERROR: Requested allocation of %d bytes failed.  Program Halting.\n\n",n*sizeof(T));
+      while(1);
+    }
+    return p;
+  }
+  void deallocate(T* p, std::size_t) noexcept { if(!pool.release(p)) std::free(p); }
+};
+template <class T, class U, BlockPool &P>
+bool operator==(const PoolAllocator<T,P>&, const PoolAllocator<U,P>&) { return true; }
+template <class T, class U, BlockPool &P>
+bool operator!=(const PoolAllocator<T,P>&, const PoolAllocator<U,P>&) { return false; }
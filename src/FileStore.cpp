@@ -0,0 +1,306 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#include "FileStore.h"
+
+#include <unistd.h>
+
+//////////////////////////////////////
+
+uint32_t FileStore::crc32(const void *buf, size_t len, uint32_t crc){
+
+  const uint8_t *p=(const uint8_t *)buf;
+  crc=~crc;
+  while(len--){
+    crc^=*p++;
+    for(int i=0;i<8;i++)
+      crc=(crc>>1)^(0xEDB88320 & (0-(crc&1)));
+  }
+  return(~crc);
+}
+
+//////////////////////////////////////
+
+void FileStore::stage(std::string &out, op_t op, type_t type, const char *key, size_t keyLen, const void *val, size_t valLen){
+
+  record_t r={op,type,(uint16_t)keyLen,(uint32_t)valLen};
+  out.append((const char *)&r,sizeof(r));
+  if(keyLen)
+    out.append(key,keyLen);
+  if(valLen)
+    out.append((const char *)val,valLen);
+}
+
+//////////////////////////////////////
+
+void FileStore::stageCommit(std::string &out, size_t batchStart){
+
+  uint32_t crc=crc32(out.data()+batchStart,out.size()-batchStart);
+  stage(out,OP_COMMIT,U64,"",0,&crc,sizeof(crc));
+}
+
+//////////////////////////////////////
+
+bool FileStore::append(const std::string &data){
+
+  if(!fp || fwrite(data.data(),1,data.size(),fp)!=data.size() || fflush(fp))
+    return(false);
+
+  if(syncOnCommit)
+    fsync(fileno(fp));
+
+  fileSize+=data.size();
+  bytesWritten+=data.size();
+  return(true);
+}
+
+//////////////////////////////////////
+
+bool FileStore::open(){
+
+  std::string log;
+  std::string tmpPath=path+".tmp";
+
+  if(FILE *tmp=fopen(tmpPath.c_str(),"rb")){          // a compaction was interrupted
+    fclose(tmp);
+    if(FILE *in=fopen(path.c_str(),"rb")){            // original log is intact, so temporary snapshot may be incomplete - discard it
+      fclose(in);
+      remove(tmpPath.c_str());
+    } else {                                          // original log was already removed, so temporary snapshot is complete - finish the rename
+      rename(tmpPath.c_str(),path.c_str());
+    }
+  }
+
+  if(FILE *in=fopen(path.c_str(),"rb")){              // read entire existing log
+    char buf[512];
+    size_t n;
+    while((n=fread(buf,1,sizeof(buf),in))>0)
+      log.append(buf,n);
+    fclose(in);
+  }
+
+  table.clear();
+  liveSize=recordSize(0,sizeof(uint32_t));            // every log ends with a commit record
+
+  size_t offset=0;            // current read position
+  size_t batchStart=0;        // start of current (uncommitted) batch
+  size_t goodSize=0;          // end of last valid commit
+
+  while(offset+sizeof(record_t)<=log.size()){         // first pass - verify batches
+    record_t r;
+    memcpy(&r,log.data()+offset,sizeof(r));
+    size_t n=recordSize(r.keyLen,r.valLen);
+    if(offset+n>log.size() || r.op<OP_SET || r.op>OP_COMMIT)
+      break;
+
+    if(r.op==OP_COMMIT){
+      uint32_t crc;
+      memcpy(&crc,log.data()+offset+sizeof(r),sizeof(crc));
+      if(r.valLen!=sizeof(crc) || crc!=crc32(log.data()+batchStart,offset-batchStart))
+        break;
+      goodSize=offset+n;
+      batchStart=goodSize;
+    }
+    offset+=n;
+  }
+
+  for(offset=0;offset<goodSize;){                     // second pass - apply all committed records
+    record_t r;
+    memcpy(&r,log.data()+offset,sizeof(r));
+    std::string key(log.data()+offset+sizeof(r),r.keyLen);
+    const char *val=log.data()+offset+sizeof(r)+r.keyLen;
+
+    if(r.op==OP_SET || r.op==OP_ERASE){
+      auto it=table.find(key);
+      if(it!=table.end()){
+        liveSize-=recordSize(key.size(),it->second.val.size());
+        table.erase(it);
+      }
+      if(r.op==OP_SET){
+        table[key]={(type_t)r.type,std::string(val,r.valLen)};
+        liveSize+=recordSize(key.size(),r.valLen);
+      }
+    } else if(r.op==OP_ERASE_ALL){
+      table.clear();
+      liveSize=recordSize(0,sizeof(uint32_t));
+    }
+    offset+=recordSize(r.keyLen,r.valLen);
+  }
+
+  fileSize=log.size();
+
+  if(fp){
+    fclose(fp);
+    fp=NULL;
+  }
+
+  if(goodSize<log.size()){                            // discard incomplete or corrupted batch at end of log
+    nDiscarded++;
+    return(compact());
+  }
+
+  fp=fopen(path.c_str(),"ab");
+  return(fp!=NULL);
+}
+
+//////////////////////////////////////
+
+bool FileStore::compact(){
+
+  std::string snapshot;
+  snapshot.reserve(liveSize);
+
+  for(auto it=table.begin();it!=table.end();it++)
+    stage(snapshot,OP_SET,it->second.type,it->first.c_str(),it->first.size(),it->second.val.data(),it->second.val.size());
+  stageCommit(snapshot,0);
+
+  std::string tmpPath=path+".tmp";
+  FILE *out=fopen(tmpPath.c_str(),"wb");
+  if(!out)
+    return(false);
+
+  bool ok=(fwrite(snapshot.data(),1,snapshot.size(),out)==snapshot.size() && !fflush(out));
+  if(ok)
+    fsync(fileno(out));
+  fclose(out);
+
+  if(!ok){
+    remove(tmpPath.c_str());
+    return(false);
+  }
+
+  if(fp){
+    fclose(fp);
+    fp=NULL;
+  }
+
+  if(rename(tmpPath.c_str(),path.c_str())){           // atomically replaces original log on POSIX file systems and LittleFS
+    remove(path.c_str());                             // some file systems (e.g. SPIFFS) will not rename over an existing file - open() completes the rename if interrupted here
+    if(rename(tmpPath.c_str(),path.c_str()))
+      return(false);
+  }
+
+  fp=fopen(path.c_str(),"ab");
+  fileSize=snapshot.size();
+  bytesWritten+=snapshot.size();
+  nCompactions++;
+  return(fp!=NULL);
+}
+
+//////////////////////////////////////
+
+FileStore::~FileStore(){
+  if(fp)
+    fclose(fp);
+}
+
+//////////////////////////////////////
+
+bool FileStore::get(const char *key, type_t type, void *val, size_t *len){
+
+  auto it=table.find(key);
+  if(it==table.end() || it->second.type!=type)
+    return(false);
+
+  size_t n=it->second.val.size();
+
+  if(val){
+    if(*len<n)
+      return(false);
+    memcpy(val,it->second.val.data(),n);
+  }
+
+  *len=n;
+  return(true);
+}
+
+//////////////////////////////////////
+
+bool FileStore::set(const char *key, type_t type, const void *val, size_t len){
+
+  size_t keyLen=strlen(key);
+  if(keyLen>UINT16_MAX)
+    return(false);
+
+  entry_t &e=table[key];
+  if(e.val.size() || e.type)
+    liveSize-=recordSize(keyLen,e.val.size());
+  e.type=type;
+  e.val.assign((const char *)val,len);
+  liveSize+=recordSize(keyLen,len);
+
+  stage(journal,OP_SET,type,key,keyLen,val,len);
+  nSets++;
+  return(true);
+}
+
+//////////////////////////////////////
+
+bool FileStore::erase(const char *key){
+
+  auto it=table.find(key);
+  if(it==table.end())
+    return(false);
+
+  liveSize-=recordSize(it->first.size(),it->second.val.size());
+  table.erase(it);
+  stage(journal,OP_ERASE,U64,key,strlen(key),NULL,0);
+  nSets++;
+  return(true);
+}
+
+//////////////////////////////////////
+
+bool FileStore::eraseAll(){
+
+  table.clear();
+  liveSize=recordSize(0,sizeof(uint32_t));
+  journal.clear();                                    // nothing staged before this matters any more
+  stage(journal,OP_ERASE_ALL,U64,"",0,NULL,0);
+  nSets++;
+  return(true);
+}
+
+//////////////////////////////////////
+
+bool FileStore::commit(){
+
+  if(journal.empty())
+    return(true);
+
+  if(fileSize+journal.size()>minCompactSize && fileSize+journal.size()>2*liveSize){      // log would be mostly stale data - write a fresh snapshot instead
+    journal.clear();
+    nCommits++;
+    return(compact());
+  }
+
+  stageCommit(journal,0);
+  bool ok=append(journal);
+  journal.clear();
+  nCommits++;
+  return(ok);
+}
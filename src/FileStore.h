@@ -0,0 +1,114 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "SpanStore.h"
+
+/////////////////////////////////////////////////
+// Journaled, log-structured SpanStore backed by a
+// single file.  All live values are held in memory.
+// Changes are staged and appended to the file as one
+// batch, followed by a CRC-protected commit record,
+// when commit() is called.  On open() the file is
+// replayed, and any batch that was not completely
+// written (e.g. power was lost mid-commit) is
+// discarded.  When the file grows beyond twice the
+// size of the live data it is compacted by writing
+// a fresh snapshot to a temporary file and renaming
+// it over the original.  If a compaction is
+// interrupted, open() either discards the temporary
+// file (when the original is intact) or completes
+// the rename (when the original was already removed).
+//
+// Uses only standard C/C++ file I/O, so it runs on
+// a host as well as on an ESP32 with a mounted file
+// system (e.g. LittleFS or SD).
+
+class FileStore : public SpanStore {
+
+  enum op_t : uint8_t {
+    OP_SET=1,
+    OP_ERASE=2,
+    OP_ERASE_ALL=3,
+    OP_COMMIT=4
+  };
+
+  struct record_t {                   // header of each record in file, followed by key and value bytes
+    uint8_t op;
+    uint8_t type;
+    uint16_t keyLen;
+    uint32_t valLen;
+  };
+
+  struct entry_t {
+    type_t type;
+    std::string val;
+  };
+
+  std::string path;                                   // path of log file
+  FILE *fp=NULL;                                      // log file, opened for appending
+  std::unordered_map<std::string, entry_t> table;     // all live values
+  std::string journal;                                // records staged since last commit
+  size_t fileSize=0;                                  // current size of log file
+  size_t liveSize=0;                                  // size a freshly-compacted log file would have
+  size_t minCompactSize;                              // log file is never compacted below this size
+  bool syncOnCommit;                                  // flag to fsync() log file after each commit
+
+  static uint32_t crc32(const void *buf, size_t len, uint32_t crc=0);
+  static size_t recordSize(size_t keyLen, size_t valLen){return(sizeof(record_t)+keyLen+valLen);}
+  void stage(std::string &out, op_t op, type_t type, const char *key, size_t keyLen, const void *val, size_t valLen);
+  void stageCommit(std::string &out, size_t batchStart);
+  bool append(const std::string &data);
+
+  public:
+
+  uint32_t nSets=0;                   // number of set() and erase() calls
+  uint32_t nCommits=0;                // number of batches written to log file
+  uint32_t nCompactions=0;            // number of times log file was compacted
+  uint32_t nDiscarded=0;              // number of incomplete or corrupted batches discarded when log was replayed
+  uint64_t bytesWritten=0;            // total bytes written to log file (including compactions)
+
+  FileStore(const char *path, size_t minCompactSize=4096, bool syncOnCommit=true) : path{path}, minCompactSize{minCompactSize}, syncOnCommit{syncOnCommit} {}
+  ~FileStore();
+
+  bool open();                        // replays log file (creating it if needed) and prepares it for appending.  Returns false if file cannot be opened
+  bool compact();                     // writes snapshot of all live values to new log file
+  size_t size(){return(table.size());}
+  size_t getFileSize(){return(fileSize);}
+
+  bool get(const char *key, type_t type, void *val, size_t *len) override;
+  bool set(const char *key, type_t type, const void *val, size_t len) override;
+  bool erase(const char *key) override;
+  bool eraseAll() override;
+  bool commit() override;
+};
@@ -56,6 +56,17 @@ void HAPClient::init(){
    }
   }
 
+  srpMutex=xSemaphoreCreateMutex();
+  cryptoQueue=xQueueCreate(MAX_CLIENTS,sizeof(HAPClient *));
+  
+  if(!cryptoQueue){
+    LOG0("\n*** WARNING: Unable to create crypto worker queue.  Pair-Setup and Pair-Verify cryptography will be performed inline.\n\n");
+  } else if(xTaskCreateUniversal(cryptoTask,"cryptoTask",DEFAULT_CRYPTO_STACK_SIZE,NULL,uxTaskPriorityGet(NULL),NULL,tskNO_AFFINITY)!=pdPASS){
+    LOG0("\n*** WARNING: Unable to start crypto worker task.  Pair-Setup and Pair-Verify cryptography will be performed inline.\n\n");
+    vQueueDelete(cryptoQueue);
+    cryptoQueue=NULL;
+  }
+
   if(nvs_get_blob(homeSpan.srpNVS,"VERIFYDATA",NULL,&len))                // if Pair-Setup verification code data not found in NVS
     homeSpan.setPairingCode(DEFAULT_SETUP_CODE,false);                    // create and save verification from default Pairing Setup Code 
   
@@ -77,12 +88,30 @@ void HAPClient::init(){
     nvs_commit(homeSpan.hapNVS);                                                  // commit to NVS
   }
 
-  if(!nvs_get_blob(homeSpan.hapNVS,"CONTROLLERS",NULL,&len)){            // if found long-term Controller Pairings data from NVS
+  for(int n=0;n<ControllerTable::CAPACITY;n++){                         // retrieve long-term Controller Pairings data from NVS (one record per table slot)
+    char key[16];
+    Controller tCont;
+    len=sizeof(Controller);
+    sprintf(key,"CONTROLLER%02d",n);
+    if(!nvs_get_blob(homeSpan.hapNVS,key,&tCont,&len) && tCont.allocated)
+      controllerTable.insert(tCont,n);
+  }
+
+  controllerTable.clearDirty();                                          // slots just loaded already match NVS
+
+  if(!nvs_get_blob(homeSpan.hapNVS,"CONTROLLERS",NULL,&len)){            // if found Controller Pairings data in original single-record format, convert to one record per slot
     TempBuffer<Controller> tBuf(len/sizeof(Controller));
     nvs_get_blob(homeSpan.hapNVS,"CONTROLLERS",tBuf,&len);               // retrieve data
     for(int i=0;i<tBuf.size();i++){
-      if(tBuf[i].allocated)
-        controllerList.push_back(tBuf[i]);
+      if(tBuf[i].allocated && !controllerTable.find(tBuf[i].ID))
+        controllerTable.insert(tBuf[i]);
+    }
+    if(storeControllers()){                                              // write and commit converted records BEFORE erasing original record
+      nvs_erase_key(homeSpan.hapNVS,"CONTROLLERS");
+      nvs_commit(homeSpan.hapNVS);
+      LOG0("Converted Controller Pairings data to per-slot NVS records\n");
+    } else {
+      LOG0("\n*** WARNING: Unable to save converted Controller Pairings data.  Original record retained and conversion will be retried at next start-up.\n\n");
     }
   }
   
@@ -102,7 +131,11 @@ void HAPClient::init(){
     nvs_commit(homeSpan.hapNVS);                                                                // commit to NVS
   }
 
-  if(homeSpan.updateDatabase(false)){       // create Configuration Number and Loop vector
+  if(homeSpan.warmStart.sameConfig(homeSpan.hapConfig)){      // database hash is unchanged since warm restart - skip re-computing it
+    homeSpan.updateLoops();
+    LOG0("\nAccessory configuration number: %d (restored after warm restart)\n",homeSpan.hapConfig.configNumber);
+  }
+  else if(homeSpan.updateDatabase(false)){       // create Configuration Number and Loop vector
     LOG0("\nAccessory configuration has changed.  Updating configuration number to %d\n",homeSpan.hapConfig.configNumber);
   }
   else{
@@ -115,6 +148,13 @@ void HAPClient::init(){
 
 //////////////////////////////////////
 
+HAPClient::~HAPClient(){
+
+  controllerTable.detach(this);
+}
+
+//////////////////////////////////////
+
 void HAPClient::processRequest(){
 
   int nBytes, messageSize;
@@ -127,11 +167,11 @@ void HAPClient::processRequest(){
     return;
   }
  
-  TempBuffer<uint8_t> httpBuf(messageSize+1);      // leave room for null character added below
+  uint8_t *httpBuf=scratch.alloc<uint8_t>(messageSize+1);      // leave room for null character added below
   
   if(cPair){                                       // expecting encrypted message
     LOG2("<<<< #### ");
-    LOG2(client.remoteIP());
+    LOG2(ipAddress);
     LOG2(" #### <<<<\n");
 
     nBytes=receiveEncrypted(httpBuf,messageSize);  // decrypt and return number of bytes read      
@@ -143,7 +183,7 @@ void HAPClient::processRequest(){
         
   } else {                                         // expecting plaintext message  
     LOG2("<<<<<<<<< ");
-    LOG2(client.remoteIP());
+    LOG2(ipAddress);
     LOG2(" <<<<<<<<<\n");
     
     nBytes=client.read(httpBuf,messageSize);       // read expected number of bytes
@@ -158,10 +198,10 @@ void HAPClient::processRequest(){
       
   httpBuf[nBytes]='\0';   // add null character to enable string functions
       
-  char *body=(char *)httpBuf.get();   // char pointer to start of HTTP Body
+  char *body=(char *)httpBuf;         // char pointer to start of HTTP Body
   char *p;                            // char pointer used for searches
      
-  if(!(p=strstr((char *)httpBuf.get(),"\r\n\r\n"))){
+  if(!(p=strstr(body,"\r\n\r\n"))){
     badRequestError();
     LOG0("\n*** ERROR:  Malformed HTTP request (can't find blank line indicating end of BODY)\n\n");
     return;      
@@ -265,7 +305,25 @@ int HAPClient::notFoundError(){
 
   char s[]="HTTP/1.1 404 Not Found\r\n\r\n";
   LOG2("\n>>>>>>>>>> ");
-  LOG2(client.remoteIP());
+  LOG2(ipAddress);
+  LOG2(" >>>>>>>>>>\n");
+  LOG2(s);
+  client.print(s);
+  LOG2("------------ SENT! --------------\n");
+  
+  delay(1);
+  client.stop();
+
+  return(-1);
+}
+
+//////////////////////////////////////
+
+int HAPClient::internalError(){
+
+  char s[]="HTTP/1.1 500 Internal Server Error\r\n\r\n";
+  LOG2("\n>>>>>>>>>> ");
+  LOG2(ipAddress);
   LOG2(" >>>>>>>>>>\n");
   LOG2(s);
   client.print(s);
@@ -283,7 +341,7 @@ int HAPClient::badRequestError(){
 
   char s[]="HTTP/1.1 400 Bad Request\r\n\r\n";
   LOG2("\n>>>>>>>>>> ");
-  LOG2(client.remoteIP());
+  LOG2(ipAddress);
   LOG2(" >>>>>>>>>>\n");
   LOG2(s);
   client.print(s);
@@ -301,7 +359,7 @@ int HAPClient::unauthorizedError(){
 
   char s[]="HTTP/1.1 470 Connection Authorization Required\r\n\r\n";
   LOG2("\n>>>>>>>>>> ");
-  LOG2(client.remoteIP());
+  LOG2(ipAddress);
   LOG2(" >>>>>>>>>>\n");
   LOG2(s);
   client.print(s);
@@ -317,18 +375,23 @@ int HAPClient::unauthorizedError(){
 
 int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
 
-  static SRP6A *srp=NULL;   // must persist across multiple calls to postPairSetupURL
+  static uint32_t startTime;    // time at which current Pair-Setup attempt started (used to log timing of each step)
 
-  HAPTLV iosTLV;
+  HAPTLVView iosTLV;
   HAPTLV responseTLV;
   HAPTLV subTLV;
+  HAPTLVView iosSubTLV;
 
-  iosTLV.unpack(content,len);
+  if(iosTLV.unpack(content,len)){                               // parse TLV records in place (no copies are made)
+    LOG0("\n*** ERROR: Malformed TLV8 content\n\n");
+    badRequestError();                                          // return with 400 error, which closes connection
+    return(0);
+  }
   if(homeSpan.getLogLevel()>1)
     iosTLV.print();
   LOG2("------------ END TLVS! ------------\n");
 
-  LOG1("In Pair Setup #%d (%s)...",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Pair Setup #%d (%s)...",clientNumber,ipAddress);
   
   auto itState=iosTLV.find(kTLVType_State);
 
@@ -356,6 +419,7 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
     responseTLV.add(kTLVType_Error,tagError_Unknown);               // set Error=Unknown (there is no specific error type for out-of-sequence steps)
     tlvRespond(responseTLV);                                        // send response to client
     pairStatus=pairState_M1;                                        // reset pairStatus to first step of unpaired accessory (M1)
+    pairSetupGen++;                                                 // any SRP Verify still running on the crypto worker task is now stale
     return(0);
   };
    
@@ -376,6 +440,10 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
 
       auto itPublicKey=responseTLV.add(kTLVType_PublicKey,384,NULL);                // create blank PublicKey TLV with space for 384 bytes
 
+      startTime=micros();
+
+      xSemaphoreTake(srpMutex,portMAX_DELAY);                                       // wait for any background precomputation to complete
+
       if(srp==NULL)                                                                 // create instance of SRP (if not already created) to persist until Pairing-Setup M5 completes
         srp=new SRP6A;
         
@@ -384,11 +452,16 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
       nvs_get_blob(homeSpan.srpNVS,"VERIFYDATA",verifyData,&len);
 
       responseTLV.add(kTLVType_Salt,16,verifyData.get()->salt);                     // write Salt from verification data into TLV
-      
+
+      boolean precomputed=srp->precomputed;
       srp->createPublicKey(verifyData,*itPublicKey);                                // create accessory Public Key from stored verification data and write result into PublicKey TLV
+      pairStatus=pairState_M3;                                                      // set next expected pair-state request from client
+      pairSetupGen++;                                                               // new SRP exchange - any SRP Verify still running for a previous one is now stale
+
+      xSemaphoreGive(srpMutex);
       
       tlvRespond(responseTLV);                                                      // send response to client
-      pairStatus=pairState_M3;                                                      // set next expected pair-state request from client
+      LOG1("Pair-Setup <M2> sent in %.1f ms (SRP %s)\n",(micros()-startTime)/1000.0,precomputed?"precomputed":"computed on demand");
       return(1);
     } 
     break;
@@ -397,6 +470,8 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
 
       responseTLV.add(kTLVType_State,pairState_M4);                     // set State=<M4>
 
+      uint32_t gen=++pairSetupGen;                                      // identifies this SRP Verify job (a later M3, or a reset of pairStatus, makes any earlier job stale)
+
       auto itPublicKey=iosTLV.find(kTLVType_PublicKey);
       auto itClientProof=iosTLV.find(kTLVType_Proof);
 
@@ -408,22 +483,48 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
         return(0);
       };
 
-      srp->createSessionKey(*itPublicKey,itPublicKey->getLen());              // create session key, K, from client Public Key, A
-
-      if(!srp->verifyClientProof(*itClientProof)){                            // verify client Proof, M1
-        LOG0("\n*** ERROR: SRP Proof Verification Failed\n\n");
-        responseTLV.add(kTLVType_Error,tagError_Authentication);              // set Error=Authentication
-        tlvRespond(responseTLV);                                              // send response to client
-        pairStatus=pairState_M1;                                              // reset pairStatus to first step of unpaired
-        return(0);        
-      };
+      uint32_t t0=micros();
+      uint8_t *A=*itPublicKey;                                                // Client Public Key and Proof remain in scratch memory until crypto job is done
+      size_t aLen=itPublicKey->getLen();
+      uint8_t *clientProof=*itClientProof;
+      uint8_t *accProof=scratch.alloc<uint8_t>(64);
+      int *verified=scratch.alloc<int>(1);
+
+      runCrypto([A,aLen,clientProof,accProof,verified,gen](){
+        xSemaphoreTake(srpMutex,portMAX_DELAY);
+        *verified=0;
+        if(gen==pairSetupGen){                                                // skip if SRP state has since been claimed by a newer exchange
+          srp->createSessionKey(A,aLen);                                      // create session key, K, from client Public Key, A
+          if((*verified=srp->verifyClientProof(clientProof)))                 // verify client Proof, M1
+            srp->createAccProof(accProof);                                    // M1 has been successully verified; now create accessory Proof M2
+        }
+        xSemaphoreGive(srpMutex);
+      },
+      [this,accProof,verified,t0,gen](){
+        HAPTLV responseTLV;
+        responseTLV.add(kTLVType_State,pairState_M4);                         // set State=<M4>
+
+        if(gen!=pairSetupGen){                                                // Pair-Setup was restarted or reset while this job was running
+          LOG0("\n*** ERROR: Pair-Setup interrupted by another request\n\n");
+          responseTLV.add(kTLVType_Error,tagError_Unknown);                   // set Error=Unknown
+          tlvRespond(responseTLV);                                            // send response to client, but leave pairStatus to the newer exchange
+          return;
+        }
 
-      auto itAccProof=responseTLV.add(kTLVType_Proof,64,NULL);                // create blank accessory Proof TLV with space for 64 bytes
+        if(!*verified){
+          LOG0("\n*** ERROR: SRP Proof Verification Failed\n\n");
+          responseTLV.add(kTLVType_Error,tagError_Authentication);            // set Error=Authentication
+          tlvRespond(responseTLV);                                            // send response to client
+          pairStatus=pairState_M1;                                            // reset pairStatus to first step of unpaired
+          return;
+        }
 
-      srp->createAccProof(*itAccProof);                                       // M1 has been successully verified; now create accessory Proof M2
+        responseTLV.add(kTLVType_Proof,64,accProof);                          // set accessory Proof TLV
 
-      tlvRespond(responseTLV);                                                // send response to client
-      pairStatus=pairState_M5;                                                // set next expected pair-state request from client
+        tlvRespond(responseTLV);                                              // send response to client
+        pairStatus=pairState_M5;                                              // set next expected pair-state request from client
+        LOG1("Pair-Setup <M4> sent in %.1f ms\n",(micros()-t0)/1000.0);
+      });
      
       return(1);        
     }
@@ -451,15 +552,17 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
       // Note the SALT and INFO text fields used by HKDF to create this Session Key are NOT the same as those for creating iosDeviceX.
       // The iosDeviceX HKDF calculations are separate and will be performed further below with the SALT and INFO as specified in the HAP docs.
 
-      HKDF::create(temp.sessionKey,srp->K,64,"Pair-Setup-Encrypt-Salt","Pair-Setup-Encrypt-Info");               // create SessionKey
+      static HKDF::Salt encryptSalt("Pair-Setup-Encrypt-Salt");
+      encryptSalt.create(temp.sessionKey,srp->K,64,"Pair-Setup-Encrypt-Info");                                     // create SessionKey
 
       LOG2("------- DECRYPTING SUB-TLVS -------\n");
       
       // use SessionKey to decrypt encryptedData TLV with padded nonce="PS-Msg05"
                                   
-      TempBuffer<uint8_t> decrypted(itEncryptedData->getLen()-crypto_aead_chacha20poly1305_IETF_ABYTES);  // temporary storage for decrypted data
+      size_t decryptedLen=itEncryptedData->getLen()-AEAD::TAG_BYTES;
+      uint8_t *decrypted=scratch.alloc<uint8_t>(decryptedLen);          // storage for decrypted data (in scratch memory so it persists until crypto job is done)
        
-      if(crypto_aead_chacha20poly1305_ietf_decrypt(decrypted, NULL, NULL, *itEncryptedData, itEncryptedData->getLen(), NULL, 0, (unsigned char *)"\x00\x00\x00\x00PS-Msg05", temp.sessionKey)==-1){          
+      if(AEAD::decrypt(decrypted,*itEncryptedData,itEncryptedData->getLen(),NULL,0,(unsigned char *)"\x00\x00\x00\x00PS-Msg05",temp.sessionKey)==-1){          
         LOG0("\n*** ERROR: Exchange-Request Authentication Failed\n\n");
         responseTLV.add(kTLVType_Error,tagError_Authentication);        // set Error=Authentication
         tlvRespond(responseTLV);                                        // send response to client
@@ -467,17 +570,24 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
         return(0);        
       }
 
-      subTLV.unpack(decrypted,decrypted.len());                         // unpack TLV      
+      if(iosSubTLV.unpack(decrypted,decryptedLen)){                     // unpack TLV (records point directly into decrypted buffer)
+        LOG0("\n*** ERROR: Malformed encrypted TLV8 content\n\n");
+        responseTLV.add(kTLVType_Error,tagError_Authentication);        // set Error=Authentication
+        tlvRespond(responseTLV);                                        // send response to client
+        pairStatus=pairState_M1;                                        // reset pairStatus to first step of unpaired
+        return(0);
+      }
+
       if(homeSpan.getLogLevel()>1)
-        subTLV.print();                                                 // print decrypted TLV data
+        iosSubTLV.print();                                              // print decrypted TLV data
       
       LOG2("---------- END SUB-TLVS! ----------\n");
 
-      auto itIdentifier=subTLV.find(kTLVType_Identifier);
-      auto itSignature=subTLV.find(kTLVType_Signature);
-      auto itPublicKey=subTLV.find(kTLVType_PublicKey);
+      auto itIdentifier=iosSubTLV.find(kTLVType_Identifier);
+      auto itSignature=iosSubTLV.find(kTLVType_Signature);
+      auto itPublicKey=iosSubTLV.find(kTLVType_PublicKey);
 
-      if(subTLV.len(itIdentifier)!=hap_controller_IDBYTES || subTLV.len(itSignature)!=crypto_sign_BYTES || subTLV.len(itPublicKey)!=crypto_sign_PUBLICKEYBYTES){ 
+      if(iosSubTLV.len(itIdentifier)!=hap_controller_IDBYTES || iosSubTLV.len(itSignature)!=crypto_sign_BYTES || iosSubTLV.len(itPublicKey)!=crypto_sign_PUBLICKEYBYTES){ 
         LOG0("\n*** ERROR: One or more of required 'Identifier,' 'PublicKey,' and 'Signature' TLV records for this step is bad or missing\n\n");
         responseTLV.add(kTLVType_Error,tagError_Unknown);               // set Error=Unknown (there is no specific error type for missing/bad TLV data)
         tlvRespond(responseTLV);                                        // send response to client
@@ -490,70 +600,103 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
       // Rather, it purposely does not transmit "iosDeviceX", which is derived from the SRP Shared Secret that only the Client and this Server know.
       // Note that the SALT and INFO text fields now match those in HAP Section 5.6.6.1
 
-      TempBuffer<uint8_t> iosDeviceX(32);
-      HKDF::create(iosDeviceX,srp->K,64,"Pair-Setup-Controller-Sign-Salt","Pair-Setup-Controller-Sign-Info");     // derive iosDeviceX (32 bytes) from SRP Shared Secret using HKDF 
+      uint8_t iosDeviceX[32];
+      static HKDF::Salt controllerSignSalt("Pair-Setup-Controller-Sign-Salt");
+      controllerSignSalt.create(iosDeviceX,srp->K,64,"Pair-Setup-Controller-Sign-Info");                          // derive iosDeviceX (32 bytes) from SRP Shared Secret using HKDF 
 
       // Concatenate iosDeviceX, IOS ID, and IOS PublicKey into iosDeviceInfo
       
-      TempBuffer<uint8_t> iosDeviceInfo(iosDeviceX,iosDeviceX.len(),(uint8_t *)(*itIdentifier),itIdentifier->getLen(),(uint8_t *)(*itPublicKey),itPublicKey->getLen(),NULL);
-
-      if(crypto_sign_verify_detached(*itSignature, iosDeviceInfo, iosDeviceInfo.len(), *itPublicKey) != 0){      // verify signature of iosDeviceInfo using iosDeviceLTPK   
-        LOG0("\n*** ERROR: LPTK Signature Verification Failed\n\n");
-        responseTLV.add(kTLVType_Error,tagError_Authentication);        // set Error=Authentication
-        tlvRespond(responseTLV);                                        // send response to client
-        pairStatus=pairState_M1;                                        // reset pairStatus to first step of unpaired
-        return(0);                
-      }
-
-      addController(*itIdentifier,*itPublicKey,true);                   // save Pairing ID and LTPK for this Controller with admin privileges
+      size_t iosDeviceInfoLen=sizeof(iosDeviceX)+hap_controller_IDBYTES+crypto_sign_PUBLICKEYBYTES;
+      uint8_t *iosDeviceInfo=scratch.alloc<uint8_t>(iosDeviceInfoLen);
+      memcpy(iosDeviceInfo,iosDeviceX,sizeof(iosDeviceX));
+      memcpy(iosDeviceInfo+sizeof(iosDeviceX),*itIdentifier,hap_controller_IDBYTES);
+      memcpy(iosDeviceInfo+sizeof(iosDeviceX)+hap_controller_IDBYTES,*itPublicKey,crypto_sign_PUBLICKEYBYTES);
 
       // Now perform the above steps in reverse to securely transmit the AccessoryLTPK to the Controller (HAP Section 5.6.6.2)
 
-      TempBuffer<uint8_t> accessoryX(32);
-      HKDF::create(accessoryX,srp->K,64,"Pair-Setup-Accessory-Sign-Salt","Pair-Setup-Accessory-Sign-Info");       // derive accessoryX from SRP Shared Secret using HKDF 
+      uint8_t accessoryX[32];
+      static HKDF::Salt accessorySignSalt("Pair-Setup-Accessory-Sign-Salt");
+      accessorySignSalt.create(accessoryX,srp->K,64,"Pair-Setup-Accessory-Sign-Info");                            // derive accessoryX from SRP Shared Secret using HKDF 
       
       // Concatenate accessoryX, Accessory ID, and Accessory PublicKey into accessoryInfo
 
-      TempBuffer<uint8_t> accessoryInfo(accessoryX,accessoryX.len(),accessory.ID,hap_accessory_IDBYTES,accessory.LTPK,crypto_sign_PUBLICKEYBYTES,NULL);
+      size_t accessoryInfoLen=sizeof(accessoryX)+hap_accessory_IDBYTES+crypto_sign_PUBLICKEYBYTES;
+      uint8_t *accessoryInfo=scratch.alloc<uint8_t>(accessoryInfoLen);
+      memcpy(accessoryInfo,accessoryX,sizeof(accessoryX));
+      memcpy(accessoryInfo+sizeof(accessoryX),accessory.ID,hap_accessory_IDBYTES);
+      memcpy(accessoryInfo+sizeof(accessoryX)+hap_accessory_IDBYTES,accessory.LTPK,crypto_sign_PUBLICKEYBYTES);
+
+      uint8_t *iosSignature=*itSignature;
+      uint8_t *iosID=*itIdentifier;
+      uint8_t *iosLTPK=*itPublicKey;
+      uint8_t *accSignature=scratch.alloc<uint8_t>(crypto_sign_BYTES);
+      int *verified=scratch.alloc<int>(1);
+
+      runCrypto([=](){
+        *verified=(crypto_sign_verify_detached(iosSignature, iosDeviceInfo, iosDeviceInfoLen, iosLTPK)==0);       // verify signature of iosDeviceInfo using iosDeviceLTPK   
+        if(*verified)
+          crypto_sign_detached(accSignature,NULL,accessoryInfo,accessoryInfoLen,accessory.LTSK);                  // produce signature of accessoryInfo using AccessoryLTSK (Ed25519 long-term secret key)
+      },
+      [this,verified,iosID,iosLTPK,accSignature](){
+        HAPTLV responseTLV;
+        HAPTLV subTLV;
+        responseTLV.add(kTLVType_State,pairState_M6);                     // set State=<M6>
+
+        if(!*verified){
+          LOG0("\n*** ERROR: LPTK Signature Verification Failed\n\n");
+          responseTLV.add(kTLVType_Error,tagError_Authentication);        // set Error=Authentication
+          tlvRespond(responseTLV);                                        // send response to client
+          pairStatus=pairState_M1;                                        // reset pairStatus to first step of unpaired
+          return;                
+        }
 
-      subTLV.clear();                                                                            // clear existing SUBTLV records
+        subTLV.add(kTLVType_Signature,crypto_sign_BYTES,accSignature);                             // set Signature TLV record
+        subTLV.add(kTLVType_Identifier,hap_accessory_IDBYTES,accessory.ID);                        // set Identifier TLV record as accessoryPairingID
+        subTLV.add(kTLVType_PublicKey,crypto_sign_PUBLICKEYBYTES,accessory.LTPK);                  // set PublicKey TLV record as accessoryLTPK
 
-      itSignature=subTLV.add(kTLVType_Signature,64,NULL);                                        // create blank Signature TLV with space for 64 bytes
+        LOG2("------- ENCRYPTING SUB-TLVS -------\n");
 
-      crypto_sign_detached(*itSignature,NULL,accessoryInfo,accessoryInfo.len(),accessory.LTSK);  // produce signature of accessoryInfo using AccessoryLTSK (Ed25519 long-term secret key)
+        if(homeSpan.getLogLevel()>1)
+          subTLV.print();
 
-      subTLV.add(kTLVType_Identifier,hap_accessory_IDBYTES,accessory.ID);                        // set Identifier TLV record as accessoryPairingID
-      subTLV.add(kTLVType_PublicKey,crypto_sign_PUBLICKEYBYTES,accessory.LTPK);                  // set PublicKey TLV record as accessoryLTPK
+        TempBuffer<uint8_t> subPack(subTLV.pack_size());                                           // create sub-TLV by packing Identifier, PublicKey and Signature TLV records together
+        subTLV.pack(subPack);      
 
-      LOG2("------- ENCRYPTING SUB-TLVS -------\n");
+        // Encrypt the subTLV data using the same SRP Session Key as above with ChaCha20-Poly1305
 
-      if(homeSpan.getLogLevel()>1)
-        subTLV.print();
+        auto itAccEncryptedData=responseTLV.add(kTLVType_EncryptedData,subPack.len()+AEAD::TAG_BYTES,NULL);     //create blank EncryptedData TLV with space for subTLV + Authentication Tag
 
-      TempBuffer<uint8_t> subPack(subTLV.pack_size());                                           // create sub-TLV by packing Identifier, PublicKey and Signature TLV records together
-      subTLV.pack(subPack);      
+        if(subTLV.failed() || itAccEncryptedData==responseTLV.end()){
+          LOG0("\n*** ERROR: Insufficient memory to create TLV8 response\n\n");
+          internalError();                                                // Controller is not added, so Pair-Setup can be retried
+          pairStatus=pairState_M1;
+          return;
+        }
 
-      // Encrypt the subTLV data using the same SRP Session Key as above with ChaCha20-Poly1305
+        AEAD::encrypt(*itAccEncryptedData,subPack,subPack.len(),NULL,0,(unsigned char *)"\x00\x00\x00\x00PS-Msg06",temp.sessionKey);
+                                                     
+        LOG2("---------- END SUB-TLVS! ----------\n");
 
-      itEncryptedData=responseTLV.add(kTLVType_EncryptedData,subPack.len()+crypto_aead_chacha20poly1305_IETF_ABYTES,NULL);     //create blank EncryptedData TLV with space for subTLV + Authentication Tag
+        addController(iosID,iosLTPK,true);                    // save Pairing ID and LTPK for this Controller with admin privileges
+        
+        tlvRespond(responseTLV);                              // send response to client
 
-      crypto_aead_chacha20poly1305_ietf_encrypt(*itEncryptedData,NULL,subPack,subPack.len(),NULL,0,NULL,(unsigned char *)"\x00\x00\x00\x00PS-Msg06",temp.sessionKey);
-                                                   
-      LOG2("---------- END SUB-TLVS! ----------\n");
-      
-      tlvRespond(responseTLV);                              // send response to client
+        xSemaphoreTake(srpMutex,portMAX_DELAY);
+        delete srp;                                           // delete SRP - no longer needed once pairing is completed
+        srp=NULL;                                             // reset to NULL
+        xSemaphoreGive(srpMutex);
 
-      delete srp;                                           // delete SRP - no longer needed once pairing is completed
-      srp=NULL;                                             // reset to NULL
+        LOG1("Pair-Setup <M6> sent.  Total Pair-Setup time: %.1f ms\n",(micros()-startTime)/1000.0);
 
-      mdns_service_txt_item_set("_hap","_tcp","sf","0");    // broadcast new status
-      
-      LOG1("\n*** ACCESSORY PAIRED! ***\n");
+        mdns_service_txt_item_set("_hap","_tcp","sf","0");    // broadcast new status
+        
+        LOG1("\n*** ACCESSORY PAIRED! ***\n");
 
-      STATUS_UPDATE(on(),HS_PAIRED)      
-            
-      if(homeSpan.pairCallback)                             // if set, invoke user-defined Pairing Callback to indicate device has been paired
-        homeSpan.pairCallback(true);
+        STATUS_UPDATE(on(),HS_PAIRED)      
+              
+        if(homeSpan.pairCallback)                             // if set, invoke user-defined Pairing Callback to indicate device has been paired
+          homeSpan.pairCallback(true);
+      });
       
       return(1);        
     }       
@@ -569,16 +712,21 @@ int HAPClient::postPairSetupURL(uint8_t *content, size_t len){
 
 int HAPClient::postPairVerifyURL(uint8_t *content, size_t len){
 
-  HAPTLV iosTLV;
+  HAPTLVView iosTLV;
   HAPTLV responseTLV;
   HAPTLV subTLV;
+  HAPTLVView iosSubTLV;
 
-  iosTLV.unpack(content,len);
+  if(iosTLV.unpack(content,len)){                               // parse TLV records in place (no copies are made)
+    LOG0("\n*** ERROR: Malformed TLV8 content\n\n");
+    badRequestError();                                          // return with 400 error, which closes connection
+    return(0);
+  }
   if(homeSpan.getLogLevel()>1)
     iosTLV.print();
   LOG2("------------ END TLVS! ------------\n");
 
-  LOG1("In Pair Verify #%d (%s)...",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Pair Verify #%d (%s)...",clientNumber,ipAddress);
   
   auto itState=iosTLV.find(kTLVType_State);
 
@@ -614,45 +762,81 @@ int HAPClient::postPairVerifyURL(uint8_t *content, size_t len){
         return(0);        
       }
 
-      TempBuffer<uint8_t> secretCurveKey(crypto_box_SECRETKEYBYTES);                // temporary space - used only in this block     
-      crypto_box_keypair(temp.publicCurveKey,secretCurveKey);                       // generate Accessory's random Curve25519 Public/Secret Key Pair
+      uint32_t startTime=micros();
+      auto itMethod=iosTLV.find(kTLVType_Method);
+      auto itSessionID=iosTLV.find(kTLVType_SessionID);
+      auto itAuthTag=iosTLV.find(kTLVType_EncryptedData);
+
+      if(iosTLV.len(itMethod)==1 && itMethod->getVal()==pairMethod_Resume){     // Controller is requesting Pair-Resume of a previous session
+        if(iosTLV.len(itSessionID)==ResumeCache::ID_BYTES && iosTLV.len(itAuthTag)==AEAD::TAG_BYTES && pairResume(*itPublicKey,*itSessionID,*itAuthTag)){
+          uint32_t t=micros()-startTime;
+          resumeCache.nResumed++;
+          resumeCache.resumeTime+=t;
+          LOG1("Session resumed with Pair-Resume (%lu us)\n",t);
+          return(1);
+        }
+        LOG1("Session cannot be resumed - performing full Pair-Verify\n");     // as required by HAP, fall back to a full Pair-Verify using Controller's new Public Key
+      }
 
       memcpy(temp.iosCurveKey,*itPublicKey,crypto_box_PUBLICKEYBYTES);              // save Controller's Curve25519 Public Key
-            
-      // concatenate Accessory's Curve25519 Public Key, Accessory's Pairing ID, and Controller's Curve25519 Public Key into accessoryInfo
+
+      uint8_t *signature=scratch.alloc<uint8_t>(crypto_sign_BYTES);
+
+      runCrypto([this,signature](){
+        uint8_t secretCurveKey[crypto_box_SECRETKEYBYTES];                          // temporary space - used only in this block     
+        crypto_box_keypair(temp.publicCurveKey,secretCurveKey);                     // generate Accessory's random Curve25519 Public/Secret Key Pair
+
+        // concatenate Accessory's Curve25519 Public Key, Accessory's Pairing ID, and Controller's Curve25519 Public Key into accessoryInfo
       
-      TempBuffer<uint8_t> accessoryInfo(temp.publicCurveKey,crypto_box_PUBLICKEYBYTES,accessory.ID,hap_accessory_IDBYTES,temp.iosCurveKey,crypto_box_PUBLICKEYBYTES,NULL);
+        TempBuffer<uint8_t> accessoryInfo(temp.publicCurveKey,crypto_box_PUBLICKEYBYTES,accessory.ID,hap_accessory_IDBYTES,temp.iosCurveKey,crypto_box_PUBLICKEYBYTES,NULL);
+        crypto_sign_detached(signature,NULL,accessoryInfo,accessoryInfo.len(),accessory.LTSK);            // produce Signature of accessoryInfo using Accessory's LTSK
 
-      subTLV.add(kTLVType_Identifier,hap_accessory_IDBYTES,accessory.ID);                         // set Identifier subTLV record as Accessory's Pairing ID
-      auto itSignature=subTLV.add(kTLVType_Signature,crypto_sign_BYTES,NULL);                     // create blank Signature subTLV
-      crypto_sign_detached(*itSignature,NULL,accessoryInfo,accessoryInfo.len(),accessory.LTSK);   // produce Signature of accessoryInfo using Accessory's LTSK
+        crypto_scalarmult_curve25519(temp.sharedCurveKey,secretCurveKey,temp.iosCurveKey);                // generate Shared-Secret Curve25519 Key from Accessory's Curve25519 Secret Key and Controller's Curve25519 Public Key
+        sodium_memzero(secretCurveKey,sizeof(secretCurveKey));
+      },
+      [this,signature,startTime](){
+        HAPTLV responseTLV;
+        HAPTLV subTLV;
 
-      LOG2("------- ENCRYPTING SUB-TLVS -------\n");
+        subTLV.add(kTLVType_Identifier,hap_accessory_IDBYTES,accessory.ID);                         // set Identifier subTLV record as Accessory's Pairing ID
+        subTLV.add(kTLVType_Signature,crypto_sign_BYTES,signature);                                 // set Signature subTLV record
 
-      if(homeSpan.getLogLevel()>1)
-        subTLV.print();
+        LOG2("------- ENCRYPTING SUB-TLVS -------\n");
 
-      TempBuffer<uint8_t> subPack(subTLV.pack_size());                                                    // create sub-TLV by packing Identifier and Signature TLV records together
-      subTLV.pack(subPack);                                
+        if(homeSpan.getLogLevel()>1)
+          subTLV.print();
 
-      crypto_scalarmult_curve25519(temp.sharedCurveKey,secretCurveKey,temp.iosCurveKey);                  // generate Shared-Secret Curve25519 Key from Accessory's Curve25519 Secret Key and Controller's Curve25519 Public Key
+        TempBuffer<uint8_t> subPack(subTLV.pack_size());                                                    // create sub-TLV by packing Identifier and Signature TLV records together
+        subTLV.pack(subPack);                                
 
-      HKDF::create(temp.sessionKey,temp.sharedCurveKey,crypto_box_PUBLICKEYBYTES,"Pair-Verify-Encrypt-Salt","Pair-Verify-Encrypt-Info");   // create Session Curve25519 Key from Shared-Secret Curve25519 Key using HKDF-SHA-512  
+        static HKDF::Salt encryptSalt("Pair-Verify-Encrypt-Salt");
+        encryptSalt.create(temp.sessionKey,temp.sharedCurveKey,crypto_box_PUBLICKEYBYTES,"Pair-Verify-Encrypt-Info");   // create Session Curve25519 Key from Shared-Secret Curve25519 Key using HKDF-SHA-512  
 
-      auto itEncryptedData=responseTLV.add(kTLVType_EncryptedData,subPack.len()+crypto_aead_chacha20poly1305_IETF_ABYTES,NULL);                                         // create blank EncryptedData subTLV
-      crypto_aead_chacha20poly1305_ietf_encrypt(*itEncryptedData,NULL,subPack,subPack.len(),NULL,0,NULL,(unsigned char *)"\x00\x00\x00\x00PV-Msg02",temp.sessionKey);   // encrypt data with Session Curve25519 Key and padded nonce="PV-Msg02"
-                                            
-      LOG2("---------- END SUB-TLVS! ----------\n");
+        auto itEncryptedData=responseTLV.add(kTLVType_EncryptedData,subPack.len()+AEAD::TAG_BYTES,NULL);                                         // create blank EncryptedData subTLV
+
+        if(subTLV.failed() || itEncryptedData==responseTLV.end()){
+          LOG0("\n*** ERROR: Insufficient memory to create TLV8 response\n\n");
+          internalError();
+          return;
+        }
+
+        AEAD::encrypt(*itEncryptedData,subPack,subPack.len(),NULL,0,(unsigned char *)"\x00\x00\x00\x00PV-Msg02",temp.sessionKey);   // encrypt data with Session Curve25519 Key and padded nonce="PV-Msg02"
+                                              
+        LOG2("---------- END SUB-TLVS! ----------\n");
+        
+        responseTLV.add(kTLVType_State,pairState_M2);                                        // set State=<M2>
+        responseTLV.add(kTLVType_PublicKey,crypto_box_PUBLICKEYBYTES,temp.publicCurveKey);        // set PublicKey to Accessory's Curve25519 Public Key
+
+        verifyTime=micros()-startTime;
       
-      responseTLV.add(kTLVType_State,pairState_M2);                                        // set State=<M2>
-      responseTLV.add(kTLVType_PublicKey,crypto_box_PUBLICKEYBYTES,temp.publicCurveKey);        // set PublicKey to Accessory's Curve25519 Public Key
-    
-      tlvRespond(responseTLV);                                      // send response to client  
+        tlvRespond(responseTLV);                                      // send response to client  
+      });
     }
     break;  
    
     case pairState_M3:{                     // 'Verify Finish Request'
 
+      uint32_t startTime=micros();
       auto itEncryptedData=iosTLV.find(kTLVType_EncryptedData);
 
       if(iosTLV.len(itEncryptedData)<=0){            
@@ -667,9 +851,10 @@ int HAPClient::postPairVerifyURL(uint8_t *content, size_t len){
 
       // use Session Curve25519 Key (from previous step) to decrypt encrypytedData TLV with padded nonce="PV-Msg03"
 
-      TempBuffer<uint8_t> decrypted((*itEncryptedData).getLen()-crypto_aead_chacha20poly1305_IETF_ABYTES);        // temporary storage for decrypted data
+      size_t decryptedLen=itEncryptedData->getLen()-AEAD::TAG_BYTES;
+      uint8_t *decrypted=scratch.alloc<uint8_t>(decryptedLen);      // storage for decrypted data (in scratch memory so it persists until crypto job is done)
       
-      if(crypto_aead_chacha20poly1305_ietf_decrypt(decrypted, NULL, NULL, *itEncryptedData, itEncryptedData->getLen(), NULL, 0, (unsigned char *)"\x00\x00\x00\x00PV-Msg03", temp.sessionKey)==-1){          
+      if(AEAD::decrypt(decrypted,*itEncryptedData,itEncryptedData->getLen(),NULL,0,(unsigned char *)"\x00\x00\x00\x00PV-Msg03",temp.sessionKey)==-1){          
         LOG0("\n*** ERROR: Verify Authentication Failed\n\n");
         responseTLV.add(kTLVType_State,pairState_M4);               // set State=<M4>
         responseTLV.add(kTLVType_Error,tagError_Authentication);    // set Error=Authentication
@@ -677,16 +862,23 @@ int HAPClient::postPairVerifyURL(uint8_t *content, size_t len){
         return(0);        
       }
 
-      subTLV.unpack(decrypted,decrypted.len());                     // unpack TLV     
+      if(iosSubTLV.unpack(decrypted,decryptedLen)){                 // unpack TLV (records point directly into decrypted buffer)
+        LOG0("\n*** ERROR: Malformed encrypted TLV8 content\n\n");
+        responseTLV.add(kTLVType_State,pairState_M4);               // set State=<M4>
+        responseTLV.add(kTLVType_Error,tagError_Authentication);    // set Error=Authentication
+        tlvRespond(responseTLV);                                    // send response to client
+        return(0);
+      }
+
       if(homeSpan.getLogLevel()>1)
-        subTLV.print();                                             // print decrypted TLV data
+        iosSubTLV.print();                                          // print decrypted TLV data
       
       LOG2("---------- END SUB-TLVS! ----------\n");
 
-      auto itIdentifier=subTLV.find(kTLVType_Identifier);
-      auto itSignature=subTLV.find(kTLVType_Signature);
+      auto itIdentifier=iosSubTLV.find(kTLVType_Identifier);
+      auto itSignature=iosSubTLV.find(kTLVType_Signature);
 
-      if(subTLV.len(itIdentifier)!=hap_controller_IDBYTES || subTLV.len(itSignature)!=crypto_sign_BYTES){ 
+      if(iosSubTLV.len(itIdentifier)!=hap_controller_IDBYTES || iosSubTLV.len(itSignature)!=crypto_sign_BYTES){ 
         LOG0("\n*** ERROR: One or more of required 'Identifier,' and 'Signature' TLV records for this step is bad or missing\n\n");
         responseTLV.add(kTLVType_State,pairState_M4);               // set State=<M4>
         responseTLV.add(kTLVType_Error,tagError_Unknown);           // set Error=Unknown (there is no specific error type for missing/bad TLV data)
@@ -712,28 +904,50 @@ int HAPClient::postPairVerifyURL(uint8_t *content, size_t len){
 
       // concatenate Controller's Curve25519 Public Key (from previous step), Controller's Pairing ID, and Accessory's Curve25519 Public Key (from previous step) into iosDeviceInfo     
 
-      TempBuffer<uint8_t> iosDeviceInfo(temp.iosCurveKey,crypto_box_PUBLICKEYBYTES,tPair->ID,hap_controller_IDBYTES,temp.publicCurveKey,crypto_box_PUBLICKEYBYTES,NULL);
-      
-      if(crypto_sign_verify_detached(*itSignature, iosDeviceInfo, iosDeviceInfo.len(), tPair->LTPK) != 0){         // verify signature of iosDeviceInfo using Controller's LTPK   
-        LOG0("\n*** ERROR: LPTK Signature Verification Failed\n\n");
-        responseTLV.add(kTLVType_State,pairState_M4);               // set State=<M4>
-        responseTLV.add(kTLVType_Error,tagError_Authentication);    // set Error=Authentication
-        tlvRespond(responseTLV);                                    // send response to client
-        return(0);                
-      }
+      size_t iosDeviceInfoLen=crypto_box_PUBLICKEYBYTES+hap_controller_IDBYTES+crypto_box_PUBLICKEYBYTES;
+      uint8_t *iosDeviceInfo=scratch.alloc<uint8_t>(iosDeviceInfoLen);
+      memcpy(iosDeviceInfo,temp.iosCurveKey,crypto_box_PUBLICKEYBYTES);
+      memcpy(iosDeviceInfo+crypto_box_PUBLICKEYBYTES,tPair->ID,hap_controller_IDBYTES);
+      memcpy(iosDeviceInfo+crypto_box_PUBLICKEYBYTES+hap_controller_IDBYTES,temp.publicCurveKey,crypto_box_PUBLICKEYBYTES);
+
+      uint8_t *iosSignature=*itSignature;
+      uint8_t *iosLTPK=scratch.alloc<uint8_t>(crypto_sign_PUBLICKEYBYTES);     // copy of Controller's LTPK, since Controller may be removed by another client while crypto job is running
+      memcpy(iosLTPK,tPair->LTPK,crypto_sign_PUBLICKEYBYTES);
+      int *verified=scratch.alloc<int>(1);
+
+      runCrypto([iosSignature,iosDeviceInfo,iosDeviceInfoLen,iosLTPK,verified](){
+        *verified=(crypto_sign_verify_detached(iosSignature, iosDeviceInfo, iosDeviceInfoLen, iosLTPK)==0);     // verify signature of iosDeviceInfo using Controller's LTPK   
+      },
+      [this,iosDeviceInfo,verified,startTime](){
+        HAPTLV responseTLV;
+        responseTLV.add(kTLVType_State,pairState_M4);                 // set State=<M4>
+
+        Controller *tPair=findController(iosDeviceInfo+crypto_box_PUBLICKEYBYTES);     // look up Controller again in case it was removed while crypto job was running
+
+        if(!*verified || !tPair){
+          LOG0("\n*** ERROR: LPTK Signature Verification Failed\n\n");
+          responseTLV.add(kTLVType_Error,tagError_Authentication);    // set Error=Authentication
+          tlvRespond(responseTLV);                                    // send response to client
+          return;                
+        }
 
-      responseTLV.add(kTLVType_State,pairState_M4);                 // set State=<M4>
-      tlvRespond(responseTLV);                                      // send response to client (unencrypted since cPair=NULL)
+        tlvRespond(responseTLV);                                      // send response to client (unencrypted since cPair=NULL)
 
-      cPair=tPair;        // save Controller for this connection slot - connection is now verified and should be encrypted going forward
+        controllerTable.attach(tPair,this);       // save Controller for this connection slot - connection is now verified and should be encrypted going forward
 
-      HKDF::create(a2cKey,temp.sharedCurveKey,32,"Control-Salt","Control-Read-Encryption-Key");        // create AccessoryToControllerKey from (previously-saved) Shared-Secret Curve25519 Key (HAP Section 6.5.2)
-      HKDF::create(c2aKey,temp.sharedCurveKey,32,"Control-Salt","Control-Write-Encryption-Key");       // create ControllerToAccessoryKey from (previously-saved) Shared-Secret Curve25519 Key (HAP Section 6.5.2)
-      
-      a2cNonce.zero();         // reset Nonces for this session to zero
-      c2aNonce.zero();
+        setSessionKeys(temp.sharedCurveKey);
+
+        static HKDF::Salt sessionSalt("Pair-Verify-ResumeSessionID-Salt");
+        uint8_t sessionID[ResumeCache::ID_BYTES];             // derive Session ID so that Controller can later resume this session with Pair-Resume
+        sessionSalt.create(sessionID,temp.sharedCurveKey,32,"Pair-Verify-ResumeSessionID-Info",sizeof(sessionID));
+        resumeCache.add(sessionID,temp.sharedCurveKey,tPair->ID);
+
+        verifyTime+=micros()-startTime;
+        resumeCache.nFull++;
+        resumeCache.fullTime+=verifyTime;
 
-      LOG2("\n*** SESSION VERIFICATION COMPLETE *** \n");
+        LOG2("\n*** SESSION VERIFICATION COMPLETE (%lu us) *** \n",verifyTime);
+      });
     }
     break;
   
@@ -745,6 +959,98 @@ int HAPClient::postPairVerifyURL(uint8_t *content, size_t len){
 
 //////////////////////////////////////
 
+boolean HAPClient::pairResume(uint8_t *publicKey, uint8_t *sessionID, uint8_t *authTag){
+
+  ResumeCache::session_t *session=resumeCache.find(sessionID);
+
+  if(!session){
+    LOG2("\n*** Session ID for Pair-Resume not found or expired\n");
+    return(false);
+  }
+
+  Controller *tPair=findController(session->controllerID);
+
+  if(!tPair){
+    LOG2("\n*** Controller for Pair-Resume is no longer paired\n");
+    session->valid=false;
+    return(false);
+  }
+
+  uint8_t salt[crypto_box_PUBLICKEYBYTES+ResumeCache::ID_BYTES];     // salt is Controller's new Curve25519 Public Key followed by a Session ID
+  uint8_t key[32];
+  uint8_t empty[1];
+
+  memcpy(salt,publicKey,crypto_box_PUBLICKEYBYTES);
+  memcpy(salt+crypto_box_PUBLICKEYBYTES,sessionID,ResumeCache::ID_BYTES);
+
+  uint8_t prk[HKDF::PRK_BYTES];
+  HKDF::extract(prk,session->sharedKey,32,salt,sizeof(salt));
+  HKDF::expand(key,32,prk,"Pair-Resume-Request-Info");          // derive Request Key from Shared-Secret of cached session
+  sodium_memzero(prk,sizeof(prk));
+
+  if(AEAD::decrypt(empty,authTag,AEAD::TAG_BYTES,NULL,0,(unsigned char *)"\x00\x00\x00\x00PR-Msg01",key)==-1){    // EncryptedData is authentication tag of empty message
+    LOG0("\n*** WARNING: Pair-Resume Authentication Failed\n\n");
+    sodium_memzero(key,sizeof(key));
+    session->valid=false;
+    return(false);
+  }
+
+  uint8_t newSessionID[ResumeCache::ID_BYTES];
+  uint8_t sharedKey[32];
+
+  randombytes_buf(newSessionID,ResumeCache::ID_BYTES);
+  memcpy(salt+crypto_box_PUBLICKEYBYTES,newSessionID,ResumeCache::ID_BYTES);
+
+  HKDF::extract(prk,session->sharedKey,32,salt,sizeof(salt));                // both keys below use the same salt and input key, so Extract step is only needed once
+  HKDF::expand(key,32,prk,"Pair-Resume-Response-Info");                       // derive Response Key
+  HKDF::expand(sharedKey,32,prk,"Pair-Resume-Shared-Secret-Info");            // derive Shared-Secret of new session
+  sodium_memzero(prk,sizeof(prk));
+
+  session->valid=false;                                   // a Session ID can only be resumed once - it is replaced by the new Session ID
+  resumeCache.add(newSessionID,sharedKey,tPair->ID);
+
+  HAPTLV responseTLV;
+
+  responseTLV.add(kTLVType_State,pairState_M2);                                     // set State=<M2>
+  responseTLV.add(kTLVType_SessionID,ResumeCache::ID_BYTES,newSessionID);           // set SessionID to new Session ID
+  auto itAuthTag=responseTLV.add(kTLVType_EncryptedData,AEAD::TAG_BYTES,NULL);
+  if(itAuthTag==responseTLV.end()){
+    sodium_memzero(key,sizeof(key));
+    sodium_memzero(sharedKey,sizeof(sharedKey));
+    tlvRespond(responseTLV);                              // reports error instead, since response is incomplete
+    return(true);
+  }
+  AEAD::encrypt(*itAuthTag,empty,0,NULL,0,(unsigned char *)"\x00\x00\x00\x00PR-Msg02",key);     // EncryptedData is authentication tag of empty message
+  sodium_memzero(key,sizeof(key));
+
+  tlvRespond(responseTLV);                                // send response to client (unencrypted since cPair=NULL)
+
+  controllerTable.attach(tPair,this);                     // connection is now verified and should be encrypted going forward
+  setSessionKeys(sharedKey);
+  sodium_memzero(sharedKey,sizeof(sharedKey));
+
+  LOG2("\n*** SESSION RESUMED *** \n");
+  return(true);
+}
+
+//////////////////////////////////////
+
+void HAPClient::setSessionKeys(uint8_t *sharedKey){
+
+  static HKDF::Salt controlSalt("Control-Salt");
+  uint8_t prk[HKDF::PRK_BYTES];
+
+  controlSalt.extract(prk,sharedKey,32);                            // both keys use the same salt and Shared-Secret, so Extract step is only needed once
+  HKDF::expand(a2cKey,32,prk,"Control-Read-Encryption-Key");        // create AccessoryToControllerKey from Shared-Secret Curve25519 Key (HAP Section 6.5.2)
+  HKDF::expand(c2aKey,32,prk,"Control-Write-Encryption-Key");       // create ControllerToAccessoryKey from Shared-Secret Curve25519 Key (HAP Section 6.5.2)
+  sodium_memzero(prk,sizeof(prk));                                  // intermediate key is no longer needed
+      
+  a2cNonce.zero();         // reset Nonces for this session to zero
+  c2aNonce.zero();
+}
+
+//////////////////////////////////////
+
 int HAPClient::postPairingsURL(uint8_t *content, size_t len){
 
   if(!cPair){                       // unverified, unencrypted session
@@ -752,15 +1058,19 @@ int HAPClient::postPairingsURL(uint8_t *content, size_t len){
     return(0);
   }
 
-  HAPTLV iosTLV;
+  HAPTLVView iosTLV;
   HAPTLV responseTLV;
 
-  iosTLV.unpack(content,len);
+  if(iosTLV.unpack(content,len)){                               // parse TLV records in place (no copies are made)
+    LOG0("\n*** ERROR: Malformed TLV8 content\n\n");
+    badRequestError();                                          // return with 400 error, which closes connection
+    return(0);
+  }
   if(homeSpan.getLogLevel()>1)
     iosTLV.print();
   LOG2("------------ END TLVS! ------------\n");
 
-  LOG1("In Post Pairings #%d (%s)...",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Post Pairings #%d (%s)...",clientNumber,ipAddress);
   
   auto itState=iosTLV.find(kTLVType_State);
   auto itMethod=iosTLV.find(kTLVType_Method);
@@ -851,15 +1161,13 @@ int HAPClient::postPairingsURL(uint8_t *content, size_t len){
 
       boolean addSeparator=false;
       
-      for(auto it=controllerList.begin();it!=controllerList.end();it++){
-        if((*it).allocated){
-          if(addSeparator)         
-            responseTLV.add(kTLVType_Separator);                                        
-          responseTLV.add(kTLVType_Permissions,(*it).admin);      
-          responseTLV.add(kTLVType_Identifier,hap_controller_IDBYTES,(*it).ID);
-          responseTLV.add(kTLVType_PublicKey,crypto_sign_PUBLICKEYBYTES,(*it).LTPK);
-          addSeparator=true;
-        }
+      for(auto it=controllerTable.begin();it!=controllerTable.end();it++){
+        if(addSeparator)         
+          responseTLV.add(kTLVType_Separator);                                        
+        responseTLV.add(kTLVType_Permissions,(*it).admin);      
+        responseTLV.add(kTLVType_Identifier,hap_controller_IDBYTES,(*it).ID);
+        responseTLV.add(kTLVType_PublicKey,crypto_sign_PUBLICKEYBYTES,(*it).LTPK);
+        addSeparator=true;
       }
 
       tlvRespond(responseTLV);
@@ -886,13 +1194,13 @@ int HAPClient::getAccessoriesURL(){
     return(0);
   }
 
-  LOG1("In Get Accessories #%d (%s)...\n",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Get Accessories #%d (%s)...\n",clientNumber,ipAddress);
 
   homeSpan.printfAttributes();
   size_t nBytes=hapOut.getSize();
   hapOut.flush();
 
-  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
+  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",ipAddress);
 
   hapOut.setLogLevel(2).setHapClient(this);    
   hapOut << "HTTP/1.1 200 OK\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
@@ -914,7 +1222,7 @@ int HAPClient::getCharacteristicsURL(char *urlBuf){
     return(0);
   }
 
-  LOG1("In Get Characteristics #%d (%s)...\n",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Get Characteristics #%d (%s)...\n",clientNumber,ipAddress);
 
   int len=strlen(urlBuf);           // determine number of IDs specified by counting commas in URL
   int numIDs=1;
@@ -922,7 +1230,7 @@ int HAPClient::getCharacteristicsURL(char *urlBuf){
     if(urlBuf[i]==',')
       numIDs++;
   
-  TempBuffer<char *> ids(numIDs);   // reserve space for number of IDs found
+  char **ids=scratch.alloc<char *>(numIDs);   // reserve space for number of IDs found
   int flags=GET_VALUE|GET_AID;      // flags indicating which characteristic fields to include in response (HAP Table 6-13)
   numIDs=0;                         // reset number of IDs found
 
@@ -982,13 +1290,15 @@ int HAPClient::putCharacteristicsURL(char *json){
     return(0);
   }
 
-  LOG1("In Put Characteristics #%d (%s)...\n",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Put Characteristics #%d (%s)...\n",clientNumber,ipAddress);
 
   int n=homeSpan.countCharacteristics(json);    // count number of objects in JSON request
   if(n==0)                                      // if no objects found, return
     return(0);
  
-  SpanBuf pObj[n];                                        // reserve space for objects
+  SpanBuf *pObj=scratch.alloc<SpanBuf>(n);               // reserve space for objects
+  for(int i=0;i<n;i++)
+    new(pObj+i) SpanBuf;                                  // initialize each object
   if(!homeSpan.updateCharacteristics(json, pObj))         // perform update
     return(0);                                            // return if failed to update (error message will have been printed in update)
 
@@ -997,7 +1307,7 @@ int HAPClient::putCharacteristicsURL(char *json){
     if(pObj[i].status!=StatusCode::OK || pObj[i].wr)      // if so, to use multicast response
       multiCast=true;    
 
-  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
+  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",ipAddress);
 
   if(!multiCast){                                         // JSON object has no content
 
@@ -1035,7 +1345,7 @@ int HAPClient::putPrepareURL(char *json){
     return(0);
   }
 
-  LOG1("In Put Prepare #%d (%s)...\n",clientNumber,client.remoteIP().toString().c_str());
+  LOG1("In Put Prepare #%d (%s)...\n",clientNumber,ipAddress);
 
   char ttlToken[]="\"ttl\":";
   char pidToken[]="\"pid\":";
@@ -1058,7 +1368,7 @@ int HAPClient::putPrepareURL(char *json){
     status=StatusCode::InvalidValue;
   }
 
-  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
+  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",ipAddress);
 
   hapOut << "{\"status\":" << (int)status << "}";
   size_t nBytes=hapOut.getSize();
@@ -1100,7 +1410,7 @@ void HAPClient::getStatusURL(HAPClient *hapClient, void (*callBack)(const char *
   sprintf(uptime,"%d:%02d:%02d:%02d",days,hours,mins,secs);
 
   if(hapClient)
-    LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",hapClient->client.remoteIP().toString().c_str());
+    LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",hapClient->ipAddress);
     
   hapOut.setHapClient(hapClient).setLogLevel(2).setCallback(callBack).setCallbackUserData(user_data);
 
@@ -1274,7 +1584,7 @@ void HAPClient::eventNotify(SpanBuf *pObj, int nObj, HAPClient *ignore){
 
       if(nBytes>0){                                         // if there ARE notifications to send to client cNum
         
-        LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",it->client.remoteIP().toString().c_str());
+        LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",it->ipAddress);
 
         hapOut.setLogLevel(2).setHapClient(&(*it));    
         hapOut << "EVENT/1.0 200 OK\r\nContent-Type: application/hap+json\r\nContent-Length: " << nBytes << "\r\n\r\n";
@@ -1290,16 +1600,22 @@ void HAPClient::eventNotify(SpanBuf *pObj, int nObj, HAPClient *ignore){
 /////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////
 
-void HAPClient::tlvRespond(TLV8 &tlv8){
+void HAPClient::tlvRespond(TLV8Flat &tlv8){
+
+  if(tlv8.failed()){                        // one or more records could not be added for lack of memory - do not send an incomplete response
+    LOG0("\n*** ERROR: Insufficient memory to create TLV8 response\n\n");
+    internalError();
+    return;
+  }
 
   tlv8.osprint(hapOut);
   size_t nBytes=hapOut.getSize();
   hapOut.flush();
   
-  char *body;
-  asprintf(&body,"HTTP/1.1 200 OK\r\nContent-Type: application/pairing+tlv8\r\nContent-Length: %d\r\n\r\n",nBytes);      // create Body with Content Length = size of TLV data
+  char body[96];
+  snprintf(body,sizeof(body),"HTTP/1.1 200 OK\r\nContent-Type: application/pairing+tlv8\r\nContent-Length: %d\r\n\r\n",nBytes);      // create Body with Content Length = size of TLV data
 
-  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",client.remoteIP().toString().c_str());
+  LOG2("\n>>>>>>>>>> %s >>>>>>>>>>\n",ipAddress);
   LOG2(body);
   if(homeSpan.getLogLevel()>1)
     tlv8.print();
@@ -1313,8 +1629,6 @@ void HAPClient::tlvRespond(TLV8 &tlv8){
     LOG2("------------ SENT! --------------\n");
   else
     LOG2("-------- SENT ENCRYPTED! --------\n");
-
-  free(body);
   
 } // tlvRespond
 
@@ -1324,6 +1638,8 @@ int HAPClient::receiveEncrypted(uint8_t *httpBuf, int messageSize){
 
   uint8_t aad[2];
   int nBytes=0;
+  uint8_t *tBuf=NULL;                       // storage for each encrypted frame (taken from scratch arena and reused for all frames)
+  int tBufSize=0;
 
   while(client.read(aad,2)==2){    // read initial 2-byte AAD record
 
@@ -1334,14 +1650,17 @@ int HAPClient::receiveEncrypted(uint8_t *httpBuf, int messageSize){
       return(0);
       }
 
-    TempBuffer<uint8_t> tBuf(n+16);      // expected number of total bytes = n bytes in encoded message + 16 bytes for appended authentication tag      
+    if(n+16>tBufSize){                      // expected number of total bytes = n bytes in encoded message + 16 bytes for appended authentication tag
+      tBufSize=n+16;
+      tBuf=scratch.alloc<uint8_t>(tBufSize);
+    }
 
-    if(client.read(tBuf,tBuf.len())!=tBuf.len()){      
+    if(client.read(tBuf,n+16)!=n+16){      
       LOG0("\n\n*** ERROR: Malformed encrypted message frame\n\n");
       return(0);      
     }                
 
-    if(crypto_aead_chacha20poly1305_ietf_decrypt(httpBuf+nBytes, NULL, NULL, tBuf, tBuf.len(), aad, 2, c2aNonce.get(), c2aKey)==-1){
+    if(AEAD::decrypt(httpBuf+nBytes,tBuf,n+16,aad,2,c2aNonce.get(),c2aKey)==-1){
       LOG0("\n\n*** ERROR: Can't Decrypt Message\n\n");
       return(0);        
     }
@@ -1394,22 +1713,14 @@ void HAPClient::charPrintRow(const uint8_t *buf, int n, int minLogLevel){
 
 Controller *HAPClient::findController(uint8_t *id){
 
-  for(auto it=controllerList.begin();it!=controllerList.end();it++){
-    if(!memcmp((*it).ID,id,hap_controller_IDBYTES))
-      return(&*it);
-  }
-
-  return(NULL);       // no match
+  return(controllerTable.find(id));
 }
 
 //////////////////////////////////////
 
 int HAPClient::nAdminControllers(){
 
-  int n=0;
-  for(auto it=controllerList.begin();it!=controllerList.end();it++)
-    n+=((*it).admin);
-  return(n);
+  return(controllerTable.nAdmins());
 }
 
 //////////////////////////////////////
@@ -1421,8 +1732,7 @@ tagError HAPClient::addController(uint8_t *id, uint8_t *ltpk, boolean admin){
   tagError err=tagError_None;
   
   if(!cTemp){                                            // new controller    
-    if(controllerList.size()<MAX_CONTROLLERS){
-      controllerList.emplace_back(id,ltpk,admin);        // create and store data
+    if(controllerTable.insert(Controller(id,ltpk,admin))){       // create and store data
       LOG2("\n*** Added Controller: ");
       charPrintRow(id,hap_controller_IDBYTES,2);
       LOG2(admin?" (admin)\n\n":" (regular)\n\n");
@@ -1435,7 +1745,7 @@ tagError HAPClient::addController(uint8_t *id, uint8_t *ltpk, boolean admin){
     LOG2("\n*** Updated Controller: ");
     charPrintRow(id,hap_controller_IDBYTES,2);
     LOG2(" from %s to %s\n\n",cTemp->admin?"(admin)":"(regular)",admin?"(admin)":"(regular)");
-    cTemp->admin=admin;
+    controllerTable.setAdmin(cTemp,admin);
     saveControllers();    
   } else {
     LOG0("\n*** ERROR: Invalid request to update the LTPK of an existing Controller\n\n");
@@ -1449,9 +1759,9 @@ tagError HAPClient::addController(uint8_t *id, uint8_t *ltpk, boolean admin){
 
 void HAPClient::removeController(uint8_t *id){
 
-  auto it=std::find_if(controllerList.begin(), controllerList.end(), [id](const Controller& cTemp){return(!memcmp(cTemp.ID,id,hap_controller_IDBYTES));});
+  Controller *cTemp=findController(id);
 
-  if(it==controllerList.end()){
+  if(!cTemp){
     LOG2("\n*** Request to Remove Controller Ignored - Controller Not Found: ");
     charPrintRow(id,hap_controller_IDBYTES,2);
     LOG2("\n");
@@ -1459,22 +1769,23 @@ void HAPClient::removeController(uint8_t *id){
   }
 
   LOG1("\n*** Removing Controller: ");
-  charPrintRow((*it).ID,hap_controller_IDBYTES,2);
-  LOG1((*it).admin?" (admin)\n":" (regular)\n");
+  charPrintRow(cTemp->ID,hap_controller_IDBYTES,2);
+  LOG1(cTemp->admin?" (admin)\n":" (regular)\n");
   
-  tearDown((*it).ID);         // teardown any connections using this Controller
-  controllerList.erase(it);   // remove Controller
+  tearDown(cTemp->ID);                  // teardown any connections using this Controller
+  controllerTable.remove(cTemp);        // remove Controller
 
   if(!nAdminControllers()){   // no more admin Controllers
     
     LOG1("That was last Admin Controller!  Removing any remaining Regular Controllers and unpairing Accessory\n");    
     
     tearDown(NULL);                                              // teardown all remaining connections
-    controllerList.clear();                                      // remove all remaining Controllers
+    controllerTable.clear();                                     // remove all remaining Controllers
     mdns_service_txt_item_set("_hap","_tcp","sf","1");           // set Status Flag = 1 (Table 6-8)
     STATUS_UPDATE(start(LED_PAIRING_NEEDED),HS_PAIRING_NEEDED)   // set optional Status LED
     if(homeSpan.pairCallback)                                    // if set, invoke user-defined Pairing Callback to indicate device has been un-paired
       homeSpan.pairCallback(false);    
+    precomputeSRP();                                             // get SRP state ready for next Pair-Setup
   }
 
   saveControllers();
@@ -1482,13 +1793,102 @@ void HAPClient::removeController(uint8_t *id){
 
 //////////////////////////////////////
 
+void HAPClient::runCrypto(std::function<void()> work, std::function<void()> done){
+
+  cryptoWork=work;
+  cryptoDone=done;
+
+  if(!cryptoQueue){                   // no crypto worker task - perform everything inline
+    cryptoWork();
+    finishCrypto();
+    return;
+  }
+
+  HAPClient *hc=this;
+  cryptoState=CRYPTO_BUSY;                          // park client until crypto worker task is done
+  xQueueSend(cryptoQueue,&hc,portMAX_DELAY);        // queue has room for every client, and each client has at most one job pending, so this never blocks
+}
+
+//////////////////////////////////////
+
+void HAPClient::finishCrypto(){
+
+  cryptoDone();
+  cryptoWork=nullptr;
+  cryptoDone=nullptr;
+  cryptoState=CRYPTO_IDLE;
+}
+
+//////////////////////////////////////
+
+void HAPClient::cryptoTask(void *arg){
+
+  HAPClient *hc;
+
+  while(1){
+    xQueueReceive(cryptoQueue,&hc,portMAX_DELAY);
+    uint32_t startTime=micros();
+    hc->cryptoWork();
+    cryptoTime+=micros()-startTime;
+    nCryptoJobs++;
+    hc->cryptoState=CRYPTO_DONE;                    // pollTask() will finish the request the next time it checks this client
+  }
+}
+
+//////////////////////////////////////
+
+void HAPClient::precomputeSRP(){
+
+  if(nAdminControllers())         // already paired - no need for SRP
+    return;
+
+  xTaskCreateUniversal(srpTask,"srpTask",8192,NULL,1,NULL,tskNO_AFFINITY);      // run at low priority so the expensive g^b calculation does not delay anything else
+}
+
+//////////////////////////////////////
+
+void HAPClient::srpTask(void *arg){
+
+  xSemaphoreTake(srpMutex,portMAX_DELAY);
+
+  if(pairStatus==pairState_M1){                   // do not touch SRP state if a Pair-Setup is already in progress
+    if(srp==NULL)
+      srp=new SRP6A;
+
+    if(!srp->precomputed){
+      TempBuffer<Verification> verifyData;
+      size_t len=verifyData.len();
+      nvs_get_blob(homeSpan.srpNVS,"VERIFYDATA",verifyData,&len);
+      srp->precompute(verifyData);
+      LOG1("SRP state for Pair-Setup precomputed in %.1f ms\n",srp->precomputeTime/1000.0);
+    }
+  }
+
+  xSemaphoreGive(srpMutex);
+  vTaskDelete(NULL);
+}
+
+//////////////////////////////////////
+
 void HAPClient::tearDown(uint8_t *id){
 
-  for(HAPClient &hc : homeSpan.hapList){
-    if(id==NULL || (hc.cPair && !memcmp(id,hc.cPair->ID,hap_controller_IDBYTES))){
+  resumeCache.remove(id);     // sessions of torn-down Controllers can no longer be resumed
+
+  if(id==NULL){
+    for(HAPClient &hc : homeSpan.hapList){
       LOG1("*** Terminating Client #%d\n",hc.clientNumber);
       hc.client.stop();
     }
+    return;
+  }
+
+  Controller *cTemp=findController(id);
+  if(!cTemp)
+    return;
+
+  for(HAPClient *hc=controllerTable.firstSession(cTemp);hc;hc=hc->nextSession){      // only need to visit connections verified with this Controller
+    LOG1("*** Terminating Client #%d\n",hc->clientNumber);
+    hc->client.stop();
   }
 }
 
@@ -1499,12 +1899,12 @@ void HAPClient::printControllers(int minLogLevel){
   if(homeSpan.logLevel<minLogLevel)
     return;
 
-  if(controllerList.empty()){
+  if(controllerTable.empty()){
     Serial.printf("No Paired Controllers\n");
     return;    
   }
   
-  for(auto it=controllerList.begin();it!=controllerList.end();it++){
+  for(auto it=controllerTable.begin();it!=controllerTable.end();it++){
     Serial.printf("Paired Controller: ");
     charPrintRow((*it).ID,hap_controller_IDBYTES);
     Serial.printf("%s  LTPK: ",(*it).admin?"   (admin)":" (regular)");
@@ -1520,16 +1920,34 @@ void HAPClient::saveControllers(){
   if(homeSpan.controllerCallback)
     homeSpan.controllerCallback();
 
-  if(controllerList.empty()){
-    nvs_erase_key(homeSpan.hapNVS,"CONTROLLERS");
-    return;
+  storeControllers();
+}
+
+//////////////////////////////////////
+
+boolean HAPClient::storeControllers(){
+
+  char key[16];
+  boolean success=true;
+
+  for(int n=0;n<ControllerTable::CAPACITY;n++){
+    if(!controllerTable.isDirty(n))
+      continue;
+    sprintf(key,"CONTROLLER%02d",n);
+    esp_err_t status;
+    if(controllerTable.isUsed(n))
+      status=nvs_set_blob(homeSpan.hapNVS,key,controllerTable.get(n),sizeof(Controller));     // update data for this slot only
+    else
+      status=nvs_erase_key(homeSpan.hapNVS,key);
+    success&=(status==ESP_OK || status==ESP_ERR_NVS_NOT_FOUND);                               // erasing a slot that was never written is not an error
+    controllerTable.nWrites++;
   }
 
-  TempBuffer<Controller> tBuf(controllerList.size());                    // create temporary buffer to hold Controller data
-  std::copy(controllerList.begin(),controllerList.end(),tBuf.get());     // copy data from linked list to buffer
-  
-  nvs_set_blob(homeSpan.hapNVS,"CONTROLLERS",tBuf,tBuf.len());           // update data
-  nvs_commit(homeSpan.hapNVS);                                           // commit to NVS  
+  success&=(nvs_commit(homeSpan.hapNVS)==ESP_OK);                                              // commit to NVS
+
+  if(success)
+    controllerTable.clearDirty();                                                              // otherwise slots remain dirty and are rewritten at next save
+  return(success);
 }
 
 
@@ -1563,6 +1981,204 @@ void Nonce::inc(){
 //////////////////////////////////////
 //////////////////////////////////////
 
+void ResumeCache::add(uint8_t *id, uint8_t *sharedKey, uint8_t *controllerID){
+
+  session_t *session=sessions;
+
+  for(int i=0;i<DEFAULT_RESUME_SESSIONS;i++){               // use first unused slot, else replace least-recently verified session
+    if(!sessions[i].valid){
+      session=sessions+i;
+      break;
+    }
+    if((int32_t)(sessions[i].time-session->time)<0)
+      session=sessions+i;
+  }
+
+  memcpy(session->id,id,ID_BYTES);
+  memcpy(session->sharedKey,sharedKey,32);
+  memcpy(session->controllerID,controllerID,hap_controller_IDBYTES);
+  session->time=millis();
+  session->valid=true;
+}
+
+//////////////////////////////////////
+
+ResumeCache::session_t *ResumeCache::find(uint8_t *id){
+
+  for(int i=0;i<DEFAULT_RESUME_SESSIONS;i++){
+    if(sessions[i].valid && !memcmp(sessions[i].id,id,ID_BYTES)){
+      if(millis()-sessions[i].time>DEFAULT_RESUME_TTL*1000UL){    // session has expired
+        sodium_memzero(sessions[i].sharedKey,32);
+        sessions[i].valid=false;
+        return(NULL);
+      }
+      return(sessions+i);
+    }
+  }
+
+  return(NULL);
+}
+
+//////////////////////////////////////
+
+void ResumeCache::remove(uint8_t *controllerID){
+
+  for(int i=0;i<DEFAULT_RESUME_SESSIONS;i++){
+    if(controllerID==NULL || !memcmp(sessions[i].controllerID,controllerID,hap_controller_IDBYTES)){
+      sodium_memzero(sessions[i].sharedKey,32);
+      sessions[i].valid=false;
+    }
+  }
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+uint32_t ControllerTable::hash(const uint8_t *id){
+
+  uint32_t h=2166136261UL;                      // FNV-1a
+  for(int i=0;i<PREFIX_BYTES;i++)
+    h=(h^id[i])*16777619UL;
+  return(h);
+}
+
+//////////////////////////////////////
+
+void ControllerTable::reindex(){
+
+  memset(index,-1,sizeof(index));
+
+  for(int n=0;n<CAPACITY;n++){
+    if(slots[n].allocated){
+      uint32_t b=hash(slots[n].ID)%INDEX_SIZE;
+      while(index[b]>=0)
+        b=(b+1)%INDEX_SIZE;
+      index[b]=n;
+    }
+  }
+}
+
+//////////////////////////////////////
+
+Controller *ControllerTable::find(const uint8_t *id){
+
+  for(uint32_t b=hash(id)%INDEX_SIZE;index[b]>=0;b=(b+1)%INDEX_SIZE){      // index is never more than half full, so there is always an empty bucket to stop the search
+    if(!memcmp(slots[index[b]].ID,id,hap_controller_IDBYTES))
+      return(slots+index[b]);
+  }
+
+  return(NULL);
+}
+
+//////////////////////////////////////
+
+Controller *ControllerTable::insert(const Controller &c, int n){
+
+  if(n<0){
+    for(n=0;n<CAPACITY && slots[n].allocated;n++);
+  }
+
+  if(n>=CAPACITY || slots[n].allocated)
+    return(NULL);
+
+  slots[n]=c;
+  slots[n].allocated=true;
+  nUsed++;
+  nAdmin+=slots[n].admin;
+  setDirty(n);
+
+  uint32_t b=hash(slots[n].ID)%INDEX_SIZE;
+  while(index[b]>=0)
+    b=(b+1)%INDEX_SIZE;
+  index[b]=n;
+
+  return(slots+n);
+}
+
+//////////////////////////////////////
+
+void ControllerTable::setAdmin(Controller *c, boolean admin){
+
+  if(c->admin==admin)
+    return;
+
+  nAdmin+=admin?1:-1;
+  c->admin=admin;
+  setDirty(slot(c));
+}
+
+//////////////////////////////////////
+
+void ControllerTable::release(int n){
+
+  for(HAPClient *hc=sessions[n];hc;){           // sessions using this Controller can no longer be treated as verified
+    HAPClient *next=hc->nextSession;
+    hc->cPair=NULL;
+    hc->nextSession=NULL;
+    hc=next;
+  }
+
+  sessions[n]=NULL;
+  nUsed--;
+  nAdmin-=slots[n].admin;
+  slots[n].allocated=false;
+  slots[n].admin=false;
+  setDirty(n);
+}
+
+//////////////////////////////////////
+
+void ControllerTable::remove(Controller *c){
+
+  release(slot(c));
+  reindex();          // open-addressing requires re-inserting any entries that may have probed past the removed one
+}
+
+//////////////////////////////////////
+
+void ControllerTable::clear(){
+
+  for(int n=0;n<CAPACITY;n++){
+    if(slots[n].allocated)
+      release(n);
+  }
+
+  memset(index,-1,sizeof(index));
+}
+
+//////////////////////////////////////
+
+void ControllerTable::attach(Controller *c, HAPClient *hc){
+
+  detach(hc);                                   // in case connection was previously verified with another Controller
+
+  int n=slot(c);
+  hc->cPair=c;
+  hc->nextSession=sessions[n];
+  sessions[n]=hc;
+}
+
+//////////////////////////////////////
+
+void ControllerTable::detach(HAPClient *hc){
+
+  if(!hc->cPair)
+    return;
+
+  for(HAPClient **p=sessions+slot(hc->cPair);*p;p=&(*p)->nextSession){
+    if(*p==hc){
+      *p=hc->nextSession;
+      break;
+    }
+  }
+
+  hc->cPair=NULL;
+  hc->nextSession=NULL;
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
 HapOut::HapStreamBuffer::HapStreamBuffer(){
 
   // note - must require all memory allocation to be pulled from INTERNAL heap only
@@ -1619,7 +2235,7 @@ void HapOut::HapStreamBuffer::flushBuffer(){
       
       encBuf[0]=num%256;                          // store number of bytes that encrypts this frame (AAD bytes)
       encBuf[1]=num/256;
-      crypto_aead_chacha20poly1305_ietf_encrypt(encBuf+2,NULL,(uint8_t *)buffer,num,encBuf,2,NULL,hapClient->a2cNonce.get(),hapClient->a2cKey);   // encrypt buffer with AAD prepended and authentication tag appended
+      AEAD::encrypt(encBuf+2,(uint8_t *)buffer,num,encBuf,2,hapClient->a2cNonce.get(),hapClient->a2cKey);   // encrypt buffer with AAD prepended and authentication tag appended
       
       hapClient->client.write(encBuf,num+18);     // transmit encrypted frame
       hapClient->a2cNonce.inc();                  // increment nonce
@@ -1712,5 +2328,13 @@ void HapOut::HapStreamBuffer::printFormatted(char *buf, size_t nChars, size_t ns
 
 pairState HAPClient::pairStatus;                        
 Accessory HAPClient::accessory;                         
-list<Controller, Mallocator<Controller>> HAPClient::controllerList;
+ControllerTable HAPClient::controllerTable;
+ResumeCache HAPClient::resumeCache;
+SRP6A *HAPClient::srp=NULL;
+SemaphoreHandle_t HAPClient::srpMutex=NULL;
+QueueHandle_t HAPClient::cryptoQueue=NULL;
+std::atomic<uint32_t> HAPClient::pairSetupGen{0};
+uint32_t HAPClient::nCryptoJobs=0;
+uint64_t HAPClient::cryptoTime=0;
+BlockPool hapClientPool("HAP Clients",HAPClient::MAX_CLIENTS);
  
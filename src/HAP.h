@@ -28,11 +28,14 @@
 #pragma once
 
 #include <sstream>
+#include <functional>
+#include <atomic>
 #include <WiFi.h>
 
 #include "HomeSpan.h"
 #include "HAPConstants.h"
 #include "HKDF.h"
+#include "AEAD.h"
 #include "SRP.h"
 
 const TLV8_names HAP_Names[] = {
@@ -46,7 +49,8 @@ const TLV8_names HAP_Names[] = {
   {kTLVType_EncryptedData,"ENC.DATA"},
   {kTLVType_Signature,"SIGNATURE"},
   {kTLVType_Identifier,"IDENTIFIER"},
-  {kTLVType_Permissions,"PERMISSION"}
+  {kTLVType_Permissions,"PERMISSION"},
+  {kTLVType_SessionID,"SESSION.ID"}
 };
 
 #define hap_controller_IDBYTES  36
@@ -72,6 +76,38 @@ struct Accessory {
   uint8_t LTPK[crypto_sign_PUBLICKEYBYTES];        // Long Term Ed2519 Public Key
 };
 
+/////////////////////////////////////////////////
+// Pair-Resume Session Cache
+// Holds the Shared-Secret of recently-verified
+// sessions so a returning Controller can verify a
+// new connection with Pair-Resume (a few HKDF calls)
+// instead of a full Pair-Verify (Curve25519 key
+// exchange plus Ed25519 sign and verify)
+
+struct ResumeCache {
+
+  static const int ID_BYTES=8;                                // size of a Session ID
+
+  struct session_t {
+    uint8_t id[ID_BYTES];                                     // Session ID
+    uint8_t sharedKey[32];                                    // Shared-Secret of session
+    uint8_t controllerID[hap_controller_IDBYTES];             // ID of Controller that verified session
+    uint32_t time;                                            // time (in millis) session was verified
+    boolean valid=false;
+  };
+
+  session_t sessions[DEFAULT_RESUME_SESSIONS];                // cached sessions (least-recently verified is replaced when full)
+
+  uint32_t nFull=0;                                           // number of full Pair-Verifies completed
+  uint32_t nResumed=0;                                        // number of Pair-Resumes completed
+  uint64_t fullTime=0;                                        // total time (in micros) spent processing full Pair-Verifies
+  uint64_t resumeTime=0;                                      // total time (in micros) spent processing Pair-Resumes
+
+  void add(uint8_t *id, uint8_t *sharedKey, uint8_t *controllerID);   // adds session
+  session_t *find(uint8_t *id);                                        // returns session with matching id, or NULL if not found or expired
+  void remove(uint8_t *controllerID);                                  // removes all sessions of Controller with controllerID (or all sessions if controllerID=NULL)
+};
+
 /////////////////////////////////////////////////
 // HAPClient Structure
 // Reads and Writes from each HAP Client connection
@@ -81,18 +117,33 @@ struct HAPClient {
   // common structures and data shared across all HAP Clients
 
   static const int MAX_HTTP=8096;                     // max number of bytes allowed for HTTP message
-  static const int MAX_CONTROLLERS=16;                // maximum number of paired controllers (HAP requires at least 16)
+  static const int MAX_CONTROLLERS=ControllerTable::CAPACITY;   // maximum number of paired controllers (HAP requires at least 16)
   static const int MAX_ACCESSORIES=150;               // maximum number of allowed Accessories (HAP limit=150)
+  static const int MAX_CLIENTS=CONFIG_LWIP_MAX_SOCKETS;   // maximum number of simultaneous HAP Client connections (cannot exceed number of LWIP sockets)
+  static const int MAX_SCRATCH=2*MAX_HTTP;            // maximum size to which the per-client scratch arena is allowed to grow
   
   static pairState pairStatus;                                      // tracks pair-setup status
+  static std::atomic<uint32_t> pairSetupGen;                        // incremented whenever Pair-Setup starts, restarts or submits an SRP Verify, so stale crypto worker results can be dropped
   static Accessory accessory;                                       // Accessory ID and Ed25519 public and secret keys - permanently stored
-  static list<Controller, Mallocator<Controller>> controllerList;   // linked-list of Paired Controller IDs and ED25519 long-term public keys - permanently stored
+  static ControllerTable controllerTable;                           // table of Paired Controller IDs and ED25519 long-term public keys - permanently stored
+  static ResumeCache resumeCache;                                   // Shared-Secrets of recently-verified sessions available for Pair-Resume
+  static SRP6A *srp;                                                // SRP state for Pair-Setup (persists across M1-M5, and may be precomputed in background before M1 arrives)
+  static SemaphoreHandle_t srpMutex;                                // held by background SRP task and crypto worker task while computing, and by Pair-Setup M1 while using, the SRP state
+  static QueueHandle_t cryptoQueue;                                 // queue of HAP Clients with pairing cryptography waiting for the crypto worker task (NULL=crypto performed inline)
+  static uint32_t nCryptoJobs;                                      // number of crypto jobs completed by the crypto worker task
+  static uint64_t cryptoTime;                                       // total time (in micros) spent by the crypto worker task performing crypto jobs
 
   // individual structures and data defined for each Hap Client connection
   
   NetworkClient client;           // handle to client
   int clientNumber;               // client number
+  char ipAddress[46];             // IP address of client (stored once upon connection so logging does not require String conversions)
+  ScratchArena scratch{MAX_SCRATCH};  // scratch memory for the request being processed (reset after each request, but arena memory is retained)
+  uint32_t heapCalls=0;           // number of HS_MALLOC/HS_CALLOC/HS_REALLOC calls made by HomeSpan while processing the most recent request
+  uint32_t nRequests=0;           // number of requests processed
+  uint32_t nHeapRequests=0;       // number of requests that made one or more HS_MALLOC/HS_CALLOC/HS_REALLOC calls
   Controller *cPair=NULL;         // pointer to info on current, session-verified Paired Controller (NULL=un-verified, and therefore un-encrypted, connection)
+  HAPClient *nextSession=NULL;    // next HAP Client connection verified with the same Controller (maintained by controllerTable)
    
   // These temporary Curve25519 keys are generated in the first call to pair-verify and used in the second call to pair-verify so must persist for a short period
 
@@ -109,24 +160,46 @@ struct HAPClient {
   uint8_t c2aKey[32];             // ControllerToAccessoryKey derived from HKDF-SHA-512 of sharedCurveKey (HAP Section 6.5.2)
   Nonce a2cNonce;                 // encryption nonce (starts at zero at end of each Pair-Verify and increment every encryption - NOT DOCUMENTED)
   Nonce c2aNonce;                 // decryption nonce (starts at zero at end of each Pair-Verify and increment every encryption - NOT DOCUMENTED)
+  uint32_t verifyTime=0;          // time (in micros) spent processing the current Pair-Verify
+
+  // Expensive public-key operations needed for Pair-Setup and Pair-Verify are performed by a background crypto worker task so that
+  // pollTask() can continue serving other clients.  While waiting, the client is "parked" and none of its requests are read.
+
+  enum {
+    CRYPTO_IDLE,                  // no crypto job pending
+    CRYPTO_BUSY,                  // crypto job submitted to crypto worker task (client is parked)
+    CRYPTO_DONE                   // crypto job completed - remainder of request to be finished by pollTask()
+  };
+
+  std::atomic<uint8_t> cryptoState{CRYPTO_IDLE};    // state of crypto job for this client
+  std::function<void()> cryptoWork;                 // expensive cryptography - runs on crypto worker task (must not touch any shared HomeSpan state)
+  std::function<void()> cryptoDone;                 // remainder of request (sends response) - runs in pollTask() once cryptoWork() has completed
 
   // define member methods
 
+  ~HAPClient();                                               // removes connection from its Controller's list of sessions
+
   void processRequest();                                      // process HAP request  
   int postPairSetupURL(uint8_t *content, size_t len);         // POST /pair-setup (HAP Section 5.6)
   int postPairVerifyURL(uint8_t *content, size_t len);        // POST /pair-verify (HAP Section 5.7)
+  boolean pairResume(uint8_t *publicKey, uint8_t *sessionID, uint8_t *authTag);   // attempts Pair-Resume of a cached session.  Returns true if successful (and response sent), else false
+  void setSessionKeys(uint8_t *sharedKey);                    // derives session encryption keys from sharedKey and resets nonces
   int postPairingsURL(uint8_t *content, size_t len);          // POST /pairings (HAP Sections 5.10-5.12)  
   int getAccessoriesURL();                                    // GET /accessories (HAP Section 6.6)
   int getCharacteristicsURL(char *urlBuf);                    // GET /characteristics (HAP Section 6.7.4)  
   int putCharacteristicsURL(char *json);                      // PUT /characteristics (HAP Section 6.7.2)
   int putPrepareURL(char *json);                              // PUT /prepare (HAP Section 6.7.2.4)
 
-  void tlvRespond(TLV8 &tlv8);                                // respond to client with HTTP OK header and all defined TLV data records
+  void runCrypto(std::function<void()> work, std::function<void()> done);   // submits work to crypto worker task and parks client until done() can be called (runs both inline if no worker task)
+  void finishCrypto();                                        // calls done() for completed crypto job and un-parks client
+
+  void tlvRespond(TLV8Flat &tlv8);                                // respond to client with HTTP OK header and all defined TLV data records
   int receiveEncrypted(uint8_t *httpBuf, int messageSize);    // decrypt HTTP request (HAP Section 6.5)
 
   int notFoundError();           // return 404 error
   int badRequestError();         // return 400 error
   int unauthorizedError();       // return 470 error
+  int internalError();           // return 500 error
 
   // define static methods
     
@@ -140,8 +213,12 @@ struct HAPClient {
   static tagError addController(uint8_t *id, uint8_t *ltpk, boolean admin);            // stores data for new Controller with specified data.  Returns tagError (if any)
   static void removeController(uint8_t *id);                                           // removes specific Controller.  If no remaining admin Controllers, remove all others (if any) as per HAP requirements.
   static void printControllers(int minLogLevel=0);                                     // prints IDs of all allocated (paired) Controller, subject to specified minimum log level
-  static void saveControllers();                                                       // saves Controller list in NVS
+  static void saveControllers();                                                       // saves Controller table in NVS (and calls Controller Callback, if set)
+  static boolean storeControllers();                                                   // writes NVS records of only those Controller table slots modified since last save.  Returns true if all records were written and committed
   static int nAdminControllers();                                                      // returns number of admin Controller
+  static void cryptoTask(void *arg);                                                   // crypto worker task that performs crypto jobs submitted with runCrypto()
+  static void precomputeSRP();                                                         // starts background task that precomputes SRP state for next Pair-Setup (only if Accessory is not yet paired)
+  static void srpTask(void *arg);                                                      // background task used by precomputeSRP()
   static void tearDown(uint8_t *id);                                                   // tears down connections using Controller with ID=id; tears down all connections if id=NULL
   static void checkNotifications();                                                    // checks for Event Notifications and reports to controllers as needed (HAP Section 6.8)
   static void checkTimedWrites();                                                      // checks for expired Timed Write PIDs, and clears any found (HAP Section 6.7.2.4)
@@ -149,9 +226,14 @@ struct HAPClient {
 
   static void getStatusURL(HAPClient *, void (*)(const char *, void *), void *, int refreshTime=0);       // GET / status (an optional, non-HAP feature)
 
-  class HAPTLV : public TLV8 {   // dedicated class for HAP TLV8 records
+  class HAPTLV : public TLV8Flat {   // dedicated class for building HAP TLV8 responses in a single contiguous buffer
+    public:
+      HAPTLV() : TLV8Flat(HAP_Names,12){}
+  };
+
+  class HAPTLVView : public TLV8View {   // dedicated class for zero-copy parsing of HAP TLV8 records
     public:
-      HAPTLV() : TLV8(HAP_Names,11){}
+      HAPTLVView() : TLV8View(HAP_Names,12){}
   };
   
 };
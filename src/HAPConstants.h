@@ -44,6 +44,7 @@ typedef enum {
   kTLVType_Permissions=0x0B,
   kTLVType_FragmentData=0x0C,
   kTLVType_FragmentLast=0x0D,
+  kTLVType_SessionID=0x0E,
   kTLVType_Flags=0x13,
   kTLVType_Separator=0xFF
 } kTLVType;
@@ -63,6 +64,13 @@ typedef enum {
 } tagError;
 
 
+// Pair-Verify Methods
+
+typedef enum {
+  pairMethod_Resume=0x06                 // Pair-Resume, used in place of a full Pair-Verify when a Controller returns with a cached Session ID
+} pairMethod;
+
+
 // Pair-Setup and Pair-Verify States
 
 typedef enum {
@@ -45,6 +45,145 @@ int HKDF::create(uint8_t *outputKey, uint8_t *inputKey, int inputLen, const char
   
 }
 
+/////////////////////////////////////////////////////////////////////////////////
+// HMAC-SHA-512 computed directly with SHA-512 contexts (rather than with
+// mbedtls_md_hmac, which allocates its contexts on the heap every call)
+
+static void hmacKey(mbedtls_sha512_context *inner, mbedtls_sha512_context *outer, const uint8_t *key, size_t keyLen){
+
+  uint8_t pad[128];                         // SHA-512 block size
+  uint8_t keyHash[64];
+
+  if(keyLen>sizeof(pad)){                   // keys longer than block size are first hashed
+    mbedtls_sha512(key,keyLen,keyHash,0);
+    key=keyHash;
+    keyLen=sizeof(keyHash);
+  }
+
+  memset(pad,0x36,sizeof(pad));
+  for(size_t i=0;i<keyLen;i++)
+    pad[i]^=key[i];
+  mbedtls_sha512_starts(inner,0);
+  mbedtls_sha512_update(inner,pad,sizeof(pad));
+
+  memset(pad,0x5c,sizeof(pad));
+  for(size_t i=0;i<keyLen;i++)
+    pad[i]^=key[i];
+  mbedtls_sha512_starts(outer,0);
+  mbedtls_sha512_update(outer,pad,sizeof(pad));
+
+  mbedtls_platform_zeroize(pad,sizeof(pad));
+  mbedtls_platform_zeroize(keyHash,sizeof(keyHash));
+}
+
+static void hmacFinish(mbedtls_sha512_context *inner, mbedtls_sha512_context *outer, uint8_t *mac){     // finishes inner hash and runs it through outer hash (both contexts are consumed)
+
+  mbedtls_sha512_finish(inner,mac);
+  mbedtls_sha512_update(outer,mac,64);
+  mbedtls_sha512_finish(outer,mac);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+void HKDF::extract(uint8_t *prk, const uint8_t *inputKey, size_t inputLen, const uint8_t *salt, size_t saltLen){
+
+  mbedtls_sha512_context inner, outer;
+  mbedtls_sha512_init(&inner);
+  mbedtls_sha512_init(&outer);
+
+  hmacKey(&inner,&outer,salt,saltLen);
+  mbedtls_sha512_update(&inner,inputKey,inputLen);
+  hmacFinish(&inner,&outer,prk);
+
+  mbedtls_sha512_free(&inner);
+  mbedtls_sha512_free(&outer);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+int HKDF::expand(uint8_t *outputKey, size_t outputLen, const uint8_t *prk, const char *info){
+
+  if(outputLen>255*64)                        // RFC 5869 limits output to 255 blocks (the 1-byte block counter would otherwise wrap)
+    return(MBEDTLS_ERR_HKDF_BAD_INPUT_DATA);
+
+  mbedtls_sha512_context prkInner, prkOuter, inner, outer;
+  mbedtls_sha512_init(&prkInner);
+  mbedtls_sha512_init(&prkOuter);
+  mbedtls_sha512_init(&inner);
+  mbedtls_sha512_init(&outer);
+
+  hmacKey(&prkInner,&prkOuter,prk,PRK_BYTES);     // key HMAC with prk once, then re-use for each block of output
+
+  uint8_t t[64];
+  size_t tLen=0;
+
+  for(uint8_t n=1;outputLen>0;n++){               // T(n) = HMAC(prk, T(n-1) | info | n)
+    mbedtls_sha512_clone(&inner,&prkInner);
+    mbedtls_sha512_clone(&outer,&prkOuter);
+    mbedtls_sha512_update(&inner,t,tLen);
+    mbedtls_sha512_update(&inner,(const uint8_t *)info,strlen(info));
+    mbedtls_sha512_update(&inner,&n,1);
+    hmacFinish(&inner,&outer,t);
+    tLen=sizeof(t);
+
+    size_t nBytes=outputLen<tLen?outputLen:tLen;
+    memcpy(outputKey,t,nBytes);
+    outputKey+=nBytes;
+    outputLen-=nBytes;
+  }
+
+  mbedtls_platform_zeroize(t,sizeof(t));
+  mbedtls_sha512_free(&prkInner);
+  mbedtls_sha512_free(&prkOuter);
+  mbedtls_sha512_free(&inner);
+  mbedtls_sha512_free(&outer);
+  return(0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+void HKDF::Salt::init(){
+
+  mbedtls_sha512_init(&inner);
+  mbedtls_sha512_init(&outer);
+  hmacKey(&inner,&outer,(const uint8_t *)salt,strlen(salt));
+  keyed=true;
+}
+
+HKDF::Salt::~Salt(){
+
+  if(keyed){
+    mbedtls_sha512_free(&inner);
+    mbedtls_sha512_free(&outer);
+  }
+}
+
+void HKDF::Salt::extract(uint8_t *prk, const uint8_t *inputKey, size_t inputLen){
+
+  if(!keyed)
+    init();
+
+  mbedtls_sha512_context ctxInner, ctxOuter;
+  mbedtls_sha512_init(&ctxInner);
+  mbedtls_sha512_init(&ctxOuter);
+
+  mbedtls_sha512_clone(&ctxInner,&inner);         // start from pre-keyed states rather than re-hashing padded salt
+  mbedtls_sha512_clone(&ctxOuter,&outer);
+  mbedtls_sha512_update(&ctxInner,inputKey,inputLen);
+  hmacFinish(&ctxInner,&ctxOuter,prk);
+
+  mbedtls_sha512_free(&ctxInner);
+  mbedtls_sha512_free(&ctxOuter);
+}
+
+void HKDF::Salt::create(uint8_t *outputKey, const uint8_t *inputKey, size_t inputLen, const char *info, size_t outputLen){
+
+  uint8_t prk[PRK_BYTES];
+  extract(prk,inputKey,inputLen);
+  expand(outputKey,outputLen,prk,info);
+  mbedtls_platform_zeroize(prk,sizeof(prk));
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////
 // CODE FOR HKDF IS MISSING FROM THE MBEDTLS LIBRARY INCLUDED WITH THE
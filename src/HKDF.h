@@ -27,7 +27,10 @@
  
 #pragma once
 
-#include <Arduino.h>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <mbedtls/sha512.h>
 
 /////////////////////////////////////////////////
 // HKDF-SHA-512 Structure
@@ -37,7 +40,45 @@
 // Code was instead sourced directly from MBED GitHub and 
 // incorporated under hkdf.cpp, with a wrapper to always
 // use SHA-512 with 32 bytes of output as required by HAP.
+// Depends only on mbedTLS, so it can also be built on a
+// host (see tools/benchCrypto.cpp).
+
+//
+// Since HAP always uses a small number of constant salt strings,
+// HKDF::Salt pre-keys HMAC-SHA-512 with a given salt, computing
+// the inner and outer padded states only once (upon first use)
+// so that each subsequent Extract step needs only two SHA-512
+// blocks plus the input key.  Extract and Expand can also be called
+// separately when the same input key and salt are used to derive
+// more than one output key (e.g. the Control-Salt session keys).
 
 namespace HKDF{
+
+  static const int PRK_BYTES=64;      // size of pseudorandom key produced by Extract step
+
   int create(uint8_t *outputKey, uint8_t *inputKey, int inputLen, const char *salt, const char *info);    // output of HKDF is always a 32-byte key derived from an input key, a salt string, and an info string
+
+  void extract(uint8_t *prk, const uint8_t *inputKey, size_t inputLen, const uint8_t *salt, size_t saltLen);       // HKDF Extract step: writes PRK_BYTES of prk=HMAC(salt,inputKey)
+  int expand(uint8_t *outputKey, size_t outputLen, const uint8_t *prk, const char *info);                          // HKDF Expand step: writes outputLen bytes (at most 255*64) derived from prk and info string.  Returns 0, or MBEDTLS_ERR_HKDF_BAD_INPUT_DATA if outputLen is too large
+
+  class Salt {
+
+    const char *salt;
+    mbedtls_sha512_context inner;       // SHA-512 state after absorbing salt XOR ipad
+    mbedtls_sha512_context outer;       // SHA-512 state after absorbing salt XOR opad
+    bool keyed=false;
+
+    void init();
+
+    public:
+
+    Salt(const char *salt) : salt(salt) {}
+    ~Salt();
+
+    Salt(const Salt&)=delete;
+    Salt& operator=(const Salt&)=delete;
+
+    void extract(uint8_t *prk, const uint8_t *inputKey, size_t inputLen);                    // same as HKDF::extract() using pre-keyed salt
+    void create(uint8_t *outputKey, const uint8_t *inputKey, size_t inputLen, const char *info, size_t outputLen=32);     // same as HKDF::create() using pre-keyed salt
+  };
 };
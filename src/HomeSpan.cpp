@@ -34,11 +34,14 @@
 #include <driver/ledc.h>
 #include <mbedtls/version.h>
 #include <mbedtls/sha256.h>
+#include <mbedtls/sha512.h>
 #include <esp_task_wdt.h>
 #include <esp_sntp.h>
 #include <esp_ota_ops.h>
 #include <esp_wifi.h>
 #include <esp_app_format.h>
+#include <esp_app_desc.h>
+#include <esp_rom_crc.h>
 
 #include "HomeSpan.h"
 #include "HAP.h"
@@ -50,6 +53,9 @@ using namespace Utils;
 
 HapOut hapOut;                      // Specialized output stream that can both print to serial monitor and encrypt/transmit to HAP Clients with minimal memory usage (global-scoped variable)
 Span homeSpan;                      // HAP Attributes database and all related control functions for this Accessory (global-scoped variable)
+StringPool stringPool;              // interned strings shared across all Characteristics
+
+RTC_NOINIT_ATTR SpanWarmStart::snapshot_t rtcSnapshot;     // warm-restart snapshot - not cleared by a software restart
 HapCharacteristics hapChars;        // Instantiation of all HAP Characteristics used to create SpanCharacteristics (global-scoped variable)
 
 ///////////////////////////////
@@ -60,7 +66,7 @@ Span::Span(){
 
   nvs_flash_init();                                       // initialize non-volatile-storage partition in flash 
 
-  nvs_open("CHAR",NVS_READWRITE,&charNVS);                // open Characteristic data namespace in NVS
+  nvsCharStore.open("CHAR");                              // open Characteristic data namespace in NVS
   nvs_open("WIFI",NVS_READWRITE,&wifiNVS);                // open WIFI data namespace in NVS
   nvs_open("OTA",NVS_READWRITE,&otaNVS);                  // open OTA data namespace in NVS
 
@@ -95,6 +101,9 @@ void Span::begin(Category catID, const char *_displayName, const char *_hostName
 
   SpanPoint::setAsHub();
 
+  if(!asyncQueue.begin(asyncQueueSize))
+    LOG0("\n*** WARNING: Unable to allocate queue for setValAsync() and setStringAsync().  All queued updates will be dropped!\n\n");
+
   statusLED=new Blinker(statusDevice,autoOffLED);             // create Status LED, even is statusDevice is NULL
 
   hapServer=new NetworkServer(tcpPortNum);                    // create HAP Server (can be WiFi or Ethernet)
@@ -197,15 +206,21 @@ void Span::poll() {
 void Span::pollTask() {
 
   std::unique_lock pollLock(homeSpan.pollMutex);
+  pollOwner=xTaskGetCurrentTaskHandle();
 
   if(!strlen(category)){
     LOG0("\n** FATAL ERROR: Cannot start homeSpan polling without an initial call to homeSpan.begin()!\n** PROGRAM HALTED **\n\n");
     while(1);    
   }
 
+  applyAsync();                       // apply any Characteristic updates queued by other tasks and ISRs since last pass
+
   if(!isInitialized){
   
-    processSerialCommand("i");        // print homeSpan configuration info
+    if(startupInfo)
+      processSerialCommand("i");      // print homeSpan configuration info
+    else
+      validateDatabase();             // validate database without printing configuration info
            
     HAPClient::init();                // read NVS and load HAP settings  
 
@@ -227,6 +242,12 @@ void Span::pollTask() {
       controlButton->reset();
 
     resetStatus();     
+
+    bulkNVS.release();
+    warmStart.release();
+    loopPool.begin();
+    if(nvsLoads)
+      LOG1("Loaded %lu saved Characteristic values from NVS%s in %lu ms\n",nvsLoads,bulkNVS.enabled?" (bulk)":"",nvsLoadTime/1000);
   
     LOG0("%s is READY!\n\n",displayName);
     isInitialized=true;    
@@ -238,7 +259,14 @@ void Span::pollTask() {
       addWebLog(true,"Trying to connect to %s.  Waiting %ld sec...",network.wifiData.ssid,wifiTimeCounter/1000);
     
     alarmConnect=millis()+(wifiTimeCounter++);
-    wifiBegin(network.wifiData.ssid,network.wifiData.pwd);
+    if(warmStart.channel && !customWifiBegin){                  // connect directly to access point used before warm restart, skipping scan
+      LOG1("Connecting to %s on channel %d (BSSID %02X:%02X:%02X:%02X:%02X:%02X) used before restart\n",network.wifiData.ssid,warmStart.channel,
+        warmStart.bssid[0],warmStart.bssid[1],warmStart.bssid[2],warmStart.bssid[3],warmStart.bssid[4],warmStart.bssid[5]);
+      WiFi.begin(network.wifiData.ssid,network.wifiData.pwd,warmStart.channel,warmStart.bssid);
+      warmStart.channel=0;                                      // only try once - any further attempts use normal connection
+    } else {
+      wifiBegin(network.wifiData.ssid,network.wifiData.pwd);
+    }
   }
 
   if(rescanStatus==RESCAN_PENDING && millis()>rescanAlarm){
@@ -260,26 +288,55 @@ void Span::pollTask() {
     processSerialCommand(cBuf);
   }
 
-  if(hapServer->hasClient()){  
+  if(hapServer->hasClient() && hapClientPool.full()){                        // no room for another HAPClient connection - refuse rather than fall back on heap
+    NetworkClient refused=hapServer->accept();
+    hapClientPool.noteExhausted();
+    LOG0("\n*** WARNING: Refusing new client connection from %s.  Maximum of %d connections already in use.\n\n",refused.remoteIP().toString().c_str(),HAPClient::MAX_CLIENTS);
+    refused.stop();
+  
+  } else if(hapServer->hasClient()){  
  
     auto it=hapList.emplace(hapList.begin());                                // create new HAPClient connection
     it->client=hapServer->accept();
     it->clientNumber=it->client.fd()-LWIP_SOCKET_OFFSET;
+    strlcpy(it->ipAddress,it->client.remoteIP().toString().c_str(),sizeof(it->ipAddress));
             
     HAPClient::pairStatus=pairState_M1;                                      // reset starting PAIR STATE (which may be needed if Accessory failed in middle of pair-setup)    
 
     LOG2("=======================================\n");
-    LOG1("** Client #%d Connected (%lu sec): %s\n",it->clientNumber,millis()/1000,it->client.remoteIP().toString().c_str());
+    LOG1("** Client #%d Connected (%lu sec): %s\n",it->clientNumber,millis()/1000,it->ipAddress);
     LOG2("\n");
   }
 
   currentClient=hapList.begin();
   while(currentClient!=hapList.end()){
 
-    if(currentClient->client.connected()){                                   // if the client is connected
-      if(currentClient->client.available()){                                 // if client has data available
-        homeSpan.lastClientIP=currentClient->client.remoteIP().toString();   // store IP Address for web logging
+    if(currentClient->cryptoState==HAPClient::CRYPTO_BUSY){                 // client is parked waiting for crypto worker task - do not read (or remove) it yet
+      currentClient++;
+    } else if(currentClient->client.connected()){                            // if the client is connected
+      if(currentClient->cryptoState==HAPClient::CRYPTO_DONE){                // crypto job for this client is complete
+        homeSpan.lastClientIP=currentClient->ipAddress;
+        uint32_t heapCalls=hsHeapCalls;
+        currentClient->finishCrypto();                                       // FINISH HAP REQUEST
+        currentClient->scratch.reset();                                      // release all scratch memory used while processing request
+        currentClient->heapCalls+=hsHeapCalls-heapCalls;                     // add heap calls made while finishing request to those made before it was parked
+        currentClient->nRequests++;
+        if(currentClient->heapCalls)
+          currentClient->nHeapRequests++;
+        homeSpan.lastClientIP="0.0.0.0";
+      } else if(currentClient->client.available()){                          // if client has data available
+        homeSpan.lastClientIP=currentClient->ipAddress;                      // store IP Address for web logging
+        uint32_t heapCalls=hsHeapCalls;                                      // count heap calls made by this task while processing request (calls made by the crypto worker task are not included)
         currentClient->processRequest();                                     // PROCESS HAP REQUEST
+        if(currentClient->cryptoState==HAPClient::CRYPTO_IDLE){              // scratch memory must persist if request is waiting on crypto worker task
+          currentClient->scratch.reset();                                    // release all scratch memory used while processing request
+          currentClient->heapCalls=hsHeapCalls-heapCalls;
+          currentClient->nRequests++;
+          if(currentClient->heapCalls)
+            currentClient->nHeapRequests++;
+        } else {
+          currentClient->heapCalls=hsHeapCalls-heapCalls;                    // request is completed (and counted) once crypto job is done
+        }
         homeSpan.lastClientIP="0.0.0.0";                                     // reset stored IP address to show "0.0.0.0" if homeSpan.getClientIP() is used in any other context 
       }
       currentClient++;
@@ -291,10 +348,21 @@ void Span::pollTask() {
   }
       
   snapTime=millis();                                     // snap the current time for use in ALL loop routines
+
+  uint32_t loopStart=micros();
   
   for(auto it=Loops.begin();it!=Loops.end();it++)                 // call loop() for all Services with over-ridden loop() methods
     (*it)->loop();                           
 
+  loopPool.run();                                                 // call loop() for all independent Services (in parallel, if enabled)
+
+#if defined(__cpp_impl_coroutine)
+  SpanScheduler::run();                                           // resume any coroutines that are ready
+#endif
+
+  loopTime+=micros()-loopStart;
+  loopPasses++;
+
   for(auto it=PushButtons.begin();it!=PushButtons.end();it++)     // check for SpanButton presses
     (*it)->check();
     
@@ -319,6 +387,9 @@ void Span::pollTask() {
 
   statusLED->check();
 
+  if(!nvsDirty.empty() && (millis()-nvsLastDirty>=nvsDebounceTime || millis()-nvsFirstDirty>=nvsMaxAge))     // write-behind of changed Characteristic values
+    flushNVS();
+
   if(rebootCallback && snapTime>rebootCallbackTime){
     rebootCallback(rebootCount-1);
     rebootCount=0;
@@ -326,6 +397,8 @@ void Span::pollTask() {
     nvs_set_u8(wifiNVS,"REBOOTS",rebootCount);
     nvs_commit(wifiNVS);    
   }
+
+  pollOwner=NULL;
     
 } // poll
 
@@ -411,6 +484,7 @@ void Span::networkCallback(arduino_event_id_t event){
   switch (event) {
       
     case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      warmStart.noteWiFi(false);
       if(connected%2){                        // we are in a connected state
         connected++;                          // move to unconnected state
         addWebLog(true,"*** WiFi Connection Lost!");
@@ -426,6 +500,7 @@ void Span::networkCallback(arduino_event_id_t event){
         addWebLog(true,"WiFi Connected!  IP Address = %s   (RSI=%d  BSSID=%s  \"%s\")",WiFi.localIP().toString().c_str(),WiFi.RSSI(),WiFi.BSSIDstr().c_str(),bssidNames[WiFi.BSSIDstr().c_str()].c_str());
       else
         addWebLog(true,"WiFi Connected!  IP Address = %s   (RSI=%d  BSSID=%s)",WiFi.localIP().toString().c_str(),WiFi.RSSI(),WiFi.BSSIDstr().c_str());      
+      warmStart.noteWiFi(true);
       connected++;
       if(connected==1)
         configureNetwork();
@@ -581,8 +656,10 @@ void Span::configureNetwork(){
 
   LOG0("\n");
 
-  if(!HAPClient::nAdminControllers())
+  if(!HAPClient::nAdminControllers()){
     LOG0("DEVICE NOT YET PAIRED -- PLEASE PAIR WITH HOMEKIT APP\n\n");
+    HAPClient::precomputeSRP();                                 // prepare SRP state in background so Pair-Setup can respond immediately
+  }
   
   if(wifiCallback)
     wifiCallback();
@@ -678,7 +755,7 @@ void Span::processSerialCommand(const char *c){
       LOG0("\n");
 
       for(auto it=hapList.begin(); it!=hapList.end(); ++it){
-        LOG0("Client #%d: %s",(*it).clientNumber,(*it).client.remoteIP().toString().c_str());
+        LOG0("Client #%d: %s",(*it).clientNumber,(*it).ipAddress);
         if((*it).cPair){
           LOG0("  ID=");
           HAPClient::charPrintRow((*it).cPair->getID(),36);
@@ -760,13 +837,14 @@ void Span::processSerialCommand(const char *c){
 
     case 'U': {
 
-      HAPClient::controllerList.clear();                                        // clear all Controller data  
+      HAPClient::controllerTable.clear();                                       // clear all Controller data  
       HAPClient::saveControllers();
       LOG0("\n*** HomeSpan Pairing Data DELETED ***\n\n");
       HAPClient::tearDown(NULL);                                                // tear down all verified connections
             
       LOG0("\nDEVICE NOT YET PAIRED -- PLEASE PAIR WITH HOMEKIT APP\n\n");
       mdns_service_txt_item_set("_hap","_tcp","sf","1");                        // set Status Flag = 1 (Table 6-8)
+      HAPClient::precomputeSRP();                                               // get SRP state ready for next Pair-Setup
 
       if(homeSpan.pairCallback)
         homeSpan.pairCallback(false);
@@ -837,8 +915,10 @@ void Span::processSerialCommand(const char *c){
 
     case 'V': {
       
-      nvs_erase_all(charNVS);
-      nvs_commit(charNVS);      
+      discardNVS();
+      warmStart.invalidate();
+      charStore->eraseAll();
+      charStore->commit();      
       LOG0("\n*** Values for all saved Characteristics erased!\n\n");
     }
     break;
@@ -860,12 +940,14 @@ void Span::processSerialCommand(const char *c){
 
     case 'F': {
       
+      discardNVS();
+      warmStart.invalidate();                 // restart must not restore values, WiFi information, or database hash from before the reset
       nvs_erase_all(hapNVS);
       nvs_commit(hapNVS);      
       nvs_erase_all(wifiNVS);
       nvs_commit(wifiNVS);   
-      nvs_erase_all(charNVS);
-      nvs_commit(charNVS);
+      charStore->eraseAll();
+      charStore->commit();
       nvs_erase_all(otaNVS);
       nvs_commit(otaNVS);
       WiFi.begin("none");  
@@ -876,6 +958,10 @@ void Span::processSerialCommand(const char *c){
 
     case 'E': {
       
+      discardNVS();
+      warmStart.invalidate();
+      charStore->eraseAll();                  // in case Characteristic data is not stored in NVS
+      charStore->commit();
       nvs_flash_erase();
       LOG0("\n*** ALL DATA ERASED!  Restarting...\n\n");
       reboot();
@@ -917,7 +1003,31 @@ void Span::processSerialCommand(const char *c){
       LOG0("Lowest stack level: %d bytes (%s)\n",uxTaskGetStackHighWaterMark(loopTaskHandle),pcTaskGetName(loopTaskHandle));
       nvs_stats_t nvs_stats;
       nvs_get_stats(NULL, &nvs_stats);
-      LOG0("NVS Flash Partition: %d of %d records used\n\n",nvs_stats.used_entries,nvs_stats.total_entries-126);      
+      LOG0("NVS Flash Partition: %d of %d records used\n",nvs_stats.used_entries,nvs_stats.total_entries-126);
+      LOG0("NVS Characteristic Values: %lu changes, %lu writes, %lu commits (%lu commits saved), %d pending, %lu failed writes\n",nvsSaves,nvsWrites,nvsCommits,nvsSaves-nvsCommits,nvsDirty.size(),nvsFailures);
+      if(HAPClient::resumeCache.nFull || HAPClient::resumeCache.nResumed)
+        LOG0("Pair-Verify: %lu full (%.1f ms average), %lu resumed (%.1f ms average)\n",HAPClient::resumeCache.nFull,HAPClient::resumeCache.nFull?HAPClient::resumeCache.fullTime/1000.0/HAPClient::resumeCache.nFull:0.0,
+          HAPClient::resumeCache.nResumed,HAPClient::resumeCache.nResumed?HAPClient::resumeCache.resumeTime/1000.0/HAPClient::resumeCache.nResumed:0.0);
+      if(HAPClient::nCryptoJobs)
+        LOG0("Crypto Worker: %lu jobs (%.1f ms average)\n",HAPClient::nCryptoJobs,HAPClient::cryptoTime/1000.0/HAPClient::nCryptoJobs);
+      LOG0("Paired Controllers: %d of %d slots used (%d admin), %lu NVS record writes\n",HAPClient::controllerTable.size(),ControllerTable::CAPACITY,HAPClient::controllerTable.nAdmins(),HAPClient::controllerTable.nWrites);
+      if(loopPasses)
+        LOG0("Service Loops: %d serial, %d independent on %d worker tasks, %.1f us average per pass, %lu stolen\n",Loops.size(),loopPool.Loops.size(),loopPool.nWorkers,(double)loopTime/loopPasses,loopPool.nSteals.load());
+#if defined(__cpp_impl_coroutine)
+      LOG0("Coroutines: %d suspended, %lu frames allocated (%lu reused from pool)\n",SpanScheduler::size(),SpanScheduler::framePool.nAllocs,SpanScheduler::framePool.nReused);
+#endif
+      LOG0("Async Characteristic Updates: %lu applied, %lu dropped (%lu-slot queue)\n\n",asyncApplied,asyncQueue.nDropped.load(),asyncQueue.capacity());
+
+      hapClientPool.print();
+      tlv8Pool.print();
+      stringPool.print();
+      LOG0("\n");
+
+      for(auto it=hapList.begin(); it!=hapList.end(); ++it)
+        LOG0("Client #%d Scratch Arena: %d bytes allocated, %d bytes high-water, %lu overflows, %lu grows; %lu of %lu requests made heap calls (%lu in last request)\n",
+          it->clientNumber,it->scratch.getCapacity(),it->scratch.highWater,it->scratch.nOverflows,it->scratch.nGrows,it->nHeapRequests,it->nRequests,it->heapCalls);
+      if(!hapList.empty())
+        LOG0("\n");
     }
     break;       
 
@@ -927,134 +1037,9 @@ void Span::processSerialCommand(const char *c){
 
       int nErrors=0;
       int nWarnings=0;
-      
-      vector<uint32_t, Mallocator<uint32_t>> aidValues;
-      char pNames[][7]={"PR","PW","EV","AA","TW","HD","WR"};
-
-      for(auto acc=Accessories.begin(); acc!=Accessories.end(); acc++){
-        LOG0("\u27a4 Accessory:  AID=%lu\n",(*acc)->aid);
-        boolean foundInfo=false;
-
-        if(acc==Accessories.begin() && (*acc)->aid!=1)
-          LOG0("   *** ERROR #%d!  AID of first Accessory must always be 1 ***\n",++nErrors);
-
-        if(std::find(aidValues.begin(),aidValues.end(),(*acc)->aid)!=aidValues.end())
-          LOG0("   *** ERROR #%d!  AID already in use for another Accessory ***\n",++nErrors);
-        
-        aidValues.push_back((*acc)->aid);
-        vector<uint32_t, Mallocator<uint32_t>> iidValues;
-
-        for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
-          LOG0("   \u279f Service %s:  IID=%lu, %sUUID=\"%s\"\n",(*svc)->hapName,(*svc)->iid,(*svc)->isCustom?"Custom-":"",(*svc)->type);
-
-          if(!strcmp((*svc)->type,"3E")){
-            foundInfo=true;
-            if((*svc)->iid!=1)
-              LOG0("     *** ERROR #%d!  The Accessory Information Service must be defined with IID=1 (i.e. before any other Services in an Accessory) ***\n",++nErrors);
-          }
-          else if((*acc)->aid==1)            // this is an Accessory with aid=1, but it has more than just AccessoryInfo.  So...
-            isBridge=false;                  // ...this is not a bridge device
-
-          if(std::find(iidValues.begin(),iidValues.end(),(*svc)->iid)!=iidValues.end())
-            LOG0("   *** ERROR #%d!  IID already in use for another Service or Characteristic within this Accessory ***\n",++nErrors);
-
-          iidValues.push_back((*svc)->iid);
-
-          for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
-            LOG0("      \u21e8 Characteristic %s(%.33s%s):  IID=%lu, %sUUID=\"%s\", %sPerms=",
-              (*chr)->hapName,(*chr)->uvPrint((*chr)->value).c_str(),strlen((*chr)->uvPrint((*chr)->value).c_str())>33?"...\"":"",(*chr)->iid,(*chr)->isCustom?"Custom-":"",(*chr)->type,(*chr)->perms!=(*chr)->hapChar->perms?"Custom-":"");
-
-            int foundPerms=0;
-            for(uint8_t i=0;i<7;i++){
-              if((*chr)->perms & (1<<i))
-                LOG0("%s%s",(foundPerms++)?"+":"",pNames[i]);
-            }           
-            
-            if((*chr)->format<FORMAT::STRING && (*chr)->format!=FORMAT::BOOL){
-              if((*chr)->validValues)
-                LOG0(", Valid Values=%s",(*chr)->validValues);
-              else if((*chr)->uvGet<double>((*chr)->stepValue)>0)
-                LOG0(", %sRange=[%s,%s,%s]",(*chr)->customRange?"Custom-":"",(*chr)->uvPrint((*chr)->minValue).c_str(),(*chr)->uvPrint((*chr)->maxValue).c_str(),(*chr)->uvPrint((*chr)->stepValue).c_str());
-              else
-                LOG0(", %sRange=[%s,%s]",(*chr)->customRange?"Custom-":"",(*chr)->uvPrint((*chr)->minValue).c_str(),(*chr)->uvPrint((*chr)->maxValue).c_str());
-            }
-
-            if(((*chr)->perms)&EV){
-              LOG0(", EV=(");
-              boolean addComma=false;
-              for(auto const &hc : (*chr)->evList){
-                LOG0("%s%d",addComma?",":"",hc->clientNumber);
-                addComma=true;
-              }
-              LOG0(")");              
-            }
-            
-            if((*chr)->nvsKey)
-              LOG0(" (nvs)");
-              
-            LOG0("\n");        
-            
-            if(!(*chr)->isCustom && !(*svc)->isCustom  && std::find((*svc)->req.begin(),(*svc)->req.end(),(*chr)->hapChar)==(*svc)->req.end() && std::find((*svc)->opt.begin(),(*svc)->opt.end(),(*chr)->hapChar)==(*svc)->opt.end())
-              LOG0("          *** WARNING #%d!  Service does not support this Characteristic ***\n",++nWarnings);
-            else
-            if(invalidUUID((*chr)->type))
-              LOG0("          *** ERROR #%d!  Format of UUID is invalid ***\n",++nErrors);
-            else       
-              if(std::find_if((*svc)->Characteristics.begin(),chr,[chr](SpanCharacteristic *c)->boolean{return(c->hapChar==(*chr)->hapChar);})!=chr)
-              LOG0("          *** ERROR #%d!  Characteristic already defined for this Service ***\n",++nErrors);
-
-            if((*chr)->setRangeError)
-              LOG0("          *** WARNING #%d!  Attempt to set Custom Range for this Characteristic ignored ***\n",++nWarnings);
-
-            if((*chr)->setValidValuesError)
-              LOG0("          *** WARNING #%d!  Attempt to set Custom Valid Values for this Characteristic ignored ***\n",++nWarnings);
-
-            if((*chr)->format<STRING && (!(((*chr)->uvGet<double>((*chr)->value) >= (*chr)->uvGet<double>((*chr)->minValue)) && ((*chr)->uvGet<double>((*chr)->value) <= (*chr)->uvGet<double>((*chr)->maxValue)))))
-              LOG0("          *** WARNING #%d!  Value of %g is out of range [%g,%g] ***\n",++nWarnings,(*chr)->uvGet<double>((*chr)->value),(*chr)->uvGet<double>((*chr)->minValue),(*chr)->uvGet<double>((*chr)->maxValue));
-
-            if(std::find(iidValues.begin(),iidValues.end(),(*chr)->iid)!=iidValues.end())
-              LOG0("   *** ERROR #%d!  IID already in use for another Service or Characteristic within this Accessory ***\n",++nErrors);
-
-            iidValues.push_back((*chr)->iid);
-          
-          } // Characteristics
-
-          for(auto req=(*svc)->req.begin(); req!=(*svc)->req.end(); req++){
-            if(std::find_if((*svc)->Characteristics.begin(),(*svc)->Characteristics.end(),[req](SpanCharacteristic *c)->boolean{return(c->hapChar==*req);})==(*svc)->Characteristics.end())
-              LOG0("          *** WARNING #%d!  Required '%s' Characteristic for this Service not found ***\n",++nWarnings,(*req)->hapName);
-          }
-
-          for(auto button=PushButtons.begin(); button!=PushButtons.end(); button++){
-            if((*button)->service==(*svc)){
-              
-              if((*button)->buttonType==SpanButton::HS_BUTTON)
-                LOG0("      \u25bc SpanButton: Pin=%d, Single=%ums, Double=%ums, Long=%ums, Type=",(*button)->pin,(*button)->singleTime,(*button)->doubleTime,(*button)->longTime);
-              else
-                LOG0("      \u25bc SpanToggle: Pin=%d, Toggle=%ums, Type=",(*button)->pin,(*button)->longTime);
-                
-              if((*button)->triggerType==PushButton::TRIGGER_ON_LOW)
-                LOG0("TRIGGER_ON_LOW\n");
-              else if((*button)->triggerType==PushButton::TRIGGER_ON_HIGH)
-                LOG0("TRIGGER_ON_HIGH\n");
-
-#if SOC_TOUCH_SENSOR_NUM > 0
-              else if((*button)->triggerType==PushButton::TRIGGER_ON_TOUCH)
-                LOG0("TRIGGER_ON_TOUCH\n");
-#endif
-              else
-                LOG0("USER-DEFINED\n");
-              
-              if((void(*)(int,int))((*svc)->*(&SpanService::button))==(void(*)(int,int))(&SpanService::button))
-                LOG0("          *** WARNING #%d!  No button() method defined in this Service ***\n",++nWarnings);
-            }
-          }
-          
-        } // Services
-        
-        if(!foundInfo)
-          LOG0("   *** ERROR #%d!  Required 'AccessoryInformation' Service not found ***\n",++nErrors);
-          
-      } // Accessories   
+      unsigned long validateTime=micros();
+      validateAccessories(true,nErrors,nWarnings);
+      validateTime=micros()-validateTime;
 
       char d[]="------------------------------";
       LOG0("\n%-30s  %8s  %10s  %s  %s  %s  %s  %s\n","Service","UUID","AID","IID","Update","Loop","Button","Linked Services");
@@ -1094,11 +1079,11 @@ void Span::processSerialCommand(const char *c){
 
       LOG0("\nConfigured as Bridge: %s\n",isBridge?"YES":"NO");
       if(!isBridge && Accessories.size()>3)
-        LOG0("*** WARNING #%d!  HomeKit requires the device be configured as a Bridge when more than 3 Accessories are defined ***\n",++nWarnings);
+        LOG0("*** WARNING #%d!  HomeKit requires the device be configured as a Bridge when more than 3 Accessories are defined ***\n",nWarnings);
       
       if(hapConfig.configNumber>0)
         LOG0("Configuration Number: %d\n",hapConfig.configNumber);
-      LOG0("\nDatabase Validation:  Warnings=%d, Errors=%d\n",nWarnings,nErrors);      
+      LOG0("\nDatabase Validation:  Warnings=%d, Errors=%d (%lu us)\n",nWarnings,nErrors,validateTime);      
       LOG0("\n*** End Info ***\n\n");
     }
     
@@ -1111,7 +1096,7 @@ void Span::processSerialCommand(const char *c){
       TempBuffer<char> tBuf(256);
       mbedtls_base64_encode((uint8_t *)tBuf.get(),256,&olen,(uint8_t *)&HAPClient::accessory,sizeof(struct Accessory));
       LOG0("Accessory data:  %s\n",tBuf.get());
-      for(const auto &cont : HAPClient::controllerList){
+      for(const auto &cont : HAPClient::controllerTable){
         mbedtls_base64_encode((uint8_t *)tBuf.get(),256,&olen,(uint8_t *)(&cont),sizeof(struct Controller));
         LOG0("Controller data: %s\n",tBuf.get());        
       }
@@ -1141,10 +1126,10 @@ void Span::processSerialCommand(const char *c){
         LOG0("\n");
       }
 
-      HAPClient::controllerList.clear();
+      HAPClient::controllerTable.clear();
       Controller tCont;
       
-      while(HAPClient::controllerList.size()<16){
+      while(HAPClient::controllerTable.size()<ControllerTable::CAPACITY){
         tBuf[0]='\0';
         LOG0(">>> Controller data: ");
         readSerial(tBuf,199);
@@ -1157,7 +1142,7 @@ void Span::processSerialCommand(const char *c){
             LOG0("\n*** Error in size of Controller data - cloning cancelled.  Restarting...\n\n");
             reboot();
           } else {
-            HAPClient::controllerList.push_back(tCont);
+            HAPClient::controllerTable.insert(tCont);
             HAPClient::charPrintRow(tCont.getID(),36);
             LOG0("\n");
           }
@@ -1264,13 +1249,19 @@ void Span::resetStatus(){
     STATUS_UPDATE(start(LED_WIFI_CONNECTING),ethernetEnabled?HS_ETH_CONNECTING:HS_WIFI_CONNECTING)
   else if(!HAPClient::nAdminControllers())
     STATUS_UPDATE(start(LED_PAIRING_NEEDED),HS_PAIRING_NEEDED)
-  else
+  else {
     STATUS_UPDATE(on(),HS_PAIRED)
+    if(!pairedTime){
+      pairedTime=millis();
+      LOG0("Device paired and ready %lu ms after %s\n",pairedTime,warmStart.warm?"warm restart":"cold start");
+    }
+  }
 }
 
 ///////////////////////////////
 
 void Span::reboot(){
+  flushNVS();
   STATUS_UPDATE(off(),HS_REBOOTING)
   delay(1000);
   ESP.restart();  
@@ -1278,6 +1269,85 @@ void Span::reboot(){
 
 ///////////////////////////////
 
+void Span::flushNVS(){
+
+  if(nvsDirty.empty())
+    return;
+
+  std::unordered_set<uint32_t, std::hash<uint32_t>, std::equal_to<uint32_t>, Mallocator<uint32_t>> saved;     // aids of Accessories whose blob has been written
+  std::unordered_set<uint32_t, std::hash<uint32_t>, std::equal_to<uint32_t>, Mallocator<uint32_t>> failed;    // aids of Accessories whose blob could not be written
+  vector<SpanCharacteristic *, Mallocator<SpanCharacteristic *>> retry;                                       // Characteristics whose values could not be written
+
+  for(auto chr : nvsDirty){
+    boolean ok;
+    if(!bulkNVS.enabled)
+      ok=chr->nvsWrite();
+    else if(saved.count(chr->aid))                        // write each Accessory's blob only once
+      ok=true;
+    else if(failed.count(chr->aid))
+      ok=false;
+    else if((ok=bulkNVS.save(charStore,chr->aid)))
+      saved.insert(chr->aid);
+    else
+      failed.insert(chr->aid);
+
+    if(ok)
+      nvsWrites++;
+    else
+      retry.push_back(chr);
+  }
+
+  boolean committed=charStore->commit();                // single commit for all pending values
+  nvsCommits++;
+
+  if(!committed)                                        // nothing was stored - every value must be retried
+    retry=nvsDirty;
+
+  LOG2("Committed %d Characteristic value%s to NVS\n",nvsDirty.size()-retry.size(),nvsDirty.size()-retry.size()!=1?"s":"");
+
+  int nErased=0;
+
+  for(auto chr=nvsDirty.begin();committed && chr!=nvsDirty.end();chr++){       // now that bulk blobs are safely committed, erase individual keys of any values migrated into them
+    if((*chr)->nvsMigrate && !failed.count((*chr)->aid)){
+      charStore->erase((*chr)->nvsKey);
+      (*chr)->nvsMigrate=false;
+      nErased++;
+    }
+  }
+
+  if(nErased){
+    charStore->commit();
+    nvsCommits++;
+    LOG2("Erased %d migrated Characteristic key%s from NVS\n",nErased,nErased>1?"s":"");
+  }
+
+  for(auto chr : nvsDirty)
+    chr->nvsPending=false;
+
+  for(auto chr : retry)                                 // failed values remain pending and are retried at the next write-behind deadline
+    chr->nvsPending=true;
+
+  if(!retry.empty()){
+    nvsFailures+=retry.size();
+    LOG0("\n*** WARNING: Unable to %s %d Characteristic value%s to NVS.  Will retry.\n\n",committed?"write":"commit",retry.size(),retry.size()>1?"s":"");
+    nvsFirstDirty=nvsLastDirty=millis();
+  }
+
+  nvsDirty.swap(retry);
+}
+
+///////////////////////////////
+
+void Span::discardNVS(){
+
+  for(auto chr=nvsDirty.begin();chr!=nvsDirty.end();chr++)
+    (*chr)->nvsPending=false;
+
+  nvsDirty.clear();
+}
+
+///////////////////////////////
+
 const char* Span::statusString(HS_STATUS s){
   switch(s){
     case HS_WIFI_NEEDED: return("WiFi Credentials Needed");
@@ -1382,36 +1452,355 @@ void Span::printfAttributes(int flags){
 
 boolean Span::deleteAccessory(uint32_t n){
   
-  auto it=homeSpan.Accessories.begin();
-  for(;it!=homeSpan.Accessories.end() && (*it)->aid!=n; it++);
+  SpanAccessory *acc=findAccessory(n);
   
-  if(it==homeSpan.Accessories.end())
+  if(!acc || acc->pendingDelete)
     return(false);
 
-  delete *it;
+  if(updateDepth>0){                  // within a batch update - defer deletion until commitUpdate()
+    acc->pendingDelete=true;
+    pendingDeletes.push_back(acc);
+    LOG1("Accessory AID=%lu will be deleted upon commit\n",n);
+    return(true);
+  }
+
+  delete acc;
   return(true);
 }
 
 ///////////////////////////////
 
-SpanCharacteristic *Span::find(uint32_t aid, uint32_t iid){
+boolean Span::commitUpdate(){
 
-  int index=-1;
-  for(int i=0;i<Accessories.size();i++){   // loop over all Accessories to find aid
-    if(Accessories[i]->aid==aid){          // if match, save index into Accessories array
-      index=i;
-      break;
-    }
+  if(updateDepth==0){
+    LOG0("\n*** WARNING: commitUpdate() called without matching beginUpdate().  Request ignored.\n\n");
+    return(false);
+  }
+
+  if(--updateDepth>0)                 // nested batch - wait for outermost commit
+    return(false);
+
+  if(!pendingDeletes.empty()){
+    auto doomed=[](SpanService *svc){return(svc->accessory->pendingDelete);};                                         // remove all references first, in single passes, while pointers are still valid...
+    Loops.erase(std::remove_if(Loops.begin(),Loops.end(),doomed),Loops.end());
+    loopPool.Loops.erase(std::remove_if(loopPool.Loops.begin(),loopPool.Loops.end(),doomed),loopPool.Loops.end());
+    Accessories.erase(std::remove_if(Accessories.begin(),Accessories.end(),[](SpanAccessory *acc){return(acc->pendingDelete);}),Accessories.end());
+
+    for(auto acc=pendingDeletes.begin(); acc!=pendingDeletes.end(); acc++)     // ...then delete the Accessories (destructors skip searching Accessories and Loops vectors)
+      delete *acc;
+
+    LOG1("Deleted %d Accessories\n",pendingDeletes.size());
+    pendingDeletes.clear();
+    pendingDeletes.shrink_to_fit();
+    aidIndexValid=false;
+  }
+
+  return(updateDatabase());           // rebuilds Loop vector and updates config number (and MDNS) once for entire batch
+}
+
+///////////////////////////////
+
+SpanAccessory *Span::findAccessory(uint32_t aid){
+
+  if(!aidIndexValid){
+    aidIndex.assign(Accessories.begin(),Accessories.end());
+    std::sort(aidIndex.begin(),aidIndex.end(),[](SpanAccessory *a, SpanAccessory *b){return(a->aid<b->aid);});
+    aidIndexValid=true;
+  }
+
+  auto it=std::lower_bound(aidIndex.begin(),aidIndex.end(),aid,[](SpanAccessory *a, uint32_t aid){return(a->aid<aid);});
+  return((it!=aidIndex.end() && (*it)->aid==aid)?*it:NULL);
+}
+
+///////////////////////////////
+
+int Span::validateDatabase(){
+
+  int nErrors=0;
+  int nWarnings=0;
+
+  unsigned long validateTime=micros();
+  validateAccessories(false,nErrors,nWarnings);
+  validateTime=micros()-validateTime;
+
+  LOG0("\nDatabase Validation:  Accessories=%d, Warnings=%d, Errors=%d (%lu us)%s\n\n",Accessories.size(),nWarnings,nErrors,validateTime,(nWarnings||nErrors)?".  Type 'i' for details":"");
+  return(nErrors);
+}
+
+///////////////////////////////
+
+boolean Span::validUUID(const char *uuid){
+
+  auto isHex=[](char c)->boolean{return((c>='0' && c<='9') || (c>='a' && c<='f') || (c>='A' && c<='F'));};
+
+  int n=0;
+  while(n<=8 && isHex(uuid[n]))
+    n++;
+
+  if(uuid[n]=='\0')                                   // short form: 1-8 hex digits, not starting with 0
+    return(n>0 && n<=8 && uuid[0]!='0');
+
+  const int groups[]={8,4,4,4,12};                     // long form: 8-4-4-4-12 hex digits separated by dashes
+  const char *p=uuid;
+  for(int i=0;i<5;i++){
+    for(int j=0;j<groups[i];j++)
+      if(!isHex(*p++))
+        return(false);
+    if(*p++!=(i<4?'-':'\0'))
+      return(false);
   }
+  return(true);
+}
+
+///////////////////////////////
+
+void Span::validateAccessories(boolean verbose, int &nErrors, int &nWarnings){
+
+  const int nHapChars=sizeof(HapCharacteristics)/sizeof(HapChar);
+  const int nWords=(nHapChars+31)/32;
+
+  char pNames[][7]={"PR","PW","EV","AA","TW","HD","WR"};
+  std::unordered_set<uint32_t, std::hash<uint32_t>, std::equal_to<uint32_t>, Mallocator<uint32_t>> aidValues;   // all aids found so far
+  vector<uint32_t, Mallocator<uint32_t>> iidBits;               // bitmap of iids found so far within current Accessory
+  std::unordered_set<uint32_t, std::hash<uint32_t>, std::equal_to<uint32_t>, Mallocator<uint32_t>> iidOverflow; // iids found so far within current Accessory that are beyond range of bitmap
+  uint32_t allowed[nWords];                                     // bitmap of hapChars indices that are required or optional for current Service
+  uint32_t found[nWords];                                       // bitmap of hapChars indices found so far in current Service
+
+  aidValues.reserve(Accessories.size());
+
+  auto iidUsed=[&](uint32_t iid)->boolean{                      // returns true if iid was already found in current Accessory (and records it as found)
+    if(iid<iidBits.size()*32){
+      boolean used=iidBits[iid/32]&(1u<<(iid%32));
+      iidBits[iid/32]|=(1u<<(iid%32));
+      return(used);
+    }
+    return(!iidOverflow.insert(iid).second);
+  };
+
+  for(auto acc=Accessories.begin(); acc!=Accessories.end(); acc++){
+    if(verbose)
+      LOG0("\u27a4 Accessory:  AID=%lu\n",(*acc)->aid);
+    boolean foundInfo=false;
+
+    if(acc==Accessories.begin() && (*acc)->aid!=1){
+      nErrors++;
+      if(verbose)
+        LOG0("   *** ERROR #%d!  AID of first Accessory must always be 1 ***\n",nErrors);
+    }
+
+    if(!aidValues.insert((*acc)->aid).second){
+      nErrors++;
+      if(verbose)
+        LOG0("   *** ERROR #%d!  AID already in use for another Accessory ***\n",nErrors);
+    }
+
+    iidBits.assign(((*acc)->iidCount+32)/32,0);
+    iidOverflow.clear();
+
+    for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
+      if(verbose)
+        LOG0("   \u279f Service %s:  IID=%lu, %sUUID=\"%s\"\n",(*svc)->hapName,(*svc)->iid,(*svc)->isCustom?"Custom-":"",(*svc)->type);
+
+      if(!strcmp((*svc)->type,"3E")){
+        foundInfo=true;
+        if((*svc)->iid!=1){
+          nErrors++;
+          if(verbose)
+            LOG0("     *** ERROR #%d!  The Accessory Information Service must be defined with IID=1 (i.e. before any other Services in an Accessory) ***\n",nErrors);
+        }
+      }
+      else if((*acc)->aid==1)            // this is an Accessory with aid=1, but it has more than just AccessoryInfo.  So...
+        isBridge=false;                  // ...this is not a bridge device
+
+      if(iidUsed((*svc)->iid)){
+        nErrors++;
+        if(verbose)
+          LOG0("   *** ERROR #%d!  IID already in use for another Service or Characteristic within this Accessory ***\n",nErrors);
+      }
+
+      memset(allowed,0,sizeof(allowed));
+      memset(found,0,sizeof(found));
+      boolean customAllowed=false;                                    // flag indicating req/opt contains a HapChar outside of hapChars (must be checked linearly)
+
+      for(auto hc : (*svc)->req){
+        int index=hapCharIndex(hc);
+        if(index<0)
+          customAllowed=true;
+        else
+          allowed[index/32]|=(1u<<(index%32));
+      }
+      for(auto hc : (*svc)->opt){
+        int index=hapCharIndex(hc);
+        if(index<0)
+          customAllowed=true;
+        else
+          allowed[index/32]|=(1u<<(index%32));
+      }
+
+      for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+
+        int index=hapCharIndex((*chr)->hapChar);
+
+        if(verbose){
+          String value=(*chr)->uvPrint((*chr)->value);
+          LOG0("      \u21e8 Characteristic %s(%.33s%s):  IID=%lu, %sUUID=\"%s\", %sPerms=",
+            (*chr)->hapName,value.c_str(),value.length()>33?"...\"":"",(*chr)->iid,(*chr)->isCustom?"Custom-":"",(*chr)->type,(*chr)->perms!=(*chr)->hapChar->perms?"Custom-":"");
+
+          int foundPerms=0;
+          for(uint8_t i=0;i<7;i++){
+            if((*chr)->perms & (1<<i))
+              LOG0("%s%s",(foundPerms++)?"+":"",pNames[i]);
+          }           
+          
+          if((*chr)->format<FORMAT::STRING && (*chr)->format!=FORMAT::BOOL){
+            if((*chr)->validValues)
+              LOG0(", Valid Values=%s",(*chr)->validValues);
+            else if((*chr)->uvGet<double>((*chr)->stepValue)>0)
+              LOG0(", %sRange=[%s,%s,%s]",(*chr)->customRange?"Custom-":"",(*chr)->uvPrint((*chr)->minValue).c_str(),(*chr)->uvPrint((*chr)->maxValue).c_str(),(*chr)->uvPrint((*chr)->stepValue).c_str());
+            else
+              LOG0(", %sRange=[%s,%s]",(*chr)->customRange?"Custom-":"",(*chr)->uvPrint((*chr)->minValue).c_str(),(*chr)->uvPrint((*chr)->maxValue).c_str());
+          }
+
+          if(((*chr)->perms)&EV){
+            LOG0(", EV=(");
+            boolean addComma=false;
+            for(auto const &hc : (*chr)->evList){
+              LOG0("%s%d",addComma?",":"",hc->clientNumber);
+              addComma=true;
+            }
+            LOG0(")");              
+          }
+          
+          if((*chr)->nvsStored)
+            LOG0(" (nvs)");
+            
+          LOG0("\n");        
+        }
+
+        boolean supported;
+        if(index>=0)
+          supported=(allowed[index/32]&(1u<<(index%32))) || (customAllowed && (std::find((*svc)->req.begin(),(*svc)->req.end(),(*chr)->hapChar)!=(*svc)->req.end() || std::find((*svc)->opt.begin(),(*svc)->opt.end(),(*chr)->hapChar)!=(*svc)->opt.end()));
+        else
+          supported=std::find((*svc)->req.begin(),(*svc)->req.end(),(*chr)->hapChar)!=(*svc)->req.end() || std::find((*svc)->opt.begin(),(*svc)->opt.end(),(*chr)->hapChar)!=(*svc)->opt.end();
+
+        boolean duplicate;
+        if(index>=0){
+          duplicate=found[index/32]&(1u<<(index%32));
+          found[index/32]|=(1u<<(index%32));
+        } else {
+          duplicate=std::find_if((*svc)->Characteristics.begin(),chr,[chr](SpanCharacteristic *c)->boolean{return(c->hapChar==(*chr)->hapChar);})!=chr;
+        }
+
+        if(!(*chr)->isCustom && !(*svc)->isCustom && !supported){
+          nWarnings++;
+          if(verbose)
+            LOG0("          *** WARNING #%d!  Service does not support this Characteristic ***\n",nWarnings);
+        }
+        else if(index<0 && !validUUID((*chr)->type)){                  // UUIDs of all Characteristics in hapChars are known to be valid
+          nErrors++;
+          if(verbose)
+            LOG0("          *** ERROR #%d!  Format of UUID is invalid ***\n",nErrors);
+        }
+        else if(duplicate){
+          nErrors++;
+          if(verbose)
+            LOG0("          *** ERROR #%d!  Characteristic already defined for this Service ***\n",nErrors);
+        }
+
+        if((*chr)->setRangeError){
+          nWarnings++;
+          if(verbose)
+            LOG0("          *** WARNING #%d!  Attempt to set Custom Range for this Characteristic ignored ***\n",nWarnings);
+        }
+
+        if((*chr)->setValidValuesError){
+          nWarnings++;
+          if(verbose)
+            LOG0("          *** WARNING #%d!  Attempt to set Custom Valid Values for this Characteristic ignored ***\n",nWarnings);
+        }
+
+        if((*chr)->format<STRING && (!(((*chr)->uvGet<double>((*chr)->value) >= (*chr)->uvGet<double>((*chr)->minValue)) && ((*chr)->uvGet<double>((*chr)->value) <= (*chr)->uvGet<double>((*chr)->maxValue))))){
+          nWarnings++;
+          if(verbose)
+            LOG0("          *** WARNING #%d!  Value of %g is out of range [%g,%g] ***\n",nWarnings,(*chr)->uvGet<double>((*chr)->value),(*chr)->uvGet<double>((*chr)->minValue),(*chr)->uvGet<double>((*chr)->maxValue));
+        }
+
+        if(iidUsed((*chr)->iid)){
+          nErrors++;
+          if(verbose)
+            LOG0("   *** ERROR #%d!  IID already in use for another Service or Characteristic within this Accessory ***\n",nErrors);
+        }
+      
+      } // Characteristics
+
+      for(auto req=(*svc)->req.begin(); req!=(*svc)->req.end(); req++){
+        int index=hapCharIndex(*req);
+        boolean present=(index>=0)?(found[index/32]&(1u<<(index%32))):(std::find_if((*svc)->Characteristics.begin(),(*svc)->Characteristics.end(),[req](SpanCharacteristic *c)->boolean{return(c->hapChar==*req);})!=(*svc)->Characteristics.end());
+        if(!present){
+          nWarnings++;
+          if(verbose)
+            LOG0("          *** WARNING #%d!  Required '%s' Characteristic for this Service not found ***\n",nWarnings,(*req)->hapName);
+        }
+      }
+
+      for(auto button=PushButtons.begin(); button!=PushButtons.end(); button++){
+        if((*button)->service==(*svc)){
+          
+          if(verbose){
+            if((*button)->buttonType==SpanButton::HS_BUTTON)
+              LOG0("      \u25bc SpanButton: Pin=%d, Single=%ums, Double=%ums, Long=%ums, Type=",(*button)->pin,(*button)->singleTime,(*button)->doubleTime,(*button)->longTime);
+            else
+              LOG0("      \u25bc SpanToggle: Pin=%d, Toggle=%ums, Type=",(*button)->pin,(*button)->longTime);
+              
+            if((*button)->triggerType==PushButton::TRIGGER_ON_LOW)
+              LOG0("TRIGGER_ON_LOW\n");
+            else if((*button)->triggerType==PushButton::TRIGGER_ON_HIGH)
+              LOG0("TRIGGER_ON_HIGH\n");
+
+#if SOC_TOUCH_SENSOR_NUM > 0
+            else if((*button)->triggerType==PushButton::TRIGGER_ON_TOUCH)
+              LOG0("TRIGGER_ON_TOUCH\n");
+#endif
+            else
+              LOG0("USER-DEFINED\n");
+          }
+          
+          if((void(*)(int,int))((*svc)->*(&SpanService::button))==(void(*)(int,int))(&SpanService::button)){
+            nWarnings++;
+            if(verbose)
+              LOG0("          *** WARNING #%d!  No button() method defined in this Service ***\n",nWarnings);
+          }
+        }
+      }
+      
+    } // Services
+    
+    if(!foundInfo){
+      nErrors++;
+      if(verbose)
+        LOG0("   *** ERROR #%d!  Required 'AccessoryInformation' Service not found ***\n",nErrors);
+    }
+      
+  } // Accessories   
+
+  if(!isBridge && Accessories.size()>3)
+    nWarnings++;
+}
+
+///////////////////////////////
+
+SpanCharacteristic *Span::find(uint32_t aid, uint32_t iid){
 
-  if(index<0)                  // fail if no match on aid
+  SpanAccessory *acc=findAccessory(aid);
+
+  if(!acc)                     // fail if no match on aid
     return(NULL);
     
-  for(int i=0;i<Accessories[index]->Services.size();i++){                           // loop over all Services in this Accessory
-    for(int j=0;j<Accessories[index]->Services[i]->Characteristics.size();j++){     // loop over all Characteristics in this Service
+  for(int i=0;i<acc->Services.size();i++){                           // loop over all Services in this Accessory
+    for(int j=0;j<acc->Services[i]->Characteristics.size();j++){     // loop over all Characteristics in this Service
       
-      if(iid == Accessories[index]->Services[i]->Characteristics[j]->iid)           // if matching iid
-        return(Accessories[index]->Services[i]->Characteristics[j]);                // return pointer to Characteristic
+      if(iid == acc->Services[i]->Characteristics[j]->iid)           // if matching iid
+        return(acc->Services[i]->Characteristics[j]);                // return pointer to Characteristic
     }
   }
 
@@ -1538,13 +1927,12 @@ int Span::updateCharacteristics(char *buf, SpanBuf *pObj){
           LOG1("Updating aid=%lu iid=%lu",pObj[j].characteristic->aid,pObj[j].characteristic->iid);
           if(status==StatusCode::OK){                                                                       // if status is okay
             pObj[j].characteristic->uvSet(pObj[j].characteristic->value,pObj[j].characteristic->newValue);  // update characteristic value with new value
-            if(pObj[j].characteristic->nvsKey){                                                             // if storage key found
-              if(pObj[j].characteristic->format<FORMAT::STRING)
-                nvs_set_u64(charNVS,pObj[j].characteristic->nvsKey,pObj[j].characteristic->value.UINT64);   // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
-              else
-                nvs_set_str(charNVS,pObj[j].characteristic->nvsKey,pObj[j].characteristic->value.STRING);   // store data
-              nvs_commit(charNVS);
-            }
+            if(pObj[j].characteristic->nvsStored)                                                           // if value is saved in NVS
+              pObj[j].characteristic->nvsSave();                                                            // store data
+#if defined(__cpp_impl_coroutine)
+            if(pObj[j].characteristic->awaited)                                                             // if any coroutines are waiting for this characteristic to change
+              SpanScheduler::notify(pObj[j].characteristic);                                                // resume them on next pass
+#endif
             LOG1(" (okay)\n");
           } else {                                                                                          // if status not okay
             pObj[j].characteristic->uvSet(pObj[j].characteristic->newValue,pObj[j].characteristic->value);  // replace characteristic new value with original value
@@ -1604,8 +1992,10 @@ void Span::printfAttributes(SpanBuf *pObj, int nObj){
 
   for(int i=0;i<nObj;i++){
     hapOut << "{\"aid\":" << pObj[i].aid << ",\"iid\":" << pObj[i].iid << ",\"status\":" << (int)pObj[i].status;
-    if(pObj[i].status==StatusCode::OK && pObj[i].wr && pObj[i].characteristic)
-      hapOut << ",\"value\":" << pObj[i].characteristic->uvPrint(pObj[i].characteristic->value).c_str();
+    if(pObj[i].status==StatusCode::OK && pObj[i].wr && pObj[i].characteristic){
+      hapOut << ",\"value\":";
+      pObj[i].characteristic->uvStream(pObj[i].characteristic->value);
+    }
     hapOut << "}";
     if(i+1<nObj)
       hapOut << ",";
@@ -1686,13 +2076,36 @@ Span& Span::resetIID(uint32_t newIID){
 
 boolean Span::updateDatabase(boolean updateMDNS){
 
-  printfAttributes(GET_META|GET_PERMS|GET_TYPE|GET_DESC);   // stream attributes database, which automtically produces a SHA-384 hash
-  hapOut.flush();  
+  if(updateDepth>0)                                         // within a batch update - database will be updated once upon commitUpdate()
+    return(false);
+
+  uint8_t hashCode[48];
+  int nUpdated=0;
+
+  mbedtls_sha512_context ctx;
+  mbedtls_sha512_init(&ctx);
+  mbedtls_sha512_starts(&ctx,1);                            // database hash is a SHA-384 hash of the digests of each Accessory
+
+  for(auto acc=Accessories.begin(); acc!=Accessories.end(); acc++){
+    if(!(*acc)->digestValid){                                                       // only re-stream Accessories that have changed since last update
+      (*acc)->printfAttributes(GET_META|GET_PERMS|GET_TYPE|GET_DESC);               // stream attributes of Accessory, which automtically produces a SHA-384 hash
+      hapOut.flush();
+      memcpy((*acc)->digest,hapOut.getHash(),48);
+      (*acc)->digestValid=true;
+      nUpdated++;
+    }
+    mbedtls_sha512_update(&ctx,(*acc)->digest,48);
+  }
+
+  mbedtls_sha512_finish(&ctx,hashCode);
+  mbedtls_sha512_free(&ctx);
+
+  LOG2("Database hash computed from %d Accessories (%d updated)\n",Accessories.size(),nUpdated);
 
   boolean changed=false;
 
-  if(memcmp(hapOut.getHash(),hapConfig.hashCode,48)){       // if hash code of current HAP database does not match stored hash code
-    memcpy(hapConfig.hashCode,hapOut.getHash(),48);         // update stored hash code
+  if(memcmp(hashCode,hapConfig.hashCode,48)){               // if hash code of current HAP database does not match stored hash code
+    memcpy(hapConfig.hashCode,hashCode,48);                 // update stored hash code
     hapConfig.configNumber++;                               // increment configuration number
     if(hapConfig.configNumber==65536)                       // reached max value
       hapConfig.configNumber=1;                             // reset to 1
@@ -1713,28 +2126,80 @@ boolean Span::updateDatabase(boolean updateMDNS){
   if(nvs_stats.free_entries<=130)
     LOG0("\n*** WARNING: NVS is running low on space.  Try erasing with 'E'.  If that fails, increase size of NVS partition or reduce NVS usage.\n\n");
 
+  updateLoops();
+  return(changed);
+}
+
+///////////////////////////////
+
+void Span::updateLoops(){
+
   Loops.clear();
+  loopPool.Loops.clear();
 
   for(auto acc=Accessories.begin(); acc!=Accessories.end(); acc++){                        // identify all services with over-ridden loop() methods
     for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
-      if((void(*)())((*svc)->*(&SpanService::loop)) != (void(*)())(&SpanService::loop))    // save pointers to services in Loops vector
-        homeSpan.Loops.push_back((*svc));
+      if((void(*)())((*svc)->*(&SpanService::loop)) != (void(*)())(&SpanService::loop)){   // save pointers to services in Loops vector...
+        if((*svc)->independent && loopPool.nWorkers)                                         // ...or in loopPool vector if independent and parallel loops are enabled
+          loopPool.Loops.push_back((*svc));
+        else
+          Loops.push_back((*svc));
+      }
     }
   }    
+}
 
-  return(changed);
+///////////////////////////////
+
+void Span::applyAsync(){
+
+  SpanAsyncUpdate a;
+
+  while(asyncQueue.pop(a)){
+    SpanCharacteristic *chr=a.characteristic;
+
+    if(chr){
+      if((a.type==SpanAsyncUpdate::STRING)!=(chr->format==FORMAT::STRING) || chr->format>FORMAT::STRING){     // numeric value queued from an ISR for a non-numeric Characteristic
+        LOG0("\n*** WARNING:  Can't apply setValAsync() to non-numeric Characteristic::%s - update ignored!\n\n",chr->hapName);
+        free(a.str);
+        continue;
+      }
+      chr->setValCheck();
+      if(a.str)
+        chr->uvSet(chr->value,(const char *)a.str);
+      else {
+        SpanCharacteristic::UVal u;
+        u.UINT64=0;
+        switch(a.type){                                    // convert raw value to format of Characteristic
+          case SpanAsyncUpdate::INT: chr->uvSet(u,(int64_t)a.value); break;
+          case SpanAsyncUpdate::FLOAT: {float f; memcpy(&f,&a.value,sizeof(float)); chr->uvSet(u,f);} break;
+          case SpanAsyncUpdate::DOUBLE: {double d; memcpy(&d,&a.value,sizeof(double)); chr->uvSet(u,d);} break;
+          default: chr->uvSet(u,a.value); break;
+        }
+        if(!((chr->uvGet<double>(u) >= chr->uvGet<double>(chr->minValue)) && (chr->uvGet<double>(u) <= chr->uvGet<double>(chr->maxValue)))){
+          LOG0("\n*** WARNING:  Attempt to update Characteristic::%s with setValAsync(%g) is out of range [%g,%g].  This may cause device to become non-responsive!\n\n",
+          chr->hapName,chr->uvGet<double>(u),chr->uvGet<double>(chr->minValue),chr->uvGet<double>(chr->maxValue));
+        }
+        chr->uvSet(chr->value,u);
+      }
+      chr->setValFinish(true);
+      asyncApplied++;
+    }
+
+    free(a.str);
+  }
 }
 
 ///////////////////////////////
 
-list<Controller, Mallocator<Controller>>::const_iterator Span::controllerListBegin(){
-  return(HAPClient::controllerList.cbegin());
+ControllerTable::const_iterator Span::controllerListBegin(){
+  return(HAPClient::controllerTable.cbegin());
 }
 
 ///////////////////////////////
 
-list<Controller, Mallocator<Controller>>::const_iterator Span::controllerListEnd(){
-  return(HAPClient::controllerList.cend());
+ControllerTable::const_iterator Span::controllerListEnd(){
+  return(HAPClient::controllerTable.cend());
 }
 
 ///////////////////////////////
@@ -1757,6 +2222,7 @@ SpanAccessory::SpanAccessory(uint32_t aid){
   }
   
   homeSpan.Accessories.push_back(this);
+  homeSpan.aidIndexValid=false;
 
   if(aid>0){                 // override with user-specified aid
     this->aid=aid;
@@ -1771,10 +2237,14 @@ SpanAccessory::~SpanAccessory(){
   while(Services.rbegin()!=Services.rend())           // delete all Services in this Accessory
     delete *Services.rbegin();                       
   
-  auto acc=homeSpan.Accessories.begin();              // find Accessory in homeSpan vector and erase entry
-  while((*acc)!=this)
-    acc++;
-  homeSpan.Accessories.erase(acc);
+  homeSpan.aidIndexValid=false;
+
+  if(!pendingDelete){                                 // find Accessory in homeSpan vector and erase entry (unless deleted as part of a batch update, in which case commitUpdate() has already erased it)
+    auto acc=homeSpan.Accessories.begin();
+    while((*acc)!=this)
+      acc++;
+    homeSpan.Accessories.erase(acc);
+  }
   LOG1("Deleted Accessory AID=%lu\n",aid);
 }
 
@@ -1812,6 +2282,7 @@ SpanService::SpanService(const char *type, const char *hapName, boolean isCustom
   homeSpan.Accessories.back()->Services.push_back(this);  
   accessory=homeSpan.Accessories.back();
   iid=++(homeSpan.Accessories.back()->iidCount);
+  invalidateDigest();
 }
 
 ///////////////////////////////
@@ -1825,11 +2296,19 @@ SpanService::~SpanService(){
   while((*svc)!=this)
     svc++;
   accessory->Services.erase(svc);
+  invalidateDigest();
 
-  for(svc=homeSpan.Loops.begin(); svc!=homeSpan.Loops.end() && (*svc)!=this; svc++);    // search for entry in Loop vector...
-  if(svc!=homeSpan.Loops.end()){                                                        // ...if it exists, erase it
-    homeSpan.Loops.erase(svc);
-    LOG1("Deleted Loop Entry\n");
+  if(!accessory->pendingDelete){                                                          // entries of Accessories deleted in a batch update were already removed by commitUpdate()
+    for(svc=homeSpan.Loops.begin(); svc!=homeSpan.Loops.end() && (*svc)!=this; svc++);    // search for entry in Loop vector...
+    if(svc!=homeSpan.Loops.end()){                                                        // ...if it exists, erase it
+      homeSpan.Loops.erase(svc);
+      LOG1("Deleted Loop Entry\n");
+    }
+    for(svc=homeSpan.loopPool.Loops.begin(); svc!=homeSpan.loopPool.Loops.end() && (*svc)!=this; svc++);    // repeat for independent Services
+    if(svc!=homeSpan.loopPool.Loops.end()){
+      homeSpan.loopPool.Loops.erase(svc);
+      LOG1("Deleted Loop Entry\n");
+    }
   }
 
   auto pb=homeSpan.PushButtons.begin();         // loop through PushButton vector and delete ALL PushButtons associated with this Service
@@ -1850,6 +2329,7 @@ SpanService::~SpanService(){
 
 SpanService *SpanService::setPrimary(){
   primary=true;
+  invalidateDigest();
   return(this);
 }
 
@@ -1857,6 +2337,7 @@ SpanService *SpanService::setPrimary(){
 
 SpanService *SpanService::setHidden(){
   hidden=true;
+  invalidateDigest();
   return(this);
 }
 
@@ -1864,6 +2345,7 @@ SpanService *SpanService::setHidden(){
 
 SpanService *SpanService::addLink(SpanService *svc){
   linkedServices.push_back(svc);
+  invalidateDigest();
   return(this);
 }
 
@@ -1924,6 +2406,7 @@ SpanCharacteristic::SpanCharacteristic(HapChar *hapChar, boolean isCustom){
   iid=++(homeSpan.Accessories.back()->iidCount);
   service=homeSpan.Accessories.back()->Services.back();
   aid=homeSpan.Accessories.back()->aid;
+  invalidateDigest();
 }
 
 ///////////////////////////////
@@ -1934,15 +2417,32 @@ SpanCharacteristic::~SpanCharacteristic(){
   while((*chr)!=this)
     chr++;
   service->Characteristics.erase(chr);
+  invalidateDigest();
 
-  free(desc);
-  free(unit);
-  free(validValues);
+  if(nvsPending)                                          // remove from list of values waiting to be written to NVS
+    homeSpan.nvsDirty.erase(std::find(homeSpan.nvsDirty.begin(),homeSpan.nvsDirty.end(),this));
+
+  homeSpan.asyncQueue.forEach([this](SpanAsyncUpdate &a){if(a.characteristic==this) a.characteristic=NULL;},     // cancel any queued updates not yet applied,
+                              [](){vTaskDelay(1);});                                                       // first waiting for any update another task or ISR is in the middle of queuing
+  SpanTransaction::forget(this);                          // drop any values staged for this Characteristic in open transactions
+
+#if defined(__cpp_impl_coroutine)
+  if(awaited)
+    SpanScheduler::forget(this);                          // drop any coroutines waiting for this Characteristic to change
+#endif
+
+  stringPool.release(desc);
+  stringPool.release(unit);
+  stringPool.release(validValues);
   free(nvsKey);
 
-  if(format>=FORMAT::STRING){
-    free(value.STRING);
-    free(newValue.STRING);
+  if(format==FORMAT::STRING){
+    stringPool.release(value.STRING);
+    stringPool.release(newValue.STRING);
+  } else if(format>FORMAT::STRING){
+    free(value.BLOB);
+    free(newValue.BLOB);
+    free(b64Str);
   }
   
   LOG1("Deleted Characteristic AID=%lu IID=%lu\n",aid,iid);  
@@ -1970,18 +2470,77 @@ String SpanCharacteristic::uvPrint(UVal &u){
       sprintf(c,"%g",u.FLOAT);
       return(String(c));        
     case FORMAT::STRING:
-    case FORMAT::DATA:
-    case FORMAT::TLV_ENC:
       return(String("\"") + String(u.STRING) + String("\""));        
+    case FORMAT::DATA:
+    case FORMAT::TLV_ENC:{
+      if(u.BLOB->len==0)
+        return(String("\"\""));
+      size_t olen;
+      mbedtls_base64_encode(NULL,0,&olen,NULL,u.BLOB->len);                                     // get length of string buffer needed (mbedtls includes the trailing null in this size)
+      TempBuffer<char> tBuf(olen);
+      mbedtls_base64_encode((uint8_t *)tBuf.get(),olen,&olen,u.BLOB->data,u.BLOB->len);
+      return(String("\"") + String(tBuf.get()) + String("\""));
+    }
   } // switch
   return(String());       // included to prevent compiler warnings
 }
 
 ///////////////////////////////
 
+void SpanCharacteristic::uvStream(UVal &u){
+  const size_t chunkSize=48;           // number of raw bytes to base-64 encode in each pass when streaming DATA/TLV8 values; must be multiple of 3
+  char c[chunkSize/3*4+1];             // large enough for numeric formatting and for one encoded chunk plus trailing null
+  switch(format){
+    case FORMAT::BOOL:
+      hapOut << (int)u.BOOL;
+      break;
+    case FORMAT::INT:
+      hapOut << u.INT;
+      break;
+    case FORMAT::UINT8:
+      hapOut << (unsigned int)u.UINT8;
+      break;
+    case FORMAT::UINT16:
+      hapOut << (unsigned int)u.UINT16;
+      break;
+    case FORMAT::UINT32:
+      hapOut << u.UINT32;
+      break;
+    case FORMAT::UINT64:
+      sprintf(c,"%llu",u.UINT64);
+      hapOut << c;
+      break;
+    case FORMAT::FLOAT:
+      sprintf(c,"%g",u.FLOAT);
+      hapOut << c;
+      break;
+    case FORMAT::STRING:
+      hapOut << "\"" << u.STRING << "\"";
+      break;
+    case FORMAT::DATA:
+    case FORMAT::TLV_ENC:
+      hapOut << "\"";
+      for(size_t i=0;i<u.BLOB->len;i+=chunkSize){                                                       // encode raw bytes directly into hapOut, one chunk at a time
+        size_t olen;
+        mbedtls_base64_encode((uint8_t *)c,sizeof(c),&olen,u.BLOB->data+i,min(chunkSize,u.BLOB->len-i));
+        hapOut << c;
+      }
+      hapOut << "\"";
+      break;
+  } // switch
+}
+
+///////////////////////////////
+
 void SpanCharacteristic::uvSet(UVal &dest, UVal &src){
-  if(format>=FORMAT::STRING)
-    uvSet(dest,(const char *)src.STRING);
+  if(format==FORMAT::STRING){
+    if(dest.STRING!=src.STRING){              // dest simply shares src's interned string
+      stringPool.addRef(src.STRING);
+      stringPool.release(dest.STRING);
+      dest.STRING=src.STRING;
+    }
+  } else if(format>FORMAT::STRING)
+    memcpy(uvAlloc(dest,src.BLOB->len),src.BLOB->data,src.BLOB->len);
   else
     dest=src;
 }
@@ -1989,58 +2548,80 @@ void SpanCharacteristic::uvSet(UVal &dest, UVal &src){
 ///////////////////////////////
 
 void SpanCharacteristic::uvSet(UVal &u, STRING_t val){
-  u.STRING = (char *)HS_REALLOC(u.STRING, strlen(val) + 1);
-  strcpy(u.STRING, val);
+  const char *s=stringPool.intern(val);       // intern first in case val already points into u.STRING
+  stringPool.release(u.STRING);
+  u.STRING=(char *)s;
 }
 
 ///////////////////////////////
 
 void SpanCharacteristic::uvSet(UVal &u, DATA_t data){
-  
-  if(data.second>0){
-    size_t olen;
-    mbedtls_base64_encode(NULL,0,&olen,NULL,data.second);                              // get length of string buffer needed (mbedtls includes the trailing null in this size)
-    value.STRING = (char *)HS_REALLOC(value.STRING,olen);                              // allocate sufficient size for storing value
-    mbedtls_base64_encode((uint8_t*)value.STRING,olen,&olen,data.first,data.second );  // encode data into string buf
-  } else {
-    value.STRING = (char *)HS_REALLOC(value.STRING,1);                                 // allocate sufficient size for just trailing null character
-    *value.STRING ='\0';
-  }  
+  memcpy(uvAlloc(u,data.second),data.first,data.second);
 }
 
 ///////////////////////////////
 
 void SpanCharacteristic::uvSet(UVal &u, TLV_ENC_t tlv){
 
-  const size_t bufSize=36;                                  // maximum size of buffer to store packed TLV bytes before encoding directly into value; must be multiple of 3
-  size_t nBytes=tlv.pack_size();                            // total size of packed TLV in bytes
-
-  if(nBytes>0){
-    size_t nChars;
-    mbedtls_base64_encode(NULL,0,&nChars,NULL,nBytes);      // get length of string buffer needed (mbedtls includes the trailing null in this size)
-    u.STRING = (char *)HS_REALLOC(u.STRING,nChars);         // allocate sufficient size for storing value
-    TempBuffer<uint8_t> tBuf(bufSize);                      // create fixed-size buffer to store packed TLV bytes
-    tlv.pack_init();                                        // initialize TLV packing
-    uint8_t *p=(uint8_t *)u.STRING;                         // set pointer to beginning of value
-    while((nBytes=tlv.pack(tBuf,bufSize))>0){               // pack the next set of TLV bytes, up to a maximum of bufSize, into tBuf
-      size_t olen;                                          // number of characters written (excludes null character)
-      mbedtls_base64_encode(p,nChars,&olen,tBuf,nBytes);    // encode data directly into value
-      p+=olen;                                              // advance pointer to null character
-      nChars-=olen;                                         // subtract number of characters remaining
-    }
-  } else {
-    u.STRING = (char *)HS_REALLOC(u.STRING,1);              // allocate sufficient size for just trailing null character
-    *u.STRING ='\0';
-  }  
+  size_t nBytes=tlv.pack_size();             // total size of packed TLV in bytes
+  uint8_t *p=uvAlloc(u,nBytes);
+  tlv.pack_init();
+  tlv.pack(p,nBytes);                        // pack TLV directly into value
+}
+
+///////////////////////////////
+
+uint8_t *SpanCharacteristic::uvAlloc(UVal &u, size_t len){
+  if(!u.BLOB || u.BLOB->len<len)                                     // only reallocate if existing buffer is too small
+    u.BLOB = (BLOB_t *)HS_REALLOC(u.BLOB, sizeof(BLOB_t) + len);
+  u.BLOB->len=len;
+  return(u.BLOB->data);
+}
+
+///////////////////////////////
+
+boolean SpanCharacteristic::uvDecode(UVal &u, const char *b64){
+
+  size_t nChars=strlen(b64);
+  size_t olen;
+
+  if(mbedtls_base64_decode(NULL,0,&olen,(const uint8_t *)b64,nChars)==MBEDTLS_ERR_BASE64_INVALID_CHARACTER)    // validate string and get number of bytes needed
+    return(false);
+
+  if(olen>MAX_DATA_LEN)
+    return(false);
+
+  uint8_t *p=uvAlloc(u,olen);
+  mbedtls_base64_decode(p,olen,&olen,(const uint8_t *)b64,nChars);         // decode directly into value
+  u.BLOB->len=olen;                                                         // olen above is an upper bound - reset to actual number of bytes decoded
+  return(true);
 }
 
 ///////////////////////////////
 
-char *SpanCharacteristic::getStringGeneric(UVal &val){
-  if(format>=FORMAT::STRING)
+const char *SpanCharacteristic::getStringGeneric(UVal &val){
+  if(format==FORMAT::STRING)
       return val.STRING;
 
-  return NULL;
+  if(format<FORMAT::STRING)
+    return NULL;
+
+  size_t olen;                                                                            // DATA and TLV8 values are stored as raw bytes - return base-64 encoding as prior versions did
+  mbedtls_base64_encode(NULL,0,&olen,NULL,val.BLOB->len);                                 // get length of string buffer needed (mbedtls includes the trailing null in this length)
+  b64Str=(char *)HS_REALLOC(b64Str,olen+1);                                              // extra byte ensures a non-empty buffer even when value has zero length
+  mbedtls_base64_encode((uint8_t *)b64Str,olen+1,&olen,val.BLOB->data,val.BLOB->len);
+  b64Str[olen]='\0';
+  return(b64Str);
+}
+
+///////////////////////////////
+
+boolean SpanCharacteristic::dataLenCheck(size_t len, const char *method){
+  if(len<=MAX_DATA_LEN)
+    return(true);
+
+  LOG0("\n*** WARNING:  Can't update Characteristic::%s with %s().  Value of %d bytes exceeds maximum of %d bytes - update ignored!\n\n",hapName,method,len,MAX_DATA_LEN);
+  return(false);
 }
 
 ///////////////////////////////
@@ -2054,20 +2635,43 @@ void SpanCharacteristic::setString(const char *val, boolean notify){
 
 ///////////////////////////////
 
+boolean SpanCharacteristic::setStringAsync(const char *val){
+
+  if(format!=FORMAT::STRING || !val)
+    return(false);
+
+  SpanAsyncUpdate a={this,0,NULL,SpanAsyncUpdate::STRING};
+
+  if(!(a.str=(char *)HS_MALLOC(strlen(val)+1))){
+    homeSpan.asyncQueue.nDropped++;
+    return(false);
+  }
+
+  strcpy(a.str,val);
+
+  if(!homeSpan.asyncQueue.push(a)){
+    free(a.str);
+    return(false);
+  }
+
+  return(true);
+}
+
+///////////////////////////////
+
 size_t SpanCharacteristic::getDataGeneric(uint8_t *data, size_t len, UVal &val){    
   if(format<FORMAT::DATA)
     return(0);
 
-  size_t olen;
-  int ret=mbedtls_base64_decode(data,len,&olen,(uint8_t *)val.STRING,strlen(val.STRING));
+  size_t olen=val.BLOB->len;
   
   if(data==NULL)
     return(olen);
     
-  if(ret==MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL)
-    LOG0("\n*** WARNING:  Can't decode Characteristic::%s with getData().  Destination buffer is too small (%d out of %d bytes needed)!\n\n",hapName,len,olen);
-  else if(ret==MBEDTLS_ERR_BASE64_INVALID_CHARACTER)
-    LOG0("\n*** WARNING:  Can't decode Characteristic::%s with getData().  Data is not in base-64 format!\n\n",hapName);
+  if(len<olen)
+    LOG0("\n*** WARNING:  Can't extract Characteristic::%s with getData().  Destination buffer is too small (%d out of %d bytes needed)!\n\n",hapName,len,olen);
+  else
+    memcpy(data,val.BLOB->data,olen);
     
   return(olen);
 }
@@ -2076,6 +2680,9 @@ size_t SpanCharacteristic::getDataGeneric(uint8_t *data, size_t len, UVal &val){
 
 void SpanCharacteristic::setData(const uint8_t *data, size_t len, boolean notify){
 
+  if(!dataLenCheck(len,"setData"))
+    return;
+
   setValCheck();
   uvSet(value,{data,len});
   setValFinish(notify);
@@ -2088,31 +2695,10 @@ size_t SpanCharacteristic::getTLVGeneric(TLV8 &tlv, UVal &val){
   if(format<FORMAT::TLV_ENC)
     return(0);
 
-  const size_t bufSize=36;                    // maximum size of buffer to store decoded bytes before unpacking into TLV; must be multiple of 3
-  TempBuffer<uint8_t> tBuf(bufSize);          // create fixed-size buffer to store decoded bytes
   tlv.wipe();                                 // clear TLV completely
 
-  size_t nChars=strlen(val.STRING);         // total characters to decode
-  uint8_t *p=(uint8_t *)val.STRING;         // set pointer to beginning of value
-  const size_t decodeSize=bufSize/3*4;      // number of characters to decode in each pass
-  int status=0;
-  
-  while(nChars>0){
-    size_t olen;
-    size_t n=nChars<decodeSize?nChars:decodeSize;
-    
-    int ret=mbedtls_base64_decode(tBuf,tBuf.len(),&olen,p,n);
-    if(ret==MBEDTLS_ERR_BASE64_INVALID_CHARACTER){
-      LOG0("\n*** WARNING:  Can't decode Characteristic::%s with getTLV().  Data is not in base-64 format!\n\n",hapName);
-      tlv.wipe();
-      return(0);
-    }
-    status=tlv.unpack(tBuf,olen);
-    p+=n;
-    nChars-=n;
-  }
-  if(status>0){
-    LOG0("\n*** WARNING:  Can't unpack Characteristic::%s with getTLV().  TLV record is incomplete or corrupted!\n\n",hapName);
+  if(tlv.unpack(val.BLOB->data,val.BLOB->len)!=0){
+    LOG0("\n*** WARNING:  Can't unpack Characteristic::%s with getTLV().  TLV record is incomplete, corrupted, or too large for available memory!\n\n",hapName);
     tlv.wipe();
     return(0);      
   }
@@ -2123,6 +2709,9 @@ return(tlv.pack_size());
 
 void SpanCharacteristic::setTLV(const TLV8 &tlv, boolean notify){
 
+  if(!dataLenCheck(tlv.pack_size(),"setTLV"))
+    return;
+
   setValCheck();
   uvSet(value,tlv);
   setValFinish(notify);
@@ -2142,21 +2731,162 @@ void SpanCharacteristic::setValFinish(boolean notify){
   uvSet(newValue,value);     
   updateTime=homeSpan.snapTime;
 
-  if(notify){
-    if((perms&EV) && (updateFlag!=2)){        // only broadcast notification if EV permission is set AND update is NOT being done in context of write-response    
-      SpanBuf sb;                             // create SpanBuf object
-      sb.characteristic=this;                 // set characteristic          
-      sb.status=StatusCode::OK;               // set status
-      char dummy[]="";
-      sb.val=dummy;                           // set dummy "val" so that printfNotify knows to consider this "update"
-      homeSpan.Notifications.push_back(sb);   // store SpanBuf in Notifications vector
+  if(notify && !homeSpan.loopPool.defer(this))     // when called from a loop() running on a worker task, notification is queued later by pollTask()
+    queueNotify();
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::queueNotify(){
+
+  if((perms&EV) && (updateFlag!=2)){        // only broadcast notification if EV permission is set AND update is NOT being done in context of write-response    
+    SpanBuf sb;                             // create SpanBuf object
+    sb.characteristic=this;                 // set characteristic          
+    sb.status=StatusCode::OK;               // set status
+    char dummy[]="";
+    sb.val=dummy;                           // set dummy "val" so that printfNotify knows to consider this "update"
+    homeSpan.Notifications.push_back(sb);   // store SpanBuf in Notifications vector
+  }
+
+  if(nvsStored)
+    nvsSave();
+
+#if defined(__cpp_impl_coroutine)
+  if(awaited)
+    SpanScheduler::notify(this);
+#endif
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::nvsLoad(){
+
+  unsigned long startTime=micros();
+  nvsStored=true;
+
+  SpanWarmStart::record_t *w;
+  SpanBulkNVS::record_t *r;
+  uint8_t *data=NULL;
+  size_t len;
+
+  auto fits=[this](const uint8_t *data, size_t len)->boolean{            // checks that a record's length matches its format, so a truncated or foreign record is never over-read
+    if(format<FORMAT::STRING)
+      return(len==sizeof(uint64_t));
+    if(format==FORMAT::STRING)
+      return(len>0 && data[len-1]=='\0');
+    return(true);
+  };
+
+  if(homeSpan.warmStart.valid && (w=homeSpan.warmStart.find(aid,iid)) && w->format==format && fits((uint8_t *)(w+1),w->len)){                // found in warm-restart snapshot
+    data=(uint8_t *)(w+1);
+    len=w->len;
+  } else if(homeSpan.bulkNVS.enabled && (r=homeSpan.bulkNVS.find(homeSpan.charStore,aid,iid)) && r->format==format && fits((uint8_t *)(r+1),r->len)){     // found in bulk blob
+    data=(uint8_t *)(r+1);
+    len=r->len;
+  }
+
+  if(data){
+    if(format<FORMAT::STRING)
+      memcpy(&value.UINT64,data,sizeof(value.UINT64));
+    else if(format==FORMAT::STRING)
+      uvSet(value,(const char *)data);
+    else
+      memcpy(uvAlloc(value,len),data,len);
+  }
+  else if(nvsRead()){                    // found in individual key
+    if(homeSpan.bulkNVS.enabled){
+      nvsMigrate=true;                   // individual key is erased only after bulk blob has been committed
+      nvsSave();                         // migrate value into bulk blob
     }
+  }
+  else
+    nvsSave();                           // store initial value
+
+  homeSpan.nvsLoads++;
+  homeSpan.nvsLoadTime+=micros()-startTime;
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::nvsSetKey(){
 
-    if(nvsKey){
-      nvs_set_str(homeSpan.charNVS,nvsKey,value.STRING);    // store data
-      nvs_commit(homeSpan.charNVS);
+  if(nvsKey)
+    return;
+
+  nvsKey=(char *)HS_MALLOC(16);
+  uint16_t t;
+  sscanf(type,"%hx",&t);
+  sprintf(nvsKey,"%04X%08lX%03lX",t,aid,iid&0xFFF);
+}
+
+///////////////////////////////
+
+boolean SpanCharacteristic::nvsRead(){
+
+  nvsSetKey();
+  size_t len;    
+
+  if(format<FORMAT::STRING){
+    if(homeSpan.charStore->getU64(nvsKey,&(value.UINT64)))
+      return(true);
+  } else if(format==FORMAT::STRING){
+    if(homeSpan.charStore->getStr(nvsKey,NULL,&len)){
+      TempBuffer<char> tBuf(len);
+      homeSpan.charStore->getStr(nvsKey,tBuf,&len);
+      uvSet(value,(const char *)tBuf);
+      return(true);
+    }
+  } else {
+    if(homeSpan.charStore->getBlob(nvsKey,NULL,&len)){
+      homeSpan.charStore->getBlob(nvsKey,uvAlloc(value,len),&len);
+      return(true);
     }
-  }      
+    if(homeSpan.charStore->getStr(nvsKey,NULL,&len)){                   // value was stored as a base-64 string by an earlier version of HomeSpan
+      TempBuffer<char> tBuf(len);
+      homeSpan.charStore->getStr(nvsKey,tBuf,&len);
+      if(!uvDecode(value,tBuf))
+        LOG0("\n*** WARNING:  Can't convert stored value of Characteristic::%s.  Data is not in base-64 format!  Using default value instead.\n\n",hapName);
+      if(!homeSpan.bulkNVS.enabled){                                   // replace string with blob right away so converted value is not lost if device restarts before next flush
+        homeSpan.charStore->erase(nvsKey);
+        nvsWrite();
+        homeSpan.charStore->commit();
+      }                                                                // otherwise string is erased once value is committed to bulk blob
+      return(true);
+    }
+  }
+
+  return(false);
+}
+
+///////////////////////////////
+
+void SpanCharacteristic::nvsSave(){
+
+  homeSpan.nvsSaves++;
+  homeSpan.nvsLastDirty=millis();
+
+  if(nvsPending)                            // already waiting to be written
+    return;
+
+  if(homeSpan.nvsDirty.empty())
+    homeSpan.nvsFirstDirty=homeSpan.nvsLastDirty;
+
+  nvsPending=true;
+  homeSpan.nvsDirty.push_back(this);
+}
+
+///////////////////////////////
+
+boolean SpanCharacteristic::nvsWrite(){
+
+  nvsSetKey();
+
+  if(format<FORMAT::STRING)
+    return(homeSpan.charStore->setU64(nvsKey,value.UINT64));                      // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())
+  else if(format==FORMAT::STRING)
+    return(homeSpan.charStore->setStr(nvsKey,value.STRING));                      // store string data
+  else
+    return(homeSpan.charStore->setBlob(nvsKey,value.BLOB->data,value.BLOB->len)); // store DATA/TLV8 as raw bytes
 }
 
 ///////////////////////////////
@@ -2174,18 +2904,25 @@ void SpanCharacteristic::printfAttributes(int flags){
   if((perms&PR) && (flags&GET_VALUE)){    
     if(perms&NV && !(flags&GET_NV))
       hapOut << ",\"value\":null";
-    else
-      hapOut << ",\"value\":" << uvPrint(value).c_str();
+    else {
+      hapOut << ",\"value\":";
+      uvStream(value);
+    }
   }
 
   if(flags&GET_META){
     hapOut << ",\"format\":\"" << formatCodes[format] << "\"";
     
     if(customRange && (flags&GET_META)){
-      hapOut << ",\"minValue\":" << uvPrint(minValue).c_str() << ",\"maxValue\":" << uvPrint(maxValue).c_str();
+      hapOut << ",\"minValue\":";
+      uvStream(minValue);
+      hapOut << ",\"maxValue\":";
+      uvStream(maxValue);
         
-      if(uvGet<float>(stepValue)>0)
-        hapOut << ",\"minStep\":" << uvPrint(stepValue).c_str();
+      if(uvGet<float>(stepValue)>0){
+        hapOut << ",\"minStep\":";
+        uvStream(stepValue);
+      }
     }
 
     if(unit){
@@ -2324,9 +3061,13 @@ StatusCode SpanCharacteristic::loadUpdate(char *val, char *ev, boolean wr){
       break;
 
     case STRING:
+      uvSet(newValue,(const char *)stripBackslash(val));
+      break;
+
     case DATA:
     case TLV_ENC:
-      uvSet(newValue,(const char *)stripBackslash(val));
+      if(!uvDecode(newValue,stripBackslash(val)))          // decode once here so reads of DATA/TLV8 values require no further decoding
+        return(StatusCode::InvalidValue);
       break;
 
     default:
@@ -2366,6 +3107,7 @@ SpanCharacteristic *SpanCharacteristic::setPerms(uint8_t perms){
   perms&=0x7F;
   if(perms>0)
     this->perms=perms;
+  invalidateDigest();
   return(this);
 }
 
@@ -2384,16 +3126,20 @@ SpanCharacteristic *SpanCharacteristic::removePerms(uint8_t dPerms){
 ///////////////////////////////
 
 SpanCharacteristic *SpanCharacteristic::setDescription(const char *c){
-  desc = (char *)HS_REALLOC(desc, strlen(c) + 1);
-  strcpy(desc, c);
+  const char *s=stringPool.intern(c);
+  stringPool.release(desc);
+  desc=s;
+  invalidateDigest();
   return(this);
 }  
 
 ///////////////////////////////
 
 SpanCharacteristic *SpanCharacteristic::setUnit(const char *c){
-  unit = (char *)HS_REALLOC(unit, strlen(c) + 1);
-  strcpy(unit, c);
+  const char *s=stringPool.intern(c);
+  stringPool.release(unit);
+  unit=s;
+  invalidateDigest();
   return(this);
 }  
 
@@ -2428,8 +3174,10 @@ SpanCharacteristic *SpanCharacteristic::setValidValues(int n, ...){
   va_end(vl);
   s+="]";
 
-  validValues=(char *)HS_REALLOC(validValues, strlen(s.c_str()) + 1);
-  strcpy(validValues,s.c_str());
+  const char *v=stringPool.intern(s.c_str());
+  stringPool.release(validValues);
+  validValues=v;
+  invalidateDigest();
 
   return(this);
 }
@@ -2594,6 +3342,583 @@ void SpanWebLog::vLog(boolean sysMsg, const char *fmt, va_list ap){
   free(buf);
 }
 
+///////////////////////////////
+//        SpanBulkNVS        //
+///////////////////////////////
+
+SpanBulkNVS::record_t *SpanBulkNVS::find(SpanStore *store, uint32_t aid, uint32_t iid){
+
+  if(aid!=this->aid || !loaded){              // blob for this Accessory not yet loaded
+    release();
+    this->aid=aid;
+    loaded=true;
+
+    char k[16];
+    key(k,aid);
+    size_t len;
+
+    if(!store->getBlob(k,NULL,&len) || len<sizeof(header_t))
+      return(NULL);
+
+    buf=(uint8_t *)HS_MALLOC(len);
+    store->getBlob(k,buf,&len);
+
+    header_t *h=(header_t *)buf;
+    if(h->version!=VERSION){
+      LOG0("\n*** WARNING:  Ignoring saved Characteristic values for Accessory %lu.  Unsupported format version %d\n\n",aid,h->version);
+      return(NULL);
+    }
+
+    size_t offset=sizeof(header_t);
+    for(int i=0;i<h->nRecords && offset+sizeof(record_t)<=len;i++){          // index all records, stopping at any truncation
+      record_t *r=(record_t *)(buf+offset);
+      if(offset+sizeof(record_t)+r->len>len)
+        break;
+      index.push_back(r);
+      offset+=(sizeof(record_t)+r->len+3)&~((size_t)3);
+    }
+
+    std::sort(index.begin(),index.end(),[](record_t *a, record_t *b){return(a->iid<b->iid);});
+  }
+
+  auto it=std::lower_bound(index.begin(),index.end(),iid,[](record_t *r, uint32_t iid){return(r->iid<iid);});
+  return((it!=index.end() && (*it)->iid==iid)?*it:NULL);
+}
+
+///////////////////////////////
+
+boolean SpanBulkNVS::save(SpanStore *store, uint32_t aid){
+
+  auto acc=homeSpan.Accessories.begin();
+  while(acc!=homeSpan.Accessories.end() && (*acc)->aid!=aid)
+    acc++;
+
+  if(acc==homeSpan.Accessories.end())
+    return(true);
+
+  auto valLen=[](SpanCharacteristic *chr)->size_t{return(chr->format<FORMAT::STRING?sizeof(uint64_t):(chr->format==FORMAT::STRING?strlen(chr->value.STRING)+1:chr->value.BLOB->len));};
+
+  size_t len=sizeof(header_t);
+  uint16_t nRecords=0;
+
+  for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){        // first pass - compute size of blob
+    for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+      if(!(*chr)->nvsStored)
+        continue;
+      size_t n=valLen(*chr);
+      if(n>UINT16_MAX){                                                                // record lengths are stored as 16 bits - never silently truncate
+        LOG0("\n*** WARNING:  Can't save Characteristic::%s in NVS.  Value of %d bytes exceeds maximum of %d bytes - value will not be restored after a restart!\n\n",(*chr)->hapName,n,UINT16_MAX);
+        continue;
+      }
+      len+=(sizeof(record_t)+n+3)&~((size_t)3);
+      nRecords++;
+    }
+  }
+
+  TempBuffer<uint8_t> tBuf(len);
+  memset(tBuf,0,len);
+  *(header_t *)tBuf.get()={VERSION,0,nRecords};
+  size_t offset=sizeof(header_t);
+
+  for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){        // second pass - fill blob
+    for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+      if(!(*chr)->nvsStored || valLen(*chr)>UINT16_MAX)
+        continue;
+      record_t *r=(record_t *)(tBuf+offset);
+      r->iid=(*chr)->iid;
+      r->format=(*chr)->format;
+      if((*chr)->format<FORMAT::STRING){
+        r->len=sizeof(uint64_t);
+        memcpy(r+1,&(*chr)->value.UINT64,r->len);
+      } else if((*chr)->format==FORMAT::STRING){
+        r->len=strlen((*chr)->value.STRING)+1;
+        memcpy(r+1,(*chr)->value.STRING,r->len);
+      } else {
+        r->len=(*chr)->value.BLOB->len;
+        memcpy(r+1,(*chr)->value.BLOB->data,r->len);
+      }
+      offset+=(sizeof(record_t)+r->len+3)&~((size_t)3);
+    }
+  }
+
+  char k[16];
+  key(k,aid);
+  boolean success=store->setBlob(k,tBuf,len);
+
+  if(this->aid==aid)            // any loaded copy of this blob is now stale
+    release();
+
+  return(success);
+}
+
+///////////////////////////////
+
+void SpanBulkNVS::release(){
+  free(buf);
+  buf=NULL;
+  loaded=false;
+  index.clear();
+  index.shrink_to_fit();
+}
+
+///////////////////////////////
+//      SpanTransaction      //
+///////////////////////////////
+
+SpanTransaction *SpanTransaction::openList=NULL;
+std::mutex SpanTransaction::listMutex;
+thread_local int SpanPauseLock::depth=0;
+
+//////////////////////////////////////
+
+SpanTransaction::SpanTransaction(){
+
+  std::lock_guard<std::mutex> lock(listMutex);
+  next=openList;
+  if(next)
+    next->prev=this;
+  openList=this;
+}
+
+//////////////////////////////////////
+
+SpanTransaction::~SpanTransaction(){
+
+  abort();
+
+  std::lock_guard<std::mutex> lock(listMutex);
+  if(prev)
+    prev->next=next;
+  else
+    openList=next;
+  if(next)
+    next->prev=prev;
+}
+
+//////////////////////////////////////
+
+void SpanTransaction::forget(SpanCharacteristic *chr){
+
+  std::lock_guard<std::mutex> lock(listMutex);
+
+  for(SpanTransaction *tx=openList; tx; tx=tx->next){
+    for(auto s=tx->staged.begin(); s!=tx->staged.end(); s++){     // at most one entry per Characteristic
+      if(s->characteristic==chr){
+        tx->release(*s);
+        tx->staged.erase(s);
+        break;
+      }
+    }
+  }
+}
+
+//////////////////////////////////////
+
+SpanCharacteristic::UVal &SpanTransaction::stage(SpanCharacteristic *chr){
+
+  for(auto s=staged.begin(); s!=staged.end(); s++){         // if already staged, the new value replaces the old one
+    if(s->characteristic==chr)
+      return(s->value);
+  }
+
+  staged.push_back({chr,{}});                               // note: UVal initializes to NULL, as needed for both STRING and BLOB values
+  return(staged.back().value);
+}
+
+//////////////////////////////////////
+
+void SpanTransaction::release(staged_t &s){
+
+  if(s.characteristic->format==FORMAT::STRING)
+    stringPool.release(s.value.STRING);
+  else if(s.characteristic->format>FORMAT::STRING)
+    free(s.value.BLOB);
+}
+
+//////////////////////////////////////
+
+void SpanTransaction::commit(){
+
+  {
+    std::lock_guard<std::mutex> lock(listMutex);
+    if(staged.empty())
+      return;
+  }
+
+  if(int slot=homeSpan.loopPool.workerSlot()){            // pollTask() holds exclusive lock while it waits for worker tasks, so locking here would deadlock - hand values to pollTask() instead
+    SpanTransaction *tx=new SpanTransaction;
+    {
+      std::lock_guard<std::mutex> lock(listMutex);
+      tx->staged.swap(staged);
+    }
+    homeSpan.loopPool.slots[slot].transactions.push_back(tx);
+    return;
+  }
+
+  boolean locked=(homeSpan.pollOwner!=xTaskGetCurrentTaskHandle() && SpanPauseLock::depth==0);     // if not called from within pollTask(), lock out pollTask() and all other tasks while applying values (unless caller has already paused HomeSpan with homeSpanPAUSE, in which case pollTask() is already locked out)
+
+  if(locked)
+    homeSpan.pollMutex.lock();                                // always taken before listMutex, the same order as in pollTask() calling forget()
+
+  int n;
+  {
+    std::lock_guard<std::mutex> lock(listMutex);
+    n=staged.size();
+
+    for(auto s=staged.begin(); s!=staged.end(); s++){
+      s->characteristic->setValCheck();
+      s->characteristic->uvSet(s->characteristic->value,s->value);
+      s->characteristic->setValFinish(true);                 // notifications are sent together in a single EVENT message, and stored values are written together in a single NVS commit
+    }
+
+    clear();                                                  // release staged values
+  }
+
+  if(locked)
+    homeSpan.pollMutex.unlock();
+
+  LOG2("Committed transaction of %d Characteristic values\n",n);
+}
+
+//////////////////////////////////////
+
+void SpanTransaction::abort(){
+
+  std::lock_guard<std::mutex> lock(listMutex);
+  clear();
+}
+
+//////////////////////////////////////
+
+void SpanTransaction::clear(){
+
+  for(auto s=staged.begin(); s!=staged.end(); s++)
+    release(*s);
+  staged.clear();
+}
+
+///////////////////////////////
+//        SpanLoopPool       //
+///////////////////////////////
+
+void SpanLoopPool::begin(){
+
+  if(nWorkers==0 || slots)
+    return;
+
+  slots=new slot_t[nWorkers+1];
+  done=xSemaphoreCreateBinary();
+
+  for(int i=1;i<=nWorkers;i++){
+    char name[16];
+    sprintf(name,"loopWorker%d",i);
+    xTaskCreateUniversal(workerTask,name,stackSize,(void *)i,uxTaskPriorityGet(NULL),&slots[i].task,(xPortGetCoreID()+i)%portNUM_PROCESSORS);
+  }
+
+  LOG0("Parallel Loops:   %d independent and %d other Services with loop() methods, run on %d worker tasks plus polling task\n\n",Loops.size(),homeSpan.Loops.size(),nWorkers);
+}
+
+//////////////////////////////////////
+
+void SpanLoopPool::run(){
+
+  if(Loops.empty())
+    return;
+
+  if(!slots){                                       // worker tasks not yet created
+    for(auto svc=Loops.begin(); svc!=Loops.end(); svc++)
+      (*svc)->loop();
+    return;
+  }
+
+  int nSlots=nWorkers+1;
+  uint32_t n=Loops.size();
+
+  for(int i=0;i<nSlots;i++){                        // split Services into contiguous shares, one per slot
+    slots[i].next=i*n/nSlots;
+    slots[i].end=(i+1)*n/nSlots;
+  }
+
+  active=true;
+  nBusy=nWorkers;
+  for(int i=1;i<nSlots;i++)
+    xTaskNotifyGive(slots[i].task);
+
+  work(0);                                          // pollTask() runs its own share (and steals from workers) rather than simply waiting
+  xSemaphoreTake(done,portMAX_DELAY);
+  active=false;
+
+  for(int i=1;i<nSlots;i++){                        // queue notifications in pollTask() for Characteristics updated by workers, so they are sent via the normal path
+    for(auto chr=slots[i].deferred.begin(); chr!=slots[i].deferred.end(); chr++)
+      (*chr)->queueNotify();
+    slots[i].deferred.clear();
+    for(auto tx=slots[i].transactions.begin(); tx!=slots[i].transactions.end(); tx++){      // apply transactions committed by workers
+      (*tx)->commit();
+      delete *tx;
+    }
+    slots[i].transactions.clear();
+  }
+}
+
+//////////////////////////////////////
+
+void SpanLoopPool::work(int n){
+
+  int nSlots=nWorkers+1;
+
+  for(int i=0;i<nSlots;i++){                        // start with own share, then steal from each other share in turn
+    slot_t *slot=slots+(n+i)%nSlots;
+    uint32_t index;
+    while((index=slot->next.fetch_add(1))<slot->end){
+      Loops[index]->loop();
+      if(i>0)
+        nSteals++;
+    }
+  }
+}
+
+//////////////////////////////////////
+
+int SpanLoopPool::workerSlot(){
+
+  if(!active || xTaskGetCurrentTaskHandle()==homeSpan.pollOwner)
+    return(0);
+
+  for(int i=1;i<=nWorkers;i++){
+    if(slots[i].task==xTaskGetCurrentTaskHandle())
+      return(i);
+  }
+
+  return(0);
+}
+
+//////////////////////////////////////
+
+boolean SpanLoopPool::defer(SpanCharacteristic *chr){
+
+  int i=workerSlot();
+  if(i==0)
+    return(false);
+
+  slots[i].deferred.push_back(chr);
+  return(true);
+}
+
+//////////////////////////////////////
+
+void SpanLoopPool::workerTask(void *arg){
+
+  int n=(int)arg;
+
+  for(;;){
+    ulTaskNotifyTake(pdTRUE,portMAX_DELAY);         // wait for pollTask() to start next pass
+    homeSpan.loopPool.work(n);
+    if(homeSpan.loopPool.nBusy.fetch_sub(1)==1)     // last worker to finish wakes pollTask()
+      xSemaphoreGive(homeSpan.loopPool.done);
+  }
+}
+
+///////////////////////////////
+//       SpanWarmStart       //
+///////////////////////////////
+
+void SpanWarmStart::load(){
+
+  if(enabled)
+    return;
+
+  enabled=true;
+  esp_register_shutdown_handler(save);
+
+  snapshot_t *snap=&rtcSnapshot;
+  size_t checkLen=offsetof(snapshot_t,data)-offsetof(snapshot_t,appSHA)+snap->dataLen;
+
+  boolean found=(esp_reset_reason()==ESP_RST_SW && snap->magic==MAGIC && snap->dataLen<=MAX_DATA &&
+                 snap->checksum==esp_rom_crc32_le(0,snap->appSHA,checkLen));
+
+  snap->magic=0;                              // snapshot is only used once
+
+  if(!found)
+    return;
+
+  warm=true;
+  channel=snap->channel;
+  memcpy(bssid,snap->bssid,6);
+
+  if(memcmp(snap->appSHA,esp_app_get_description()->app_elf_sha256,32)){       // application has changed (e.g. after an OTA update) - only WiFi information can be used
+    LOG1("Warm restart: application changed - using saved WiFi channel only\n");
+    return;
+  }
+
+  size_t offset=0;
+  for(int i=0;i<snap->nRecords && offset+sizeof(record_t)<=snap->dataLen;i++){
+    record_t *r=(record_t *)(snap->data+offset);
+    index.push_back(r);
+    offset+=(sizeof(record_t)+r->len+3)&~((size_t)3);
+  }
+
+  std::sort(index.begin(),index.end(),[](record_t *a, record_t *b){return(a->aid<b->aid || (a->aid==b->aid && a->iid<b->iid));});
+  valid=true;
+  LOG1("Warm restart: found snapshot with %d saved Characteristic values\n",index.size());
+}
+
+///////////////////////////////
+
+void SpanWarmStart::save(){
+
+  if(homeSpan.warmStart.suppressed)           // stored data was erased (e.g. factory reset) - device must start cold
+    return;
+
+  boolean locked=(homeSpan.pollOwner!=xTaskGetCurrentTaskHandle() && SpanPauseLock::depth==0);     // runs on whichever task called esp_restart() - unless that is pollTask() or a task that has paused HomeSpan, lock out pollTask() so snapshot is not torn by concurrent changes
+
+  if(locked){
+    int nTicks=0;
+    while(!homeSpan.pollMutex.try_lock()){
+      if(++nTicks>LOCK_TICKS){
+        LOG0("\n*** WARNING: Unable to lock out HomeSpan polling before restart.  Warm-restart snapshot not saved.\n\n");
+        return;                               // no snapshot (magic is left invalid) - device will start cold
+      }
+      vTaskDelay(1);
+    }
+  }
+
+  homeSpan.flushNVS();                        // make sure NVS is consistent with snapshot
+
+  snapshot_t *snap=&rtcSnapshot;
+  snap->magic=0;
+
+  memcpy(snap->appSHA,esp_app_get_description()->app_elf_sha256,32);
+  memcpy(snap->hashCode,homeSpan.hapConfig.hashCode,48);
+  snap->configNumber=homeSpan.hapConfig.configNumber;
+  snap->layout=layout();
+
+  snap->channel=homeSpan.warmStart.wifiChannel;     // WiFi.channel() cannot be used here since the WiFi driver's own shutdown handler has already stopped WiFi
+  memcpy(snap->bssid,homeSpan.warmStart.wifiBssid,6);
+
+  snap->nRecords=0;
+  snap->dataLen=0;
+
+  for(auto acc=homeSpan.Accessories.begin(); acc!=homeSpan.Accessories.end(); acc++){
+    for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
+      for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+        if(!(*chr)->nvsStored)
+          continue;
+
+        const void *data;
+        size_t len;
+        if((*chr)->format<FORMAT::STRING){
+          data=&(*chr)->value.UINT64;
+          len=sizeof(uint64_t);
+        } else if((*chr)->format==FORMAT::STRING){
+          data=(*chr)->value.STRING;
+          len=strlen((*chr)->value.STRING)+1;
+        } else {
+          data=(*chr)->value.BLOB->data;
+          len=(*chr)->value.BLOB->len;
+        }
+
+        size_t recLen=(sizeof(record_t)+len+3)&~((size_t)3);
+        if(snap->dataLen+recLen>MAX_DATA)             // no room - this value will be loaded from NVS instead
+          continue;
+
+        record_t *r=(record_t *)(snap->data+snap->dataLen);
+        r->aid=(*chr)->aid;
+        r->iid=(*chr)->iid;
+        r->len=len;
+        r->format=(*chr)->format;
+        memcpy(r+1,data,len);
+        snap->dataLen+=recLen;
+        snap->nRecords++;
+      }
+    }
+  }
+
+  size_t checkLen=offsetof(snapshot_t,data)-offsetof(snapshot_t,appSHA)+snap->dataLen;
+  snap->checksum=esp_rom_crc32_le(0,snap->appSHA,checkLen);
+  snap->magic=MAGIC;
+
+  if(locked)
+    homeSpan.pollMutex.unlock();
+}
+
+///////////////////////////////
+
+SpanWarmStart::record_t *SpanWarmStart::find(uint32_t aid, uint32_t iid){
+
+  auto it=std::lower_bound(index.begin(),index.end(),std::make_pair(aid,iid),[](record_t *r, std::pair<uint32_t,uint32_t> k){return(r->aid<k.first || (r->aid==k.first && r->iid<k.second));});
+  return((it!=index.end() && (*it)->aid==aid && (*it)->iid==iid)?*it:NULL);
+}
+
+///////////////////////////////
+
+uint32_t SpanWarmStart::layout(){
+
+  uint32_t crc=0;
+
+  for(auto acc=homeSpan.Accessories.begin(); acc!=homeSpan.Accessories.end(); acc++){
+    for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
+      for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+        uint32_t id[2]={(*chr)->aid,(*chr)->iid};
+        uint8_t fp[2]={(uint8_t)(*chr)->format,(*chr)->perms};
+        crc=esp_rom_crc32_le(crc,(uint8_t *)id,sizeof(id));
+        crc=esp_rom_crc32_le(crc,(uint8_t *)(*chr)->type,strlen((*chr)->type));
+        crc=esp_rom_crc32_le(crc,fp,sizeof(fp));
+      }
+    }
+  }
+
+  return(crc);
+}
+
+///////////////////////////////
+
+void SpanWarmStart::invalidate(){
+  rtcSnapshot.magic=0;
+  suppressed=true;
+}
+
+///////////////////////////////
+
+void SpanWarmStart::noteWiFi(boolean connected){
+  wifiChannel=0;
+  if(connected){
+    wifiChannel=WiFi.channel();
+    memcpy(wifiBssid,WiFi.BSSID(),6);
+  }
+}
+
+///////////////////////////////
+
+boolean SpanWarmStart::sameConfig(SpanConfig &config){
+
+  if(!valid)
+    return(false);
+
+  if(rtcSnapshot.layout!=layout()){          // database was created differently (e.g. a bridge restored different Accessories) - saved values may belong to other Characteristics
+    LOG1("Warm restart: database layout changed - re-loading saved Characteristic values from NVS\n");
+    release();
+    for(auto acc=homeSpan.Accessories.begin(); acc!=homeSpan.Accessories.end(); acc++){
+      for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
+        for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+          if((*chr)->nvsStored)
+            (*chr)->nvsLoad();
+        }
+      }
+    }
+    return(false);
+  }
+
+  return(rtcSnapshot.configNumber==config.configNumber && !memcmp(rtcSnapshot.hashCode,config.hashCode,48));
+}
+
+///////////////////////////////
+
+void SpanWarmStart::release(){
+  index.clear();
+  index.shrink_to_fit();
+  valid=false;
+}
+
 ///////////////////////////////
 //         SpanOTA           //
 ///////////////////////////////
@@ -2631,6 +3956,7 @@ int SpanOTA::setPassword(const char *pwd){
 ///////////////////////////////
 
 void SpanOTA::start(){
+  homeSpan.flushNVS();                  // make sure pending Characteristic values are not lost when device restarts after update
   LOG0("\n*** Current Partition: %s\n*** New Partition: %s\n*** OTA Starting..",
     esp_ota_get_running_partition()->label,esp_ota_get_next_update_partition(NULL)->label);
   otaPercent=0;
@@ -34,9 +34,13 @@
 
 #include <Arduino.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <list>
+#include <type_traits>
+#include <iterator>
 #include <shared_mutex>
+#include <mutex>
 #include <nvs.h>
 #include <ArduinoOTA.h>
 #include <ETH.h>
@@ -51,6 +55,12 @@
 
 #include "Settings.h"
 #include "Utils.h"
+#include "BlockPool.h"
+#include "StringPool.h"
+#include "SpanStore.h"
+#include "SpanMap.h"
+#include "SpanQueue.h"
+#include "SpanCoroutine.h"
 #include "Network_HS.h"
 #include "HAPConstants.h"
 #include "HapQR.h"
@@ -88,9 +98,23 @@ typedef std::pair<const uint8_t *, size_t> DATA_t;
 static DATA_t NULL_DATA={NULL,0};
 static TLV8 NULL_TLV{};
 
-#define homeSpanPAUSE std::shared_lock pollLock(homeSpan.getMutex());
+#define homeSpanPAUSE SpanPauseLock pollLock(homeSpan.getMutex());
 #define homeSpanRESUME if(pollLock.owns_lock()){pollLock.unlock();}
 
+class SpanPauseLock {                         // shared lock on pollMutex used by homeSpanPAUSE, which also counts the locks held by each task so SpanTransaction::commit() and SpanWarmStart::save() can tell if their caller has paused HomeSpan
+
+  std::shared_lock<std::shared_mutex> lock;
+
+  public:
+
+  static thread_local int depth;              // number of homeSpanPAUSE locks currently held by the calling task
+
+  SpanPauseLock(std::shared_mutex &m) : lock{m} {depth++;}
+  ~SpanPauseLock(){if(lock.owns_lock()) depth--;}
+  boolean owns_lock(){return(lock.owns_lock());}
+  void unlock(){lock.unlock();depth--;}
+};
+
 ///////////////////////////////
 
 #define STATUS_UPDATE(LED_UPDATE,MESSAGE_UPDATE)  {homeSpan.statusLED->LED_UPDATE;if(homeSpan.statusCallback)homeSpan.statusCallback(MESSAGE_UPDATE);}
@@ -126,8 +150,9 @@ enum HS_STATUS {
 
 class Controller {
   friend class HAPClient;
+  friend class ControllerTable;
   
-  boolean allocated=false;        // DEPRECATED (but needed for backwards compatability with original NVS storage of Controller info)
+  boolean allocated=false;        // indicates table slot is in use (also needed for backwards compatability with original NVS storage of Controller info)
   boolean admin;                  // Controller has admin privileges
   uint8_t ID[36];                 // Pairing ID
   uint8_t LTPK[32];               // Long Term Ed2519 Public Key
@@ -160,10 +185,103 @@ struct SpanCharacteristic;
 struct SpanBuf;
 struct SpanButton;
 struct SpanUserCommand;
+class SpanTransaction;
 
 struct HAPClient;
 
 extern Span homeSpan;
+extern BlockPool hapClientPool;           // fixed-block pool for HAPClient list nodes
+extern StringPool stringPool;             // interned storage for STRING Characteristic values, descriptions, and units
+
+//////////////////////////////////////////////////////////
+// Fixed-capacity table of Paired Controllers.  Lookups
+// by ID use a small open-addressing hash index keyed on
+// the first bytes of the ID, the number of admin Controllers
+// is kept up to date as Controllers change, slots modified
+// since the last save are tracked so only their NVS records
+// need to be re-written, and each slot keeps a list of the
+// HAP Client connections verified with that Controller
+
+class ControllerTable {
+
+  public:
+
+  static const int CAPACITY=16;               // maximum number of paired controllers (HAP requires at least 16)
+
+  private:
+
+  static const int INDEX_SIZE=2*CAPACITY;     // keeps hash index no more than half full
+  static const int PREFIX_BYTES=8;            // number of ID bytes hashed (IDs are UUID strings, so the first 8 characters are already well-distributed)
+
+  Controller slots[CAPACITY];
+  int8_t index[INDEX_SIZE];                   // slot number of each hash bucket (-1=empty)
+  HAPClient *sessions[CAPACITY]={};           // head of linked-list of HAP Client connections verified with Controller in each slot
+  int nUsed=0;                                // number of slots in use
+  int nAdmin=0;                               // number of admin Controllers
+  uint32_t dirty=0;                           // bit-mask of slots modified since last save
+
+  static uint32_t hash(const uint8_t *id);
+  void reindex();                             // rebuilds hash index from scratch
+  void release(int n);                        // frees slot n and un-verifies any sessions using it
+
+  public:
+
+  uint32_t nWrites=0;                         // number of NVS records written (or erased) since start-up
+
+  class const_iterator {                      // bidirectional iterator over allocated slots (a drop-in replacement for the const_iterator of the std::list previously used to hold Controllers)
+    const Controller *p=NULL;
+    const Controller *first=NULL;
+    const Controller *last=NULL;
+    void skip(){while(p<last && !p->allocated) p++;}
+
+    public:
+
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef Controller value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Controller *pointer;
+    typedef const Controller &reference;
+
+    const_iterator(){}
+    const_iterator(const Controller *p, const Controller *first, const Controller *last) : p{p}, first{first}, last{last} {skip();}
+    const Controller &operator*() const {return(*p);}
+    const Controller *operator->() const {return(p);}
+    const_iterator &operator++(){p++;skip();return(*this);}
+    const_iterator operator++(int){const_iterator t=*this;++*this;return(t);}
+    const_iterator &operator--(){do p--; while(p>first && !p->allocated);return(*this);}
+    const_iterator operator--(int){const_iterator t=*this;--*this;return(t);}
+    bool operator==(const const_iterator &it) const {return(p==it.p);}
+    bool operator!=(const const_iterator &it) const {return(p!=it.p);}
+  };
+
+  ControllerTable(){reindex();}
+
+  const_iterator begin() const {return(const_iterator(slots,slots,slots+CAPACITY));}
+  const_iterator end() const {return(const_iterator(slots+CAPACITY,slots,slots+CAPACITY));}
+  const_iterator cbegin() const {return(begin());}
+  const_iterator cend() const {return(end());}
+
+  int size() const {return(nUsed);}
+  boolean empty() const {return(nUsed==0);}
+  int nAdmins() const {return(nAdmin);}
+
+  Controller *find(const uint8_t *id);                        // returns pointer to Controller with matching ID, or NULL if not found
+  Controller *insert(const Controller &c, int n=-1);          // stores copy of c in slot n (or first free slot if n<0).  Returns pointer to stored Controller, or NULL if no slot available
+  void setAdmin(Controller *c, boolean admin);                // updates admin permission of c
+  void remove(Controller *c);                                 // removes c (and clears its list of sessions)
+  void clear();                                               // removes all Controllers
+
+  int slot(const Controller *c) const {return(c-slots);}      // slot number of c
+  Controller *get(int n){return(slots+n);}                    // Controller in slot n (check isUsed() first)
+  boolean isUsed(int n) const {return(slots[n].allocated);}
+  boolean isDirty(int n) const {return(dirty&(1u<<n));}
+  void setDirty(int n){dirty|=(1u<<n);}
+  void clearDirty(){dirty=0;}
+
+  void attach(Controller *c, HAPClient *hc);                  // records that connection hc has been verified with Controller c (and sets hc->cPair)
+  void detach(HAPClient *hc);                                 // removes connection hc from the list of sessions of its Controller
+  HAPClient *firstSession(Controller *c){return(sessions[slot(c)]);}
+};
 
 ////////////////////////////////////////////////////////
 // INTERNAL HOMESPAN STRUCTURES - NOT FOR USER ACCESS //
@@ -183,6 +301,180 @@ struct SpanConfig{
 
 ///////////////////////////////
 
+struct SpanBulkNVS{                           // optional storage of all saved Characteristic values for an Accessory in a single NVS blob
+  
+  static const uint8_t VERSION=1;             // version of blob format - blobs with any other version are ignored
+
+  struct header_t {                           // header at start of each blob
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t nRecords;
+  };
+
+  struct record_t {                           // header for each Characteristic value in blob, followed by len bytes of data (padded to 4-byte boundary)
+    uint32_t iid;
+    uint16_t len;
+    uint8_t format;
+    uint8_t reserved;
+  };
+
+  boolean enabled=false;                      // flag indicating bulk storage is enabled
+  uint32_t aid=0;                             // aid of Accessory whose blob is currently loaded
+  boolean loaded=false;                       // flag indicating blob for aid has been loaded (or was not found)
+  uint8_t *buf=NULL;                          // contents of currently-loaded blob
+  vector<record_t *, Mallocator<record_t *>> index;   // records in currently-loaded blob, sorted by iid
+
+  static void key(char *k, uint32_t aid){sprintf(k,"BULK%08lX",aid);}   // NVS key for Accessory aid (k must be at least 13 characters)
+
+  record_t *find(SpanStore *store, uint32_t aid, uint32_t iid);   // returns record for aid/iid (loading and indexing blob for aid only if not already loaded), or NULL if not found
+  boolean save(SpanStore *store, uint32_t aid);                   // writes (but does not commit) blob containing all saved Characteristic values for Accessory aid.  Returns false if blob could not be written
+  void release();                                                 // frees currently-loaded blob and index
+};
+
+///////////////////////////////
+
+struct SpanWarmStart{                         // optional snapshot of runtime state preserved in RTC memory across software restarts
+
+  static const uint32_t MAGIC=0x48535752;     // marks a completed snapshot
+  static const size_t MAX_DATA=1024;          // maximum number of bytes available for saving Characteristic values
+  static const int LOCK_TICKS=100;            // maximum number of ticks save() waits for pollTask() to finish its current pass before giving up on the snapshot
+
+  struct record_t {                           // header for each Characteristic value in snapshot, followed by len bytes of data (padded to 4-byte boundary)
+    uint32_t aid;
+    uint32_t iid;
+    uint16_t len;
+    uint8_t format;
+    uint8_t reserved;
+  };
+
+  struct snapshot_t {                         // layout of snapshot in RTC memory (must have no initializers, else it would be cleared upon every boot)
+    uint32_t magic;
+    uint32_t checksum;                        // CRC-32 of all following fields (through end of used data)
+    uint8_t appSHA[32];                       // ELF SHA-256 of application that created snapshot
+    uint8_t hashCode[48];                     // HAP database hash at time of snapshot
+    int configNumber;                         // HAP configuration number at time of snapshot
+    uint32_t layout;                          // CRC-32 of database layout at time of snapshot (see layout())
+    uint8_t bssid[6];                         // BSSID of WiFi access point connected at time of snapshot
+    uint8_t channel;                          // WiFi channel connected at time of snapshot (0 if not connected)
+    uint8_t reserved;
+    uint16_t nRecords;                        // number of Characteristic values saved
+    uint16_t dataLen;                         // number of bytes of data used
+    uint8_t data[MAX_DATA];                   // saved Characteristic values
+  };
+
+  boolean enabled=false;                      // flag indicating warm restarts are enabled
+  boolean valid=false;                        // flag indicating a valid snapshot created by this same application was found at startup
+  boolean warm=false;                         // flag indicating any valid snapshot was found at startup
+  uint8_t channel=0;                          // WiFi channel to try on first connection attempt (0 if none)
+  uint8_t bssid[6];                           // WiFi BSSID to try on first connection attempt
+  uint8_t wifiChannel=0;                      // WiFi channel currently connected (0 if not connected) - recorded upon connection since WiFi is already stopped when shutdown handlers run
+  uint8_t wifiBssid[6];                       // WiFi BSSID currently connected
+  boolean suppressed=false;                   // flag indicating no snapshot should be saved (set after stored data is erased)
+  vector<record_t *, Mallocator<record_t *>> index;   // saved Characteristic values, sorted by aid and iid
+
+  void load();                                // validates and indexes any snapshot left in RTC memory by a software restart
+  static void save();                         // writes new snapshot to RTC memory (registered as a shutdown handler so it runs upon any software restart)
+  static uint32_t layout();                   // returns CRC-32 of the aid, iid, type, format, and permissions of every Characteristic in the database
+  void invalidate();                          // discards any snapshot and prevents a new one from being saved (used when stored data is erased)
+  void noteWiFi(boolean connected);           // records WiFi channel and BSSID upon connection (or clears them upon disconnection)
+  record_t *find(uint32_t aid, uint32_t iid); // returns saved value for aid/iid, or NULL if not found
+  boolean sameConfig(SpanConfig &config);     // returns true if snapshot was taken with the same database layout, HAP database hash, and configuration number as config.  If the layout changed, saved values are re-loaded from NVS
+  void release();                             // discards index once startup is complete
+};
+
+///////////////////////////////
+
+struct SpanSnapshot{                          // compact binary image of the Accessory database (see exportDatabase() and loadDatabase())
+
+  static const uint32_t MAGIC=0x42445348;     // "HSDB"
+  static const uint16_t VERSION=1;            // version of image format - images with any other version are rejected
+  static const uint16_t CUSTOM=0xFFFF;        // Characteristic index indicating a Custom Characteristic, with its type information stored in the image
+
+  struct header_t {                           // header at start of image, followed by len bytes of Accessory, Service, and Characteristic records
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nAccessories;
+    uint32_t len;
+    uint32_t crc;                             // CRC-32 of the len bytes following the header
+  };
+
+  uint8_t *wBuf=NULL;                         // image being written (NULL if only computing size)
+  size_t wSize=0;                             // size of wBuf
+  size_t wPos=0;                              // number of bytes written (or that would have been written)
+  boolean wError=false;                       // flag indicating a string or data value too long to be stored with a 16-bit length
+
+  const uint8_t *rBuf=NULL;                   // image being read
+  size_t rLen=0;                              // length of rBuf
+  size_t rPos=0;                              // current read position
+  boolean rError=false;                       // flag indicating an attempt to read past end of image
+
+  static vector<HapChar *, Mallocator<HapChar *>> customChars;   // Custom HapChars created while loading images - interned so repeated loads re-use them rather than allocating new ones
+
+  void put(const void *data, size_t n);                     // appends n bytes of data to image
+  template <typename T> void put(T v){put(&v,sizeof(T));}   // appends v to image
+  void putStr(const char *s);                               // appends 16-bit length (including terminator, or 0 if s=NULL) followed by s.  Sets wError if s is too long
+  void putData(const uint8_t *data, size_t n);              // appends 16-bit length followed by n bytes of data.  Sets wError if n is too large
+  void putIndex(HapChar *hc);                               // appends index of hc in hapChars, or CUSTOM followed by hc's type information
+
+  const void *get(size_t n);                                // returns pointer to next n bytes of image, or NULL (and sets rError) if past end of image
+  template <typename T> T get(){T v{}; const void *p=get(sizeof(T)); if(p) memcpy(&v,p,sizeof(T)); return(v);}   // reads next value from image
+  const char *getStr();                                     // returns pointer to next string in image (or NULL)
+  HapChar *getIndex();                                      // reads Characteristic index and returns matching HapChar (creating a Custom HapChar if needed)
+
+  size_t save(uint8_t *buf, size_t len);                    // writes image of current database into buf (if large enough) and returns size of image, or 0 if database contains values too large for an image
+  boolean load(const uint8_t *buf, size_t len);             // creates Accessories, Services, and Characteristics from image.  Returns false if image is invalid
+};
+
+///////////////////////////////
+
+struct SpanLoopPool{                         // optional pool of worker tasks that run the loop() methods of independent Services in parallel
+
+  struct slot_t {                             // one share of the independent Services to be run on each pass (slot 0 is run by pollTask() itself)
+    std::atomic<uint32_t> next;               // index of next Service in this share not yet claimed, either by the slot's own task or by another task stealing work
+    uint32_t end;                             // index one past the last Service in this share
+    TaskHandle_t task=NULL;                   // worker task that owns this slot (NULL for slot 0)
+    vector<SpanCharacteristic *, Mallocator<SpanCharacteristic *>> deferred;  // Characteristics updated by a worker task, waiting for notifications to be queued by pollTask()
+    vector<SpanTransaction *, Mallocator<SpanTransaction *>> transactions;   // transactions committed by a worker task, waiting to be applied by pollTask()
+  };
+
+  uint8_t nWorkers=0;                         // number of worker tasks (0=parallel loops disabled)
+  uint32_t stackSize;                         // stack size of each worker task
+  slot_t *slots=NULL;                         // nWorkers+1 slots
+  boolean active=false;                       // flag indicating worker tasks are running loop() methods
+  std::atomic<int> nBusy;                     // number of worker tasks that have not yet finished the current pass
+  std::atomic<uint32_t> nSteals{0};           // number of loop() methods run by a task other than the one whose share they were in
+  SemaphoreHandle_t done=NULL;                // given by last worker task to finish the current pass
+  vector<SpanService *, Mallocator<SpanService *>> Loops;   // independent Services with over-ridden loop() methods
+
+  void begin();                               // creates worker tasks, spread over all cores starting with the one not running pollTask()
+  void run();                                 // runs loop() for all independent Services across pollTask() and worker tasks, then queues any deferred notifications
+  void work(int n);                           // runs loop() for Services in slot n, then steals remaining Services from other slots
+  int workerSlot();                           // returns slot of calling task if it is a worker task running loop() methods, else returns 0
+  boolean defer(SpanCharacteristic *chr);     // if called from a worker task, defers notification of update to chr and returns true, else returns false
+  static void workerTask(void *arg);          // body of each worker task
+};
+
+///////////////////////////////
+
+struct SpanAsyncUpdate{                       // Characteristic update queued by setValAsync() or setStringAsync() for application at start of next pollTask()
+
+  enum : uint8_t {UINT, INT, FLOAT, DOUBLE, STRING};
+
+  SpanCharacteristic *characteristic;         // Characteristic to update (set to NULL if Characteristic is deleted before update is applied)
+  uint64_t value;                             // raw bits of new numeric value exactly as passed to setValAsync() (conversion to the format of the Characteristic is done when applied, since ISRs cannot use the FPU)
+  char *str;                                  // copy of new string value (NULL for numeric updates)
+  uint8_t type;                               // type of value (or STRING)
+
+  template <typename T> inline __attribute__((always_inline)) void setRaw(T val){     // stores integer val using integer operations only (safe in an ISR)
+    type=std::is_signed<T>::value?INT:UINT;
+    value=std::is_signed<T>::value?(uint64_t)(int64_t)val:(uint64_t)val;
+  }
+  inline __attribute__((always_inline)) void setRaw(float val){type=FLOAT;value=0;__builtin_memcpy(&value,&val,sizeof(float));}        // stores raw bits of val without any floating-point operation
+  inline __attribute__((always_inline)) void setRaw(double val){type=DOUBLE;__builtin_memcpy(&value,&val,sizeof(double));}
+};
+
+///////////////////////////////
+
 struct SpanBuf{                               // temporary storage buffer for use with putCharacteristicsURL() and checkTimedResets() 
   uint32_t aid=0;                             // updated aid 
   uint32_t iid=0;                             // updated iid
@@ -255,6 +547,10 @@ class Span{
   friend class SpanOTA;
   friend class Network_HS;
   friend class HAPClient;
+  friend struct SpanWarmStart;
+  friend struct SpanSnapshot;
+  friend struct SpanLoopPool;
+  friend class SpanTransaction;
   
   char *displayName;                            // display name for this device - broadcast as part of Bonjour MDNS
   char *hostNameBase;                           // base of hostName of this device - full host name broadcast by Bonjour MDNS will have 6-byte accessoryID as well as '.local' automatically appended
@@ -265,27 +561,52 @@ class Span{
   unsigned long snapTime;                       // current time (in millis) snapped before entering Service loops() or updates()
   boolean isInitialized=false;                  // flag indicating HomeSpan has been initialized
   boolean isBridge=true;                        // flag indicating whether device is configured as a bridge (i.e. first Accessory contains nothing but AccessoryInformation and HAPProtocolInformation)
+  boolean startupInfo=true;                     // flag indicating whether full configuration info is printed at startup (else only a validation summary)
   HapQR qrCode;                                 // optional QR Code to use for pairing
   const char *sketchVersion="n/a";              // version of the sketch
   char pairingCodeCommand[12]="";               // user-specified Pairing Code - only needed if Pairing Setup Code is specified in sketch using setPairingCode()
-  String lastClientIP="0.0.0.0";                // IP address of last client accessing device through encrypted channel
+  const char *lastClientIP="0.0.0.0";           // IP address of last client accessing device through encrypted channel
   boolean newCode;                              // flag indicating new application code has been loaded (based on keeping track of app SHA256)
   boolean serialInputDisabled=false;            // flag indiating that serial input is disabled
   uint8_t rebootCount=0;                        // counts number of times device was rebooted (used in optional Reboot callback)
   uint32_t rebootCallbackTime;                  // length of time to wait (in milliseconds) before calling optional Reboot callback
   boolean ethernetEnabled=false;                // flag to indicate whether Ethernet is being used instead of WiFi
   
-  nvs_handle charNVS;                           // handle for non-volatile-storage of Characteristics data
+  NVSStore nvsCharStore;                        // default storage of Characteristics data (in NVS)
+  SpanStore *charStore=&nvsCharStore;           // storage of Characteristics data actually used (may be replaced with setCharStore())
   nvs_handle wifiNVS=0;                         // handle for non-volatile-storage of WiFi data
   nvs_handle otaNVS;                            // handle for non-volatile storage of OTA data
   nvs_handle srpNVS;                            // handle for non-volatile storage of SRP data
   nvs_handle hapNVS;                            // handle for non-volatile-storage of HAP data
 
+  vector<SpanCharacteristic *, Mallocator<SpanCharacteristic *>> nvsDirty;   // Characteristics with values that have changed but have not yet been written to NVS
+  unsigned long nvsFirstDirty=0;                // time (in millis) of oldest change not yet written to NVS
+  unsigned long nvsLastDirty=0;                 // time (in millis) of most recent change not yet written to NVS
+  uint32_t nvsDebounceTime=DEFAULT_NVS_DEBOUNCE_TIME;   // time (in millis) without further changes before dirty values are written to NVS
+  uint32_t nvsMaxAge=DEFAULT_NVS_MAX_AGE;               // maximum time (in millis) a change is held before dirty values are written to NVS
+  uint32_t nvsSaves=0;                          // number of Characteristic value changes requiring storage in NVS
+  uint32_t nvsWrites=0;                         // number of Characteristic values actually written to NVS
+  uint32_t nvsCommits=0;                        // number of NVS commits performed
+  uint32_t nvsFailures=0;                       // number of Characteristic values that could not be written or committed to NVS (each is retried)
+  uint32_t nvsLoads=0;                          // number of saved Characteristic values loaded from NVS at startup
+  uint32_t nvsLoadTime=0;                       // total time (in micros) spent loading saved Characteristic values
+  SpanBulkNVS bulkNVS;                          // optional storage of saved Characteristic values as one blob per Accessory
+  SpanWarmStart warmStart;                      // optional snapshot of runtime state preserved across software restarts
+  SpanMap databaseMap;                          // database image mapped from flash partition (see mapDatabase())
+  SpanLoopPool loopPool;                        // optional pool of worker tasks for running loop() methods of independent Services in parallel
+  uint32_t loopPasses=0;                        // number of passes through all Service loop() methods
+  uint64_t loopTime=0;                          // total time (in micros) spent in all passes through Service loop() methods
+  SpanQueue<SpanAsyncUpdate> asyncQueue;        // lock-free queue of Characteristic updates made from other tasks and ISRs
+  uint16_t asyncQueueSize=DEFAULT_ASYNC_QUEUE_SIZE;     // number of slots in asyncQueue (allocated in begin())
+  uint32_t asyncApplied=0;                      // number of queued Characteristic updates applied by pollTask()
+  unsigned long pairedTime=0;                   // time (in millis) HS_PAIRED status was first reached after startup
+
   int connected=0;                              // WiFi connection status (increments upon each connect and disconnect)
   HS_ExpCounter wifiTimeCounter;                // exponentially-increasing wait time counter between WiFi connection attempts
   unsigned long alarmConnect=0;                 // time after which WiFi connection attempt should be tried again
   
   void (*wifiBegin)(const char *s, const char *p)=[](const char *s, const char *p){WiFi.begin(s,p);};     // default call to WiFi.begin()
+  boolean customWifiBegin=false;                                                                           // flag indicating wifiBegin has been over-ridden
  
   uint32_t rescanInitialTime=0;
   uint32_t rescanPeriodicTime=0;
@@ -317,6 +638,7 @@ class Span{
   Network_HS network;                               // configures WiFi and Setup Code via either serial monitor or temporary Access Point
   SpanWebLog webLog;                                // optional web status/log
   TaskHandle_t pollTaskHandle = NULL;               // optional task handle to use for poll() function
+  TaskHandle_t pollOwner = NULL;                    // task currently running pollTask() (and holding exclusive lock on pollMutex), else NULL
   TaskHandle_t loopTaskHandle;                      // Arduino Loop Task handle
   boolean verboseWifiReconnect = true;              // set to false to not print WiFi reconnect attempts messages
   std::shared_mutex pollMutex;                      // mutex lock for poll task
@@ -324,9 +646,13 @@ class Span{
   SpanOTA spanOTA;                                  // manages OTA process
   SpanConfig hapConfig;                             // track configuration changes to the HAP Accessory database; used to increment the configuration number (c#) when changes found
 
-  list<HAPClient, Mallocator<HAPClient>> hapList;                        // linked-list of HAPClient structures containing HTTP client connections, parsing routines, and state variables
-  list<HAPClient, Mallocator<HAPClient>>::iterator currentClient;        // iterator to current client
+  list<HAPClient, PoolAllocator<HAPClient,hapClientPool>> hapList;                    // linked-list of HAPClient structures containing HTTP client connections, parsing routines, and state variables
+  list<HAPClient, PoolAllocator<HAPClient,hapClientPool>>::iterator currentClient;    // iterator to current client
   vector<SpanAccessory *, Mallocator<SpanAccessory *>> Accessories;      // vector of pointers to all Accessories
+  vector<SpanAccessory *, Mallocator<SpanAccessory *>> aidIndex;         // pointers to all Accessories, sorted by aid (rebuilt as needed whenever Accessories are added or deleted)
+  boolean aidIndexValid=false;                                           // flag indicating aidIndex is up to date
+  int updateDepth=0;                                                     // number of nested beginUpdate() calls not yet committed
+  vector<SpanAccessory *, Mallocator<SpanAccessory *>> pendingDeletes;   // Accessories deleted since beginUpdate() that will be removed upon commitUpdate()
   vector<SpanService *, Mallocator<SpanService *>> Loops;                // vector of pointer to all Services that have over-ridden loop() methods
   vector<SpanBuf, Mallocator<SpanBuf>> Notifications;                    // vector of SpanBuf objects that store info for Characteristics that are updated with setVal() and require a Notification Event
   vector<SpanButton *,  Mallocator<SpanButton *>> PushButtons;           // vector of pointer to all PushButtons
@@ -337,7 +663,11 @@ class Span{
   void configureNetwork();                                               // configure Network services (MDNS, WebLog,  OTA, etc.) and start HAP Server
   void commandMode();                                                    // allows user to control and reset HomeSpan settings with the control button
   void resetStatus();                                                    // resets statusLED and calls statusCallback based on current HomeSpan status
-  void reboot();                                                         // reboots device
+  void reboot();                                                         // reboots device (after flushing any pending Characteristic values to NVS)
+  void discardNVS();                                                     // discards any pending Characteristic values without writing them to NVS
+  void updateLoops();                                                    // rebuilds Loop vector of Services with over-ridden loop() methods
+  void applyAsync();                                                     // applies all Characteristic updates queued by setValAsync() and setStringAsync()
+  SpanAccessory *findAccessory(uint32_t aid);                            // returns Accessory with matching aid (using aidIndex), or NULL if not found
 
   void printfAttributes(int flags=GET_VALUE|GET_META|GET_PERMS|GET_TYPE|GET_DESC);   // writes Attributes JSON database to hapOut stream
   
@@ -349,14 +679,12 @@ class Span{
   void clearNotify(HAPClient *hc);                                        // clear all notifications related to specific client connection
   void printfNotify(SpanBuf *pObj, int nObj, HAPClient *hc);              // writes notification JSON to hapOut stream based on SpanBuf objects and specified connection
 
-  static boolean invalidUUID(const char *uuid){
-    int x=0;
-    sscanf(uuid,"%*8[0-9a-fA-F]%n",&x);       // check for short-form of UUID
-    if(strlen(uuid)==x && uuid[0]!='0')
-      return(false);
-    sscanf(uuid,"%*8[0-9a-fA-F]-%*4[0-9a-fA-F]-%*4[0-9a-fA-F]-%*4[0-9a-fA-F]-%*12[0-9a-fA-F]%n",&x);
-    return(strlen(uuid)!=36 || x!=36);
+  static boolean validUUID(const char *uuid);                             // returns true if uuid is a valid short-form or long-form UUID
+  static int hapCharIndex(HapChar *hc){                                   // returns index of hc in hapChars, or -1 if hc is a Custom HapChar
+    HapChar *base=(HapChar *)&hapChars;
+    return((hc>=base && hc<base+sizeof(HapCharacteristics)/sizeof(HapChar))?hc-base:-1);
   }
+  void validateAccessories(boolean verbose, int &nErrors, int &nWarnings);   // validates Accessory database, counting errors and warnings (and printing details if verbose=true)
 
   QueueHandle_t networkEventQueue;                         // queue to transmit network events from callback thread to HomeSpan thread
   void networkCallback(WiFiEvent_t event);                 // network event handler (works for WiFi as well as Ethernet)
@@ -375,6 +703,17 @@ class Span{
   
   boolean updateDatabase(boolean updateMDNS=true);   // updates HAP Configuration Number and Loop vector; if updateMDNS=true and config number has changed, re-broadcasts MDNS 'c#' record; returns true if config number changed
   boolean deleteAccessory(uint32_t aid);             // deletes Accessory with matching aid; returns true if found, else returns false 
+  size_t exportDatabase(uint8_t *buf, size_t len);   // writes binary image of Accessory database into buf (if len is large enough); returns size of image
+  boolean exportDatabase(const char *key);           // writes binary image of Accessory database to NVS under key; returns true if successful
+  boolean loadDatabase(const uint8_t *buf, size_t len);   // creates Accessories from binary image in buf; returns false if image is invalid
+  boolean loadDatabase(const char *key);             // creates Accessories from binary image stored in NVS under key; returns false if not found or invalid
+  boolean exportDatabasePartition(const char *label);     // writes binary image of Accessory database to data partition with specified label; returns true if successful
+  boolean mapDatabase(const char *label);            // creates Accessories from binary image in data partition with specified label, leaving image mapped in flash; returns false if not found or invalid
+  SpanCharacteristic *getCharacteristic(uint32_t aid, uint32_t iid){return(find(aid,iid));}   // returns Characteristic with matching aid and iid (or NULL if not found)
+  int validateDatabase();                            // validates Accessory database without printing details; prints summary (with time taken) and returns number of errors found
+  Span& setStartupInfo(boolean verbose){startupInfo=verbose;return(*this);}   // sets whether full configuration info is printed at startup (true, the default) or only a validation summary (false)
+  Span& beginUpdate(){updateDepth++;return(*this);}  // starts a batch of Accessory additions and deletions that are applied together upon commitUpdate()
+  boolean commitUpdate();                            // completes batch started with beginUpdate(), deleting all Accessories marked for deletion and updating the database once; returns true if config number changed
 
   Span& setControlPin(uint8_t pin, PushButton::triggerType_t triggerType=PushButton::TRIGGER_ON_LOW){            // sets Control Pin, with optional trigger type   
     controlButton=new PushButton(pin, triggerType);
@@ -416,9 +755,19 @@ class Span{
   const char* statusString(HS_STATUS s);                                                 // returns char string for HomeSpan status change messages
   Span& setPairingCode(const char *s, boolean progCall=true);                            // sets the Pairing Code - use is NOT recommended.  Use 'S' from CLI instead
   void deleteStoredValues(){processSerialCommand("V");}                                  // deletes stored Characteristic values from NVS
+  Span& setNVSFlushTimes(uint32_t debounceTime, uint32_t maxAge=DEFAULT_NVS_MAX_AGE){nvsDebounceTime=debounceTime;nvsMaxAge=maxAge;return(*this);}  // sets debounce and maximum age (in millis) before changed Characteristic values are committed to NVS
+  void flushNVS();                                                                       // immediately writes and commits any pending Characteristic values to NVS
+  Span& setCharStore(SpanStore *store){charStore=store;return(*this);}                   // replaces NVS with another SpanStore (e.g. a FileStore) for saving Characteristic values - must be called before any Characteristics are created
+  Span& enableBulkNVS(){bulkNVS.enabled=true;return(*this);}                             // stores all saved Characteristic values for each Accessory in a single NVS blob - must be called before any Characteristics are created
+#if defined(__cpp_impl_coroutine)
+  SpanSleep sleep(std::chrono::milliseconds ms){return(SpanSleep{(uint32_t)ms.count()});}       // returns awaitable that suspends a coroutine (without blocking HomeSpan) for ms milliseconds
+#endif
+  Span& enableParallelLoops(uint8_t nWorkers=2, uint32_t stackSize=4096){loopPool.nWorkers=nWorkers;loopPool.stackSize=stackSize;return(*this);}  // runs loop() methods of Services marked with setIndependent() in parallel on nWorkers worker tasks plus the polling task - must be called before polling starts
+  Span& setAsyncQueueSize(uint16_t nSlots){asyncQueueSize=nSlots;return(*this);}       // sets number of slots in queue used by setValAsync() and setStringAsync() - must be called before begin()
+  Span& enableWarmRestart(){warmStart.load();return(*this);}                             // preserves database hash, saved Characteristic values, and WiFi channel/BSSID in RTC memory across software restarts - must be called before any Characteristics are created
   Span& resetIID(uint32_t newIID);                                                       // resets the IID count for the current Accessory to start at newIID
   Span& setControllerCallback(void (*f)()){controllerCallback=f;return(*this);}          // sets an optional user-defined function to call whenever a Controller is added/removed
-  Span& setWifiBegin(void (*f)(const char *, const char *)){wifiBegin=f;return(*this);}  // sets an optional user-defined function to over-ride WiFi.begin() with additional logic
+  Span& setWifiBegin(void (*f)(const char *, const char *)){wifiBegin=f;customWifiBegin=true;return(*this);}  // sets an optional user-defined function to over-ride WiFi.begin() with additional logic
 
   Span& setHostNameSuffix(const char *suffix){asprintf(&hostNameSuffix,"%s",suffix);return(*this);}      // sets the hostName suffix to be used instead of the 6-byte AccessoryID
  
@@ -471,8 +820,8 @@ class Span{
 
   Span& addBssidName(String bssid, string name){bssid.toUpperCase();bssidNames[bssid.c_str()]=name;return(*this);}
 
-  list<Controller, Mallocator<Controller>>::const_iterator controllerListBegin();
-  list<Controller, Mallocator<Controller>>::const_iterator controllerListEnd();
+  ControllerTable::const_iterator controllerListBegin();
+  ControllerTable::const_iterator controllerListEnd();
 
   [[deprecated("This homeSpan method has been deprecated and will be removed in a future version.  Please use the more generic setNetworkCallback() method instead.")]]
   Span& setWifiCallback(void (*f)()){wifiCallback=f;return(*this);}                      // sets an optional user-defined function to call once WiFi connectivity is initially established
@@ -489,10 +838,16 @@ class SpanAccessory{
   friend class SpanService;
   friend class SpanCharacteristic;
   friend class SpanButton;
+  friend struct SpanBulkNVS;
+  friend struct SpanWarmStart;
+  friend struct SpanSnapshot;
     
   uint32_t aid=0;                                               // Accessory Instance ID (HAP Table 6-1)
   uint32_t iidCount=0;                                          // running count of iid to use for Services and Characteristics associated with this Accessory                                 
   vector<SpanService *, Mallocator<SpanService*>> Services;     // vector of pointers to all Services in this Accessory  
+  uint8_t digest[48];                                           // SHA-384 hash of this Accessory's JSON attributes (excluding values)
+  boolean pendingDelete=false;                                  // flag indicating this Accessory was deleted within a batch update and will be removed upon commitUpdate()
+  boolean digestValid=false;                                    // flag indicating digest is up to date (cleared whenever a Service or Characteristic is added, deleted, or changed)
 
   void printfAttributes(int flags);                             // writes Accessory JSON to hapOut stream
 
@@ -515,18 +870,24 @@ class SpanService{
   friend class Span;
   friend class SpanAccessory;
   friend class SpanCharacteristic;
+  friend struct SpanBulkNVS;
+  friend struct SpanWarmStart;
+  friend struct SpanSnapshot;
+  friend struct SpanLoopPool;
 
   uint32_t iid=0;                                                                   // Instance ID (HAP Table 6-2)
   const char *type;                                                                 // Service Type
   const char *hapName;                                                              // HAP Name
   boolean hidden=false;                                                             // optional property indicating service is hidden
   boolean primary=false;                                                            // optional property indicating service is primary
+  boolean independent=false;                                                        // flag indicating loop() may run in parallel with loop() of other independent Services
   vector<SpanCharacteristic *, Mallocator<SpanCharacteristic*>> Characteristics;    // vector of pointers to all Characteristics in this Service  
   vector<SpanService *, Mallocator<SpanService *>> linkedServices;                  // vector of pointers to any optional linked Services
   boolean isCustom;                                                                 // flag to indicate this is a Custom Service
   SpanAccessory *accessory=NULL;                                                    // pointer to Accessory containing this Service
   
   void printfAttributes(int flags);                                                 // writes Service JSON to hapOut stream
+  void invalidateDigest(){accessory->digestValid=false;}                            // marks digest of containing Accessory as needing to be re-computed
 
   protected:
   
@@ -543,6 +904,7 @@ class SpanService{
   SpanService *setPrimary();                                                              // sets the Service Type to be primary and returns pointer to self
   SpanService *setHidden();                                                               // sets the Service Type to be hidden and returns pointer to self
   SpanService *addLink(SpanService *svc);                                                 // adds svc as a Linked Service and returns pointer to self
+  SpanService *setIndependent(){independent=true;return(this);}                           // marks loop() as safe to run in parallel with other independent Services (see enableParallelLoops()) and returns pointer to self
 
   template <typename T=SpanService *> vector<T, Mallocator<T>> getLinks(const char *hapName=NULL){     // returns linkedServices vector, mapped to <T>, for use as range in "for-each" loops
     vector<T, Mallocator<T>> v;
@@ -566,6 +928,16 @@ class SpanCharacteristic{
 
   friend class Span;
   friend class SpanService;
+  friend struct SpanBulkNVS;
+  friend struct SpanWarmStart;
+  friend struct SpanSnapshot;
+  friend struct SpanLoopPool;
+  friend class SpanTransaction;
+
+  struct BLOB_t {                               // length-prefixed byte array used to store DATA and TLV8 values in raw (un-encoded) form
+    size_t len;
+    uint8_t data[];
+  };
 
   union UVal {                                  
     boolean BOOL;
@@ -575,7 +947,8 @@ class SpanCharacteristic{
     uint64_t UINT64;
     int32_t INT;
     double FLOAT;
-    char * STRING = NULL;
+    char * STRING = NULL;                       // interned in stringPool (value and newValue share storage until a write diverges them)
+    BLOB_t * BLOB;
   };
 
   class EVLIST : public vector<HAPClient *, Mallocator<HAPClient *>>{      // vector of current connections that have subscribed to EV notifications for this Characteristic
@@ -592,18 +965,23 @@ class SpanCharacteristic{
   UVal value;                              // Characteristic Value
   uint8_t perms;                           // Characteristic Permissions
   FORMAT format;                           // Characteristic Format        
-  char *desc=NULL;                         // Characteristic Description (optional)
-  char *unit=NULL;                         // Characteristic Unit (optional)
+  const char *desc=NULL;                   // Characteristic Description (optional) - interned in stringPool
+  const char *unit=NULL;                   // Characteristic Unit (optional) - interned in stringPool
   UVal minValue;                           // Characteristic minimum (not applicable for STRING)
   UVal maxValue;                           // Characteristic maximum (not applicable for STRING)
   UVal stepValue;                          // Characteristic step size (not applicable for STRING)
   boolean staticRange;                     // Flag that indicates whether Range is static and cannot be changed with setRange()
   boolean customRange=false;               // Flag for custom ranges
-  char *validValues=NULL;                  // Optional JSON array of valid values.  Applicable only to uint8 Characteristics
-  char *nvsKey=NULL;                       // key for NVS storage of Characteristic value
+  const char *validValues=NULL;            // Optional JSON array of valid values.  Applicable only to uint8 Characteristics - interned in stringPool
+  char *nvsKey=NULL;                       // key for individual NVS storage of Characteristic value (not used when stored in a bulk blob)
+  boolean nvsStored=false;                 // flag indicating Characteristic value is saved in NVS
+  boolean nvsPending=false;                // flag indicating current value has changed but has not yet been written to NVS
+  boolean nvsMigrate=false;                // flag indicating value was loaded from an individual NVS key that should be erased once the value is committed to a bulk blob
   boolean isCustom;                        // flag to indicate this is a Custom Characteristic
   boolean setRangeError=false;             // flag to indicate attempt to set Range on Characteristic that does not support changes to Range
   boolean setValidValuesError=false;       // flag to indicate attempt to set Valid Values on Characteristic that does not support changes to Valid Values
+  boolean awaited=false;                   // flag to indicate a coroutine has awaited changes to this Characteristic with changed()
+  char *b64Str=NULL;                       // base-64 copy of DATA/TLV8 value most recently returned by getString() or getNewString()
   
   uint32_t aid=0;                          // Accessory ID - passed through from Service containing this Characteristic
   uint8_t updateFlag=0;                    // set to either 1 (for normal write) or 2 (for write-response) inside update() when Characteristic is successfully updated via Home App
@@ -613,13 +991,24 @@ class SpanCharacteristic{
   EVLIST evList;                           // vector of current connections that have subscribed to EV notifications for this Characteristic 
     
   void printfAttributes(int flags);                           // writes Characteristic JSON to hapOut stream
+  void invalidateDigest(){service->invalidateDigest();}       // marks digest of containing Accessory as needing to be re-computed
   StatusCode loadUpdate(char *val, char *ev, boolean wr);     // load updated val/ev from PUT /characteristic JSON request.  Return intitial HAP status code (checks to see if characteristic is found, is writable, etc.)  
   String uvPrint(UVal &u);                                    // returns "printable" String for any type of Characteristic  
+  void uvStream(UVal &u);                                     // prints same output as uvPrint() directly into hapOut, without creating any temporary Strings
   
   void uvSet(UVal &dest, UVal &src);                          // copies UVal src into UVal dest
   void uvSet(UVal &u, STRING_t val);                          // copies string val into UVal u
-  void uvSet(UVal &u, DATA_t data);                           // copies DATA data into UVal u (after transforming to a char *)
-  void uvSet(UVal &u, TLV_ENC_t tlv);                         // copies TLV8 tlv into UVal u (after transforming to a char *)
+  void uvSet(UVal &u, DATA_t data);                           // copies DATA data into UVal u (stored as raw bytes)
+  void uvSet(UVal &u, TLV_ENC_t tlv);                         // copies TLV8 tlv into UVal u (packed and stored as raw bytes)
+  uint8_t *uvAlloc(UVal &u, size_t len);                      // sizes BLOB in UVal u to hold len bytes and returns pointer to its data
+  boolean uvDecode(UVal &u, const char *b64);                 // decodes base-64 string b64 into BLOB in UVal u.  Returns false (leaving u unchanged) if b64 is not valid base-64 or decodes to more than MAX_DATA_LEN bytes
+  boolean dataLenCheck(size_t len, const char *method);       // returns true if len bytes fits in a DATA/TLV8 value, else logs warning and returns false
+
+  void nvsLoad();                                             // loads value from NVS, from either a bulk blob or an individual key (or stores initial value if not found)
+  boolean nvsRead();                                          // loads value from individual NVS key.  Returns false if not found
+  void nvsSetKey();                                           // creates nvsKey for individual NVS storage (if not already created)
+  void nvsSave();                                             // marks current value as needing to be written to NVS (actual write is deferred until homeSpan.flushNVS())
+  boolean nvsWrite();                                         // writes current value to NVS (without committing).  Returns false if value could not be written
 
   template <typename T> void uvSet(UVal &u, T val){           // copies numeric val into UVal u  
     switch(format){
@@ -649,7 +1038,7 @@ class SpanCharacteristic{
     } // switch
   }
  
-  char *getStringGeneric(UVal &val);                                      // gets the specified UVal for string-based Characteristics
+  const char *getStringGeneric(UVal &val);                                // gets the specified UVal for string-based Characteristics (read-only, since STRING values are shared through the StringPool)
   size_t getDataGeneric(uint8_t *data, size_t len, UVal &val);            // gets the specified UVal for data-based Characteristics
   size_t getTLVGeneric(TLV8 &tlv, UVal &val);                             // gets the specified UVal for tlv8-based Characteristics
   
@@ -678,6 +1067,7 @@ class SpanCharacteristic{
 
   void setValCheck();                                                     // initial check before setting value of any Characteristic
   void setValFinish(boolean notify);                                      // final processing after setting value of any Characteristic
+  void queueNotify();                                                     // queues EV notification (if applicable) and marks value for saving in NVS (if applicable)
    
   protected:
 
@@ -687,29 +1077,8 @@ class SpanCharacteristic{
 
     uvSet(value,val);
 
-    if(nvsStore){
-      nvsKey=(char *)HS_MALLOC(16);
-      uint16_t t;
-      sscanf(type,"%hx",&t);
-      sprintf(nvsKey,"%04X%08lX%03lX",t,aid,iid&0xFFF);
-      size_t len;    
-
-      if(format<FORMAT::STRING){
-        if(nvs_get_u64(homeSpan.charNVS,nvsKey,&(value.UINT64))!=ESP_OK) {
-          nvs_set_u64(homeSpan.charNVS,nvsKey,value.UINT64);                // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
-          nvs_commit(homeSpan.charNVS);                                     // commit to NVS  
-        }     
-      } else {
-        if(!nvs_get_str(homeSpan.charNVS,nvsKey,NULL,&len)){
-          value.STRING = (char *)HS_REALLOC(value.STRING,len);
-          nvs_get_str(homeSpan.charNVS,nvsKey,value.STRING,&len);
-        }
-        else {
-          nvs_set_str(homeSpan.charNVS,nvsKey,value.STRING);               // store string data
-          nvs_commit(homeSpan.charNVS);                                    // commit to NVS  
-        }
-      }
-    }
+    if(nvsStore)
+      nvsLoad();
   
     uvSet(newValue,value);
 
@@ -723,17 +1092,19 @@ class SpanCharacteristic{
 
   public:
 
+  static const size_t MAX_DATA_LEN=65535;                                                     // maximum size (in bytes) of a DATA or TLV8 value - lengths are stored as 16 bits in bulk NVS records and database images
+
   SpanCharacteristic(HapChar *hapChar, boolean isCustom=false);                               // SpanCharacteristic constructor
   void *operator new(size_t size){return(HS_MALLOC(size));}                                   // override new operator to use PSRAM when available
   void operator delete(void *p){free(p);}
 
   template <class T=int> T getVal(){return(uvGet<T>(value));}                                 // gets the value for numeric-based Characteristics
-  char *getString(){return(getStringGeneric(value));}                                         // gets the value for string-based Characteristics
+  const char *getString(){return(getStringGeneric(value));}                                   // gets the value for string-based Characteristics (base-64 encoded for data-based Characteristics) - read-only
   size_t getData(uint8_t *data, size_t len){return(getDataGeneric(data,len,value));}          // gets the value for data-based Characteristics
   size_t getTLV(TLV8 &tlv){return(getTLVGeneric(tlv,value));}                                 // gets the value for tlv8-based Characteristics
 
   template <class T=int> T getNewVal(){return(uvGet<T>(newValue));}                           // gets the newValue for numeric-based Characteristics
-  char *getNewString(){return(getStringGeneric(newValue));}                                   // gets the newValue for string-based Characteristics
+  const char *getNewString(){return(getStringGeneric(newValue));}                             // gets the newValue for string-based Characteristics (base-64 encoded for data-based Characteristics) - read-only
   size_t getNewData(uint8_t *data, size_t len){return(getDataGeneric(data,len,newValue));}    // gets the newValue for data-based Characteristics
   size_t getNewTLV(TLV8 &tlv){return(getTLVGeneric(tlv,newValue));}                           // gets the newValue for tlv8-based Characteristics
 
@@ -751,27 +1122,25 @@ class SpanCharacteristic{
     }
    
     uvSet(value,val);
-    uvSet(newValue,value);
-      
-    updateTime=homeSpan.snapTime;
-
-    if(notify){
-      if(updateFlag!=2){                        // do not broadcast EV if update is being done in context of write-response
-        SpanBuf sb;                             // create SpanBuf object
-        sb.characteristic=this;                 // set characteristic          
-        sb.status=StatusCode::OK;               // set status
-        char dummy[]="";
-        sb.val=dummy;                           // set dummy "val" so that printfNotify knows to consider this "update"
-        homeSpan.Notifications.push_back(sb);   // store SpanBuf in Notifications vector  
-      }
-    
-      if(nvsKey){
-        nvs_set_u64(homeSpan.charNVS,nvsKey,value.UINT64);            // store data as uint64_t regardless of actual type (it will be read correctly when access through uvGet())         
-        nvs_commit(homeSpan.charNVS);
-      }
-    }
+    setValFinish(notify);
     
   } // setVal()  
+
+  template <typename T> IRAM_ATTR boolean setValAsync(T val){                                 // queues new value for numeric-based Characteristic - safe to call from any task or (IRAM) ISR.  Returns false if not numeric-based
+    if(!xPortInIsrContext() && format>=FORMAT::STRING)                                        // Characteristic may be in PSRAM, which an ISR cannot safely read - format is then checked when value is applied
+      return(false);
+    SpanAsyncUpdate a;
+    a.characteristic=this;
+    a.str=NULL;
+    a.setRaw(val);                                                                            // value is converted to the format of the Characteristic by pollTask(), not here
+    return(homeSpan.asyncQueue.push(a));
+  }
+
+  boolean setStringAsync(const char *val);                                                    // queues new value for string-based Characteristic - safe to call from any task (but not from an ISR).  Returns false if not string-based or val is NULL
+
+#if defined(__cpp_impl_coroutine)
+  SpanChanged changed(){awaited=true;return(SpanChanged{this});}                             // returns awaitable that suspends a coroutine until value is next changed, either by Home App or by setVal()
+#endif
     
   boolean updated();                                  // returns true within update() if Characteristic was updated by Home App 
   unsigned long timeVal();                            // returns time elapsed (in millis) since value was last updated, either by Home App or by using setVal()
@@ -791,6 +1160,7 @@ class SpanCharacteristic{
       uvSet(maxValue,max);
       uvSet(stepValue,step);  
       customRange=true; 
+      invalidateDigest();
     } else
       setRangeError=true;
       
@@ -801,6 +1171,54 @@ class SpanCharacteristic{
 
 ///////////////////////////////
 
+class SpanTransaction {
+
+  struct staged_t {
+    SpanCharacteristic *characteristic;
+    SpanCharacteristic::UVal value;
+  };
+
+  vector<staged_t, Mallocator<staged_t>> staged;      // values staged for Characteristics (at most one per Characteristic)
+  SpanTransaction *prev=NULL;                         // previous transaction in list of all open transactions
+  SpanTransaction *next=NULL;                         // next transaction in list of all open transactions
+
+  static SpanTransaction *openList;                   // all open transactions, so values staged for a Characteristic can be dropped if it is deleted
+  static std::mutex listMutex;                        // protects openList and the staged values of every open transaction (transactions may be built by any task, while forget() is called by pollTask())
+
+  SpanCharacteristic::UVal &stage(SpanCharacteristic *chr);   // returns staged value for chr (adding new entry if chr not yet staged) - caller must hold listMutex until it has finished writing the value
+  void release(staged_t &s);                                   // releases any storage used by staged value
+  void clear();                                                // releases all staged values - caller must hold listMutex
+
+  public:
+
+  SpanTransaction();
+  ~SpanTransaction();                                          // any values not committed are discarded
+
+  static void forget(SpanCharacteristic *chr);                 // discards any values staged for chr in all open transactions (called when chr is deleted)
+
+  SpanTransaction(const SpanTransaction&)=delete;
+  SpanTransaction& operator=(const SpanTransaction&)=delete;
+
+  template <typename T> SpanTransaction& setVal(SpanCharacteristic *chr, T val){      // stages new value for numeric-based Characteristic
+    if(!((val >= chr->uvGet<T>(chr->minValue)) && (val <= chr->uvGet<T>(chr->maxValue)))){
+      LOG0("\n*** WARNING:  Attempt to update Characteristic::%s with setVal(%g) is out of range [%g,%g].  This may cause device to become non-responsive!\n\n",
+      chr->hapName,(double)val,chr->uvGet<double>(chr->minValue),chr->uvGet<double>(chr->maxValue));
+    }
+    std::lock_guard<std::mutex> lock(listMutex);
+    chr->uvSet(stage(chr),val);
+    return(*this);
+  }
+
+  SpanTransaction& setString(SpanCharacteristic *chr, const char *val){std::lock_guard<std::mutex> lock(listMutex);chr->uvSet(stage(chr),val);return(*this);}                           // stages new value for string-based Characteristic
+  SpanTransaction& setData(SpanCharacteristic *chr, const uint8_t *data, size_t len){if(chr->dataLenCheck(len,"setData")){std::lock_guard<std::mutex> lock(listMutex);chr->uvSet(stage(chr),DATA_t(data,len));}return(*this);}  // stages new value for data-based Characteristic
+
+  void commit();            // atomically applies all staged values, generating notifications and marking stored values for saving together (if called from an independent loop() on a worker task, values are applied by pollTask() once all loops have finished)
+  void abort();             // discards all staged values
+  int size(){std::lock_guard<std::mutex> lock(listMutex);return(staged.size());}     // returns number of Characteristics with staged values
+};
+
+///////////////////////////////
+
 class SpanButton : public PushButton {
 
   friend class Span;
@@ -29,15 +29,19 @@
 
 #ifndef HS_MALLOC
 
+inline thread_local uint32_t hsHeapCalls=0;      // number of HS_MALLOC, HS_CALLOC, and HS_REALLOC calls made by the calling task (compared before and after an operation to count its heap calls)
+
+inline void *hsCountHeapCall(void *p){hsHeapCalls++; return(p);}
+
 #if defined(BOARD_HAS_PSRAM)
-#define HS_MALLOC ps_malloc
-#define HS_CALLOC ps_calloc
-#define HS_REALLOC ps_realloc
+#define HS_MALLOC(n) hsCountHeapCall(ps_malloc(n))
+#define HS_CALLOC(n,s) hsCountHeapCall(ps_calloc(n,s))
+#define HS_REALLOC(p,n) hsCountHeapCall(ps_realloc(p,n))
 #define ps_new(X) new(ps_malloc(sizeof(X)))X
 #else
-#define HS_MALLOC malloc
-#define HS_CALLOC calloc
-#define HS_REALLOC realloc
+#define HS_MALLOC(n) hsCountHeapCall(malloc(n))
+#define HS_CALLOC(n,s) hsCountHeapCall(calloc(n,s))
+#define HS_REALLOC(p,n) hsCountHeapCall(realloc(p,n))
 #define ps_new(X) new X
 #endif
 
@@ -57,6 +57,33 @@ SRP6A::SRP6A(){
   
   mbedtls_mpi_read_string(&N,16,N3072);
   mbedtls_mpi_lset(&g,g3072);
+
+  if(!constantsReady){
+
+    TempBuffer<uint8_t> tBuf(768);                  // temporary buffer for staging
+    TempBuffer<uint8_t> tHash(64);                  // temporary buffer for storing SHA-512 results
+
+    // compute k = SHA512( N | PAD(g) )
+  
+    mbedtls_mpi_write_binary(&N,tBuf,384);          // write N into first half of staging buffer
+    mbedtls_mpi_write_binary(&g,tBuf+384,384);      // write g into second half of staging buffer (fully padded with leading zeros)
+    mbedtls_sha512(tBuf,768,hashK,0);               // create hash of data
+
+    // compute SHA512(N) xor SHA512(g)
+
+    mbedtls_sha512(tBuf,384,tHash,0);               // create hash of N (still in first half of staging buffer)
+    mbedtls_sha512(&g3072,1,hashNg,0);              // create hash of g
+    for(int i=0;i<64;i++)
+      hashNg[i]^=tHash[i];
+
+    // compute SHA512(I)
+
+    mbedtls_sha512((uint8_t *)I,strlen(I),hashI,0);
+
+    constantsReady=true;
+  }
+
+  mbedtls_mpi_read_binary(&k,hashK,64);             // load k
     
 }
 
@@ -116,10 +143,9 @@ void SRP6A::createVerifyCode(const char *setupCode, Verification *vData){
 
 //////////////////////////////////////
 
-void SRP6A::createPublicKey(const Verification *vData, uint8_t *publicKey){
+void SRP6A::precompute(const Verification *vData){
 
-  TempBuffer<uint8_t> tBuf(768);                  // temporary buffer for staging
-  TempBuffer<uint8_t> tHash(64);                  // temporary buffer for storing SHA-512 results
+  uint32_t startTime=micros();
   TempBuffer<uint8_t> privateKey(32);             // temporary buffer for generating private key random numbers
 
   // load stored salt, s, and verification code, v
@@ -132,20 +158,27 @@ void SRP6A::createPublicKey(const Verification *vData, uint8_t *publicKey){
   randombytes_buf(privateKey,32);                 // generate 32 random bytes for private key                     
   mbedtls_mpi_read_binary(&b,privateKey,32);      // load private key into b
     
-  // compute k = SHA512( N | PAD(g) )
-  
-  mbedtls_mpi_write_binary(&N,tBuf,384);          // write N into first half of staging buffer
-  mbedtls_mpi_write_binary(&g,tBuf+384,384);      // write g into second half of staging buffer (fully padded with leading zeros)
-  mbedtls_sha512(tBuf,768,tHash,0);               // create hash of data
-  mbedtls_mpi_read_binary(&k,tHash,64);           // load hash result into k  
-
-  // compute B = (k*v + g^b) %N
+  // compute B = (k*v + g^b) %N  (k was already computed in constructor)
   
   mbedtls_mpi_mul_mpi(&t1,&k,&v);                 // t1 = k*v
   mbedtls_mpi_exp_mod(&t2,&g,&b,&N,&_rr);         // t2 = g^b %N
   mbedtls_mpi_add_mpi(&t3,&t1,&t2);               // t3 = t1 + t2
   mbedtls_mpi_mod_mpi(&B,&t3,&N);                 // B = t3 %N      = ACCESSORY PUBLIC KEY
 
+  memcpy(precomputedSalt,vData->salt,16);
+  precomputed=true;
+  precomputeTime=micros()-startTime;
+}
+
+//////////////////////////////////////
+
+void SRP6A::createPublicKey(const Verification *vData, uint8_t *publicKey){
+
+  if(!precomputed || memcmp(precomputedSalt,vData->salt,16))    // b and B were not precomputed, or were precomputed for a different Setup Code
+    precompute(vData);
+
+  precomputed=false;                              // b must never be used for more than one pairing attempt
+
   mbedtls_mpi_write_binary(&B,publicKey,384);     // write B into publicKey (padding with initial zeros is less than 384 bytes)
 
 }
@@ -195,14 +228,8 @@ int SRP6A::verifyClientProof(const uint8_t *proof){
 
   // compute M1V = SHA512( SHA512(N) xor SHA512(g) | SHA512(I) | s | A | B | K )
 
-  mbedtls_mpi_write_binary(&N,tBuf,384);             // write N into staging buffer
-  mbedtls_sha512(tBuf,384,tHash,0);                  // create hash of data
-  mbedtls_sha512(&g3072,1,tBuf,0);                   // create hash of g, but place output directly into staging buffer
-
-  for(int i=0;i<64;i++)                              // H(g) ->  H(g) XOR H(N), with results in first 64 bytes of staging buffer
-    tBuf[i]^=tHash[i];
- 
-  mbedtls_sha512((uint8_t *)I,strlen(I),tBuf+64,0);     // create hash of userName and concatenate result to end of staging buffer
+  memcpy(tBuf,hashNg,64);                            // H(N) XOR H(g) was already computed in constructor
+  memcpy(tBuf+64,hashI,64);                          // as was hash of userName
 
   mbedtls_mpi_write_binary(&s,tBuf+128,16);           // concatenate s to staging buffer
 
@@ -255,6 +282,10 @@ void SRP6A::print(mbedtls_mpi *mpi){
 
 //////////////////////////////////////
 
+uint8_t SRP6A::hashK[64];
+uint8_t SRP6A::hashNg[64];
+uint8_t SRP6A::hashI[64];
+boolean SRP6A::constantsReady=false;
 constexpr char SRP6A::N3072[];
 constexpr char SRP6A::I[];
 const uint8_t SRP6A::g3072;
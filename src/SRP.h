@@ -85,15 +85,25 @@ struct SRP6A {
   mbedtls_mpi t3;         // temp3                        - temporary mpi structures for intermediate results
   mbedtls_mpi _rr;        // _rr                          - temporary "helper" for large exponential modulus calculations
 
+  static uint8_t hashK[64];       // k = H(N | PAD(g))            - computed only once, since N and g are constants
+  static uint8_t hashNg[64];      // H(N) xor H(g)                - computed only once (used in M1 proof)
+  static uint8_t hashI[64];       // H(I)                         - computed only once (used in M1 proof)
+  static boolean constantsReady;  // flag indicating above hashes have been computed
 
-  SRP6A();                                         // initializes N, G, and computes k
+  boolean precomputed=false;      // flag indicating b and B have been computed ahead of time and not yet used
+  uint8_t precomputedSalt[16];    // salt of verification data used to precompute B
+  uint32_t precomputeTime=0;      // time (in micros) taken to precompute b and B
+
+
+  SRP6A();                                         // initializes N, g, and k (computing constant hashes upon first use)
   ~SRP6A();
 
   void *operator new(size_t size){return(HS_MALLOC(size));}     // override new operator to use PSRAM when available
   void operator delete(void *p){free(p);}
   
   void createVerifyCode(const char *setupCode, Verification *vData);                    // generates random s and computes v; writes back resulting Verification Data
-  void createPublicKey(const Verification *vData, uint8_t *publicKey);                  // generates random b and computes k and B; writes back resulting Accessory Public Key 
+  void precompute(const Verification *vData);                                           // generates random b and computes B ahead of time so that createPublicKey() can return immediately
+  void createPublicKey(const Verification *vData, uint8_t *publicKey);                  // writes back Accessory Public Key, B (computing b and B now, unless already precomputed for vData)
   void createSessionKey(const uint8_t *publicKey, size_t len);                          // computes u, S, and K from Client Public Key, A (of variable length)
   int verifyClientProof(const uint8_t *proof);                                          // verifies Client Proof, M1, received from HAP client (return 1 on success, 0 on failure)
   void createAccProof(uint8_t *proof);                                                  // computes M2; write back resulting Accessory Proof
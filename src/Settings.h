@@ -56,6 +56,17 @@
 
 #define     DEFAULT_REBOOT_CALLBACK_TIME  5000            // default time (in milliseconds) to check for reboot callback
 
+#define     DEFAULT_NVS_DEBOUNCE_TIME     1000            // default time (in milliseconds) without further changes before saved Characteristic values are committed to NVS
+#define     DEFAULT_NVS_MAX_AGE           10000           // default maximum time (in milliseconds) any change to a saved Characteristic value is held before being committed to NVS
+
+#define     DEFAULT_RESUME_SESSIONS       8               // number of verified sessions cached for Pair-Resume
+#define     DEFAULT_RESUME_TTL            3600            // time (in seconds) after a session is verified during which it may be resumed with Pair-Resume
+#define     DEFAULT_CRYPTO_STACK_SIZE     8192            // stack size (in bytes) of background task that performs Pair-Setup and Pair-Verify cryptography
+
+#define     DEFAULT_TLV8_RECORDS          32              // number of TLV8 records preallocated in the pool shared by all TLV8 objects (further records are taken from the heap)
+
+#define     DEFAULT_ASYNC_QUEUE_SIZE      32              // default number of slots in the lock-free queue used by setValAsync() and setStringAsync() - rounded up to a power of 2
+
 /////////////////////////////////////////////////////
 //              OTA PARTITION INFO                 //
 
@@ -0,0 +1,272 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+/////////////////////////////////////////////////
+// Optional C++20 coroutine API for expressing
+// time-based Service behaviour as straight-line
+// code instead of state machines in loop().  A
+// member function returning SpanTask may use:
+//
+//   co_await homeSpan.sleep(500ms);
+//   co_await characteristic->changed();
+//
+// Suspended coroutines are kept by SpanScheduler
+// (sleepers in a min-heap ordered by wake time,
+// and waiters keyed by the Characteristic they are
+// waiting on), so a Service whose coroutine is
+// suspended costs nothing on each pass through
+// HomeSpan's polling.  Coroutine frames come from
+// SpanFramePool, which recycles freed frames by
+// size class.  Everything here is compiled only if
+// the compiler supports coroutines.
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#if !defined(ARDUINO)
+#define HS_MALLOC malloc
+#endif
+
+/////////////////////////////////////////////////
+// Recycles coroutine frames, which are all freed
+// and re-allocated whenever a Service restarts a
+// coroutine, without returning them to the heap.
+// Frames larger than the largest size class are
+// taken from (and returned to) the heap directly.
+
+class SpanFramePool {
+
+  static const size_t GRANULE=32;                   // size classes are multiples of GRANULE bytes
+  static const int N_CLASSES=16;                    // frames up to N_CLASSES*GRANULE bytes are recycled
+
+  struct free_t {
+    free_t *next;
+  };
+
+  free_t *freeList[N_CLASSES]={};                   // list of freed frames for each size class
+
+  public:
+
+  uint32_t nAllocs=0;                               // number of frames allocated
+  uint32_t nReused=0;                               // number of frames allocated by reusing a freed frame
+
+  void *alloc(size_t size){                         // returns NULL if heap is exhausted
+    nAllocs++;
+    size_t c=(size-1)/GRANULE;
+    if(c>=N_CLASSES)
+      return(HS_MALLOC(size));
+    if(freeList[c]){
+      nReused++;
+      free_t *p=freeList[c];
+      freeList[c]=p->next;
+      return(p);
+    }
+    return(HS_MALLOC((c+1)*GRANULE));
+  }
+
+  void release(void *p, size_t size){
+    size_t c=(size-1)/GRANULE;
+    if(c>=N_CLASSES){
+      free(p);
+      return;
+    }
+    ((free_t *)p)->next=freeList[c];
+    freeList[c]=(free_t *)p;
+  }
+};
+
+/////////////////////////////////////////////////
+// Holds all suspended coroutines and resumes them
+// from run(), which HomeSpan calls once on each
+// pass through its polling (after all Service
+// loop() methods).  Characteristics call notify()
+// whenever their value changes.
+
+struct SpanScheduler {
+
+  struct sleeper_t {
+    uint32_t wakeTime;                              // time (in millis) at which coroutine should be resumed
+    std::coroutine_handle<> handle;
+    bool operator<(const sleeper_t &s) const {return((int32_t)(wakeTime-s.wakeTime)>0);}    // reversed so std heap functions keep earliest wakeTime on top
+  };
+
+  struct waiter_t {
+    const void *source;                             // Characteristic being waited on
+    std::coroutine_handle<> handle;
+  };
+
+  static inline std::vector<sleeper_t> sleepers;    // coroutines suspended by sleep(), kept as a heap
+  static inline std::vector<waiter_t> waiters;      // coroutines suspended by changed()
+  static inline std::vector<std::coroutine_handle<>> ready;     // coroutines to be resumed on next call to run()
+  static inline std::vector<std::coroutine_handle<>> resuming;  // coroutines being resumed by current call to run() (entries are set to nullptr if cancelled before being resumed)
+  static inline SpanFramePool framePool;            // pool of coroutine frames
+
+  static uint32_t now(){
+#if defined(ARDUINO)
+    return(millis());
+#else
+    return(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+  }
+
+  static void notify(const void *source){           // moves all coroutines waiting on source to ready list
+    for(auto w=waiters.begin(); w!=waiters.end();){
+      if(w->source==source){
+        ready.push_back(w->handle);
+        w=waiters.erase(w);
+      } else
+        w++;
+    }
+  }
+
+  static void run(){                                // resumes all coroutines whose sleep has expired or whose Characteristic has changed
+    uint32_t t=now();
+    while(!sleepers.empty() && (int32_t)(t-sleepers.front().wakeTime)>=0){
+      std::pop_heap(sleepers.begin(),sleepers.end());
+      ready.push_back(sleepers.back().handle);
+      sleepers.pop_back();
+    }
+    if(ready.empty())
+      return;
+    resuming.swap(ready);                           // coroutines made ready while these are resumed will be resumed on next call
+    for(size_t i=0;i<resuming.size();i++){          // a resumed coroutine may cancel another one further down the list, so check each entry again just before resuming it
+      if(resuming[i])
+        resuming[i].resume();
+    }
+    resuming.clear();
+  }
+
+  static void remove(std::coroutine_handle<> h){    // removes all references to h (used when a coroutine is cancelled)
+    sleepers.erase(std::remove_if(sleepers.begin(),sleepers.end(),[h](sleeper_t &s){return(s.handle==h);}),sleepers.end());
+    std::make_heap(sleepers.begin(),sleepers.end());
+    waiters.erase(std::remove_if(waiters.begin(),waiters.end(),[h](waiter_t &w){return(w.handle==h);}),waiters.end());
+    ready.erase(std::remove(ready.begin(),ready.end(),h),ready.end());
+    std::replace(resuming.begin(),resuming.end(),h,std::coroutine_handle<>());     // cannot erase, since run() may be iterating over resuming
+  }
+
+  static void forget(const void *source){           // drops all coroutines waiting on source (used when a Characteristic is deleted).  They remain suspended until cancelled by their SpanTask
+    waiters.erase(std::remove_if(waiters.begin(),waiters.end(),[source](waiter_t &w){return(w.source==source);}),waiters.end());
+  }
+
+  static size_t size(){return(sleepers.size()+waiters.size()+ready.size());}     // returns number of suspended coroutines
+};
+
+/////////////////////////////////////////////////
+// Awaitable returned by homeSpan.sleep()
+
+struct SpanSleep {
+
+  uint32_t duration;
+
+  bool await_ready(){return(duration==0);}
+  void await_suspend(std::coroutine_handle<> h){
+    SpanScheduler::sleepers.push_back({SpanScheduler::now()+duration,h});
+    std::push_heap(SpanScheduler::sleepers.begin(),SpanScheduler::sleepers.end());
+  }
+  void await_resume(){}
+};
+
+/////////////////////////////////////////////////
+// Awaitable returned by SpanCharacteristic::changed()
+
+struct SpanChanged {
+
+  const void *source;
+
+  bool await_ready(){return(false);}
+  void await_suspend(std::coroutine_handle<> h){SpanScheduler::waiters.push_back({source,h});}
+  void await_resume(){}
+};
+
+/////////////////////////////////////////////////
+// Return type of a coroutine.  The coroutine runs
+// immediately when called, up to its first
+// co_await.  The returned SpanTask owns the
+// coroutine, and cancels it if destroyed first,
+// so it must be kept (typically as a member of
+// the Service running the coroutine).  If there is
+// no memory for the coroutine's frame, it does not
+// run and the returned SpanTask is empty.
+
+class [[nodiscard]] SpanTask {
+
+  public:
+
+  struct promise_type {
+    SpanTask get_return_object(){return(SpanTask(std::coroutine_handle<promise_type>::from_promise(*this)));}
+    std::suspend_never initial_suspend() noexcept {return{};}
+    std::suspend_always final_suspend() noexcept {return{};}
+    void return_void(){}
+    void unhandled_exception(){abort();}
+    static SpanTask get_return_object_on_allocation_failure(){return(SpanTask());}      // makes the compiler check operator new for NULL rather than expect an exception
+    static void *operator new(size_t size) noexcept {return(SpanScheduler::framePool.alloc(size));}
+    static void operator delete(void *p, size_t size){SpanScheduler::framePool.release(p,size);}
+  };
+
+  private:
+
+  std::coroutine_handle<promise_type> handle;
+
+  explicit SpanTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+  public:
+
+  SpanTask(){}
+  SpanTask(SpanTask &&t) : handle(t.handle) {t.handle=nullptr;}
+  SpanTask& operator=(SpanTask &&t){
+    if(this!=&t){
+      cancel();
+      handle=t.handle;
+      t.handle=nullptr;
+    }
+    return(*this);
+  }
+  SpanTask(const SpanTask&)=delete;
+  SpanTask& operator=(const SpanTask&)=delete;
+  ~SpanTask(){cancel();}
+
+  bool done(){return(!handle || handle.done());}    // returns true if coroutine has finished (or was never started)
+
+  void cancel(){                                    // stops coroutine (if not finished) and frees its frame
+    if(!handle)
+      return;
+    if(!handle.done())
+      SpanScheduler::remove(handle);
+    handle.destroy();
+    handle=nullptr;
+  }
+};
+
+#endif
@@ -0,0 +1,143 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/////////////////////////////////////////////////
+// Read-only memory mapping of a binary image.
+// On an ESP32 the image is a data partition,
+// identified by its label, that is mapped into
+// the data address space with esp_partition_mmap()
+// so it can be read directly from flash without
+// using any heap.  On a host the image is a file,
+// identified by its path, that is mapped with
+// POSIX mmap(), so the mapping can be tested on
+// a computer (see tools/testMap.cpp).
+
+#if defined(ESP_PLATFORM)
+
+#include <esp_partition.h>
+
+class SpanMap {
+
+  const esp_partition_t *partition=NULL;
+  esp_partition_mmap_handle_t handle;
+  const uint8_t *data=NULL;
+  size_t len=0;
+
+  public:
+
+  ~SpanMap(){unmap();}
+
+  bool map(const char *label){                      // maps entire data partition with specified label; returns false if not found or cannot be mapped
+    unmap();
+    if(!(partition=esp_partition_find_first(ESP_PARTITION_TYPE_DATA,ESP_PARTITION_SUBTYPE_ANY,label)))
+      return(false);
+    const void *p;
+    if(esp_partition_mmap(partition,0,partition->size,ESP_PARTITION_MMAP_DATA,&p,&handle)!=ESP_OK)
+      return(false);
+    data=(const uint8_t *)p;
+    len=partition->size;
+    return(true);
+  }
+
+  void unmap(){
+    if(data)
+      esp_partition_munmap(handle);
+    data=NULL;
+    len=0;
+  }
+
+  static bool write(const char *label, const uint8_t *buf, size_t n){     // erases data partition with specified label and writes n bytes of buf; returns false if not found or too small
+    const esp_partition_t *p=esp_partition_find_first(ESP_PARTITION_TYPE_DATA,ESP_PARTITION_SUBTYPE_ANY,label);
+    if(!p || n>p->size)
+      return(false);
+    size_t eraseLen=(n+p->erase_size-1)/p->erase_size*p->erase_size;
+    return(esp_partition_erase_range(p,0,eraseLen)==ESP_OK && esp_partition_write(p,0,buf,n)==ESP_OK);
+  }
+
+  const uint8_t *get(){return(data);}               // returns pointer to mapped image, or NULL if not mapped
+  size_t size(){return(len);}                       // returns size of mapped image
+};
+
+#else
+
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class SpanMap {
+
+  const uint8_t *data=NULL;
+  size_t len=0;
+
+  public:
+
+  ~SpanMap(){unmap();}
+
+  bool map(const char *path){                       // maps entire file at specified path; returns false if not found or cannot be mapped
+    unmap();
+    int fd=open(path,O_RDONLY);
+    if(fd<0)
+      return(false);
+    struct stat st;
+    void *p=MAP_FAILED;
+    if(fstat(fd,&st)==0 && st.st_size>0)
+      p=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(p==MAP_FAILED)
+      return(false);
+    data=(const uint8_t *)p;
+    len=st.st_size;
+    return(true);
+  }
+
+  void unmap(){
+    if(data)
+      munmap((void *)data,len);
+    data=NULL;
+    len=0;
+  }
+
+  static bool write(const char *path, const uint8_t *buf, size_t n){      // replaces file at specified path with n bytes of buf
+    FILE *fp=fopen(path,"wb");
+    if(!fp)
+      return(false);
+    bool success=(fwrite(buf,1,n,fp)==n);
+    return(fclose(fp)==0 && success);
+  }
+
+  const uint8_t *get(){return(data);}
+  size_t size(){return(len);}
+};
+
+#endif
@@ -0,0 +1,144 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+#if defined(ESP_PLATFORM)
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#else
+#define IRAM_ATTR
+#endif
+
+/////////////////////////////////////////////////
+// Bounded, lock-free, multi-producer/single-
+// consumer ring buffer.  Each cell carries a
+// sequence number that tells producers whether
+// the cell is free and tells the consumer whether
+// the cell has been published, so a push() never
+// blocks and never takes a lock (it only retries
+// its compare-exchange if another producer claimed
+// the same cell first).  This makes push() safe to
+// call from any task and from interrupts, as long
+// as T is trivially copyable.  On an ESP32, push()
+// and the ring are placed in internal RAM so that
+// push() also works from an IRAM interrupt while
+// the flash cache is disabled.  pop() and forEach()
+// may only be called by the single consumer.
+
+template <class T>
+class SpanQueue {
+
+  struct cell_t {
+    std::atomic<uint32_t> seq;
+    T data;
+  };
+
+  cell_t *cells=NULL;                               // ring memory (cells are placed in internal RAM so atomic operations work on all chips)
+  uint32_t mask=0;                                  // number of cells minus one (number of cells is always a power of 2)
+  std::atomic<uint32_t> head{0};                    // next position to be claimed by a producer
+  uint32_t tail=0;                                  // next position to be read by the consumer
+
+  public:
+
+  std::atomic<uint32_t> nDropped{0};                // number of push() calls rejected because the ring was full (or not yet allocated)
+
+  ~SpanQueue(){free(cells);}
+
+  bool begin(uint32_t n){                           // allocates ring of at least n cells (rounded up to a power of 2); must be called once before any producers start
+    uint32_t size=2;
+    while(size<n)
+      size<<=1;
+#if defined(ESP_PLATFORM)
+    cells=(cell_t *)heap_caps_malloc(size*sizeof(cell_t),MALLOC_CAP_INTERNAL|MALLOC_CAP_8BIT);
+#else
+    cells=(cell_t *)malloc(size*sizeof(cell_t));
+#endif
+    if(!cells)
+      return(false);
+    for(uint32_t i=0;i<size;i++)
+      new(&cells[i].seq) std::atomic<uint32_t>(i);
+    mask=size-1;
+    return(true);
+  }
+
+  IRAM_ATTR bool push(const T &item){                         // adds item to ring; returns false (and increments nDropped) if ring is full
+    if(!cells){
+      nDropped.fetch_add(1,std::memory_order_relaxed);
+      return(false);
+    }
+    uint32_t pos=head.load(std::memory_order_relaxed);
+    cell_t *cell;
+    while(1){
+      cell=cells+(pos&mask);
+      int32_t diff=(int32_t)(cell->seq.load(std::memory_order_acquire)-pos);
+      if(diff==0){                                                              // cell is free - try to claim it
+        if(head.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+          break;
+      } else if(diff<0){                                                        // cell still holds an item from one lap ago - ring is full
+        nDropped.fetch_add(1,std::memory_order_relaxed);
+        return(false);
+      } else {                                                                  // another producer claimed cell - reload head and try again
+        pos=head.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data=item;
+    cell->seq.store(pos+1,std::memory_order_release);                           // publish item to consumer
+    return(true);
+  }
+
+  bool pop(T &item){                                // removes oldest published item from ring; returns false if there is none
+    if(!cells)
+      return(false);
+    cell_t *cell=cells+(tail&mask);
+    if(cell->seq.load(std::memory_order_acquire)!=tail+1)
+      return(false);
+    item=cell->data;
+    cell->seq.store(tail+mask+1,std::memory_order_release);                     // free cell for use by producers on their next lap
+    tail++;
+    return(true);
+  }
+
+  template <class F, class W> void forEach(F f, W wait){     // calls f(T &item) for every item pushed (or being pushed) but not yet popped, allowing the consumer to amend items in place
+    if(!cells)
+      return;
+    uint32_t end=head.load(std::memory_order_acquire);
+    for(uint32_t pos=tail;pos!=end;pos++){                                      // visit every claimed cell, calling wait() until any a producer is still filling has been published
+      while(cells[pos&mask].seq.load(std::memory_order_acquire)!=pos+1)
+        wait();
+      f(cells[pos&mask].data);
+    }
+  }
+
+  uint32_t capacity(){return(cells?mask+1:0);}
+};
@@ -0,0 +1,537 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+
+#include <esp_rom_crc.h>
+
+#include "HomeSpan.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Binary image of an Accessory database, which can be exported from a running device and later loaded
+//  in place of the Arduino code that would otherwise construct the database one object at a time.
+//
+//  Image layout (all values little-endian):
+//
+//    header_t
+//    for each Accessory:       aid(4), iidCount(4), nServices(2)
+//      for each Service:       type(str), hapName(str), flags(1), iid(4), nReq(1), req[nReq](index), nOpt(1), opt[nOpt](index),
+//                              nLinks(1), linkedIID[nLinks](4), nCharacteristics(2)
+//        for each Char:        index, isCustom(1), iid(4), perms(1), flags(1), value, desc(str), unit(str), validValues(str)
+//
+//  where str is a 2-byte length (including terminator, or 0 for NULL) followed by the string, and index is a 2-byte
+//  index into hapChars, or CUSTOM followed by type(str), hapName(str), perms(1), format(1), staticRange(1).  Values
+//  are 8 bytes each for value, min, max, and step for numeric formats; a str for STRING; and a 2-byte length followed
+//  by the data for DATA and TLV8.
+//
+//  When an image is mapped from flash with mapDatabase(), the image is declared a static region of stringPool, so
+//  all strings (types, names, descriptions, units, valid values, and string values) are used in place rather than
+//  copied to the heap.  Only mutable state (numeric values, EV subscriptions, etc.) is held in RAM.
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void SpanSnapshot::put(const void *data, size_t n){
+
+  if(wBuf && wPos+n<=wSize && n>0)
+    memcpy(wBuf+wPos,data,n);
+  wPos+=n;
+}
+
+//////////////////////////////////////
+
+void SpanSnapshot::putStr(const char *s){
+
+  size_t n=s?strlen(s)+1:0;
+  if(n>UINT16_MAX){                         // never silently truncate the length
+    wError=true;
+    n=0;
+  }
+  put<uint16_t>(n);
+  put(s,n);
+}
+
+//////////////////////////////////////
+
+void SpanSnapshot::putData(const uint8_t *data, size_t n){
+
+  if(n>UINT16_MAX){
+    wError=true;
+    n=0;
+  }
+  put<uint16_t>(n);
+  put(data,n);
+}
+
+//////////////////////////////////////
+
+void SpanSnapshot::putIndex(HapChar *hc){
+
+  int index=Span::hapCharIndex(hc);
+
+  if(index>=0){
+    put<uint16_t>(index);
+    return;
+  }
+
+  put<uint16_t>(CUSTOM);
+  putStr(hc->type);
+  putStr(hc->hapName);
+  put<uint8_t>(hc->perms);
+  put<uint8_t>(hc->format);
+  put<uint8_t>(hc->staticRange);
+}
+
+//////////////////////////////////////
+
+const void *SpanSnapshot::get(size_t n){
+
+  if(rError || rPos+n>rLen){
+    rError=true;
+    return(NULL);
+  }
+
+  const void *p=rBuf+rPos;
+  rPos+=n;
+  return(p);
+}
+
+//////////////////////////////////////
+
+const char *SpanSnapshot::getStr(){
+
+  uint16_t n=get<uint16_t>();
+  if(n==0)
+    return(NULL);
+
+  const char *s=(const char *)get(n);
+  if(s && s[n-1]!='\0')                     // string must be terminated within its stated length
+    rError=true;
+  return(rError?NULL:s);
+}
+
+//////////////////////////////////////
+
+HapChar *SpanSnapshot::getIndex(){
+
+  uint16_t index=get<uint16_t>();
+
+  if(index!=CUSTOM){
+    if(index>=sizeof(HapCharacteristics)/sizeof(HapChar)){
+      rError=true;
+      return(NULL);
+    }
+    return((HapChar *)&hapChars+index);
+  }
+
+  const char *type=getStr();
+  const char *hapName=getStr();
+  uint8_t perms=get<uint8_t>();
+  uint8_t format=get<uint8_t>();
+  uint8_t staticRange=get<uint8_t>();
+
+  if(rError || !type || !hapName || format>FORMAT::TLV_ENC){
+    rError=true;
+    return(NULL);
+  }
+
+  for(auto hc=customChars.begin(); hc!=customChars.end(); hc++){      // re-use identical Custom HapChar already created by this or any earlier load
+    if(!strcmp((*hc)->type,type) && !strcmp((*hc)->hapName,hapName) && (*hc)->perms==perms && (*hc)->format==format && (*hc)->staticRange==staticRange)
+      return(*hc);
+  }
+
+  HapChar *hc=(HapChar *)HS_MALLOC(sizeof(HapChar));                   // interned in customChars rather than freed, since Characteristics created from it may outlive any one load, so at most one is allocated per distinct Custom Characteristic
+  hc->type=stringPool.intern(type);
+  hc->hapName=stringPool.intern(hapName);
+  hc->perms=(PERMS)perms;
+  hc->format=(FORMAT)format;
+  hc->staticRange=staticRange;
+  customChars.push_back(hc);
+  return(hc);
+}
+
+//////////////////////////////////////
+
+vector<HapChar *, Mallocator<HapChar *>> SpanSnapshot::customChars;
+
+//////////////////////////////////////
+
+size_t SpanSnapshot::save(uint8_t *buf, size_t len){
+
+  wBuf=buf;
+  wSize=len;
+  wPos=sizeof(header_t);
+  wError=false;
+
+  for(auto acc=homeSpan.Accessories.begin(); acc!=homeSpan.Accessories.end(); acc++){
+
+    put<uint32_t>((*acc)->aid);
+    put<uint32_t>((*acc)->iidCount);
+    put<uint16_t>((*acc)->Services.size());
+
+    for(auto svc=(*acc)->Services.begin(); svc!=(*acc)->Services.end(); svc++){
+
+      putStr((*svc)->type);
+      putStr((*svc)->hapName);
+      put<uint8_t>((*svc)->isCustom | ((*svc)->hidden<<1) | ((*svc)->primary<<2));
+      put<uint32_t>((*svc)->iid);
+
+      put<uint8_t>((*svc)->req.size());
+      for(auto hc=(*svc)->req.begin(); hc!=(*svc)->req.end(); hc++)
+        putIndex(*hc);
+
+      put<uint8_t>((*svc)->opt.size());
+      for(auto hc=(*svc)->opt.begin(); hc!=(*svc)->opt.end(); hc++)
+        putIndex(*hc);
+
+      put<uint8_t>((*svc)->linkedServices.size());
+      for(auto link=(*svc)->linkedServices.begin(); link!=(*svc)->linkedServices.end(); link++)
+        put<uint32_t>((*link)->iid);
+
+      put<uint16_t>((*svc)->Characteristics.size());
+
+      for(auto chr=(*svc)->Characteristics.begin(); chr!=(*svc)->Characteristics.end(); chr++){
+
+        putIndex((*chr)->hapChar);
+        put<uint8_t>((*chr)->isCustom);
+        put<uint32_t>((*chr)->iid);
+        put<uint8_t>((*chr)->perms);
+        put<uint8_t>((*chr)->customRange | ((*chr)->nvsStored<<1));
+
+        if((*chr)->format<FORMAT::STRING){
+          put((*chr)->value.UINT64);
+          put((*chr)->minValue.UINT64);
+          put((*chr)->maxValue.UINT64);
+          put((*chr)->stepValue.UINT64);
+        } else if((*chr)->format==FORMAT::STRING){
+          putStr((*chr)->value.STRING);
+        } else if((*chr)->value.BLOB){
+          putData((*chr)->value.BLOB->data,(*chr)->value.BLOB->len);
+        } else {
+          putData(NULL,0);
+        }
+
+        putStr((*chr)->desc);
+        putStr((*chr)->unit);
+        putStr((*chr)->validValues);
+      }
+    }
+  }
+
+  if(wError){
+    LOG0("\n*** WARNING: Database contains a string or data value longer than 65535 bytes, which cannot be stored in a database image.  Image not created.\n\n");
+    return(0);
+  }
+
+  if(wBuf && wPos<=wSize){
+    header_t hdr;
+    hdr.magic=MAGIC;
+    hdr.version=VERSION;
+    hdr.nAccessories=homeSpan.Accessories.size();
+    hdr.len=wPos-sizeof(header_t);
+    hdr.crc=esp_rom_crc32_le(0,wBuf+sizeof(header_t),hdr.len);
+    memcpy(wBuf,&hdr,sizeof(header_t));
+  }
+
+  return(wPos);
+}
+
+//////////////////////////////////////
+
+boolean SpanSnapshot::load(const uint8_t *buf, size_t len){
+
+  header_t hdr;
+
+  if(len<sizeof(header_t)){
+    LOG0("\n*** WARNING: Database image is too short.  Image ignored.\n\n");
+    return(false);
+  }
+
+  memcpy(&hdr,buf,sizeof(header_t));
+
+  if(hdr.magic!=MAGIC || hdr.version!=VERSION){
+    LOG0("\n*** WARNING: Database image has unrecognized format or version.  Image ignored.\n\n");
+    return(false);
+  }
+
+  if(hdr.len>len-sizeof(header_t) || hdr.crc!=esp_rom_crc32_le(0,buf+sizeof(header_t),hdr.len)){
+    LOG0("\n*** WARNING: Database image is truncated or corrupted.  Image ignored.\n\n");
+    return(false);
+  }
+
+  rBuf=buf+sizeof(header_t);
+  rLen=hdr.len;
+  rPos=0;
+  rError=false;
+
+  vector<SpanAccessory *, Mallocator<SpanAccessory *>> created;
+  size_t nCustom=customChars.size();          // Custom HapChars created by this load are freed if image is rejected
+
+  for(int i=0;i<hdr.nAccessories && !rError;i++){
+
+    uint32_t aid=get<uint32_t>();
+    uint32_t iidCount=get<uint32_t>();
+    uint16_t nServices=get<uint16_t>();
+
+    if(rError || aid==0 || homeSpan.findAccessory(aid)){
+      rError=true;
+      break;
+    }
+
+    SpanAccessory *acc=new SpanAccessory(aid);
+    created.push_back(acc);
+
+    vector<std::pair<SpanService *, uint32_t>, Mallocator<std::pair<SpanService *, uint32_t>>> links;   // linked Services are resolved once all Services in Accessory have been created
+
+    for(int j=0;j<nServices && !rError;j++){
+
+      const char *type=getStr();
+      const char *hapName=getStr();
+      uint8_t flags=get<uint8_t>();
+      uint32_t iid=get<uint32_t>();
+
+      if(rError || !type || !hapName){
+        rError=true;
+        break;
+      }
+
+      SpanService *svc=new SpanService(stringPool.intern(type),stringPool.intern(hapName),flags&1);
+      svc->iid=iid;
+      svc->hidden=(flags>>1)&1;
+      svc->primary=(flags>>2)&1;
+
+      for(int n=get<uint8_t>();n>0 && !rError;n--){
+        HapChar *hc=getIndex();
+        if(hc)
+          svc->req.push_back(hc);
+      }
+
+      for(int n=get<uint8_t>();n>0 && !rError;n--){
+        HapChar *hc=getIndex();
+        if(hc)
+          svc->opt.push_back(hc);
+      }
+
+      for(int n=get<uint8_t>();n>0 && !rError;n--)
+        links.push_back({svc,get<uint32_t>()});
+
+      for(int n=get<uint16_t>();n>0 && !rError;n--){
+
+        HapChar *hc=getIndex();
+        uint8_t isCustom=get<uint8_t>();
+        uint32_t chrIID=get<uint32_t>();
+        uint8_t perms=get<uint8_t>();
+        uint8_t chrFlags=get<uint8_t>();
+
+        if(rError)
+          break;
+
+        SpanCharacteristic *chr=new SpanCharacteristic(hc,isCustom);
+        chr->iid=chrIID;
+        chr->perms=perms;
+        chr->customRange=chrFlags&1;
+
+        if(chr->format<FORMAT::STRING){
+          chr->value.UINT64=get<uint64_t>();
+          chr->minValue.UINT64=get<uint64_t>();
+          chr->maxValue.UINT64=get<uint64_t>();
+          chr->stepValue.UINT64=get<uint64_t>();
+        } else if(chr->format==FORMAT::STRING){
+          chr->uvSet(chr->value,getStr());
+        } else {
+          uint16_t n=get<uint16_t>();
+          const void *data=get(n);
+          if(data)
+            memcpy(chr->uvAlloc(chr->value,n),data,n);
+        }
+
+        chr->desc=stringPool.intern(getStr());
+        chr->unit=stringPool.intern(getStr());
+
+        chr->validValues=stringPool.intern(getStr());
+
+        if(rError)
+          break;
+
+        if(chrFlags&2)
+          chr->nvsLoad();
+
+        chr->uvSet(chr->newValue,chr->value);
+      }
+    }
+
+    for(auto link=links.begin(); link!=links.end(); link++){
+      auto svc=std::find_if(acc->Services.begin(),acc->Services.end(),[link](SpanService *s){return(s->iid==link->second);});
+      if(svc==acc->Services.end())
+        rError=true;
+      else
+        link->first->linkedServices.push_back(*svc);
+    }
+
+    acc->iidCount=iidCount;
+  }
+
+  if(rError || rPos!=rLen){
+    LOG0("\n*** WARNING: Database image contains invalid records.  Image ignored.\n\n");
+    while(!created.empty()){                  // remove any Accessories already created from this image
+      delete created.back();
+      created.pop_back();
+    }
+    while(customChars.size()>nCustom){        // ...and any Custom HapChars (whose strings may point into an image that is about to be unmapped)
+      stringPool.release(customChars.back()->type);
+      stringPool.release(customChars.back()->hapName);
+      free(customChars.back());
+      customChars.pop_back();
+    }
+    return(false);
+  }
+
+  return(true);
+}
+
+///////////////////////////////
+//           Span            //
+///////////////////////////////
+
+size_t Span::exportDatabase(uint8_t *buf, size_t len){
+
+  SpanSnapshot snapshot;
+  return(snapshot.save(buf,len));
+}
+
+//////////////////////////////////////
+
+boolean Span::exportDatabase(const char *key){
+
+  size_t len=exportDatabase(NULL,0);
+  if(len==0)
+    return(false);
+  TempBuffer<uint8_t> buf(len);
+  exportDatabase(buf,len);
+
+  nvs_handle dbNVS;
+  if(nvs_open("DATABASE",NVS_READWRITE,&dbNVS)!=ESP_OK)
+    return(false);
+
+  boolean success=(nvs_set_blob(dbNVS,key,buf,len)==ESP_OK && nvs_commit(dbNVS)==ESP_OK);
+  nvs_close(dbNVS);
+
+  if(success)
+    LOG1("Exported database image of %d bytes to NVS key '%s'\n",len,key);
+  else
+    LOG0("\n*** WARNING: Unable to export database image of %d bytes to NVS key '%s'\n\n",len,key);
+
+  return(success);
+}
+
+//////////////////////////////////////
+
+boolean Span::loadDatabase(const uint8_t *buf, size_t len){
+
+  unsigned long startTime=micros();
+  size_t nAccessories=Accessories.size();
+
+  SpanSnapshot snapshot;
+  boolean success=snapshot.load(buf,len);
+
+  if(success)
+    LOG1("Loaded %d Accessories from database image of %d bytes in %lu us\n",Accessories.size()-nAccessories,len,micros()-startTime);
+
+  return(success);
+}
+
+//////////////////////////////////////
+
+boolean Span::exportDatabasePartition(const char *label){
+
+  if(databaseMap.get()){
+    LOG0("\n*** WARNING: Can't write database image to a partition while an image is mapped.  Request ignored.\n\n");
+    return(false);
+  }
+
+  size_t len=exportDatabase(NULL,0);
+  if(len==0)
+    return(false);
+
+  TempBuffer<uint8_t> buf(len);
+  exportDatabase(buf,len);
+
+  boolean success=SpanMap::write(label,buf,len);
+
+  if(success)
+    LOG1("Exported database image of %d bytes to partition '%s'\n",len,label);
+  else
+    LOG0("\n*** WARNING: Unable to export database image of %d bytes to partition '%s'\n\n",len,label);
+
+  return(success);
+}
+
+//////////////////////////////////////
+
+boolean Span::mapDatabase(const char *label){
+
+  if(databaseMap.get()){
+    LOG0("\n*** WARNING: A database image is already mapped.  Request ignored.\n\n");
+    return(false);
+  }
+
+  if(!databaseMap.map(label)){
+    LOG0("\n*** WARNING: Unable to map partition '%s'.  Request ignored.\n\n",label);
+    return(false);
+  }
+
+  stringPool.setStatic(databaseMap.get(),databaseMap.size());     // strings in image are used directly from flash
+
+  if(loadDatabase(databaseMap.get(),databaseMap.size()))
+    return(true);
+
+  stringPool.setStatic(NULL,0);
+  databaseMap.unmap();
+  return(false);
+}
+
+//////////////////////////////////////
+
+boolean Span::loadDatabase(const char *key){
+
+  nvs_handle dbNVS;
+  size_t len;
+
+  if(nvs_open("DATABASE",NVS_READONLY,&dbNVS)!=ESP_OK)
+    return(false);
+
+  if(nvs_get_blob(dbNVS,key,NULL,&len)!=ESP_OK){
+    nvs_close(dbNVS);
+    return(false);
+  }
+
+  TempBuffer<uint8_t> buf(len);
+  nvs_get_blob(dbNVS,key,buf,&len);
+  nvs_close(dbNVS);
+
+  return(loadDatabase(buf,len));
+}
+
+//////////////////////////////////////
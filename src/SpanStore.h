@@ -0,0 +1,125 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/////////////////////////////////////////////////
+// Minimal key-value storage interface used by
+// HomeSpan to persist Characteristic values.
+// Values are typed (as in ESP-IDF NVS) and a
+// value of one type is not found when read back
+// as another.  Changes may be buffered by an
+// implementation until commit() is called.
+//
+// This header has no Arduino or ESP-IDF
+// dependencies (other than NVSStore below) so
+// that other implementations, such as FileStore,
+// can be built and benchmarked on a host.
+
+class SpanStore {
+
+  public:
+
+  enum type_t : uint8_t {
+    U64=1,
+    STR=2,
+    BLOB=3
+  };
+
+  virtual ~SpanStore(){}
+
+  virtual bool get(const char *key, type_t type, void *val, size_t *len)=0;     // copies value into val (of size *len) and sets *len to size of value.  If val=NULL, only sets *len.  Returns false if not found or val too small
+  virtual bool set(const char *key, type_t type, const void *val, size_t len)=0;
+  virtual bool erase(const char *key)=0;
+  virtual bool eraseAll()=0;
+  virtual bool commit()=0;
+
+  bool getU64(const char *key, uint64_t *val){size_t len=sizeof(uint64_t);return(get(key,U64,val,&len));}
+  bool setU64(const char *key, uint64_t val){return(set(key,U64,&val,sizeof(uint64_t)));}
+  bool getStr(const char *key, char *val, size_t *len){return(get(key,STR,val,len));}          // *len includes terminating null
+  bool setStr(const char *key, const char *val){return(set(key,STR,val,strlen(val)+1));}
+  bool getBlob(const char *key, void *val, size_t *len){return(get(key,BLOB,val,len));}
+  bool setBlob(const char *key, const void *val, size_t len){return(set(key,BLOB,val,len));}
+};
+
+/////////////////////////////////////////////////
+// SpanStore implemented on a namespace of the
+// ESP-IDF non-volatile storage (NVS) library.
+// This is HomeSpan's default store, and uses the
+// same keys and types as earlier versions.
+
+#if defined(ESP_PLATFORM)
+
+#include <nvs.h>
+
+class NVSStore : public SpanStore {
+
+  nvs_handle_t handle=0;
+
+  public:
+
+  bool open(const char *nameSpace){return(nvs_open(nameSpace,NVS_READWRITE,&handle)==ESP_OK);}
+
+  bool get(const char *key, type_t type, void *val, size_t *len) override {
+    switch(type){
+      case U64:
+        if(val==NULL){
+          uint64_t dummy;
+          *len=sizeof(uint64_t);
+          return(nvs_get_u64(handle,key,&dummy)==ESP_OK);
+        }
+        return(*len>=sizeof(uint64_t) && nvs_get_u64(handle,key,(uint64_t *)val)==ESP_OK);
+      case STR:
+        return(nvs_get_str(handle,key,(char *)val,len)==ESP_OK);
+      case BLOB:
+        return(nvs_get_blob(handle,key,val,len)==ESP_OK);
+    }
+    return(false);
+  }
+
+  bool set(const char *key, type_t type, const void *val, size_t len) override {
+    switch(type){
+      case U64:
+        return(nvs_set_u64(handle,key,*(const uint64_t *)val)==ESP_OK);
+      case STR:
+        return(nvs_set_str(handle,key,(const char *)val)==ESP_OK);
+      case BLOB:
+        return(nvs_set_blob(handle,key,val,len)==ESP_OK);
+    }
+    return(false);
+  }
+
+  bool erase(const char *key) override {return(nvs_erase_key(handle,key)==ESP_OK);}
+  bool eraseAll() override {return(nvs_erase_all(handle)==ESP_OK);}
+  bool commit() override {return(nvs_commit(handle)==ESP_OK);}
+};
+
+#endif
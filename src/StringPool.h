@@ -0,0 +1,155 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+#pragma once
+
+#include <Arduino.h>
+
+#include "PSRAM.h"
+
+/////////////////////////////////////////////////
+// Reference-counted pool of interned, read-only
+// strings.  Identical strings (e.g. Manufacturer
+// or Model names repeated across every Accessory
+// of a bridge) share a single heap allocation,
+// which is freed once the last reference is
+// released.  Strings obtained from the pool must
+// never be modified in place - to change a value,
+// intern the new string and release the old one.
+//
+// A read-only region of memory (such as a database
+// image mapped from flash) may be declared static,
+// in which case any string located in that region
+// is used in place, without copying or counting.
+
+class StringPool {
+
+  private:
+
+  struct entry_t {
+    entry_t *next;                    // next entry in same hash bucket
+    uint32_t hash;                    // hash of str
+    uint32_t refCount;                // number of references to this entry
+    char str[];                       // null-terminated string
+  };
+
+  static const int nBuckets=32;
+  entry_t *buckets[nBuckets]={};
+  portMUX_TYPE mux=portMUX_INITIALIZER_UNLOCKED;
+  const char *staticStart=NULL;       // start of static region (strings in this region are never copied or freed)
+  const char *staticEnd=NULL;         // end of static region
+
+  static uint32_t hashOf(const char *s){       // 32-bit FNV-1a hash
+    uint32_t h=2166136261UL;
+    while(*s)
+      h=(h^(uint8_t)(*s++))*16777619UL;
+    return(h);
+  }
+
+  static entry_t *entryOf(const char *s){return((entry_t *)(s-offsetof(entry_t,str)));}
+
+  public:
+
+  size_t nStrings=0;                  // number of distinct strings currently in pool
+  size_t nBytes=0;                    // number of bytes used by those strings (including terminators)
+  uint32_t nRefs=0;                   // total number of references currently held
+  
+  constexpr StringPool(){}
+
+  void setStatic(const void *start, size_t len){staticStart=(const char *)start;staticEnd=staticStart+len;}   // declares static region (set len=0 to clear)
+  bool isStatic(const char *s){return(s>=staticStart && s<staticEnd);}                                      // returns true if s is located in static region
+
+  const char *intern(const char *s){            // returns a pooled copy of s (adding a reference), or NULL if s is NULL.  Returns s itself if located in static region
+    if(!s || isStatic(s))
+      return(s);
+    uint32_t h=hashOf(s);
+    entry_t **bucket=buckets+(h%nBuckets);
+    portENTER_CRITICAL(&mux);
+    for(entry_t *e=*bucket;e;e=e->next){
+      if(e->hash==h && !strcmp(e->str,s)){
+        e->refCount++;
+        nRefs++;
+        portEXIT_CRITICAL(&mux);
+        return(e->str);
+      }
+    }
+    portEXIT_CRITICAL(&mux);
+
+    size_t len=strlen(s)+1;
+    entry_t *e=(entry_t *)HS_MALLOC(sizeof(entry_t)+len);      // allocate outside of critical section
+    if(e==NULL){
+      Serial.printf("\n\n*** FATAL ERROR: Requested allocation of %d bytes failed.  Program Halting.\n\n",sizeof(entry_t)+len);
+      while(1);
+    }
+    e->hash=h;
+    e->refCount=1;
+    memcpy(e->str,s,len);
+
+    portENTER_CRITICAL(&mux);
+    e->next=*bucket;
+    *bucket=e;
+    nStrings++;
+    nBytes+=len;
+    nRefs++;
+    portEXIT_CRITICAL(&mux);
+    return(e->str);
+  }
+
+  const char *addRef(const char *s){            // adds a reference to a string previously obtained from intern() and returns it
+    if(s && !isStatic(s)){
+      portENTER_CRITICAL(&mux);
+      entryOf(s)->refCount++;
+      nRefs++;
+      portEXIT_CRITICAL(&mux);
+    }
+    return(s);
+  }
+
+  void release(const char *s){                  // releases a reference to a string previously obtained from intern() or addRef(); okay to release NULL
+    if(!s || isStatic(s))
+      return;
+    entry_t *e=entryOf(s);
+    portENTER_CRITICAL(&mux);
+    nRefs--;
+    if(--e->refCount>0){
+      portEXIT_CRITICAL(&mux);
+      return;
+    }
+    for(entry_t **p=buckets+(e->hash%nBuckets);*p;p=&((*p)->next)){
+      if(*p==e){
+        *p=e->next;
+        break;
+      }
+    }
+    nStrings--;
+    nBytes-=strlen(e->str)+1;
+    portEXIT_CRITICAL(&mux);
+    free(e);
+  }
+
+  void print();                      // prints pool statistics (defined in Utils.cpp)
+};
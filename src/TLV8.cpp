@@ -26,28 +26,34 @@
  ********************************************************************************/
 
 #include "TLV8.h"
+#include "Settings.h"
+
+BlockPool tlv8Pool("TLV8 Records",DEFAULT_TLV8_RECORDS);
 
 //////////////////////////////////////
 
 tlv8_t::tlv8_t(uint8_t tag, size_t len, const uint8_t* val) : tag{tag}, len{len} {       
   if(len>0){
-    this->val=std::unique_ptr<uint8_t>((uint8_t *)HS_MALLOC(len));
-    if(val!=NULL)
+    this->val=std::unique_ptr<uint8_t>((uint8_t *)HS_MALLOC(len));       // left as NULL if allocation fails (checked by TLV8::add)
+    if(val!=NULL && this->val)
       memcpy((this->val).get(),val,len);      
   }
 }
 
 //////////////////////////////////////
 
-void tlv8_t::update(size_t addLen, const uint8_t *addVal){
+boolean tlv8_t::update(size_t addLen, const uint8_t *addVal){
   if(addLen>0){
-    uint8_t *p=val.release();
-    p=(uint8_t *)HS_REALLOC(p,len+addLen);
+    uint8_t *p=(uint8_t *)HS_REALLOC(val.get(),len+addLen);
+    if(p==NULL)                               // original data is left intact if realloc fails
+      return(false);
+    val.release();
     val=std::unique_ptr<uint8_t>(p);
     if(addVal!=NULL)
       memcpy(p+len,addVal,addLen);
     len+=addLen;        
   }
+  return(true);
 }
 
 /////////////////////////////////////
@@ -70,10 +76,23 @@ void tlv8_t::osprint(std::ostream& os) const {
 
 TLV8_itc TLV8::add(uint8_t tag, size_t len, const uint8_t* val) {
 
-  if(!empty() && back().getTag()==tag)
-    back().update(len,val);
-  else
+  if(!empty() && back().getTag()==tag){
+    if(!back().update(len,val)){
+      addFailed=true;
+      return(end());
+    }
+  } else {
+    if(!tlv8Pool.reserve()){                  // no pool block or heap left for a new record
+      addFailed=true;
+      return(end());
+    }
     emplace_back(tag,len,val);
+    if(len>0 && back().get()==NULL){          // record was created but its data could not be allocated
+      pop_back();
+      addFailed=true;
+      return(end());
+    }
+  }
 
   return(--end());
 }
@@ -83,8 +102,10 @@ TLV8_itc TLV8::add(uint8_t tag, size_t len, const uint8_t* val) {
 TLV8_itc TLV8::add(uint8_t tag, TLV8 &subTLV){
   
   auto it=add(tag,subTLV.pack_size(),NULL);      // create space for inserting sub TLV and store iterator to new element
+  if(it==end())
+    return(it);
   subTLV.pack(*it);                              // pack subTLV into new element
-  return(--end());
+  return(it);
 }
 
 /////////////////////////////////////
@@ -135,6 +156,26 @@ size_t TLV8::pack(uint8_t *buf, size_t bufSize) const {
   size_t nBytes=0;
 
   while(nBytes<bufSize && currentPackIt!=endPackIt){
+
+    if(currentPackPhase==1){                                        // start of a new fragment - if entire fragment fits, copy header and value in one step
+      size_t fragLen=endPackBuf-currentPackBuf;
+      if(fragLen>255)
+        fragLen=255;
+      if(bufSize-nBytes>=fragLen+2){
+        *buf++=currentPackIt->getTag();
+        *buf++=fragLen;
+        memcpy(buf,currentPackBuf,fragLen);
+        buf+=fragLen;
+        currentPackBuf+=fragLen;
+        nBytes+=fragLen+2;
+        if(currentPackBuf==endPackBuf){
+          currentPackIt++;
+          currentPackPhase=0;
+        }
+        continue;
+      }
+    }
+
     switch(currentPackPhase){
 
       case 0:
@@ -198,7 +239,8 @@ int TLV8::unpack(uint8_t *buf, size_t bufSize){
       case 0:
         unpackTag=*buf++;
         bufSize--;
-        add(unpackTag);
+        if(add(unpackTag)==end())
+          return(-1);
         unpackPhase=1;
         break;
 
@@ -213,7 +255,8 @@ int TLV8::unpack(uint8_t *buf, size_t bufSize){
 
       case 2:
        size_t copyBytes=unpackBytes<bufSize ? unpackBytes : bufSize;
-       add(unpackTag,copyBytes,buf);
+       if(add(unpackTag,copyBytes,buf)==end())
+         return(-1);
        buf+=copyBytes;
        unpackBytes-=copyBytes;
        bufSize-=copyBytes;
@@ -227,6 +270,30 @@ int TLV8::unpack(uint8_t *buf, size_t bufSize){
 
 /////////////////////////////////////
 
+int TLV8::unpack(const TLV8View &view){
+
+  for(auto it=view.begin();it!=view.end();it++){
+    if(add(it->getTag(),it->getLen(),*it)==end())
+      return(-1);
+  }
+
+  return(0);
+}
+
+/////////////////////////////////////
+
+int TLV8::unpack(const TLV8Flat &flat){
+
+  for(auto it=flat.begin();it!=flat.end();it++){
+    if(add(it->getTag(),it->getLen(),*it)==end())
+      return(-1);
+  }
+
+  return(0);
+}
+
+/////////////////////////////////////
+
 int TLV8::unpack(TLV8_itc it){
   
   if(it==end())
@@ -297,3 +364,270 @@ void TLV8::osprint(std::ostream& os, TLV8_itc it1, TLV8_itc it2) const {
 }
 
 //////////////////////////////////////
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+int TLV8View::unpack(uint8_t *buf, size_t bufSize){
+
+  nRecords=0;
+  uint8_t *pend=buf+bufSize;
+
+  while(buf<pend){
+
+    if(pend-buf<2 || pend-buf-2<buf[1])         // header or value is incomplete
+      return(-1);
+
+    uint8_t tag=buf[0];
+    size_t n=buf[1];
+    buf+=2;
+
+    if(nRecords>0 && records[nRecords-1].tag==tag){         // continuation of previous record - shift fragment so value is contiguous
+      tlv8_view_t *r=records+nRecords-1;
+      memmove(r->val+r->len,buf,n);
+      r->len+=n;
+    } else {
+      if(nRecords==MAX_RECORDS)
+        return(-2);
+      records[nRecords].tag=tag;
+      records[nRecords].len=n;
+      records[nRecords].val=buf;
+      nRecords++;
+    }
+
+    buf+=n;
+  }
+
+  return(0);
+}
+
+/////////////////////////////////////
+
+TLV8View_itc TLV8View::find(uint8_t tag, TLV8View_itc it1, TLV8View_itc it2) const {
+
+  auto it=it1;
+  while(it!=it2 && it->getTag()!=tag)
+    it++;
+  return(it);
+}
+
+/////////////////////////////////////
+
+const char *TLV8View::getName(uint8_t tag) const {
+
+  if(names==NULL)
+    return(NULL);
+
+  for(int i=0;i<nNames;i++){
+    if(names[i].tag==tag)
+      return(names[i].name);
+  }
+
+  return(NULL);
+}
+
+/////////////////////////////////////
+
+void TLV8View::print() const {
+
+  for(auto it=begin();it!=end();it++){
+    const char *name=getName(it->getTag());
+    if(name)
+      Serial.printf("%s",name);
+    else
+      Serial.printf("%d",it->getTag());
+    Serial.printf("(%d) ",it->getLen());
+    for(int i=0;i<it->getLen();i++)
+      Serial.printf("%02X",(*it)[i]);
+    if(it->getLen()==0)
+      Serial.printf(" [null]");
+    else if(it->getLen()<=4)
+      Serial.printf(" [%lu]",it->getVal());
+    else if(it->getLen()<=8)
+      Serial.printf(" [%llu]",it->getVal<uint64_t>());
+    Serial.printf("\n");
+  }
+}
+
+//////////////////////////////////////
+//////////////////////////////////////
+
+boolean TLV8Flat::grow(size_t nBytes){
+
+  if(bufSize+nBytes<=bufCap)
+    return(true);
+
+  size_t newCap=bufCap?bufCap*2:128;        // grow geometrically so that building a TLV requires only a few reallocs
+  if(newCap<bufSize+nBytes)
+    newCap=bufSize+nBytes;
+
+  uint8_t *p=(uint8_t *)HS_REALLOC(buf,newCap);
+  if(p==NULL)                               // original data is left intact if realloc fails
+    return(false);
+
+  buf=p;
+  bufCap=newCap;
+  return(true);
+}
+
+/////////////////////////////////////
+
+TLV8Flat_itc TLV8Flat::add(uint8_t tag, size_t len, const uint8_t* val) {
+
+  if(bufSize>0 && buf[lastOffset]==tag){                  // merge into last record, which is always at the end of the buffer
+    size_t oldLen=TLV8Flat_itc(this,lastOffset).getLen();
+    if(oldLen+len>MAX_LEN || !grow(len)){
+      addFailed=true;
+      return(end());
+    }
+    if(val!=NULL)
+      memcpy(buf+bufSize,val,len);
+    bufSize+=len;
+    buf[lastOffset+1]=(oldLen+len)&0xFF;
+    buf[lastOffset+2]=(oldLen+len)>>8;
+  } else {
+    if(len>MAX_LEN || !grow(TLV8Flat_itc::HDR_BYTES+len)){
+      addFailed=true;
+      return(end());
+    }
+    lastOffset=bufSize;
+    buf[bufSize++]=tag;
+    buf[bufSize++]=len&0xFF;
+    buf[bufSize++]=len>>8;
+    if(val!=NULL)
+      memcpy(buf+bufSize,val,len);
+    bufSize+=len;
+    nRecords++;
+  }
+
+  return(TLV8Flat_itc(this,lastOffset));
+}
+
+/////////////////////////////////////
+
+TLV8Flat_itc TLV8Flat::add(uint8_t tag, const TLV8Flat &subTLV){
+  
+  auto it=add(tag,subTLV.pack_size(),NULL);      // create space for inserting sub TLV and store iterator to new element
+  if(it==end())
+    return(it);
+  subTLV.pack(*it);                              // pack subTLV into new element
+  return(it);
+}
+
+/////////////////////////////////////
+
+TLV8Flat_itc TLV8Flat::add(uint8_t tag, uint64_t val){
+  
+  uint8_t *p=reinterpret_cast<uint8_t *>(&val);
+  size_t nBytes=sizeof(uint64_t);
+  while(nBytes>1 && p[nBytes-1]==0)               // TLV requires little endian of size 1, 2, 4, or 8 bytes (include trailing zeros as needed)
+    nBytes--;
+  if(nBytes==3)                                   // need to include a trailing zero so that total bytes=4
+    nBytes=4;
+  else if(nBytes>4)                               // need to include multiple trailing zeros so that total bytes=8
+    nBytes=8;
+  return(add(tag, nBytes, p));
+}
+
+/////////////////////////////////////
+
+TLV8Flat_itc TLV8Flat::find(uint8_t tag, TLV8Flat_itc it1, TLV8Flat_itc it2) const {
+
+  auto it=it1;
+  while(it!=it2 && it->getTag()!=tag)
+    it++;
+  return(it);
+}
+
+/////////////////////////////////////
+
+size_t TLV8Flat::pack_size() const {
+
+  size_t nBytes=0;
+
+  for(auto it=begin();it!=end();it++){
+    nBytes+=2+it->getLen();
+    if(it->getLen()>255)
+      nBytes+=2*((it->getLen()-1)/255);
+  }
+
+  return(nBytes);
+}
+
+/////////////////////////////////////
+
+size_t TLV8Flat::pack(uint8_t *outBuf) const {
+
+  uint8_t *start=outBuf;
+
+  for(auto it=begin();it!=end();it++){
+    uint8_t *p=*it;                                 // starting pointer
+    uint8_t *pend=p+it->getLen();                   // ending pointer (may equal starting if len=0)
+    do{
+      uint8_t nBytes=(pend-p)>255?255:(pend-p);     // max is 255 bytes per TLV record
+      *outBuf++=it->getTag();
+      *outBuf++=nBytes;
+      memcpy(outBuf,p,nBytes);
+      outBuf+=nBytes;
+      p+=nBytes;
+    } while(p<pend);
+  }
+
+  return(outBuf-start);
+}
+
+/////////////////////////////////////
+
+void TLV8Flat::osprint(std::ostream& os) const {
+
+  for(auto it=begin();it!=end();it++){
+    uint8_t tag=it->getTag();
+    uint8_t *p=*it;
+    uint8_t *pend=p+it->getLen();
+    do{
+      uint8_t nBytes=(pend-p)>255?255:(pend-p);
+      os.write((char *)&tag,1);
+      os.write((char *)&nBytes,1);
+      os.write((char *)p,nBytes);
+      p+=nBytes;
+    } while(p<pend);
+  }
+}
+
+/////////////////////////////////////
+
+const char *TLV8Flat::getName(uint8_t tag) const {
+
+  if(names==NULL)
+    return(NULL);
+
+  for(int i=0;i<nNames;i++){
+    if(names[i].tag==tag)
+      return(names[i].name);
+  }
+
+  return(NULL);
+}
+
+/////////////////////////////////////
+
+void TLV8Flat::print() const {
+
+  for(auto it=begin();it!=end();it++){
+    const char *name=getName(it->getTag());
+    if(name)
+      Serial.printf("%s",name);
+    else
+      Serial.printf("%d",it->getTag());
+    Serial.printf("(%d) ",it->getLen());
+    for(int i=0;i<it->getLen();i++)
+      Serial.printf("%02X",(*it)[i]);
+    if(it->getLen()==0)
+      Serial.printf(" [null]");
+    else if(it->getLen()<=4)
+      Serial.printf(" [%lu]",it->getVal());
+    else if(it->getLen()<=8)
+      Serial.printf(" [%llu]",it->getVal<uint64_t>());
+    Serial.printf("\n");
+  }
+}
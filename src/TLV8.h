@@ -33,6 +33,9 @@
 #include <memory>
 
 #include "PSRAM.h"
+#include "BlockPool.h"
+
+extern BlockPool tlv8Pool;      // fixed-block pool for TLV8 list nodes (shared by all TLV8 objects)
 
 class tlv8_t {
   
@@ -45,7 +48,7 @@ class tlv8_t {
   public:
  
   tlv8_t(uint8_t tag, size_t len, const uint8_t* val);
-  void update(size_t addLen, const uint8_t *addVal);
+  boolean update(size_t addLen, const uint8_t *addVal);         // returns false (leaving record unchanged) if memory for additional data cannot be allocated
   void osprint(std::ostream& os) const;
   
   operator uint8_t*() const {
@@ -79,12 +82,224 @@ class tlv8_t {
 
 /////////////////////////////////////
 
-typedef std::list<tlv8_t, Mallocator<tlv8_t>>::const_iterator TLV8_itc;
+typedef std::list<tlv8_t, PoolAllocator<tlv8_t,tlv8Pool>>::const_iterator TLV8_itc;
 typedef struct { const uint8_t tag; const char *name; } TLV8_names;
 
 /////////////////////////////////////
+// Non-owning record in a TLV8View (same accessors as tlv8_t)
+
+class tlv8_view_t {
+
+  friend class TLV8View;
+
+  uint8_t tag;
+  size_t len;
+  uint8_t *val;
+
+  public:
+
+  operator uint8_t*() const {
+    return(val);
+  }
+
+  uint8_t & operator[](int index) const {
+    return(val[index]);
+  }
+
+  uint8_t *get() const {
+    return(val);
+  }
+
+  size_t getLen() const {
+    return(len);
+  }
+
+  uint8_t getTag() const {
+    return(tag);
+  }
+
+  template<class T=uint32_t> T getVal() const {
+    T iVal=0;
+    for(int i=0;i<len;i++)
+      iVal|=static_cast<T>(val[i])<<(i*8);
+    return(iVal);
+  }
+
+};
+
+typedef const tlv8_view_t *TLV8View_itc;
+
+/////////////////////////////////////
+// Zero-copy, read-only parse of a packed TLV8 buffer.
+// Records point directly into the buffer passed to unpack(),
+// which must therefore remain in scope while the view is used.
+// Fragmented records (values > 255 bytes) are made contiguous
+// by shifting fragments in place, so the buffer is modified.
+
+class TLV8View {
+
+  public:
+
+  static const int MAX_RECORDS=16;        // maximum number of (merged) records in a single view
+
+  private:
+
+  tlv8_view_t records[MAX_RECORDS];
+  int nRecords=0;
+
+  const TLV8_names *names=NULL;
+  int nNames=0;
+
+  public:
+
+  TLV8View(){};
+  TLV8View(const TLV8_names *names, int nNames) : names{names}, nNames{nNames} {};
+
+  int unpack(uint8_t *buf, size_t bufSize);     // returns 0 if successful, -1 if buf is incomplete or malformed, -2 if buf has more than MAX_RECORDS records
+
+  TLV8View_itc begin() const {return(records);}
+  TLV8View_itc end() const {return(records+nRecords);}
+  int size() const {return(nRecords);}
+
+  TLV8View_itc find(uint8_t tag, TLV8View_itc it1, TLV8View_itc it2) const;
+  TLV8View_itc find(uint8_t tag, TLV8View_itc it1) const {return(find(tag, it1, end()));}
+  TLV8View_itc find(uint8_t tag) const {return(find(tag, begin(), end()));}
+
+  int len(TLV8View_itc it) const {return(it==end()?-1:it->getLen());}
+
+  const char *getName(uint8_t tag) const;
+  void print() const;
+};
+
+/////////////////////////////////////
+// Owning TLV8 container that stores all records in one contiguous buffer.
+// Each record is a 3-byte header (TAG plus 16-bit little-endian LENGTH)
+// followed directly by its VALUE, so adding a record never allocates more
+// than a (geometrically growing) realloc of the buffer, and pack() writes
+// each record, or each 255-byte fragment of a longer record, with a single
+// memcpy.  Iterators store offsets rather than pointers so they remain valid
+// as the buffer grows, but the pointer returned by *it is only valid until
+// the next record is added.
 
-class TLV8 : public std::list<tlv8_t, Mallocator<tlv8_t>> {
+class TLV8Flat;
+
+class TLV8Flat_itc {
+
+  friend class TLV8Flat;
+
+  const TLV8Flat *tlv=NULL;
+  size_t offset=0;
+
+  TLV8Flat_itc(const TLV8Flat *tlv, size_t offset) : tlv{tlv}, offset{offset} {};
+
+  public:
+
+  TLV8Flat_itc(){};
+
+  uint8_t *operator*() const {return(get());}
+  const TLV8Flat_itc *operator->() const {return(this);}
+  TLV8Flat_itc & operator++(){offset+=HDR_BYTES+getLen(); return(*this);}
+  TLV8Flat_itc operator++(int){TLV8Flat_itc it=*this; ++(*this); return(it);}
+  bool operator==(const TLV8Flat_itc &it) const {return(offset==it.offset && tlv==it.tlv);}
+  bool operator!=(const TLV8Flat_itc &it) const {return(!(*this==it));}
+
+  static const size_t HDR_BYTES=3;
+
+  inline uint8_t *get() const;
+  inline size_t getLen() const;
+  inline uint8_t getTag() const;
+
+  template<class T=uint32_t> T getVal() const {
+    T iVal=0;
+    uint8_t *val=get();
+    for(int i=0;i<getLen();i++)
+      iVal|=static_cast<T>(val[i])<<(i*8);
+    return(iVal);
+  }
+};
+
+/////////////////////////////////////
+
+class TLV8Flat {
+
+  friend class TLV8Flat_itc;
+
+  public:
+
+  static const size_t MAX_LEN=65535;        // maximum length of a single (merged) record
+
+  private:
+
+  uint8_t *buf=NULL;              // contiguous record storage
+  size_t bufSize=0;               // number of bytes of buf in use
+  size_t bufCap=0;                // number of bytes allocated for buf
+  size_t lastOffset=0;            // offset of the last record in buf (used to merge consecutive records with the same tag)
+  int nRecords=0;
+
+  const TLV8_names *names=NULL;
+  int nNames=0;
+
+  boolean addFailed=false;        // set if any record could not be added for lack of memory
+
+  boolean grow(size_t nBytes);    // ensures there is room for nBytes more bytes, returns false if memory could not be allocated
+
+  public:
+
+  TLV8Flat(){};
+  TLV8Flat(const TLV8_names *names, int nNames) : names{names}, nNames{nNames} {};
+  ~TLV8Flat(){free(buf);}
+
+  TLV8Flat(const TLV8Flat &)=delete;
+  TLV8Flat &operator=(const TLV8Flat &)=delete;
+
+  boolean reserve(size_t nBytes){return(nBytes<=bufSize || grow(nBytes-bufSize));}    // pre-allocates space for nBytes of record storage (including 3-byte headers)
+
+  TLV8Flat_itc add(uint8_t tag, size_t len, const uint8_t *val);
+  TLV8Flat_itc add(uint8_t tag, uint64_t val);
+  TLV8Flat_itc add(uint8_t tag, const TLV8Flat &subTLV);
+  TLV8Flat_itc add(uint8_t tag){return(add(tag, 0, NULL));}
+  TLV8Flat_itc add(uint8_t tag, const char *val){return(add(tag, strlen(val), reinterpret_cast<const uint8_t*>(val)));}
+
+  TLV8Flat_itc begin() const {return(TLV8Flat_itc(this,0));}
+  TLV8Flat_itc end() const {return(TLV8Flat_itc(this,bufSize));}
+  int size() const {return(nRecords);}
+  boolean empty() const {return(nRecords==0);}
+
+  TLV8Flat_itc find(uint8_t tag, TLV8Flat_itc it1, TLV8Flat_itc it2) const;
+  TLV8Flat_itc find(uint8_t tag, TLV8Flat_itc it1) const {return(find(tag, it1, end()));}
+  TLV8Flat_itc find(uint8_t tag) const {return(find(tag, begin(), end()));}
+
+  int len(TLV8Flat_itc it) const {return(it==end()?-1:it->getLen());}
+
+  size_t pack_size() const;
+  size_t pack(uint8_t *buf) const;          // packs all records into buf, which must have room for pack_size() bytes, and returns number of bytes written
+
+  const char *getName(uint8_t tag) const;
+  void print() const;
+  void osprint(std::ostream& os) const;
+
+  boolean failed() const {return(addFailed);}     // returns true if any record could not be added (in which case add() returned end()) for lack of memory
+
+  void wipe() {free(buf); buf=NULL; bufSize=bufCap=lastOffset=0; nRecords=0; addFailed=false;}
+};
+
+/////////////////////////////////////
+
+uint8_t *TLV8Flat_itc::get() const {
+  return(tlv->buf+offset+HDR_BYTES);
+}
+
+size_t TLV8Flat_itc::getLen() const {
+  return(tlv->buf[offset+1] | (tlv->buf[offset+2]<<8));
+}
+
+uint8_t TLV8Flat_itc::getTag() const {
+  return(tlv->buf[offset]);
+}
+
+/////////////////////////////////////
+
+class TLV8 : public std::list<tlv8_t, PoolAllocator<tlv8_t,tlv8Pool>> {
 
   TLV8_itc mutable currentPackIt;
   TLV8_itc mutable endPackIt;
@@ -100,6 +315,8 @@ class TLV8 : public std::list<tlv8_t, Mallocator<tlv8_t>> {
   const TLV8_names *names=NULL;
   int nNames=0;
 
+  boolean addFailed=false;        // set if any record could not be added for lack of memory
+
   void printAll_r(String label) const;
 
   public:
@@ -142,6 +359,10 @@ class TLV8 : public std::list<tlv8_t, Mallocator<tlv8_t>> {
 
   int unpack(uint8_t *buf, size_t bufSize);
   int unpack(TLV8_itc it);
+  int unpack(const TLV8View &view);         // copies all records from a TLV8View into this TLV8 (adapter for code that needs an owning copy)
+  int unpack(const TLV8Flat &flat);         // copies all records from a TLV8Flat into this TLV8 (adapter for code that uses the TLV8 list API)
+
+  boolean failed() const {return(addFailed);}     // returns true if any record could not be added (in which case add() returned end()) for lack of memory
   
-  void wipe() {std::list<tlv8_t, Mallocator<tlv8_t>>().swap(*this);}
+  void wipe() {std::list<tlv8_t, PoolAllocator<tlv8_t,tlv8Pool>>().swap(*this); addFailed=false;}
 };
@@ -35,6 +35,8 @@
 //  Utils::readSerial       - reads all characters from Serial port and saves only up to max specified
 //  Utils::mask             - masks a string with asterisks (good for displaying passwords)
 //
+//  class ScratchArena      - bump-pointer scratch memory that is released all at once and reused across requests
+//
 //  class PushButton        - tracks Single, Double, and Long Presses of a pushbutton that connects a specified pin to ground
 //
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -99,9 +101,84 @@ String Utils::mask(char *c, int n){
       s+='*';
   }
   
-  return(s);  
+  return(s);
 } // mask
 
+////////////////////////////////
+//    BlockPool, StringPool   //
+////////////////////////////////
+
+void BlockPool::print(){
+  LOG0("%-16s %4d-byte blocks: %3d of %3d in use, peak %3d, exhausted %lu times (%lu from heap, %lu refused)\n",name,blockSize,nUsed,nBlocks,nPeak,nExhausted,nHeap,nRefused);
+}
+
+void StringPool::print(){
+  LOG0("%-16s %4d strings using %5d bytes, %lu references\n","Interned Strings",nStrings,nBytes,nRefs);
+}
+
+////////////////////////////////
+//        ScratchArena        //
+////////////////////////////////
+
+void *ScratchArena::alloc(size_t nBytes){
+
+  nBytes=(nBytes+7)&~((size_t)7);         // round up to maintain 8-byte alignment
+  requested+=nBytes;
+
+  if(used+nBytes<=capacity){              // fits in arena
+    void *p=buf+used;
+    used+=nBytes;
+    return(p);
+  }
+
+  nOverflows++;                           // does not fit (or arena not yet allocated) - take from heap and release upon reset()
+
+  overflow_t *p=(overflow_t *)HS_MALLOC(sizeof(overflow_t)+nBytes);
+  if(p==NULL){
+    Serial.printf("\n\n*** FATAL ERROR: Requested allocation of %d bytes failed.  Program Halting.\n\n",sizeof(overflow_t)+nBytes);
+    while(1);
+  }
+
+  p->next=overflowList;
+  overflowList=p;
+  return(p+1);
+}
+
+//////////////////////////////////////
+
+void ScratchArena::reset(){
+
+  while(overflowList){
+    overflow_t *next=overflowList->next;
+    free(overflowList);
+    overflowList=next;
+  }
+
+  if(requested>highWater)
+    highWater=requested;
+
+  if(requested>capacity && capacity<maxCapacity){     // last cycle did not fit - grow arena so the next similar cycle will
+    size_t newCapacity=(requested+255)&~((size_t)255);
+    if(newCapacity>maxCapacity)
+      newCapacity=maxCapacity;
+    free(buf);                                        // arena is empty at this point, so no need to preserve contents
+    buf=(uint8_t *)HS_MALLOC(newCapacity);
+    capacity=buf?newCapacity:0;
+    nGrows++;
+  }
+
+  used=0;
+  requested=0;
+}
+
+//////////////////////////////////////
+
+ScratchArena::~ScratchArena(){
+  maxCapacity=0;          // prevents reset() from growing arena
+  reset();
+  free(buf);
+}
+
 ////////////////////////////////
 //         PushButton         //
 ////////////////////////////////
@@ -96,7 +96,51 @@ class TempBuffer {
   operator bufType*() const{
     return(buf);
   }
-  
+
+};
+
+/////////////////////////////////////////////////
+// Creates a bump-pointer scratch arena that hands
+// out memory which is only released all at once
+// with reset().  The underlying block is kept
+// across resets (and grown to the high-water mark
+// if needed) so that steady-state use makes no
+// calls to the general heap
+
+class ScratchArena {
+
+  private:
+
+  struct overflow_t {                 // header placed in front of any allocation that does not fit in the arena
+    overflow_t *next;
+    size_t pad;                       // keeps returned memory 8-byte aligned
+  };
+
+  uint8_t *buf=NULL;                  // arena memory (allocated upon first use)
+  size_t capacity=0;                  // current size of arena memory
+  size_t maxCapacity;                 // arena memory will never be grown beyond this size
+  size_t used=0;                      // number of arena bytes used since last reset
+  size_t requested=0;                 // number of bytes requested since last reset (including overflow)
+  overflow_t *overflowList=NULL;      // linked-list of overflow allocations to be freed upon reset
+
+  public:
+
+  size_t highWater=0;                 // largest number of bytes requested between any two resets
+  uint32_t nOverflows=0;              // number of allocations that did not fit in the arena and were taken from the heap
+  uint32_t nGrows=0;                  // number of times arena memory was (re)allocated
+
+  ScratchArena(size_t maxCapacity) : maxCapacity(maxCapacity) {}
+  ~ScratchArena();
+
+  ScratchArena(const ScratchArena&)=delete;
+  ScratchArena& operator=(const ScratchArena&)=delete;
+
+  void *alloc(size_t nBytes);         // returns pointer to nBytes of (8-byte aligned) scratch memory that persists until next reset()
+  void reset();                       // releases all scratch memory (and grows arena if last cycle overflowed)
+
+  template <class T> T *alloc(size_t nElements){return((T *)alloc(nElements*sizeof(T)));}
+
+  size_t getCapacity(){return(capacity);}
 };
 
 ////////////////////////////////
@@ -0,0 +1,264 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+
+
+// Host benchmark of HomeSpan's cryptographic hot paths, using the same library code
+// (HKDF.cpp and AEAD.cpp) and the same libsodium and mbedTLS calls made on-device by
+// Pair-Verify, session key derivation, encrypted HAP traffic, and database hashing:
+//
+//   * X25519 key exchange and Ed25519 sign/verify over the 81-byte AccessoryInfo
+//   * HKDF-SHA-512 with the generic HKDF::create() versus an HKDF::Salt pre-keyed with
+//     the fixed "Control-Salt", for a single key and for the session key pair
+//   * ChaCha20-Poly1305 encrypt and decrypt of 64-byte and 1024-byte frames with both
+//     AEAD backends (libsodium and multi-block)
+//   * SHA-384 of an Accessory's attributes and of the combined database digests
+//
+// Each step reports operations per second along with the 50th, 90th, and 99th percentile
+// and maximum latency of a single operation.  Also checks that both HKDF paths derive
+// identical keys, that HKDF::expand() refuses more than 255 blocks of output, and that
+// both AEAD backends produce identical ciphertext and decrypt each other's frames (exits
+// with status 1 if not).
+//
+// The SRP-6A steps of Pair-Setup are not included, since SRP.cpp depends on the Arduino
+// runtime.  Use the "@P" command of the Benchmarks example to time them on-device.
+//
+// Requires the libsodium and libmbedtls development packages (mbedTLS 2.28 or 3.x).
+// Build and run from the tools directory:
+//
+//   g++ -std=c++17 -O2 -I../src benchCrypto.cpp ../src/HKDF.cpp ../src/AEAD.cpp -lmbedcrypto -lsodium -o benchCrypto
+//   ./benchCrypto [nIterations]
+//
+// The default is 10000 timed operations per step.
+
+#include "HKDF.h"
+#include "AEAD.h"
+
+#include <sodium.h>
+#include <mbedtls/hkdf.h>
+#include <mbedtls/sha512.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define FRAME_SIZE    1024          // size of a full HAP frame
+#define N_DIGESTS     150           // number of Accessory digests combined into the database hash (HAP limit=150)
+#define ATTR_SIZE     4096          // size of the streamed attributes of a single Accessory hashed into its digest
+
+static int nFailed=0;
+
+static void check(bool ok, const char *label){
+  printf("  %-52s %s\n",label,ok?"PASS":"FAIL");
+  if(!ok)
+    nFailed++;
+}
+
+//////////////////////////////////////
+
+// Times each of n calls to op() individually and reports throughput and latency percentiles.  Returns operations per second.
+
+template <class F> static double timeOp(const char *name, int n, F op){
+
+  std::vector<double> t(n);
+
+  op();                                                       // warm-up (first call may include one-time initialization, such as keying an HKDF::Salt)
+
+  auto start=std::chrono::steady_clock::now();
+  for(int i=0;i<n;i++){
+    auto t0=std::chrono::steady_clock::now();
+    op();
+    t[i]=std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now()-t0).count();
+  }
+  double total=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+  std::sort(t.begin(),t.end());
+
+  printf("  %-44s %11.0f ops/sec   p50 %8.2f us   p90 %8.2f us   p99 %8.2f us   max %8.2f us\n",
+    name,n/total,t[(n-1)*50/100],t[(n-1)*90/100],t[(n-1)*99/100],t[n-1]);
+  return(n/total);
+}
+
+//////////////////////////////////////
+
+static void pairVerify(int n, uint8_t *sharedKey){
+
+  uint8_t curvePublic[crypto_box_PUBLICKEYBYTES], curveSecret[crypto_box_SECRETKEYBYTES], iosCurveKey[crypto_box_PUBLICKEYBYTES];
+  uint8_t LTPK[crypto_sign_PUBLICKEYBYTES], LTSK[crypto_sign_SECRETKEYBYTES], signature[crypto_sign_BYTES];
+  uint8_t accessoryInfo[crypto_box_PUBLICKEYBYTES+17+crypto_box_PUBLICKEYBYTES];
+
+  crypto_box_keypair(iosCurveKey,curveSecret);
+  crypto_sign_keypair(LTPK,LTSK);
+  randombytes_buf(accessoryInfo,sizeof(accessoryInfo));
+
+  printf("Pair-Verify:\n\n");
+  timeOp("X25519 keypair + shared secret",n,[&](){crypto_box_keypair(curvePublic,curveSecret);crypto_scalarmult(sharedKey,curveSecret,iosCurveKey);});
+  timeOp("Ed25519 sign (AccessoryInfo)",n,[&](){crypto_sign_detached(signature,NULL,accessoryInfo,sizeof(accessoryInfo),LTSK);});
+  timeOp("Ed25519 verify (iOSDeviceInfo)",n,[&](){crypto_sign_verify_detached(signature,accessoryInfo,sizeof(accessoryInfo),LTPK);});
+  printf("\n");
+}
+
+//////////////////////////////////////
+
+static void hkdf(int n, const uint8_t *sharedKey){
+
+  uint8_t key1[32], key2[32], ref1[32], ref2[32], prk[HKDF::PRK_BYTES];
+  HKDF::Salt controlSalt("Control-Salt");
+
+  printf("Session key derivation (HKDF-SHA-512):\n\n");
+
+  double before=timeOp("single key - HKDF::create()",n,[&](){HKDF::create(key1,(uint8_t *)sharedKey,32,"Control-Salt","Control-Read-Encryption-Key");});
+  double after=timeOp("single key - HKDF::Salt",n,[&](){controlSalt.create(key1,sharedKey,32,"Control-Read-Encryption-Key");});
+  printf("  %-44s %10.2fx\n","  speedup",after/before);
+
+  before=timeOp("session key pair - HKDF::create()",n,[&](){
+    HKDF::create(key1,(uint8_t *)sharedKey,32,"Control-Salt","Control-Read-Encryption-Key");
+    HKDF::create(key2,(uint8_t *)sharedKey,32,"Control-Salt","Control-Write-Encryption-Key");
+  });
+  after=timeOp("session key pair - HKDF::Salt",n,[&](){     // same sequence as HAPClient::setSessionKeys()
+    controlSalt.extract(prk,sharedKey,32);
+    HKDF::expand(key1,32,prk,"Control-Read-Encryption-Key");
+    HKDF::expand(key2,32,prk,"Control-Write-Encryption-Key");
+  });
+  printf("  %-44s %10.2fx\n\n","  speedup",after/before);
+
+  HKDF::create(ref1,(uint8_t *)sharedKey,32,"Control-Salt","Control-Read-Encryption-Key");
+  HKDF::create(ref2,(uint8_t *)sharedKey,32,"Control-Salt","Control-Write-Encryption-Key");
+  controlSalt.extract(prk,sharedKey,32);
+  HKDF::expand(key1,32,prk,"Control-Read-Encryption-Key");
+  HKDF::expand(key2,32,prk,"Control-Write-Encryption-Key");
+  check(!memcmp(key1,ref1,32) && !memcmp(key2,ref2,32),"pre-keyed salt derives same session keys");
+
+  uint8_t salt[44];                                           // binary salt and multi-block output, as used by Pair-Resume
+  uint8_t long1[100], long2[100];
+  for(int i=0;i<(int)sizeof(salt);i++)
+    salt[i]=i;
+  const char *resumeInfo="Pair-Resume-Shared-Secret-Info";
+  mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA512),salt,sizeof(salt),sharedKey,32,(const uint8_t *)resumeInfo,strlen(resumeInfo),long1,sizeof(long1));
+  HKDF::extract(prk,sharedKey,32,salt,sizeof(salt));
+  HKDF::expand(long2,sizeof(long2),prk,resumeInfo);
+  check(!memcmp(long1,long2,sizeof(long1)),"extract/expand matches mbedtls_hkdf (multi-block)");
+
+  check(HKDF::expand(key1,255*64+1,prk,"x")==MBEDTLS_ERR_HKDF_BAD_INPUT_DATA,"expand() refuses more than 255 blocks");
+  printf("\n");
+}
+
+//////////////////////////////////////
+
+static void traffic(int n, const uint8_t *key){
+
+  uint8_t nonce[AEAD::NONCE_BYTES]={0};
+  std::vector<uint8_t> plain(FRAME_SIZE), frame(FRAME_SIZE+AEAD::TAG_BYTES), work(FRAME_SIZE+AEAD::TAG_BYTES);
+  randombytes_buf(plain.data(),FRAME_SIZE);
+
+  printf("Encrypted HAP traffic (ChaCha20-Poly1305):\n\n");
+
+  for(const AEADBackend *b : {&AEAD::sodium,&AEAD::multiBlock}){
+    for(int size : {64,FRAME_SIZE}){                          // a small frame (e.g. an Event Notification) and a full frame
+      char name[64];
+      uint8_t aad[2]={(uint8_t)(size%256),(uint8_t)(size/256)};
+      sprintf(name,"%s encrypt (%d bytes)",b->name,size);
+      timeOp(name,n,[&](){b->encrypt(work.data(),plain.data(),size,aad,2,nonce,key);});
+      b->encrypt(frame.data(),plain.data(),size,aad,2,nonce,key);
+      sprintf(name,"%s decrypt (%d bytes)",b->name,size);
+      timeOp(name,n,[&](){
+        if(b->decrypt(work.data(),frame.data(),size+AEAD::TAG_BYTES,aad,2,nonce,key))
+          nFailed++;
+      });
+    }
+  }
+  printf("\n");
+
+  bool same=true, cross=true, tamper=true;
+  for(int size=0;size<=FRAME_SIZE;size+=size<130?1:61){
+    uint8_t aad[2]={(uint8_t)(size%256),(uint8_t)(size/256)};
+    std::vector<uint8_t> c1(size+AEAD::TAG_BYTES), c2(size+AEAD::TAG_BYTES), m(size+1);
+    AEAD::sodium.encrypt(c1.data(),plain.data(),size,aad,2,nonce,key);
+    AEAD::multiBlock.encrypt(c2.data(),plain.data(),size,aad,2,nonce,key);
+    same&=(c1==c2);
+    cross&=(!AEAD::sodium.decrypt(m.data(),c2.data(),c2.size(),aad,2,nonce,key) && !memcmp(m.data(),plain.data(),size));
+    cross&=(!AEAD::multiBlock.decrypt(m.data(),c1.data(),c1.size(),aad,2,nonce,key) && !memcmp(m.data(),plain.data(),size));
+    c1[size/2]^=1;
+    tamper&=(AEAD::multiBlock.decrypt(m.data(),c1.data(),c1.size(),aad,2,nonce,key)==-1);
+  }
+  check(same,"backends produce identical ciphertext and tag");
+  check(cross,"backends decrypt each other's frames");
+  check(tamper,"multi-block backend rejects tampered frames");
+  printf("\n");
+}
+
+//////////////////////////////////////
+
+static void hashing(int n){
+
+  std::vector<uint8_t> attributes(ATTR_SIZE), digests(N_DIGESTS*48);
+  uint8_t hashCode[64];
+  randombytes_buf(attributes.data(),ATTR_SIZE);
+  randombytes_buf(digests.data(),N_DIGESTS*48);
+
+  printf("Database hashing (SHA-384):\n\n");
+
+  char name[64];
+  sprintf(name,"Accessory digest (%d bytes)",ATTR_SIZE);
+  timeOp(name,n,[&](){mbedtls_sha512(attributes.data(),ATTR_SIZE,hashCode,1);});
+  sprintf(name,"database hash (%d digests)",N_DIGESTS);
+  timeOp(name,n,[&](){
+    mbedtls_sha512_context ctx;
+    mbedtls_sha512_init(&ctx);
+    mbedtls_sha512_starts(&ctx,1);
+    for(int i=0;i<N_DIGESTS;i++)
+      mbedtls_sha512_update(&ctx,digests.data()+i*48,48);
+    mbedtls_sha512_finish(&ctx,hashCode);
+    mbedtls_sha512_free(&ctx);
+  });
+  printf("\n");
+}
+
+//////////////////////////////////////
+
+int main(int argc, char **argv){
+
+  int n=argc>1?atoi(argv[1]):10000;
+
+  if(n<1 || sodium_init()<0){
+    printf("Usage: benchCrypto [nIterations]  (libsodium must initialize)\n");
+    return(1);
+  }
+
+  printf("%d timed operations per step\n\n",n);
+
+  uint8_t sharedKey[crypto_box_PUBLICKEYBYTES];
+
+  pairVerify(n,sharedKey);
+  hkdf(n,sharedKey);
+  traffic(n,sharedKey);
+  hashing(n);
+
+  printf("%s\n",nFailed?"FAILED":"All checks passed");
+  return(nFailed?1:0);
+}
@@ -0,0 +1,285 @@
+/*********************************************************************************
+ *  MIT License
+ *  
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *  
+ *  https://github.com/HomeSpan/HomeSpan
+ *  
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *  
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *  
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *  
+ ********************************************************************************/
+ 
+
+// Host benchmark of FileStore, HomeSpan's portable, log-structured SpanStore.
+// Simulates the Characteristic-persistence workload of a bridge and reports
+// boot-load time, commit batching and compaction behavior.  Also simulates
+// power loss part-way through a commit and a compaction, and checks that
+// every committed value is recovered (exits with status 1 if not).
+//
+// Build and run from the tools directory:
+//
+//   g++ -std=c++17 -O2 -I../src benchStore.cpp ../src/FileStore.cpp -o benchStore
+//   ./benchStore [nAccessories] [nUpdates] [directory]
+//
+// Defaults are 100 Accessories (each with 4 saved Characteristics), 2000 updates, and /tmp.
+
+#include "FileStore.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cinttypes>
+#include <unistd.h>
+
+static double msSince(std::chrono::steady_clock::time_point t){
+  return(std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-t).count());
+}
+
+static void perKeyName(char *k, uint32_t aid, uint32_t iid){sprintf(k,"%04X%08" PRIX32 "%03" PRIX32,0x25,aid,iid&0xFFF);}    // same form as SpanCharacteristic keys
+static void bulkName(char *k, uint32_t aid){sprintf(k,"BULK%08" PRIX32,aid);}                                                  // same form as SpanBulkNVS keys
+
+//////////////////////////////////////
+
+static void bootLoad(const std::string &dir, int nAcc){
+
+  const int nChars=4;
+  std::string perKeyPath=dir+"/benchStore-perkey.log";
+  std::string bulkPath=dir+"/benchStore-bulk.log";
+  remove(perKeyPath.c_str());
+  remove(bulkPath.c_str());
+
+  {
+    FileStore perKey(perKeyPath.c_str());
+    FileStore bulk(bulkPath.c_str());
+    perKey.open();
+    bulk.open();
+    for(int aid=1;aid<=nAcc;aid++){
+      uint8_t blob[nChars*16];
+      for(int iid=0;iid<nChars;iid++){
+        char k[16];
+        perKeyName(k,aid,iid+9);
+        perKey.setU64(k,aid*100+iid);
+        memset(blob+iid*16,iid,16);
+      }
+      char k[16];
+      bulkName(k,aid);
+      bulk.setBlob(k,blob,sizeof(blob));
+    }
+    perKey.commit();
+    bulk.commit();
+  }
+
+  auto t=std::chrono::steady_clock::now();
+  FileStore perKey(perKeyPath.c_str());
+  perKey.open();
+  uint64_t sum=0;
+  for(int aid=1;aid<=nAcc;aid++){
+    for(int iid=0;iid<nChars;iid++){
+      char k[16];
+      uint64_t v=0;
+      perKeyName(k,aid,iid+9);
+      perKey.getU64(k,&v);
+      sum+=v;
+    }
+  }
+  double perKeyTime=msSince(t);
+
+  t=std::chrono::steady_clock::now();
+  FileStore bulk(bulkPath.c_str());
+  bulk.open();
+  for(int aid=1;aid<=nAcc;aid++){
+    uint8_t blob[nChars*16];
+    size_t len=sizeof(blob);
+    char k[16];
+    bulkName(k,aid);
+    bulk.getBlob(k,blob,&len);
+    sum+=blob[0];
+  }
+  double bulkTime=msSince(t);
+
+  printf("Boot load of %d values (%d Accessories):\n",nAcc*nChars,nAcc);
+  printf("  per-Characteristic keys: %8.3f ms  (%zu keys, %zu-byte log)\n",perKeyTime,perKey.size(),perKey.getFileSize());
+  printf("  bulk blob per Accessory: %8.3f ms  (%zu keys, %zu-byte log)  [checksum %" PRIu64 "]\n\n",bulkTime,bulk.size(),bulk.getFileSize(),sum);
+}
+
+//////////////////////////////////////
+
+static void updates(const std::string &dir, int nAcc, int nUpdates, int batchSize, bool sync){
+
+  std::string path=dir+"/benchStore-updates.log";
+  remove(path.c_str());
+
+  FileStore store(path.c_str(),4096,sync);
+  store.open();
+  for(int aid=1;aid<=nAcc;aid++){
+    char k[16];
+    perKeyName(k,aid,9);
+    store.setU64(k,0);
+  }
+  store.commit();
+  store.nCommits=0;
+  store.nCompactions=0;
+  store.bytesWritten=0;
+
+  auto t=std::chrono::steady_clock::now();
+  for(int i=0;i<nUpdates;i++){
+    char k[16];
+    perKeyName(k,1+(i/50)%nAcc,9);          // drag one "slider" for 50 updates, then move to the next Accessory
+    store.setU64(k,i%100);
+    if((i+1)%batchSize==0)
+      store.commit();
+  }
+  store.commit();
+  double elapsed=msSince(t);
+
+  printf("  batch=%4d%s: %9.3f ms, %6" PRIu32 " commits, %4" PRIu32 " compactions, %8" PRIu64 " bytes written, %6zu-byte log\n",
+    batchSize,sync?" (fsync)":"        ",elapsed,store.nCommits,store.nCompactions,store.bytesWritten,store.getFileSize());
+}
+
+//////////////////////////////////////
+
+static void copyFile(const std::string &from, const std::string &to, size_t len=SIZE_MAX){
+
+  FILE *in=fopen(from.c_str(),"rb");
+  FILE *out=fopen(to.c_str(),"wb");
+  char buf[512];
+  size_t n;
+  while(len && (n=fread(buf,1,len<sizeof(buf)?len:sizeof(buf),in))>0){
+    fwrite(buf,1,n,out);
+    len-=n;
+  }
+  fclose(in);
+  fclose(out);
+}
+
+//////////////////////////////////////
+
+static bool verify(const std::string &path, int nKeys, uint64_t base, const char *label){
+
+  FileStore store(path.c_str());
+  bool ok=store.open() && store.size()==(size_t)nKeys;
+
+  for(int i=0;ok && i<nKeys;i++){
+    char k[16];
+    uint64_t v=0;
+    perKeyName(k,1,i);
+    ok=store.getU64(k,&v) && v==base+i;
+  }
+
+  FILE *tmp=fopen((path+".tmp").c_str(),"rb");
+  if(tmp){
+    fclose(tmp);
+    ok=false;
+  }
+
+  printf("  %-46s %s\n",label,ok?"PASS":"FAIL");
+  return(ok);
+}
+
+//////////////////////////////////////
+
+static bool interruptions(const std::string &dir){
+
+  const int nKeys=20;
+  std::string path=dir+"/benchStore-crash.log";
+  std::string tmpPath=path+".tmp";
+  std::string savedPath=dir+"/benchStore-crash.saved";
+  bool ok=true;
+
+  auto reset=[&](){                   // log holding one committed batch (values 0..nKeys-1), saved for reuse
+    remove(path.c_str());
+    remove(tmpPath.c_str());
+    FileStore store(path.c_str());
+    store.open();
+    for(int i=0;i<nKeys;i++){
+      char k[16];
+      perKeyName(k,1,i);
+      store.setU64(k,i);
+    }
+    store.commit();
+    copyFile(path,savedPath);
+    return(store.getFileSize());
+  };
+
+  printf("Recovery from interrupted writes:\n");
+
+  size_t committed=reset();           // power lost mid-commit: second batch only partially appended
+  size_t full;
+  {
+    FileStore store(path.c_str());
+    store.open();
+    for(int i=0;i<nKeys;i++){
+      char k[16];
+      perKeyName(k,1,i);
+      store.setU64(k,1000+i);
+    }
+    store.commit();
+    full=store.getFileSize();
+  }
+  truncate(path.c_str(),committed+(full-committed)/2);
+  ok&=verify(path,nKeys,0,"commit interrupted (partial batch discarded)");
+
+  reset();                            // power lost while writing temporary snapshot
+  copyFile(savedPath,tmpPath,committed/2);
+  ok&=verify(path,nKeys,0,"compaction interrupted before rename");
+
+  reset();                            // power lost after original removed but before rename (SPIFFS fallback)
+  copyFile(savedPath,tmpPath);
+  remove(path.c_str());
+  ok&=verify(path,nKeys,0,"compaction interrupted after remove");
+
+  reset();                            // compaction completes normally
+  {
+    FileStore store(path.c_str());
+    store.open();
+    for(int i=0;i<nKeys;i++){
+      char k[16];
+      perKeyName(k,1,i);
+      store.setU64(k,2000+i);
+    }
+    store.commit();
+    store.compact();
+  }
+  ok&=verify(path,nKeys,2000,"compaction completed");
+
+  remove(path.c_str());
+  remove(savedPath.c_str());
+  printf("\n");
+  return(ok);
+}
+
+//////////////////////////////////////
+
+int main(int argc, char **argv){
+
+  int nAcc=argc>1?atoi(argv[1]):100;
+  int nUpdates=argc>2?atoi(argv[2]):2000;
+  std::string dir=argc>3?argv[3]:"/tmp";
+
+  bool ok=interruptions(dir);
+
+  bootLoad(dir,nAcc);
+
+  printf("Commit batching for %d updates:\n",nUpdates);
+  for(bool sync : {false,true}){
+    for(int batchSize : {1,10,100})
+      updates(dir,nAcc,nUpdates,batchSize,sync);
+  }
+
+  return(ok?0:1);
+}
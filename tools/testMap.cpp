@@ -0,0 +1,119 @@
+/*********************************************************************************
+ *  MIT License
+ *
+ *  Copyright (c) 2020-2024 Gregg E. Berman
+ *
+ *  https://github.com/HomeSpan/HomeSpan
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ ********************************************************************************/
+
+
+// Host test of SpanMap, the read-only mapping used by mapDatabase().  On a host,
+// SpanMap maps a file with POSIX mmap() in place of an ESP32 data partition.  This
+// writes an image with SpanMap::write(), maps it, and checks that length-prefixed
+// strings (laid out as in a database image) are read in place from the mapping,
+// that remapping and unmapping behave, and that missing or empty files are refused.
+// The database loader itself depends on ESP32 headers and is not exercised here.
+//
+// Build and run from the tools directory:
+//
+//   g++ -std=c++17 -O2 -I../src testMap.cpp -o testMap
+//   ./testMap [directory]
+//
+// The default directory is /tmp.  Exits with status 1 if any check fails.
+
+#include "SpanMap.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static int nFailed=0;
+
+static void check(bool ok, const char *label){
+  printf("  %-52s %s\n",label,ok?"PASS":"FAIL");
+  if(!ok)
+    nFailed++;
+}
+
+//////////////////////////////////////
+
+static std::vector<uint8_t> makeImage(const std::vector<const char *> &strs){      // each string is a 2-byte length (including terminator) followed by the string, as in a database image
+
+  std::vector<uint8_t> img;
+  for(auto s : strs){
+    uint16_t n=strlen(s)+1;
+    img.insert(img.end(),(uint8_t *)&n,(uint8_t *)&n+2);
+    img.insert(img.end(),s,s+n);
+  }
+  return(img);
+}
+
+//////////////////////////////////////
+
+int main(int argc, char **argv){
+
+  std::string dir=argc>1?argv[1]:"/tmp";
+  std::string path=dir+"/testMap.img";
+  std::string emptyPath=dir+"/testMap-empty.img";
+
+  std::vector<const char *> strs={"3E","AccessoryInformation","HomeSpan","Living Room Lamp",""};
+  std::vector<uint8_t> img=makeImage(strs);
+
+  printf("SpanMap (POSIX mmap shim):\n");
+
+  check(SpanMap::write(path.c_str(),img.data(),img.size()),"write image");
+
+  SpanMap map;
+  check(map.get()==NULL && map.size()==0,"unmapped state before map()");
+  check(map.map(path.c_str()),"map image");
+  check(map.size()==img.size() && !memcmp(map.get(),img.data(),img.size()),"mapped contents match image");
+
+  bool inPlace=true;
+  size_t pos=0;
+  for(auto s : strs){
+    uint16_t n;
+    memcpy(&n,map.get()+pos,2);
+    const char *p=(const char *)map.get()+pos+2;
+    inPlace&=(n==strlen(s)+1 && !strcmp(p,s) && p>=(const char *)map.get() && p<(const char *)map.get()+map.size());
+    pos+=2+n;
+  }
+  check(inPlace && pos==map.size(),"strings read in place from mapping");
+
+  std::vector<uint8_t> img2=makeImage({"Replacement"});
+  check(SpanMap::write(path.c_str(),img2.data(),img2.size()),"rewrite image");
+  check(map.map(path.c_str()) && map.size()==img2.size() && !memcmp(map.get(),img2.data(),img2.size()),"remap picks up new contents");
+
+  map.unmap();
+  check(map.get()==NULL && map.size()==0,"unmap() clears mapping");
+
+  check(!map.map((dir+"/testMap-missing.img").c_str()) && map.get()==NULL,"missing file is refused");
+
+  fclose(fopen(emptyPath.c_str(),"wb"));
+  check(!map.map(emptyPath.c_str()) && map.get()==NULL,"empty file is refused");
+
+  remove(path.c_str());
+  remove(emptyPath.c_str());
+
+  printf("\n%s\n",nFailed?"FAILED":"All checks passed");
+  return(nFailed?1:0);
+}